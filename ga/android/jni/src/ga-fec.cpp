@@ -0,0 +1 @@
+../../../core/ga-fec.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../../core/ga-fec.h
\ No newline at end of file
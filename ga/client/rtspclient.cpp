@@ -35,6 +35,7 @@ unsigned increaseReceiveBufferTo(UsageEnvironment& env,
 #include "ga-common.h"
 #include "ga-conf.h"
 #include "ga-avcodec.h"
+#include "ga-fec.h"
 #include "controller.h"
 #include "minih264.h"
 #include "qosreport.h"
@@ -116,11 +117,26 @@ static void shutdownStream(RTSPClient* rtspClient, int exitCode = 1);
 
 // for audio: ref from ffmpeg tutorial03
 //	http://dranger.com/ffmpeg/tutorial03.html
+// packets are kept in RTP timestamp order, AVPacket.pts holds the
+// extended (64-bit) RTP timestamp of each packet
 struct PacketQueue {
 	list<AVPacket> queue;
 	int size;
 	pthread_mutex_t mutex;
 	pthread_cond_t cond;
+	// adaptive jitter buffer, all in RTP timestamp units
+	unsigned int clockrate;
+	struct timeval basetime;	// arrival time of the first packet
+	long long lastts;		// highest timestamp received
+	long long playts;		// next timestamp expected by the player
+	long long pktdur;		// packet duration
+	long long transit;		// relative transit time of the last packet
+	double jitter;			// interarrival jitter (RFC 3550 A.8)
+	int buffering;			// wait for target delay before playing
+	// statistics
+	unsigned int underruns, overruns, late;
+	long long stretched, played;	// in output samples
+	struct timeval reporttime;
 };
 
 static RTSPThreadParam *rtspParam = NULL;
@@ -132,7 +148,11 @@ static AVFrame *aframe = NULL;
 
 static int packet_queue_initialized = 0;
 static int packet_queue_limit = 5;	// limit the queue size
-static int packet_queue_dropfactor = 2;	// default drop half
+static int jb_min_delay = 20;		// ms
+static int jb_max_delay = 200;		// ms
+static int jb_factor = 3;		// target = factor * jitter + packet duration
+static int jb_max_stretch = 2;		// percent, 0 disables time-stretch
+static int jb_report_interval = 10;	// seconds, 0 disables the report
 static PacketQueue audioq;
 
 void
@@ -141,34 +161,137 @@ packet_queue_init(PacketQueue *q) {
 	char buf[8];
 	packet_queue_initialized = 1;
 	q->queue.clear();
+	q->size = 0;
 	pthread_mutex_init(&q->mutex, NULL);
 	pthread_cond_init(&q->cond, NULL);
+	q->clockrate = 0;
+	q->lastts = q->playts = -1;
+	q->pktdur = q->transit = 0;
+	q->jitter = 0.0;
+	q->buffering = 1;
+	q->underruns = q->overruns = q->late = 0;
+	q->stretched = q->played = 0;
 	if(ga_conf_readv("audio-playback-queue-limit", buf, sizeof(buf)) != NULL) {
 		// must ensure that we have configured audio-playback-queue-limit
 		if((val = ga_conf_readint("audio-playback-queue-limit")) >= 0) {
 			packet_queue_limit = val;
 		}
 	}
-	if((val = ga_conf_readint("audio-playback-queue-dropfactor")) > 0) {
-		packet_queue_dropfactor = val;
-	}
-	ga_error("packet queue: initialized - limit %d%s; dropfactor %d%s\n",
+	if((val = ga_conf_readint("audio-jitter-min-delay")) > 0)
+		jb_min_delay = val;
+	if((val = ga_conf_readint("audio-jitter-max-delay")) > 0)
+		jb_max_delay = val;
+	if(jb_max_delay < jb_min_delay)
+		jb_max_delay = jb_min_delay;
+	if((val = ga_conf_readint("audio-jitter-factor")) > 0)
+		jb_factor = val;
+	if(ga_conf_readv("audio-jitter-max-stretch", buf, sizeof(buf)) != NULL) {
+		if((val = ga_conf_readint("audio-jitter-max-stretch")) >= 0)
+			jb_max_stretch = val > 10 ? 10 : val;
+	}
+	if(ga_conf_readv("audio-jitter-report", buf, sizeof(buf)) != NULL) {
+		if((val = ga_conf_readint("audio-jitter-report")) >= 0)
+			jb_report_interval = val;
+	}
+	ga_error("packet queue: initialized - limit %d%s; delay %d-%dms (%dx jitter); stretch %d%%%s\n",
 		packet_queue_limit,
 		packet_queue_limit <= 0 ? " (unlimited)" : "",
-		packet_queue_dropfactor,
-		packet_queue_dropfactor <= 0 ? " (no drop)" : "");
+		jb_min_delay, jb_max_delay, jb_factor,
+		jb_max_stretch,
+		jb_max_stretch <= 0 ? " (disabled)" : "");
+	return;
+}
+
+/* buffered duration of queued packets, must be called with the queue locked */
+static long long
+packet_queue_span(PacketQueue *q) {
+	if(q->queue.size() <= 0)
+		return 0;
+	return q->queue.back().pts - q->queue.front().pts + q->pktdur;
+}
+
+/* target playout delay, must be called with the queue locked */
+static long long
+packet_queue_target(PacketQueue *q) {
+	long long target = (long long) (jb_factor * q->jitter) + q->pktdur;
+	long long lo = 1LL * jb_min_delay * q->clockrate / 1000;
+	long long hi = 1LL * jb_max_delay * q->clockrate / 1000;
+	if(target < lo)	target = lo;
+	if(target > hi)	target = hi;
+	return target;
+}
+
+/* must be called with the queue locked */
+static void
+packet_queue_report(PacketQueue *q, struct timeval *now) {
+	double ms = 1000.0 / q->clockrate;
+	if(jb_report_interval <= 0 || tvdiff_us(now, &q->reporttime) < jb_report_interval * 1000000LL)
+		return;
+	rtsperror("audio jitter buffer: delay=%.1fms; target=%.1fms; jitter=%.2fms; underruns=%u; overruns=%u; late=%u; stretched=%.3f%%\n",
+		ms * packet_queue_span(q),
+		ms * packet_queue_target(q),
+		ms * q->jitter,
+		q->underruns, q->overruns, q->late,
+		q->played > 0 ? 100.0 * q->stretched / q->played : 0.0);
+	q->reporttime = *now;
 	return;
 }
 
 int
-packet_queue_put(PacketQueue *q, AVPacket *pkt) {
+packet_queue_put(PacketQueue *q, AVPacket *pkt, unsigned int rtpts, unsigned int clockrate) {
+	list<AVPacket>::iterator mi;
+	struct timeval now;
+	long long ts, arrival, transit, d;
 	if(av_dup_packet(pkt) < 0) {
 		rtsperror("packet queue put failed\n");
 		return -1;
 	}
+	gettimeofday(&now, NULL);
 	pthread_mutex_lock(&q->mutex);
-	q->queue.push_back(*pkt);
+	// extend the 32-bit RTP timestamp
+	if(q->lastts < 0 || q->clockrate != clockrate) {
+		q->clockrate = clockrate > 0 ? clockrate : 90000;
+		q->basetime = q->reporttime = now;
+		q->lastts = ts = rtpts;
+		q->transit = -ts;
+	} else {
+		ts = q->lastts + (int) (rtpts - (unsigned int) q->lastts);
+	}
+	// interarrival jitter
+	arrival = tvdiff_us(&now, &q->basetime) * q->clockrate / 1000000LL;
+	transit = arrival - ts;
+	d = transit - q->transit;
+	q->transit = transit;
+	q->jitter += ((d < 0 ? -d : d) - q->jitter) / 16.0;
+	if(ts > q->lastts) {
+		if(ts - q->lastts < q->clockrate)
+			q->pktdur = ts - q->lastts;
+		q->lastts = ts;
+	}
+	// too late to be played?
+	if(q->playts >= 0 && ts < q->playts) {
+		q->late++;
+		pthread_mutex_unlock(&q->mutex);
+		av_free_packet(pkt);
+		return 0;
+	}
+	// insert in timestamp order, drop duplicates
+	for(mi = q->queue.end(); mi != q->queue.begin(); ) {
+		--mi;
+		if(mi->pts <= ts) {
+			if(mi->pts == ts) {
+				pthread_mutex_unlock(&q->mutex);
+				av_free_packet(pkt);
+				return 0;
+			}
+			++mi;
+			break;
+		}
+	}
+	pkt->pts = ts;
+	q->queue.insert(mi, *pkt);
 	q->size += pkt->size;
+	packet_queue_report(q, &now);
 	pthread_mutex_unlock(&q->mutex);
 	pthread_cond_signal(&q->cond);
 	return 0;
@@ -183,10 +306,16 @@ packet_queue_get(PacketQueue *q, AVPacket *pkt, int block) {
 	}
 	pthread_mutex_lock(&q->mutex);
 	for(;;) {
-		if(q->queue.size() > 0) {
+		// (re)buffering: hold playback until the target delay is reached
+		if(q->buffering && q->queue.size() > 0
+		&& packet_queue_span(q) >= packet_queue_target(q)) {
+			q->buffering = 0;
+		}
+		if(q->queue.size() > 0 && q->buffering == 0) {
 			*pkt = q->queue.front();
 			q->queue.pop_front();
 			q->size -= pkt->size;
+			q->playts = pkt->pts + q->pktdur;
 			ret = 1;
 			break;
 		} else if(!block) {
@@ -218,36 +347,98 @@ packet_queue_get(PacketQueue *q, AVPacket *pkt, int block) {
 	return ret;
 }
 
+/**
+ * Drop packets beyond the maximum delay (overrun).
+ *
+ * Packets are dropped from the head of the queue until the buffered
+ * duration is back to the target delay. Small excess delay is handled by
+ * time-stretching in the decoder instead, see packet_queue_excess().
+ *
+ * @param q [in] The packet queue.
+ * @return Number of dropped packets.
+ */
 int
 packet_queue_drop(PacketQueue *q) {
-	int dropped, count = 0;
+	long long span, target, limit;
+	int count = 0;
 	AVPacket pkt;
-	// dropping enabled?
-	if(packet_queue_limit <= 0 || packet_queue_dropfactor <= 0)
-		return 0;
 	pthread_mutex_lock(&q->mutex);
-	// queue size exceeded?
-	if(q->queue.size() <= packet_queue_limit) {
+	if(q->clockrate == 0) {
 		pthread_mutex_unlock(&q->mutex);
 		return 0;
 	}
-	// start dropping
-	dropped = q->queue.size() / packet_queue_dropfactor;
-	// keep at least one
-	if(dropped == q->queue.size())
-		dropped--;
-	while(dropped-- > 0) {
-		if(q->queue.size() <= 0)
-			break;
+	span = packet_queue_span(q);
+	target = packet_queue_target(q);
+	limit = 1LL * jb_max_delay * q->clockrate / 1000;
+	if(limit < 2 * target)
+		limit = 2 * target;
+	// overrun?
+	if(span <= limit
+	&& (packet_queue_limit <= 0 || q->queue.size() <= packet_queue_limit || span <= target)) {
+		pthread_mutex_unlock(&q->mutex);
+		return 0;
+	}
+	// drop down to the target, keep at least one
+	while(q->queue.size() > 1 && packet_queue_span(q) > target) {
 		pkt = q->queue.front();
 		q->queue.pop_front();
 		q->size -= pkt.size;
+		q->playts = pkt.pts + q->pktdur;
+		av_free_packet(&pkt);
 		count++;
 	}
+	q->overruns++;
 	pthread_mutex_unlock(&q->mutex);
 	return count;
 }
 
+/**
+ * Get the difference between the current and the target playout delay.
+ *
+ * @param q [in] The packet queue.
+ * @param buffered [in] Decoded but not yet played duration, in microseconds.
+ * @return Excess delay in microseconds, negative if the delay is too short.
+ */
+static long long
+packet_queue_excess(PacketQueue *q, long long buffered) {
+	long long excess, deadband;
+	pthread_mutex_lock(&q->mutex);
+	if(q->clockrate == 0 || q->buffering) {
+		pthread_mutex_unlock(&q->mutex);
+		return 0;
+	}
+	excess = (packet_queue_span(q) - packet_queue_target(q)) * 1000000LL / q->clockrate;
+	excess += buffered;
+	// do not chase the jitter of a single packet
+	deadband = q->pktdur * 1000000LL / q->clockrate;
+	pthread_mutex_unlock(&q->mutex);
+	if(excess > -deadband && excess < deadband)
+		return 0;
+	return excess;
+}
+
+/* update time-stretch statistics, in output samples */
+static void
+packet_queue_account(PacketQueue *q, int played, int stretched) {
+	pthread_mutex_lock(&q->mutex);
+	q->played += played;
+	q->stretched += stretched < 0 ? -stretched : stretched;
+	pthread_mutex_unlock(&q->mutex);
+	return;
+}
+
+/* nothing left to play: count an underrun and rebuffer */
+static void
+packet_queue_underrun(PacketQueue *q) {
+	pthread_mutex_lock(&q->mutex);
+	if(q->lastts >= 0 && q->buffering == 0) {
+		q->underruns++;
+		q->buffering = 1;
+	}
+	pthread_mutex_unlock(&q->mutex);
+	return;
+}
+
 UsageEnvironment&
 operator<<(UsageEnvironment& env, const RTSPClient& rtspClient) {
 	return env << "[URL:\"" << rtspClient.url() << "\"]: ";
@@ -502,8 +693,14 @@ pktloss_monitor_update(unsigned int ssrc, unsigned short seqnum) {
 		mi->second.lastseq = seqnum;
 		return;
 	}
-	if((seqnum-1) != mi->second.lastseq) {
-		mi->second.lost += (seqnum - 1 - mi->second.lastseq);
+	// late (reordered or retransmitted) packet
+	if((short) (seqnum - mi->second.lastseq) <= 0) {
+		if(mi->second.lost > 0)
+			mi->second.lost--;
+		return;
+	}
+	if((unsigned short) (seqnum-1) != mi->second.lastseq) {
+		mi->second.lost += (unsigned short) (seqnum - 1 - mi->second.lastseq);
 	}
 	mi->second.lastseq = seqnum;
 	return;
@@ -530,6 +727,235 @@ pktloss_monitor_get(unsigned int ssrc, int *count = NULL, int reset = 0) {
 	return mi->second.lost;
 }
 
+//// generic NACK (RFC 4585) generator
+
+#define	RTP_NACK_MAX	256	/* missing packets tracked per SSRC */
+#define	RTCP_RTPFB	205	/* transport layer feedback */
+#define	RTCP_FMT_NACK	1	/* generic NACK */
+
+typedef struct rtp_nack_missing_s {
+	unsigned short seq;
+	int sent;		/* NACKs sent for this packet */
+	long long first;	/* when the gap was detected, in us */
+	long long last;		/* when the last NACK was sent, in us */
+}	rtp_nack_missing_t;
+
+typedef struct rtp_nack_record_s {
+	unsigned short maxseq;	/* the highest seqnum received */
+	list<rtp_nack_missing_t> missing;
+}	rtp_nack_record_t;
+
+static map<unsigned int, rtp_nack_record_t> _nackmap;
+static int rtp_nack = 1;
+static long long rtp_nack_retry = 40000LL;	/* in us */
+static int rtp_nack_retries = 2;
+
+/* send a generic NACK for the given (ascending) seqnums to the server;
+ * RTP over RTSP/TCP is reliable, so NACKs are sent only over UDP */
+static void
+rtp_nack_send(MediaSubsession *subsession, unsigned int ssrc, unsigned short *seqs, int n) {
+	unsigned char pkt[12 + 4*RTP_NACK_MAX];
+	unsigned short pid, blp = 0;
+	int i, len = 12;
+	struct sockaddr_in sin;
+	RTPSource *rtpsrc;
+	//
+	if(n <= 0 || subsession == NULL || rtspconf->proto == IPPROTO_TCP)
+		return;
+	if((rtpsrc = subsession->rtpSource()) == NULL || rtpsrc->RTPgs() == NULL)
+		return;
+	if(rtspconf->sin.sin_addr.s_addr == 0
+	|| rtspconf->sin.sin_addr.s_addr == INADDR_NONE)
+		return;
+	// FCI: PID + bitmask of the following 16 lost packets
+	pid = seqs[0];
+	for(i = 1; i <= n; i++) {
+		unsigned short d = (i < n) ? (unsigned short) (seqs[i] - pid) : 0;
+		if(d >= 1 && d <= 16) {
+			blp |= (1 << (d-1));
+			continue;
+		}
+		pkt[len++] = pid >> 8;
+		pkt[len++] = pid & 0x0ff;
+		pkt[len++] = blp >> 8;
+		pkt[len++] = blp & 0x0ff;
+		if(i < n) {
+			pid = seqs[i];
+			blp = 0;
+		}
+	}
+	pkt[0] = 0x80 | RTCP_FMT_NACK;
+	pkt[1] = RTCP_RTPFB;
+	pkt[2] = ((len/4) - 1) >> 8;
+	pkt[3] = ((len/4) - 1) & 0x0ff;
+	*((unsigned int*) &pkt[4]) = htonl(rtpsrc->SSRC());
+	*((unsigned int*) &pkt[8]) = htonl(ssrc);
+	// to the server RTP port, which also punched the NAT for us
+	bzero(&sin, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr = rtspconf->sin.sin_addr;
+	sin.sin_port = htons(subsession->serverPortNum);
+	sendto(rtpsrc->RTPgs()->socketNum(), (const char *) pkt, len, 0,
+		(struct sockaddr*) &sin, sizeof(sin));
+	return;
+}
+
+/* track sequence gaps of an SSRC and request retransmissions */
+static void
+rtp_nack_update(MediaSubsession *subsession, unsigned int ssrc, unsigned short seqnum, struct timeval *tv) {
+	map<unsigned int, rtp_nack_record_t>::iterator mi;
+	list<rtp_nack_missing_t>::iterator li;
+	unsigned short seqs[RTP_NACK_MAX];
+	long long now = tv->tv_sec * 1000000LL + tv->tv_usec;
+	int n = 0;
+	short delta;
+	//
+	if((mi = _nackmap.find(ssrc)) == _nackmap.end()) {
+		_nackmap[ssrc].maxseq = seqnum;
+		return;
+	}
+	delta = (short) (seqnum - mi->second.maxseq);
+	if(delta > 0) {
+		if(delta - 1 > RTP_NACK_MAX) {
+			// burst too long to repair, wait for the next keyframe
+			mi->second.missing.clear();
+		} else {
+			rtp_nack_missing_t m;
+			m.sent = 0;
+			m.first = m.last = now;
+			for(m.seq = mi->second.maxseq + 1; m.seq != seqnum; m.seq++)
+				mi->second.missing.push_back(m);
+			while(mi->second.missing.size() > RTP_NACK_MAX)
+				mi->second.missing.pop_front();
+		}
+		mi->second.maxseq = seqnum;
+	} else {
+		// reordered or retransmitted
+		for(li = mi->second.missing.begin(); li != mi->second.missing.end(); li++) {
+			if(li->seq == seqnum) {
+				mi->second.missing.erase(li);
+				break;
+			}
+		}
+	}
+	// expire, then collect the packets due for a (re)transmitted NACK
+	li = mi->second.missing.begin();
+	while(li != mi->second.missing.end()) {
+		if(li->sent > rtp_nack_retries
+		|| now - li->first > rtp_packet_reordering_threshold) {
+			li = mi->second.missing.erase(li);
+			continue;
+		}
+		if(li->sent == 0 || now - li->last >= rtp_nack_retry) {
+			seqs[n++] = li->seq;
+			li->sent++;
+			li->last = now;
+		}
+		li++;
+	}
+	if(n > 0) {
+		rtp_nack_send(subsession, ssrc, seqs, n);
+		if(log_rtp > 0) {
+			ga_log("log_rtp: NACK ssrc %u, %d packets from seq %u\n",
+				ssrc, n, seqs[0]);
+		}
+	}
+	return;
+}
+
+//// XOR parity FEC receiver
+
+#define	RTP_FEC_RING	1024	/* media packets kept per SSRC, power of two */
+#define	RTP_FEC_SLOT	1500	/* max size of a kept media packet */
+
+typedef struct rtp_fec_slot_s {
+	int len;		/* 0 - empty */
+	unsigned short seq;
+	unsigned char data[RTP_FEC_SLOT];
+}	rtp_fec_slot_t;
+
+/* rings are allocated when the first FEC packet of an SSRC arrives */
+static map<unsigned int, rtp_fec_slot_t*> _fecmap;
+static int rtp_fec = 1;
+static int rtp_fec_pt = 127;
+static int rtp_fec_socket = -1;
+static unsigned int rtp_fec_recovered = 0;
+
+static void
+rtp_fec_clear() {
+	map<unsigned int, rtp_fec_slot_t*>::iterator mi;
+	for(mi = _fecmap.begin(); mi != _fecmap.end(); mi++)
+		free(mi->second);
+	_fecmap.clear();
+	return;
+}
+
+/* keep a media packet for recovery */
+static void
+rtp_fec_store(unsigned int ssrc, unsigned short seqnum, unsigned char *packet, unsigned packetSize) {
+	map<unsigned int, rtp_fec_slot_t*>::iterator mi;
+	rtp_fec_slot_t *slot;
+	if(packetSize > RTP_FEC_SLOT || (mi = _fecmap.find(ssrc)) == _fecmap.end())
+		return;
+	slot = &mi->second[seqnum & (RTP_FEC_RING-1)];
+	slot->len = packetSize;
+	slot->seq = seqnum;
+	bcopy(packet, slot->data, packetSize);
+	return;
+}
+
+/* recover the only missing packet protected by an FEC packet, and feed it
+ * back to the RTP source through its own socket */
+static void
+rtp_fec_receive(MediaSubsession *subsession, unsigned int ssrc, unsigned char *packet, unsigned packetSize) {
+	map<unsigned int, rtp_fec_slot_t*>::iterator mi;
+	unsigned short seqs[GA_FEC_GROUP_MAX];
+	const unsigned char *pkts[GA_FEC_GROUP_MAX];
+	int lens[GA_FEC_GROUP_MAX];
+	unsigned char pkt[RTP_FEC_SLOT];
+	struct sockaddr_in sin;
+	int i, n = 0, count, len;
+	//
+	if((mi = _fecmap.find(ssrc)) == _fecmap.end()) {
+		rtp_fec_slot_t *ring = (rtp_fec_slot_t*) calloc(RTP_FEC_RING, sizeof(rtp_fec_slot_t));
+		if(ring != NULL) {
+			_fecmap[ssrc] = ring;
+			rtsperror("FEC: protected stream found, ssrc %u\n", ssrc);
+		}
+		return;
+	}
+	if((count = ga_fec_protected(packet, packetSize, seqs)) <= 0)
+		return;
+	for(i = 0; i < count; i++) {
+		rtp_fec_slot_t *slot = &mi->second[seqs[i] & (RTP_FEC_RING-1)];
+		if(slot->len == 0 || slot->seq != seqs[i])
+			continue;
+		pkts[n] = slot->data;
+		lens[n] = slot->len;
+		n++;
+	}
+	if(n != count - 1 || subsession == NULL)
+		return;
+	if((len = ga_fec_recover(pkt, sizeof(pkt), packet, packetSize, pkts, lens, n)) < 0)
+		return;
+	if(rtp_fec_socket < 0
+	&& (rtp_fec_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+		rtsperror("FEC: cannot create socket - %s.\n", strerror(errno));
+		return;
+	}
+	bzero(&sin, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = htons(subsession->clientPortNum());
+	sendto(rtp_fec_socket, (const char *) pkt, len, 0, (struct sockaddr*) &sin, sizeof(sin));
+	rtp_fec_recovered++;
+	if(log_rtp > 0) {
+		ga_log("log_rtp: FEC recovered seq %u ssrc %u size %d (%u total)\n",
+			(pkt[2] << 8) | pkt[3], ssrc, len, rtp_fec_recovered);
+	}
+	return;
+}
+
 //// bandwidth estimator
 
 typedef struct bwe_record_s {
@@ -608,6 +1034,15 @@ bandwidth_estimator_update(unsigned int ssrc, unsigned short seq, struct timeval
 				mi->second.framecount = 1;
 			}
 		}
+	// late (reordered or retransmitted) packet
+	} else if((short) (seq - mi->second.lastPktSeq) <= 0) {
+		if(mi->second.pktloss > 0) {
+			mi->second.pktloss--;
+			mi->second.pktcount--;
+		}
+		mi->second.pktcount++;
+		mi->second.bytesRcvd += pktsize;
+		return;
 	// has packet loss
 	} else {
 		unsigned short delta = (seq - mi->second.lastPktSeq - 1);
@@ -669,9 +1104,18 @@ rtp_packet_handler(void *clientData, unsigned char *packet, unsigned &packetSize
 			flags, seqnum, timestamp, ssrc, packetSize);
 #endif
 	}
+	// parity packets have their own sequence numbers
+	if(rtp_fec != 0 && (flags & 0x7f) == rtp_fec_pt) {
+		rtp_fec_receive((MediaSubsession*) clientData, ssrc, packet, packetSize);
+		return;
+	}
 	//
 	bandwidth_estimator_update(ssrc, seqnum, tv, timestamp, packetSize);
 	pktloss_monitor_update(ssrc, seqnum);
+	if(rtp_nack != 0)
+		rtp_nack_update((MediaSubsession*) clientData, ssrc, seqnum, &tv);
+	if(rtp_fec != 0)
+		rtp_fec_store(ssrc, seqnum, packet, packetSize);
 	//
 	return;
 }
@@ -1072,32 +1516,108 @@ play_video(int channel, unsigned char *buffer, int bufsize, struct timeval pts,
 }
 
 static const int abmaxsize = AVCODEC_MAX_AUDIO_FRAME_SIZE*4;
-static unsigned char *audiobuf = NULL;
-static unsigned int absize = 0;
-static unsigned int abpos = 0;
+static unsigned char *audiobuf = NULL;	// decoder output
 // need a converter?
 static struct SwrContext *swrctx = NULL;
 static unsigned char *convbuf = NULL;
 static int max_decoder_size = 0;
 static int audio_start = 0;
 
+// decoded audio ring: single producer (decoder thread),
+// single consumer (audio callback), positions are in bytes
+#define	AUDIO_RING_DEFAULT_MS	100
+#define	AUDIO_RING_MIN_LEVEL_MS	10
+#define	AUDIO_RING_POLL_US	2000
+#if defined(_MSC_VER)
+/* volatile accesses have acquire/release semantics with /volatile:ms */
+#define	RING_LOAD_ACQUIRE(p)		(*(volatile unsigned int *) (p))
+#define	RING_STORE_RELEASE(p, v)	(*(volatile unsigned int *) (p) = (v))
+#else
+#define	RING_LOAD_ACQUIRE(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define	RING_STORE_RELEASE(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#endif
+static unsigned int abinitialized = 0;
+static unsigned char *abring = NULL;
+static unsigned int abringsize = 0;	// power of two
+static unsigned int abwpos = 0;		// updated by the decoder thread only
+static unsigned int abrpos = 0;		// updated by the audio callback only
+static unsigned int abframebytes = 0;
+static unsigned int abminlevel = 0;
+static pthread_t abthread;
+static unsigned int abstop = 0;		// asks the decoder thread to quit
+// audio callback statistics, updated by the audio callback only
+static unsigned int abcb_size = 0;	// last request size
+static unsigned int abcb_count = 0;
+static unsigned int abcb_us = 0;
+static unsigned int abcb_maxus = 0;
+static unsigned int abcb_underruns = 0;
+static int abcb_playing = 0;
+
+static void * audio_decoder_threadproc(void *arg);
+
 unsigned char *
 audio_buffer_init() {
+	unsigned int bytes, size;
+	int ms;
+	if(RING_LOAD_ACQUIRE(&abinitialized) != 0)
+		return audiobuf;
 	if(audiobuf == NULL) {
 		audiobuf = (unsigned char*) malloc(abmaxsize);
 		if(audiobuf == NULL) {
 			return NULL;
 		}
 	}
+	// ring size in milliseconds
+	if((ms = ga_conf_readint("audio-playback-ring")) <= 0)
+		ms = AUDIO_RING_DEFAULT_MS;
+	abframebytes = rtspconf->audio_channels * av_get_bytes_per_sample(rtspconf->audio_device_format);
+	bytes = 1LL * rtspconf->audio_samplerate * ms / 1000 * abframebytes;
+	for(size = 4096; size < bytes; size <<= 1)
+		;
+	abminlevel = 1LL * rtspconf->audio_samplerate * AUDIO_RING_MIN_LEVEL_MS / 1000 * abframebytes;
+	// the ring of a previous session is reused if it has the same size
+	if(abring != NULL && abringsize != size) {
+		free(abring);
+		abring = NULL;
+	}
+	abringsize = size;
+	if(abring == NULL && (abring = (unsigned char*) malloc(abringsize)) == NULL) {
+		rtsperror("audio decoder: cannot allocate audio ring (%u bytes)\n", abringsize);
+		return NULL;
+	}
+	abwpos = abrpos = 0;
+	RING_STORE_RELEASE(&abstop, 0);
+	if(pthread_create(&abthread, NULL, audio_decoder_threadproc, NULL) != 0) {
+		rtsperror("audio decoder: cannot create decoder thread\n");
+		free(abring);
+		abring = NULL;
+		return NULL;
+	}
+	rtsperror("audio decoder: ring initialized - %u bytes (%d ms requested)\n", abringsize, ms);
+	RING_STORE_RELEASE(&abinitialized, 1);
 	return audiobuf;
 }
 
+/* stop the decoder thread of a session; the ring is kept, an audio
+ * callback may still be running and the next session reuses it */
+static void
+audio_buffer_deinit() {
+	if(RING_LOAD_ACQUIRE(&abinitialized) == 0)
+		return;
+	RING_STORE_RELEASE(&abinitialized, 0);
+	RING_STORE_RELEASE(&abstop, 1);
+	pthread_join(abthread, NULL);
+	rtsperror("audio decoder: thread stopped\n");
+	return;
+}
+
 int
-audio_buffer_decode(AVPacket *pkt, unsigned char *dstbuf, int dstlen) {
+audio_buffer_decode(AVPacket *pkt, unsigned char *dstbuf, int dstlen, long long excess) {
 	const unsigned char *srcplanes[SWR_CH_MAX];
 	unsigned char *dstplanes[SWR_CH_MAX];
 	unsigned char *saveptr;
 	int filled = 0;
+	int framebytes = rtspconf->audio_channels * av_get_bytes_per_sample(rtspconf->audio_device_format);
 	//
 	saveptr = pkt->data;
 	while(pkt->size > 0) {
@@ -1116,7 +1636,7 @@ audio_buffer_decode(AVPacket *pkt, unsigned char *dstbuf, int dstlen) {
 			continue;
 		}
 		//
-		if(aframe->format == rtspconf->audio_device_format) {
+		if(aframe->format == rtspconf->audio_device_format && jb_max_stretch <= 0) {
 			datalen = av_samples_get_buffer_size(NULL,
 					aframe->channels/*rtspconf->audio_channels*/,
 					aframe->nb_samples,
@@ -1124,7 +1644,8 @@ audio_buffer_decode(AVPacket *pkt, unsigned char *dstbuf, int dstlen) {
 			srcbuf = aframe->data[0];
 		} else {
 			// aframe->format != rtspconf->audio_device_format
-			// need conversion!
+			// or time-stretch enabled: need conversion!
+			int outsamples, delta = 0;
 			if(swrctx == NULL) {
 				if((swrctx = swr_alloc_set_opts(NULL,
 						rtspconf->audio_device_channel_layout,
@@ -1141,6 +1662,11 @@ audio_buffer_decode(AVPacket *pkt, unsigned char *dstbuf, int dstlen) {
 					rtsperror("audio decoder: cannot initialize swrctx.\n");
 					return -1;
 				}
+				// enable the resampler for drift compensation
+				if(jb_max_stretch > 0 && swr_set_compensation(swrctx, 0, 0) < 0) {
+					rtsperror("audio decoder: time-stretch not supported, disabled.\n");
+					jb_max_stretch = 0;
+				}
 				max_decoder_size = av_samples_get_buffer_size(NULL,
 						rtspconf->audio_channels,
 						rtspconf->audio_samplerate*2/* max buffer for 2 seconds */,
@@ -1158,9 +1684,10 @@ audio_buffer_decode(AVPacket *pkt, unsigned char *dstbuf, int dstlen) {
 						(int) rtspconf->audio_samplerate,
 						av_get_sample_fmt_name(rtspconf->audio_device_format));
 			}
+			outsamples = av_rescale(aframe->nb_samples, rtspconf->audio_samplerate, aframe->sample_rate);
 			datalen = av_samples_get_buffer_size(NULL,
 					rtspconf->audio_channels,
-					aframe->nb_samples,
+					outsamples,
 					rtspconf->audio_device_format,
 					1/*no-alignment*/);
 			if(datalen > max_decoder_size) {
@@ -1193,8 +1720,26 @@ audio_buffer_decode(AVPacket *pkt, unsigned char *dstbuf, int dstlen) {
 			dstplanes[0] = convbuf;
 			dstplanes[1] = NULL;
 			//
-			swr_convert(swrctx, dstplanes, aframe->nb_samples,
-					srcplanes, aframe->nb_samples);
+			// time-stretch: spread the delay correction over this frame
+			if(jb_max_stretch > 0 && excess != 0) {
+				int maxdelta = outsamples * jb_max_stretch / 100;
+				delta = (int) (-excess * rtspconf->audio_samplerate / 1000000LL);
+				if(delta > maxdelta)	delta = maxdelta;
+				if(delta < -maxdelta)	delta = -maxdelta;
+				if(delta != 0 && swr_set_compensation(swrctx, delta, outsamples) >= 0) {
+					excess += 1000000LL * delta / rtspconf->audio_samplerate;
+				} else {
+					delta = 0;
+				}
+			}
+			if((outsamples = swr_convert(swrctx, dstplanes, max_decoder_size / framebytes,
+					srcplanes, aframe->nb_samples)) < 0) {
+				rtsperror("audio decoder: conversion failed.\n");
+				return -1;
+			}
+			if(jb_max_stretch > 0)
+				packet_queue_account(&audioq, outsamples, delta);
+			datalen = outsamples * framebytes;
 			srcbuf = convbuf;
 		}
 		if(datalen > dstlen) {
@@ -1216,56 +1761,129 @@ audio_buffer_decode(AVPacket *pkt, unsigned char *dstbuf, int dstlen) {
 	return filled;
 }
 
-int
-audio_buffer_fill(void *userdata, unsigned char *stream, int ssize) {
-	int filled = 0;
-	AVPacket avpkt;
-#ifdef ANDROID
-	// XXX: use global adecoder
-#else
-	AVCodecContext *adecoder = (AVCodecContext*) userdata;
-#endif
-	//
-	if(audio_buffer_init() == NULL) {
-		rtsperror("audio decoder: cannot allocate audio buffer\n");
-#ifdef ANDROID
-		rtspParam->quitLive555 = 1;
-		return -1;
-#else
-		exit(-1);
-#endif
+/* copy decoded audio into the ring, waits while the ring is full */
+static void
+audio_ring_write(const unsigned char *data, unsigned int size) {
+	unsigned int wpos = abwpos, space, n, off;
+	while(size > 0) {
+		space = abringsize - (wpos - RING_LOAD_ACQUIRE(&abrpos));
+		if(space == 0) {
+			usleep(AUDIO_RING_POLL_US);
+			continue;
+		}
+		n = size < space ? size : space;
+		off = wpos & (abringsize - 1);
+		if(off + n > abringsize) {
+			bcopy(data, abring + off, abringsize - off);
+			bcopy(data + abringsize - off, abring, n - (abringsize - off));
+		} else {
+			bcopy(data, abring + off, n);
+		}
+		wpos += n;
+		RING_STORE_RELEASE(&abwpos, wpos);
+		data += n;
+		size -= n;
 	}
-	while(filled < ssize) {
-		int dsize = 0, delta = 0;;
-		// buffer has enough data
-		if(absize - abpos >= ssize - filled) {
-			delta = ssize - filled;
-			bcopy(audiobuf+abpos, stream, delta);
-			abpos += delta;
-			filled += delta;
-			return ssize;
-		} else if(absize - abpos > 0) {
-			delta = absize - abpos;
-			bcopy(audiobuf+abpos, stream, delta);
-			stream += delta;
-			filled += delta;
-			abpos = absize = 0;
+	return;
+}
+
+/* must be called from the decoder thread */
+static void
+audio_callback_report(struct timeval *now) {
+	static struct timeval lasttime = *now;
+	static unsigned int lastcount = 0, lastus = 0;
+	unsigned int count, us;
+	if(jb_report_interval <= 0 || tvdiff_us(now, &lasttime) < jb_report_interval * 1000000LL)
+		return;
+	count = RING_LOAD_ACQUIRE(&abcb_count);
+	us = RING_LOAD_ACQUIRE(&abcb_us);
+	rtsperror("audio callback: calls=%u; avg=%.1fus; max=%uus; underruns=%u; ring=%u/%u bytes\n",
+		count - lastcount,
+		count != lastcount ? 1.0 * (us - lastus) / (count - lastcount) : 0.0,
+		RING_LOAD_ACQUIRE(&abcb_maxus),
+		RING_LOAD_ACQUIRE(&abcb_underruns),
+		abwpos - RING_LOAD_ACQUIRE(&abrpos), abringsize);
+	RING_STORE_RELEASE(&abcb_maxus, 0);
+	lastcount = count;
+	lastus = us;
+	lasttime = *now;
+	return;
+}
+
+/* decode packets from the jitter buffer into the ring, outside the audio callback */
+static void *
+audio_decoder_threadproc(void *arg) {
+	unsigned int level, want, underruns = 0, u;
+	struct timeval now;
+	long long excess;
+	AVPacket avpkt;
+	int dsize;
+	rtsperror("audio decoder: thread started (tid=%ld)\n", ga_gettid());
+	while(RING_LOAD_ACQUIRE(&abstop) == 0) {
+		gettimeofday(&now, NULL);
+		audio_callback_report(&now);
+		// the callback ran dry: rebuffer
+		if((u = RING_LOAD_ACQUIRE(&abcb_underruns)) != underruns) {
+			underruns = u;
+			packet_queue_underrun(&audioq);
 		}
-		// move data to head, leave more ab buffers
-		if(abpos != 0) {
-			bcopy(audiobuf+abpos, audiobuf, absize-abpos);
-			absize -= abpos;
-			abpos = 0;
+		// stay about two callbacks ahead, leave the rest in the jitter buffer
+		level = abwpos - RING_LOAD_ACQUIRE(&abrpos);
+		want = 2 * RING_LOAD_ACQUIRE(&abcb_size);
+		if(want < abminlevel)		want = abminlevel;
+		if(want > abringsize / 2)	want = abringsize / 2;
+		if(level >= want) {
+			usleep(AUDIO_RING_POLL_US);
+			continue;
 		}
-		// decode more packets
-		if(packet_queue_get(&audioq, &avpkt, 0) <= 0)
-			break;
-		if((dsize = audio_buffer_decode(&avpkt, audiobuf+absize, abmaxsize-absize)) < 0)
-			break;
-		absize += dsize;
+		if(packet_queue_get(&audioq, &avpkt, 1) <= 0)
+			continue;
+		// delay not yet played, including decoded samples
+		excess = packet_queue_excess(&audioq,
+				1000000LL * level / abframebytes / rtspconf->audio_samplerate);
+		if((dsize = audio_buffer_decode(&avpkt, audiobuf, abmaxsize, excess)) <= 0)
+			continue;
+		audio_ring_write(audiobuf, dsize);
 	}
-	//
-	return filled;
+	return NULL;
+}
+
+int
+audio_buffer_fill(void *userdata, unsigned char *stream, int ssize) {
+	unsigned int rpos, avail, n, off, us;
+	struct timeval t0, t1;
+	// decoder not yet started
+	if(RING_LOAD_ACQUIRE(&abinitialized) == 0)
+		return 0;
+	gettimeofday(&t0, NULL);
+	RING_STORE_RELEASE(&abcb_size, (unsigned int) ssize);
+	// bounded copy, no locks and no decoding here
+	rpos = abrpos;
+	avail = RING_LOAD_ACQUIRE(&abwpos) - rpos;
+	n = avail < (unsigned int) ssize ? avail : (unsigned int) ssize;
+	off = rpos & (abringsize - 1);
+	if(off + n > abringsize) {
+		bcopy(abring + off, stream, abringsize - off);
+		bcopy(abring, stream + abringsize - off, n - (abringsize - off));
+	} else {
+		bcopy(abring + off, stream, n);
+	}
+	RING_STORE_RELEASE(&abrpos, rpos + n);
+	// statistics
+	if(n < (unsigned int) ssize) {
+		if(abcb_playing)
+			RING_STORE_RELEASE(&abcb_underruns, abcb_underruns + 1);
+		abcb_playing = 0;
+	} else {
+		abcb_playing = 1;
+	}
+	gettimeofday(&t1, NULL);
+	us = (unsigned int) tvdiff_us(&t1, &t0);
+	RING_STORE_RELEASE(&abcb_count, abcb_count + 1);
+	RING_STORE_RELEASE(&abcb_us, abcb_us + us);
+	if(us > RING_LOAD_ACQUIRE(&abcb_maxus))
+		RING_STORE_RELEASE(&abcb_maxus, us);
+	return n;
 }
 
 void
@@ -1284,7 +1902,7 @@ audio_buffer_fill_sdl(void *userdata, unsigned char *stream, int ssize) {
 }
 
 static void
-play_audio(unsigned char *buffer, int bufsize, struct timeval pts) {
+play_audio(unsigned char *buffer, int bufsize, struct timeval pts, unsigned int rtpts, unsigned int clockrate) {
 #ifdef ANDROID
 	if(rtspconf->builtin_audio_decoder != 0) {
 		android_decode_audio(rtspParam, buffer, bufsize, pts);
@@ -1296,13 +1914,18 @@ play_audio(unsigned char *buffer, int bufsize, struct timeval pts) {
 	av_init_packet(&avpkt);
 	avpkt.data = buffer;
 	avpkt.size = bufsize;
+	if(audio_buffer_init() == NULL) {
+		rtsperror("audio decoder: cannot allocate audio buffer\n");
+		rtspParam->quitLive555 = 1;
+		return;
+	}
 	if(avpkt.size > 0) {
 #if 0
 		fprintf(stderr, "DEBUG: audio pts=%08ld.%06ld queue-count=%u queue-size=%u\n",
 			pts.tv_sec, pts.tv_usec,
 			audioq.queue.size(), audioq.size);
 #endif
-		packet_queue_put(&audioq, &avpkt);
+		packet_queue_put(&audioq, &avpkt, rtpts, clockrate);
 		packet_queue_drop(&audioq);
 	}
 #ifndef ANDROID
@@ -1358,8 +1981,18 @@ rtsp_thread(void *param) {
 		rtp_packet_reordering_threshold = ga_conf_readint("rtp-reordering-threshold");
 	}
 	rtsperror("RTP reordering threshold = %d\n", rtp_packet_reordering_threshold);
+	rtp_nack = ga_conf_readbool("rtp-nack", 1);
+	if(ga_conf_readint("rtp-nack-retry") > 0)
+		rtp_nack_retry = 1000LL * ga_conf_readint("rtp-nack-retry");
+	if(ga_conf_readint("rtp-nack-retries") > 0)
+		rtp_nack_retries = ga_conf_readint("rtp-nack-retries");
+	rtp_fec = ga_conf_readbool("rtp-fec", 1);
+	if(ga_conf_readint("rtp-fec-payload-type") > 0)
+		rtp_fec_pt = ga_conf_readint("rtp-fec-payload-type") & 0x7f;
 	//
 	pktloss_monitor_init();
+	_nackmap.clear();
+	rtp_fec_clear();
 	port2channel.clear();
 	video_sess_fmt = -1;
 	audio_sess_fmt = -1;
@@ -1406,6 +2039,7 @@ rtsp_thread(void *param) {
 	}
 	//
 	shutdownStream(client);
+	audio_buffer_deinit();
 	deinit_decoder_buffer();
 	// release resources in rtspThreadParam
 	for(int i = 0; i < VIDEO_SOURCE_CHANNEL_MAX; i++) {
@@ -1568,7 +2202,7 @@ setupNextSubsession(RTSPClient* rtspClient) {
 				video_sess_fmt = scs.subsession->rtpPayloadFormat();
 				video_codec_name = strdup(scs.subsession->codecName());
 				qos_add_source(video_codec_name, scs.subsession->rtpSource());
-				scs.subsession->rtpSource()->setAuxilliaryReadHandler(rtp_packet_handler, NULL);
+				scs.subsession->rtpSource()->setAuxilliaryReadHandler(rtp_packet_handler, scs.subsession);
 				if(rtp_packet_reordering_threshold > 0)
 					scs.subsession->rtpSource()->setPacketReorderingThresholdTime(rtp_packet_reordering_threshold);
 				if(port2channel.find(scs.subsession->clientPortNum()) == port2channel.end()) {
@@ -2002,8 +2636,11 @@ DummySink::afterGettingFrame(unsigned frameSize, unsigned numTruncatedBytes,
 			kickWatchdog(rtspParam->jnienv);
 #endif
 	} else if(fSubsession.rtpPayloadFormat() == audio_sess_fmt) {
+		RTPSource *rtpsrc = fSubsession.rtpSource();
 		play_audio(fReceiveBuffer+MAX_FRAMING_SIZE-audio_framing,
-			frameSize+audio_framing, presentationTime);
+			frameSize+audio_framing, presentationTime,
+			rtpsrc != NULL ? rtpsrc->curPacketRTPTimestamp() : 0,
+			fSubsession.rtpTimestampFrequency());
 	}
 #ifndef ANDROID // watchdog is implemented at the Java side
 	pthread_mutex_lock(&watchdogMutex);
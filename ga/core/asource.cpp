@@ -28,6 +28,7 @@
 #include "asource.h"
 
 #include "ga-common.h"
+#include "ga-conf.h"
 
 using namespace std;
 
@@ -38,36 +39,143 @@ static int gChunksize = 0;
 static int gSamplerate = 0;
 static int gBitspersample = 0;
 static int gChannels = 0;
+static int gLatency = -1;		// capture latency in us
+
+// shared audio ring: written once by the capture thread, read by all clients
+#define	AUDIO_RING_CHUNKS	8	/**< Minimum ring capacity in chunks */
+static pthread_mutex_t writemutex = PTHREAD_MUTEX_INITIALIZER;	// serializes writers
+static pthread_mutex_t ringmutex = PTHREAD_MUTEX_INITIALIZER;	// protects positions
+static pthread_cond_t ringcond = PTHREAD_COND_INITIALIZER;
+static unsigned char *gRing = NULL;
+static int gRingFrames = 0;		// capacity in frames, a power of two
+static int gRingFrameBytes = 0;
+static int gRingMirror = 0;		// frames at the head mirrored after the end
+static int gRingReaders = 0;
+static long long gRingWrite = 0;	// frames visible to readers
+static long long gRingReserve = 0;	// frames visible + frames being written
+static unsigned gRingWakeup = 0;	// bumped by audio_source_buffer_wakeup()
+
+/* (re)allocate the ring for the current setup: call with writemutex and ringmutex held */
+static int
+ring_alloc() {
+	int frames = 1, mirror, framebytes = gChannels * gBitspersample / 8;
+	unsigned char *ring;
+	//
+	if(gChunksize <= 0 || framebytes <= 0)
+		return -1;
+	while(frames < gChunksize * AUDIO_RING_CHUNKS || frames < 2 * AUDIO_SOURCE_PEEK_MAX)
+		frames <<= 1;
+	if(gRing != NULL && frames == gRingFrames && framebytes == gRingFrameBytes)
+		return 0;
+	if(gRing != NULL && gRingReaders > 0) {
+		ga_error("audio source: ring setup changed with %d readers attached.\n", gRingReaders);
+		return -1;
+	}
+	// the mirror keeps peeked frames contiguous across the wrap-around
+	mirror = AUDIO_SOURCE_PEEK_MAX;
+	if((ring = (unsigned char*) malloc((frames + mirror) * framebytes)) == NULL)
+		return -1;
+	if(gRing != NULL)
+		free(gRing);
+	gRing = ring;
+	gRingFrames = frames;
+	gRingFrameBytes = framebytes;
+	gRingMirror = mirror;
+	gRingWrite = gRingReserve = 0;
+	ga_error("audio source: ring allocated (%d+%d frames, %d bytes).\n",
+		frames, mirror, (frames + mirror) * framebytes);
+	return 0;
+}
+
+/* skip frames overwritten by the writer: call with ringmutex held */
+static void
+ring_catchup(audio_buffer_t *ab) {
+	long long lost = gRingReserve - gRingFrames - ab->rpos;
+	if(lost <= 0)
+		return;
+	ab->rpos += lost;
+	ab->bufPts += lost;
+	ab->overruns += lost;
+	ga_error("Audio source: buffer overflow, %lld frames dropped (%lld total)\n",
+		lost, ab->overruns);
+	return;
+}
+
+/* refresh the mirror after writing frames at a ring offset */
+static void
+ring_mirror(int offset, int frames) {
+	if(offset >= gRingMirror)
+		return;
+	if(frames > gRingMirror - offset)
+		frames = gRingMirror - offset;
+	bcopy(gRing + offset * gRingFrameBytes,
+		gRing + (gRingFrames + offset) * gRingFrameBytes,
+		frames * gRingFrameBytes);
+	return;
+}
+
+/* copy frames between the ring and a linear buffer, handling the wrap-around */
+static void
+ring_copy(long long pos, unsigned char *dst, const unsigned char *src, int frames) {
+	int offset = (int) (pos & (gRingFrames - 1));
+	int n = gRingFrames - offset;
+	if(n > frames)
+		n = frames;
+	if(dst != NULL) {
+		// read
+		bcopy(gRing + offset * gRingFrameBytes, dst, n * gRingFrameBytes);
+		if(frames > n)
+			bcopy(gRing, dst + n * gRingFrameBytes, (frames - n) * gRingFrameBytes);
+		return;
+	}
+	if(src != NULL) {
+		// write
+		bcopy(src, gRing + offset * gRingFrameBytes, n * gRingFrameBytes);
+		if(frames > n)
+			bcopy(src + n * gRingFrameBytes, gRing, (frames - n) * gRingFrameBytes);
+	} else {
+		// write silence
+		bzero(gRing + offset * gRingFrameBytes, n * gRingFrameBytes);
+		if(frames > n)
+			bzero(gRing, (frames - n) * gRingFrameBytes);
+	}
+	ring_mirror(offset, n);
+	if(frames > n)
+		ring_mirror(0, frames - n);
+	return;
+}
 
 audio_buffer_t *
 audio_source_buffer_init() {
-	// XXX:	frames, chennels, and bitspersample should be the same as the
+	// XXX:	channels and bitspersample should be the same as the
 	//	configuration -- since these are provided by encoders (clients)
 	audio_buffer_t *ab;
-	int frames = gChunksize*4;
-	int channels = gChannels;
-	int bitspersample = gBitspersample;
-	if(frames == 0
-	|| channels == 0
-	|| bitspersample == 0) {
+	if(gChunksize == 0
+	|| gChannels == 0
+	|| gBitspersample == 0) {
 		ga_error("audio source: invalid argument (frames=%d, channels=%d, bitspersample=%d)\n",
-			frames, channels, bitspersample);
+			gChunksize, gChannels, gBitspersample);
 		return NULL;
 	}
 	if((ab = (audio_buffer_t*) malloc(sizeof(audio_buffer_t))) == NULL) {
 		return NULL;
 	}
 	bzero(ab, sizeof(audio_buffer_t));
-	pthread_mutex_init(&ab->bufmutex, NULL);
-	pthread_cond_init(&ab->bufcond, NULL);
-	ab->frames = frames;
-	ab->channels = channels;
-	ab->bitspersample = bitspersample;
-	ab->bufsize = frames * channels * bitspersample / 8;
-	if((ab->buffer = (unsigned char*) malloc(ab->bufsize)) == NULL) {
+	pthread_mutex_lock(&writemutex);
+	pthread_mutex_lock(&ringmutex);
+	if(ring_alloc() < 0) {
+		pthread_mutex_unlock(&ringmutex);
+		pthread_mutex_unlock(&writemutex);
 		free(ab);
 		return NULL;
 	}
+	gRingReaders++;
+	ab->frames = gRingFrames;
+	ab->channels = gChannels;
+	ab->bitspersample = gBitspersample;
+	ab->rpos = gRingWrite;
+	pthread_mutex_unlock(&ringmutex);
+	pthread_mutex_unlock(&writemutex);
 	return ab;
 }
 
@@ -75,115 +183,145 @@ void
 audio_source_buffer_deinit(audio_buffer_t *ab) {
 	if(ab == NULL)
 		return;
-	if(ab->buffer != NULL)
-		free(ab->buffer);
+	pthread_mutex_lock(&ringmutex);
+	gRingReaders--;
+	pthread_mutex_unlock(&ringmutex);
 	free(ab);
 	return;
 }
 
 void
-audio_source_buffer_fill_one(audio_buffer_t *ab, const unsigned char *data, int frames) {
-	int headspace, tailspace;
-	int framesize;
-	if(ab == NULL)
-		return;
+audio_source_buffer_fill(const unsigned char *data, int frames) {
+	long long wpos;
 	if(frames <= 0)
 		return;
-	framesize = frames * ab->channels * ab->bitspersample / 8;
-	pthread_mutex_lock(&ab->bufmutex);
-retry:
-	headspace = ab->bufhead;
-	tailspace = ab->bufsize - ab->buftail;
-	if(framesize > headspace + tailspace) {
-		ga_error("Audio source: buffer overflow, packet dropped (%d frames)\n", frames);
-		pthread_mutex_unlock(&ab->bufmutex);
-		pthread_cond_signal(&ab->bufcond);
+	pthread_mutex_lock(&writemutex);
+	pthread_mutex_lock(&ringmutex);
+	if(gRing == NULL || gRingReaders == 0) {
+		pthread_mutex_unlock(&ringmutex);
+		pthread_mutex_unlock(&writemutex);
 		return;
 	}
-	// we GUARANTEE that bufhead <= buftail
-	if(framesize <= tailspace) {
-		// case #1: tailspace is sufficient, append at the end
-		if(data == NULL) {
-			bzero(&ab->buffer[ab->buftail], framesize);
-		} else {
-			bcopy(data, &ab->buffer[ab->buftail], framesize);
-		}
-		ab->buftail += framesize;
-		ab->bframes += frames;
-		pthread_mutex_unlock(&ab->bufmutex);
-		pthread_cond_signal(&ab->bufcond);
-		return;
+	// larger than the ring: only the latest frames survive
+	if(frames > gRingFrames) {
+		if(data != NULL)
+			data += (frames - gRingFrames) * gRingFrameBytes;
+		frames = gRingFrames;
 	}
-	// case #2: framesize > tailspace, but overall space is sufficient
-	bcopy(&ab->buffer[ab->bufhead], ab->buffer, ab->buftail - ab->bufhead);
-	ab->buftail -= ab->bufhead;
-	ab->bufhead = 0;
-	goto retry;
-	// never reach here
+	wpos = gRingWrite;
+	gRingReserve = wpos + frames;
+	pthread_mutex_unlock(&ringmutex);
+	// the only writer: copy without blocking readers
+	ring_copy(wpos, NULL, data, frames);
+	//
+	pthread_mutex_lock(&ringmutex);
+	gRingWrite = gRingReserve;
+	pthread_cond_broadcast(&ringcond);
+	pthread_mutex_unlock(&ringmutex);
+	pthread_mutex_unlock(&writemutex);
 	return;
 }
 
-void
-audio_source_buffer_fill(const unsigned char *data, int frames) {
-	map<long,audio_buffer_t*>::iterator mi;
-	pthread_mutex_lock(&ccmutex);
-	for(mi = gClients.begin(); mi != gClients.end(); mi++) {
-		if(mi->second != NULL) {
-			audio_source_buffer_fill_one(mi->second, data, frames);
-		}
+/* wait until at least frames are readable or audio_source_buffer_wakeup() is called.
+ * returns the number of readable frames */
+int
+audio_source_buffer_wait(audio_buffer_t *ab, int frames) {
+	int avail;
+	unsigned wakeup;
+	//
+	pthread_mutex_lock(&ringmutex);
+	wakeup = gRingWakeup;
+	while(1) {
+		ring_catchup(ab);
+		avail = (int) (gRingWrite - ab->rpos);
+		if(avail >= frames || wakeup != gRingWakeup)
+			break;
+		pthread_cond_wait(&ringcond, &ringmutex);
 	}
-	pthread_mutex_unlock(&ccmutex);
+	pthread_mutex_unlock(&ringmutex);
+	return avail;
 }
 
 int
 audio_source_buffer_read(audio_buffer_t *ab, unsigned char *buf, int frames) {
-	int copyframe = 0, copysize = 0;
-	struct timeval tv;
-	struct timespec to;
+	int copyframe;
+	long long lapped;
 	//
 	if(frames <= 0) {
 		return 0;
 	}
-	//
-	pthread_mutex_lock(&ab->bufmutex);
-	//
-	if(ab->bframes == 0) {
-		gettimeofday(&tv, NULL);
-		to.tv_sec = tv.tv_sec+1;
-		to.tv_nsec = tv.tv_usec * 1000;
-		pthread_cond_timedwait(&ab->bufcond, &ab->bufmutex, &to);
+	if((copyframe = audio_source_buffer_wait(ab, 1)) <= 0) {
+		return 0;
 	}
-	if(ab->bframes >= frames) {
+	if(copyframe > frames) {
 		copyframe = frames;
+	}
+	ring_copy(ab->rpos, buf, NULL, copyframe);
+	// the writer may have lapped us while copying
+	pthread_mutex_lock(&ringmutex);
+	lapped = gRingReserve - gRingFrames - ab->rpos;
+	if(lapped > 0) {
+		ring_catchup(ab);
+		copyframe = 0;
 	} else {
-		copyframe = ab->bframes;
-	}
-	if(copyframe > 0) {
-		copysize = copyframe * ab->channels * ab->bitspersample / 8;
-		//
-		bcopy(&ab->buffer[ab->bufhead], buf, copysize);
-		//
-		ab->bufhead += copysize;
-		ab->bframes -= copyframe;
+		ab->rpos += copyframe;
 		ab->bufPts += copyframe;
-		if(ab->bframes == 0) {
-			ab->bufhead = ab->buftail = 0;
-		}
 	}
-	//
-	pthread_mutex_unlock(&ab->bufmutex);
+	pthread_mutex_unlock(&ringmutex);
 	//
 	return copyframe;
 }
 
+/* get a pointer to at least frames readable frames without copying,
+ * blocks like audio_source_buffer_wait(). The frames stay in the ring until
+ * audio_source_buffer_consume() is called */
+unsigned char *
+audio_source_buffer_peek(audio_buffer_t *ab, int frames, int *avail) {
+	int n;
+	if(frames <= 0 || frames > gRingMirror) {
+		ga_error("audio source: cannot peek %d frames (max %d).\n", frames, gRingMirror);
+		return NULL;
+	}
+	if((n = audio_source_buffer_wait(ab, frames)) < frames)
+		return NULL;
+	if(avail != NULL)
+		*avail = n;
+	return gRing + (ab->rpos & (gRingFrames - 1)) * gRingFrameBytes;
+}
+
+/* release frames obtained from audio_source_buffer_peek().
+ * returns -1 if the writer has overwritten them in the meantime */
+int
+audio_source_buffer_consume(audio_buffer_t *ab, int frames) {
+	int ret = frames;
+	pthread_mutex_lock(&ringmutex);
+	if(gRingReserve - gRingFrames > ab->rpos) {
+		ring_catchup(ab);
+		ret = -1;
+	} else {
+		ab->rpos += frames;
+		ab->bufPts += frames;
+	}
+	pthread_mutex_unlock(&ringmutex);
+	return ret;
+}
+
 void
 audio_source_buffer_purge(audio_buffer_t *ab) {
-	ga_error("audio: buffer purged (%d bytes / %d frames).\n",
-		ab->buftail - ab->bufhead, ab->bframes);
-	pthread_mutex_lock(&ab->bufmutex);
+	pthread_mutex_lock(&ringmutex);
+	ga_error("audio: buffer purged (%lld frames).\n", gRingWrite - ab->rpos);
 	ab->bufPts = 0LL;
-	ab->bufhead = ab->buftail = ab->bframes = 0;
-	pthread_mutex_unlock(&ab->bufmutex);
+	ab->rpos = gRingWrite;
+	pthread_mutex_unlock(&ringmutex);
+	return;
+}
+
+void
+audio_source_buffer_wakeup() {
+	pthread_mutex_lock(&ringmutex);
+	gRingWakeup++;
+	pthread_cond_broadcast(&ringcond);
+	pthread_mutex_unlock(&ringmutex);
 	return;
 }
 
@@ -235,6 +373,46 @@ audio_source_channels() {
 	return gChannels;
 }
 
+/* snap a frame duration in ms to the next one Opus accepts: 2.5, 5, 10,
+ * 20, 40, or 60 ms; the encoder and the capture chunks must agree on it */
+double
+audio_source_frame_duration(double ms) {
+	static const double durations[] = { 2.5, 5, 10, 20, 40, 60, -1 };
+	int i;
+	for(i = 0; durations[i] > 0; i++) {
+		if(ms <= durations[i])
+			break;
+	}
+	if(durations[i] < 0)
+		i--;
+	return durations[i];
+}
+
+/* preferred capture chunk in frames: one codec frame of audio-frame-duration ms,
+ * or 0 if not configured. Sources use it to deliver whole codec frames */
+int
+audio_source_chunk_hint(int samplerate) {
+	char buf[32];
+	double ms;
+	if(ga_conf_readv("audio-frame-duration", buf, sizeof(buf)) == NULL)
+		return 0;
+	if((ms = strtod(buf, NULL)) <= 0)
+		return 0;
+	return (int) (samplerate * audio_source_frame_duration(ms) / 1000);
+}
+
+/* capture latency measured by the audio source, in microseconds (-1: unknown) */
+void
+audio_source_set_latency(int us) {
+	gLatency = us;
+	return;
+}
+
+int
+audio_source_latency() {
+	return gLatency;
+}
+
 int
 audio_source_setup(int chunksize, int samplerate, int bitspersample, int channels) {
 	gChunksize = chunksize;
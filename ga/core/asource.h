@@ -23,21 +23,31 @@
 
 #include "ga-common.h"
 
+/** Maximum number of frames audio_source_buffer_peek() can return in place */
+#define	AUDIO_SOURCE_PEEK_MAX	4096
+
+/**
+ * Per-client reader of the shared audio ring.
+ *
+ * All clients read from one ring written once by the capture thread.
+ * Positions are absolute frame counts since the ring was created.
+ */
 typedef struct audio_buffer_s {
-	pthread_mutex_t bufmutex;
-	pthread_cond_t bufcond;
-	long long bufPts;
+	long long bufPts;	/**< Frames consumed since the last purge */
+	long long rpos;		/**< Read cursor in the shared ring */
+	long long overruns;	/**< Frames lost because the writer lapped this reader */
 	int frames, channels, bitspersample;
-	int bufsize, bufhead, buftail, bframes;
-	unsigned char *buffer;
 }	audio_buffer_t;
 
 EXPORT audio_buffer_t * audio_source_buffer_init();
 EXPORT void audio_source_buffer_deinit(audio_buffer_t *ab);
-EXPORT void audio_source_buffer_fill_one(audio_buffer_t *ab, const unsigned char *data, int frames);
 EXPORT void audio_source_buffer_fill(const unsigned char *data, int frames);
+EXPORT int audio_source_buffer_wait(audio_buffer_t *ab, int frames);
 EXPORT int audio_source_buffer_read(audio_buffer_t *ab, unsigned char *buf, int frames);
+EXPORT unsigned char * audio_source_buffer_peek(audio_buffer_t *ab, int frames, int *avail);
+EXPORT int audio_source_buffer_consume(audio_buffer_t *ab, int frames);
 EXPORT void audio_source_buffer_purge(audio_buffer_t *ab);
+EXPORT void audio_source_buffer_wakeup();
 EXPORT void audio_source_client_register(long tid, audio_buffer_t *ab);
 EXPORT void audio_source_client_unregister(long tid);
 EXPORT int audio_source_client_count();
@@ -47,6 +57,10 @@ EXPORT int audio_source_chunkbytes();
 EXPORT int audio_source_samplerate();
 EXPORT int audio_source_bitspersample();
 EXPORT int audio_source_channels();
+EXPORT double audio_source_frame_duration(double ms);
+EXPORT int audio_source_chunk_hint(int samplerate);
+EXPORT void audio_source_set_latency(int us);
+EXPORT int audio_source_latency();
 EXPORT int audio_source_setup(int chunksize, int samplerate, int bitspersample, int channels);
 
 #endif
@@ -31,6 +31,7 @@
 #endif
 
 #include "ga-common.h"
+#include "ga-thread.h"
 #include "controller.h"
 
 using namespace std;
@@ -385,6 +386,7 @@ ctrl_server_thread(void *rtspconf) {
 		exit(-1);
 	}
 
+	ga_thread_role("controller", 0);
 	ga_error("controller server started: tid=%ld.\n", ga_gettid());
 
 restart:
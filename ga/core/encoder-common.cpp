@@ -26,7 +26,9 @@
 #include <list>
 
 #include "vsource.h"
+#include "rtspconf.h"
 #include "encoder-common.h"
+#include "ga-conf.h"
 
 using namespace std;
 
@@ -35,18 +37,83 @@ static map<void*, void*> encoder_clients; /**< Count for encoder clients */
 
 static bool threadLaunched = false;	/**< Encoder thread is running? */
 
-// for pts sync between encoders
+// for pts sync between encoders: media clock on the monotonic clock
 static pthread_mutex_t syncmutex = PTHREAD_MUTEX_INITIALIZER;
 static bool sync_reset = true;
-static struct timeval synctv;
+static long long syncus;
+// a/v offset monitor
+#define	CLOCK_REPORT_INTERVAL	10000000LL	/* 10s */
+#define	ACLOCK_RATE_WINDOW	10000000LL	/* 10s */
+#define	ACLOCK_MAX_SLEW		0.005		/* 0.5% of a frame */
+static pthread_mutex_t clock_mutex = PTHREAD_MUTEX_INITIALIZER;
+static double clock_lag[2];		/**< Smoothed media clock - pts, in us */
+static bool clock_valid[2];
+static double clock_arate = 0.0;	/**< Measured audio device rate */
+static int clock_nominal = 0;		/**< Nominal audio device rate */
+static long long clock_reportus = 0;
 
 // list of encoders
 static ga_module_t *vencoder = NULL;	/**< Video encoder instance */
 static ga_module_t *aencoder = NULL;	/**< Audio encoder instance */
 static ga_module_t *sinkserver = NULL;	/**< Sink server instance */
+static ga_module_t *vsource = NULL;	/**< Video source instance: for frame rate control */
 static void *vencoder_param = NULL;	/**< Vieo encoder parameter */
 static void *aencoder_param = NULL;	/**< Audio encoder parameter */
 
+// warm-pool mode: encoders stay initialized between sessions
+static bool warm_pool = false;		/**< Warm-pool mode is enabled? */
+static bool warm_initialized = false;	/**< Encoders have been initialized by the warm pool */
+static int warm_sessions = 0;		/**< Sessions served by the warm pool */
+// time-to-first-frame measurement, per video channel
+static pthread_mutex_t ttff_mutex = PTHREAD_MUTEX_INITIALIZER;
+static map<void*, struct timeval> ttff_pending[VIDEO_SOURCE_CHANNEL_MAX];	/**< Attach time of clients waiting for a keyframe */
+static volatile int ttff_waiting[VIDEO_SOURCE_CHANNEL_MAX];
+static const char *ttff_mode[VIDEO_SOURCE_CHANNEL_MAX];
+
+// simulcast encoding ladder
+#define	SIMULCAST_UPSWITCH_HEADROOM	125	/**< Percent of a rendition's bitrate required to switch up */
+typedef struct simulcast_sub_s {
+	int target;				/**< Rendition picked by bandwidth estimate */
+	int current[VIDEO_SOURCE_CHANNEL_MAX];	/**< Rendition being delivered */
+}	simulcast_sub_t;
+static pthread_mutex_t simulcast_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool simulcast_loaded = false;
+static int simulcast_count = 1;
+static encoder_rendition_t simulcast_ladder[ENCODER_SIMULCAST_MAX];
+static map<void*, simulcast_sub_t> simulcast_subs;
+
+static void simulcast_subscribe(void *ctx);
+static void simulcast_unsubscribe(void *ctx);
+
+// overload governor: degrades frame rate, then resolution
+#define	GOVERNOR_LEVEL_MAX	16
+#define	GOVERNOR_WINDOW_US	1000000LL	/**< Length of a measurement window */
+typedef struct governor_level_s {
+	int fps;		/**< Capture frame rate */
+	int scale;		/**< Output resolution in percent */
+}	governor_level_t;
+typedef struct governor_state_s {
+	int level;		/**< Current level, 0 is the native setting */
+	int calm;		/**< Number of consecutive windows with spare capacity */
+	bool settle;		/**< Ignore the window right after a level change */
+	bool floored;		/**< Overloaded at the lowest level has been logged */
+	long long sum_us;	/**< Total encode time in the window */
+	long long max_us;	/**< Longest encode time in the window */
+	int frames;		/**< Frames encoded in the window */
+	int max_backlog;	/**< Largest pipe backlog in the window */
+	struct timeval window;	/**< Start of the window */
+}	governor_state_t;
+static pthread_mutex_t governor_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool governor_loaded = false;
+static bool governor_enabled = false;
+static int governor_budget = 85;	/**< Percent of a frame interval an encode may take */
+static int governor_recover = 60;	/**< Percent of the budget required to step up */
+static int governor_backlog = 2;	/**< Queued frames that count as overloaded */
+static int governor_holddown = 5;	/**< Calm windows required to step up */
+static int governor_nlevels = 1;
+static governor_level_t governor_levels[GOVERNOR_LEVEL_MAX];
+static governor_state_t governor_state[VIDEO_SOURCE_CHANNEL_MAX];
+
 /**
  * Compute the integer presentation timestamp based on elapsed time.
  *
@@ -58,24 +125,167 @@ static void *aencoder_param = NULL;	/**< Audio encoder parameter */
  */
 int	// XXX: need to be int64_t ?
 encoder_pts_sync(int samplerate) {
-	struct timeval tv;
 	long long us;
 	int ret;
 	//
 	pthread_mutex_lock(&syncmutex);
 	if(sync_reset) {
-		gettimeofday(&synctv, NULL);
+		syncus = ga_monotonic_us();
 		sync_reset = false; 
 		pthread_mutex_unlock(&syncmutex);
 		return 0;
 	}
-	gettimeofday(&tv, NULL);
-	us = tvdiff_us(&tv, &synctv);
+	us = ga_monotonic_us() - syncus;
 	pthread_mutex_unlock(&syncmutex);
 	ret = (int) (0.000001 * us * samplerate);
 	return ret > 0 ? ret : 0;
 }
 
+/**
+ * Read the media clock.
+ *
+ * @return Micro seconds since the pts sync point, or 0 before the first
+ *	call to \a encoder_pts_sync().
+ *
+ * The media clock runs on the monotonic clock, so pts derived from it are
+ * not affected by changes of the system time.
+ */
+long long
+encoder_clock_us() {
+	long long us;
+	pthread_mutex_lock(&syncmutex);
+	us = sync_reset ? 0 : ga_monotonic_us() - syncus;
+	pthread_mutex_unlock(&syncmutex);
+	return us;
+}
+
+/**
+ * Report the pts of a frame passed to an encoder.
+ *
+ * @param media [in] ENCODER_CLOCK_VIDEO or ENCODER_CLOCK_AUDIO.
+ * @param pts [in] The pts, derived from \a encoder_pts_sync().
+ * @param rate [in] Time base of \a pts: frame rate or sample rate.
+ *
+ * The lag of each stream behind the media clock is smoothed, and the
+ * difference (the A/V offset) is logged periodically. A drifting offset
+ * means the streams are diverging.
+ */
+void
+encoder_clock_report(int media, long long pts, int rate) {
+	long long now = encoder_clock_us();
+	double lag;
+	if(rate <= 0 || media < 0 || media > 1)
+		return;
+	lag = now - 1000000.0 * pts / rate;
+	pthread_mutex_lock(&clock_mutex);
+	if(clock_valid[media] == false) {
+		clock_lag[media] = lag;
+		clock_valid[media] = true;
+	} else {
+		clock_lag[media] += (lag - clock_lag[media]) / 16.0;
+	}
+	if(now - clock_reportus < CLOCK_REPORT_INTERVAL) {
+		pthread_mutex_unlock(&clock_mutex);
+		return;
+	}
+	clock_reportus = now;
+	if(clock_valid[ENCODER_CLOCK_VIDEO] && clock_valid[ENCODER_CLOCK_AUDIO]) {
+		ga_error("media clock: a/v offset %+.1fms (video lag %.1fms, audio lag %.1fms); audio device %.1fHz (%+.0fppm)\n",
+			(clock_lag[ENCODER_CLOCK_AUDIO] - clock_lag[ENCODER_CLOCK_VIDEO]) / 1000.0,
+			clock_lag[ENCODER_CLOCK_VIDEO] / 1000.0,
+			clock_lag[ENCODER_CLOCK_AUDIO] / 1000.0,
+			clock_arate,
+			clock_nominal > 0 ? 1000000.0 * (clock_arate - clock_nominal) / clock_nominal : 0.0);
+	} else {
+		ga_error("media clock: %s lag %.1fms\n",
+			clock_valid[ENCODER_CLOCK_VIDEO] ? "video" : "audio",
+			clock_lag[clock_valid[ENCODER_CLOCK_VIDEO] ? ENCODER_CLOCK_VIDEO : ENCODER_CLOCK_AUDIO] / 1000.0);
+	}
+	pthread_mutex_unlock(&clock_mutex);
+	return;
+}
+
+/**
+ * Initialize an audio pts generator.
+ *
+ * @param c [in] The audio clock, owned by the audio encoder thread.
+ * @param samplerate [in] Nominal sample rate of the audio device.
+ */
+void
+encoder_aclock_init(encoder_aclock_t *c, int samplerate) {
+	bzero(c, sizeof(encoder_aclock_t));
+	c->samplerate = samplerate;
+	c->startUs = -1LL;
+	c->ratio = 1.0;
+	pthread_mutex_lock(&clock_mutex);
+	clock_valid[ENCODER_CLOCK_AUDIO] = false;
+	clock_arate = clock_nominal = samplerate;
+	pthread_mutex_unlock(&clock_mutex);
+	return;
+}
+
+/**
+ * Compute the pts of the next audio frame.
+ *
+ * @param c [in] The audio clock.
+ * @param frames [in] Number of frames passed to the encoder.
+ * @param queued [in] Number of frames captured after these frames.
+ * @return The pts in samples of the media clock.
+ *
+ * The pts advance with the captured samples, scaled by the device rate
+ * measured against the media clock. The remaining error is removed by a
+ * small bounded slew, so the pts never jump (except for a resync when the
+ * error exceeds 200ms, e.g., after a capture stall).
+ */
+long long
+encoder_aclock_pts(encoder_aclock_t *c, int frames, int queued) {
+	long long now = ga_monotonic_us();
+	long long pts, captured;
+	double ideal, err, slew, measured;
+	//
+	if(c->startUs < 0) {
+		c->ptsSync = encoder_pts_sync(c->samplerate);
+		c->startUs = c->rateUs = now;
+		c->queued0 = queued;
+		c->pts = c->ptsSync;
+		c->rateFrames = queued;
+	}
+	// where the media clock places this frame
+	ideal = c->ptsSync + 0.000001 * (now - c->startUs) * c->samplerate - (queued - c->queued0);
+	err = ideal - c->pts;
+	if(err > c->samplerate / 5 || err < -c->samplerate / 5) {
+		ga_error("audio clock: resync, pts error %.1fms\n", 1000.0 * err / c->samplerate);
+		c->pts = ideal;
+		c->error = 0.0;
+	} else {
+		c->error += (err - c->error) / 32.0;
+	}
+	// device rate against the media clock
+	captured = c->frames + queued;
+	if(now - c->rateUs >= ACLOCK_RATE_WINDOW) {
+		measured = 1000000.0 * (captured - c->rateFrames) / (now - c->rateUs) / c->samplerate;
+		if(measured > 1.01)	measured = 1.01;
+		if(measured < 0.99)	measured = 0.99;
+		c->ratio += (measured - c->ratio) / (c->windows > 0 ? 4.0 : 1.0);
+		c->windows++;
+		c->rateUs = now;
+		c->rateFrames = captured;
+		pthread_mutex_lock(&clock_mutex);
+		clock_arate = c->ratio * c->samplerate;
+		pthread_mutex_unlock(&clock_mutex);
+	}
+	pts = (long long) (c->pts + 0.5);
+	// the next frame
+	slew = c->error / 32.0;
+	if(slew > frames * ACLOCK_MAX_SLEW)	slew = frames * ACLOCK_MAX_SLEW;
+	if(slew < -frames * ACLOCK_MAX_SLEW)	slew = -frames * ACLOCK_MAX_SLEW;
+	c->pts += frames / c->ratio + slew;
+	c->frames += frames;
+	//
+	encoder_clock_report(ENCODER_CLOCK_AUDIO, pts, c->samplerate);
+	return pts;
+}
+
 /**
  * Check if the encoder has been launched.
  *
@@ -130,6 +340,23 @@ encoder_register_aencoder(ga_module_t *m, void *param) {
 	return 0;
 }
 
+/**
+ * Register a video source module.
+ *
+ * @param m [in] Pointer to the video source module.
+ * @return Currently it always returns 0.
+ *
+ * The video source is only used to throttle the capture frame rate
+ * when the overload governor is enabled.
+ * Without a registered video source, only the resolution is degraded.
+ */
+int
+encoder_register_vsource(ga_module_t *m) {
+	vsource = m;
+	ga_error("video source: %s registered\n", m->name);
+	return 0;
+}
+
 /**
  * Register a sink server module.
  *
@@ -186,6 +413,92 @@ encoder_get_sinkserver() {
 	return sinkserver;
 }
 
+/* fetch codec parameter sets so that encoders cache them for SDP */
+static void
+warm_prefetch_parameters() {
+	int ch, err;
+	unsigned char buf[1024];
+	ga_ioctl_buffer_t mb;
+	//
+	if(vencoder == NULL || vencoder->ioctl == NULL)
+		return;
+	for(ch = 0; ch < video_source_channels(); ch++) {
+		mb.id = ch;
+		mb.ptr = buf;
+		mb.size = sizeof(buf);
+		if((err = vencoder->ioctl(GA_IOCTL_GETSPS, sizeof(mb), &mb)) < 0)
+			continue;
+		ga_error("encoder: warm pool - channel %d sps cached (%d bytes)\n", ch, mb.size);
+		mb.size = sizeof(buf);
+		vencoder->ioctl(GA_IOCTL_GETPPS, sizeof(mb), &mb);
+		mb.size = sizeof(buf);
+		vencoder->ioctl(GA_IOCTL_GETVPS, sizeof(mb), &mb);
+	}
+	return;
+}
+
+/**
+ * Initialize encoder modules before any client connects (warm-pool mode).
+ *
+ * @return 0 if the warm pool is ready, 1 if warm-pool mode is disabled,
+ *	or quit the program on error.
+ *
+ * Warm-pool mode is enabled by the \em encoder-warm-start key.
+ * This function must be called after encoders are registered.
+ * Encoders are initialized here, and parameter sets are generated and
+ * cached for SDP. Encoder threads are still started by the first client
+ * and stopped by the last one, but the encoders are not deinitialized,
+ * so a (re)connection does not pay for opening the encoders again.
+ * An IDR frame is requested whenever a client attaches.
+ */
+int
+encoder_warm_start() {
+	struct timeval tv0, tv1;
+	//
+	if(ga_conf_readbool("encoder-warm-start", 0) == 0)
+		return 1;
+	pthread_rwlock_wrlock(&encoder_lock);
+	warm_pool = true;
+	if(warm_initialized || encoder_clients.size() > 0) {
+		pthread_rwlock_unlock(&encoder_lock);
+		return 0;
+	}
+	gettimeofday(&tv0, NULL);
+	if(vencoder != NULL && vencoder->init != NULL) {
+		if(vencoder->init(vencoder_param) < 0) {
+			ga_error("video encoder: warm init failed.\n");
+			exit(-1);
+		}
+	}
+	if(aencoder != NULL && aencoder->init != NULL) {
+		if(aencoder->init(aencoder_param) < 0) {
+			ga_error("audio encoder: warm init failed.\n");
+			exit(-1);
+		}
+	}
+	warm_prefetch_parameters();
+	warm_initialized = true;
+	gettimeofday(&tv1, NULL);
+	pthread_rwlock_unlock(&encoder_lock);
+	ga_error("encoder: warm pool ready in %.3fms\n", tvdiff_us(&tv1, &tv0) / 1000.0);
+	return 0;
+}
+
+/* request an IDR frame on all video channels and renditions */
+static void
+encoder_request_keyframe() {
+	int ch;
+	ga_ioctl_keyframe_t kf;
+	if(vencoder == NULL || vencoder->ioctl == NULL)
+		return;
+	for(ch = 0; ch < video_source_channels(); ch++) {
+		kf.id = ch;
+		kf.rendition = -1;
+		vencoder->ioctl(GA_IOCTL_REQUEST_KEYFRAME, sizeof(kf), &kf);
+	}
+	return;
+}
+
 /**
  * Register an encoder client, and start encoder modules if necessary.
  *
@@ -199,6 +512,8 @@ encoder_get_sinkserver() {
  * becomes zero, all the encoder modules are stopped.
  * GamingAnwywere now supports only share-encoder model, so each encoder
  * module only has one instance, no matter how many clients are connected.
+ * In warm-pool mode (see \a encoder_warm_start), encoders are only
+ * started and stopped here, and an IDR frame is requested on attach.
  *
  * Note that the number of encoder clients may be not equal to
  * the actual number of clients connected to the game server
@@ -208,21 +523,32 @@ encoder_get_sinkserver() {
  */
 int
 encoder_register_client(void /*RTSPContext*/ *rtsp) {
+	int ch;
+	bool fresh = false;
+	struct timeval attachtv;
+	//
+	gettimeofday(&attachtv, NULL);
 	pthread_rwlock_wrlock(&encoder_lock);
 	if(encoder_clients.size() == 0) {
-		// initialize video encoder
-		if(vencoder != NULL && vencoder->init != NULL) {
-			if(vencoder->init(vencoder_param) < 0) {
-				ga_error("video encoder: init failed.\n");
-				exit(-1);;
+		if(warm_initialized == false) {
+			// initialize video encoder
+			if(vencoder != NULL && vencoder->init != NULL) {
+				if(vencoder->init(vencoder_param) < 0) {
+					ga_error("video encoder: init failed.\n");
+					exit(-1);;
+				}
 			}
-		}
-		// initialize audio encoder
-		if(aencoder != NULL && aencoder->init != NULL) {
-			if(aencoder->init(aencoder_param) < 0) {
-				ga_error("audio encoder: init failed.\n");
-				exit(-1);
+			// initialize audio encoder
+			if(aencoder != NULL && aencoder->init != NULL) {
+				if(aencoder->init(aencoder_param) < 0) {
+					ga_error("audio encoder: init failed.\n");
+					exit(-1);
+				}
 			}
+			warm_initialized = warm_pool;
+			fresh = true;
+		} else {
+			ga_error("encoder: warm pool - session #%d reuses the initialized encoders\n", ++warm_sessions);
 		}
 		// must be set before encoder starts!
 		threadLaunched = true;
@@ -246,6 +572,18 @@ encoder_register_client(void /*RTSPContext*/ *rtsp) {
 		}
 	}
 	encoder_clients[rtsp] = rtsp;
+	simulcast_subscribe(rtsp);
+	// time-to-first-frame: measured until the next keyframe of each channel
+	pthread_mutex_lock(&ttff_mutex);
+	for(ch = 0; ch < video_source_channels(); ch++) {
+		ttff_pending[ch][rtsp] = attachtv;
+		ttff_mode[ch] = fresh ? "cold" : (warm_pool ? "warm" : "shared");
+		ttff_waiting[ch] = 1;
+	}
+	pthread_mutex_unlock(&ttff_mutex);
+	// a running encoder does not start with an IDR frame
+	if(fresh == false)
+		encoder_request_keyframe();
 	ga_error("encoder client registered: total %d clients.\n", encoder_clients.size());
 	pthread_rwlock_unlock(&encoder_lock);
 	return 0;
@@ -259,20 +597,28 @@ encoder_register_client(void /*RTSPContext*/ *rtsp) {
  */
 int
 encoder_unregister_client(void /*RTSPContext*/ *rtsp) {
+	int ch;
+	//
 	pthread_rwlock_wrlock(&encoder_lock);
 	encoder_clients.erase(rtsp);
+	simulcast_unsubscribe(rtsp);
+	pthread_mutex_lock(&ttff_mutex);
+	for(ch = 0; ch < VIDEO_SOURCE_CHANNEL_MAX; ch++)
+		ttff_pending[ch].erase(rtsp);
+	pthread_mutex_unlock(&ttff_mutex);
 	ga_error("encoder client unregistered: %d clients left.\n", encoder_clients.size());
 	if(encoder_clients.size() == 0) {
 		threadLaunched = false;
 		ga_error("encoder: no more clients, quitting ...\n");
 		if(vencoder != NULL && vencoder->stop != NULL)
 			vencoder->stop(vencoder_param);
-		if(vencoder != NULL && vencoder->deinit != NULL)
+		// warm pool: keep encoders (and cached parameter sets) for the next session
+		if(warm_pool == false && vencoder != NULL && vencoder->deinit != NULL)
 			vencoder->deinit(vencoder_param);
 #ifdef ENABLE_AUDIO
 		if(aencoder != NULL && aencoder->stop != NULL)
 			aencoder->stop(aencoder_param);
-		if(aencoder != NULL && aencoder->deinit != NULL)
+		if(warm_pool == false && aencoder != NULL && aencoder->deinit != NULL)
 			aencoder->deinit(aencoder_param);
 #endif
 		// reset packet queue
@@ -281,11 +627,33 @@ encoder_unregister_client(void /*RTSPContext*/ *rtsp) {
 		pthread_mutex_lock(&syncmutex);
 		sync_reset = true;
 		pthread_mutex_unlock(&syncmutex);
+		pthread_mutex_lock(&clock_mutex);
+		clock_valid[ENCODER_CLOCK_VIDEO] = clock_valid[ENCODER_CLOCK_AUDIO] = false;
+		pthread_mutex_unlock(&clock_mutex);
 	}
 	pthread_rwlock_unlock(&encoder_lock);
 	return 0;
 }
 
+/* log time-to-first-frame for clients waiting for a keyframe of a channel */
+static void
+encoder_ttff_report(int channelId) {
+	struct timeval now;
+	map<void*, struct timeval>::iterator mi;
+	//
+	gettimeofday(&now, NULL);
+	pthread_mutex_lock(&ttff_mutex);
+	for(mi = ttff_pending[channelId].begin(); mi != ttff_pending[channelId].end(); mi++) {
+		ga_error("encoder: client %p channel %d time-to-first-frame %.3fms (%s)\n",
+			mi->first, channelId, tvdiff_us(&now, &mi->second) / 1000.0,
+			ttff_mode[channelId]);
+	}
+	ttff_pending[channelId].clear();
+	ttff_waiting[channelId] = 0;
+	pthread_mutex_unlock(&ttff_mutex);
+	return;
+}
+
 /**
  * Send a packet to a sink server.
  *
@@ -303,13 +671,426 @@ encoder_unregister_client(void /*RTSPContext*/ *rtsp) {
  */
 int
 encoder_send_packet(const char *prefix, int channelId, AVPacket *pkt, int64_t encoderPts, struct timeval *ptv) {
+	return encoder_send_rendition(prefix, channelId, 0, pkt, encoderPts, ptv);
+}
+
+/**
+ * Send a packet of a simulcast rendition to a sink server.
+ *
+ * @param prefix [in] Name to identify the sender. Can be any valid string.
+ * @param channelId [in] Channel id.
+ * @param rendition [in] Simulcast rendition index, 0 for the full-size stream.
+ * @param pkt [in] The packet to be delivery.
+ * @param encoderPts [in] Encoder presentation timestamp in an integer.
+ * @param ptv [in] Encoder presentation timestamp in \a timeval structure.
+ * @return 0 on success, or -1 on error.
+ *
+ * The rendition travels beside the packet: \a pkt->stream_index stays
+ * the index of the stream in the per-channel muxers, which is always 0.
+ */
+int
+encoder_send_rendition(const char *prefix, int channelId, int rendition, AVPacket *pkt, int64_t encoderPts, struct timeval *ptv) {
+	if(channelId >= 0 && channelId < video_source_channels()
+	&& ttff_waiting[channelId] != 0
+	&& (pkt->flags & AV_PKT_FLAG_KEY) != 0) {
+		encoder_ttff_report(channelId);
+	}
 	if(sinkserver) {
-		return sinkserver->send_packet(prefix, channelId, pkt, encoderPts, ptv);
+		return sinkserver->send_packet(prefix, channelId, rendition, pkt, encoderPts, ptv);
 	}
 	ga_error("encoder: no sink server registered.\n");
 	return -1;
 }
 
+/**
+ * Load the simulcast encoding ladder from configuration.
+ *
+ * @return The number of renditions, including the native rendition.
+ *
+ * The ladder is read from the \em video-simulcast key, which lists
+ * \em width \em height \em kbps triples for the additional renditions,
+ * from high to low bitrate. Rendition 0 is always the native output
+ * resolution of a channel, and its bitrate is read from the
+ * \em b parameter of \em video-specific.
+ * A ladder with only one rendition means simulcast is disabled.
+ */
+int
+encoder_simulcast_load() {
+	int i, n, vals[3 * (ENCODER_SIMULCAST_MAX-1)];
+	//
+	pthread_mutex_lock(&simulcast_mutex);
+	if(simulcast_loaded) {
+		pthread_mutex_unlock(&simulcast_mutex);
+		return simulcast_count;
+	}
+	bzero(simulcast_ladder, sizeof(simulcast_ladder));
+	simulcast_count = 1;
+	simulcast_ladder[0].bitrateKbps = ga_conf_mapreadint("video-specific", "b") / 1000;
+	n = ga_conf_readints("video-simulcast", vals, 3 * (ENCODER_SIMULCAST_MAX-1));
+	if(n % 3 != 0) {
+		ga_error("encoder: simulcast - incomplete ladder, need (width height kbps) triples.\n");
+	}
+	for(i = 0; i + 2 < n; i += 3) {
+		encoder_rendition_t *r = &simulcast_ladder[simulcast_count];
+		if(vals[i] <= 0 || vals[i+1] <= 0 || vals[i+2] <= 0) {
+			ga_error("encoder: simulcast - invalid rendition %dx%d@%dKbps ignored.\n",
+				vals[i], vals[i+1], vals[i+2]);
+			continue;
+		}
+		r->width = vals[i];
+		r->height = vals[i+1];
+		r->bitrateKbps = vals[i+2];
+		simulcast_count++;
+	}
+	// native bitrate unknown: assume twice the next rendition
+	if(simulcast_count > 1 && simulcast_ladder[0].bitrateKbps <= 0)
+		simulcast_ladder[0].bitrateKbps = simulcast_ladder[1].bitrateKbps * 2;
+	for(i = 1; i < simulcast_count; i++) {
+		ga_error("encoder: simulcast rendition #%d %dx%d@%dKbps\n", i,
+			simulcast_ladder[i].width, simulcast_ladder[i].height,
+			simulcast_ladder[i].bitrateKbps);
+	}
+	simulcast_loaded = true;
+	pthread_mutex_unlock(&simulcast_mutex);
+	return simulcast_count;
+}
+
+/**
+ * Get the number of simulcast renditions.
+ *
+ * @return The number of renditions, or 1 if simulcast is disabled.
+ */
+int
+encoder_simulcast_renditions() {
+	return encoder_simulcast_load();
+}
+
+/**
+ * Get a simulcast rendition.
+ *
+ * @param rendition [in] The rendition index.
+ * @return Pointer to the rendition, or NULL if \a rendition is invalid.
+ *
+ * The width and height of rendition 0 are not filled:
+ * it uses the output resolution of each video channel.
+ */
+encoder_rendition_t *
+encoder_simulcast_rendition(int rendition) {
+	if(rendition < 0 || rendition >= encoder_simulcast_load())
+		return NULL;
+	return &simulcast_ladder[rendition];
+}
+
+static void
+simulcast_subscribe(void *ctx) {
+	simulcast_sub_t sub;
+	bzero(&sub, sizeof(sub));
+	pthread_mutex_lock(&simulcast_mutex);
+	simulcast_subs[ctx] = sub;
+	pthread_mutex_unlock(&simulcast_mutex);
+	return;
+}
+
+static void
+simulcast_unsubscribe(void *ctx) {
+	pthread_mutex_lock(&simulcast_mutex);
+	simulcast_subs.erase(ctx);
+	pthread_mutex_unlock(&simulcast_mutex);
+	return;
+}
+
+/* pick the highest rendition that fits in kbps; switching up needs headroom */
+static int
+simulcast_select(int current, int kbps) {
+	int r, need;
+	for(r = 0; r < simulcast_count; r++) {
+		need = simulcast_ladder[r].bitrateKbps;
+		if(r < current)
+			need = need * SIMULCAST_UPSWITCH_HEADROOM / 100;
+		if(need <= kbps)
+			return r;
+	}
+	return simulcast_count - 1;
+}
+
+/**
+ * Update the bandwidth estimate of a client and pick its rendition.
+ *
+ * @param ctx [in] Pointer to the encoder client context,
+ *	or NULL to apply the estimate to all clients.
+ * @param kbps [in] The estimated bandwidth in Kbit-per-second.
+ * @return 0 on success, or -1 if simulcast is disabled.
+ *
+ * The new rendition takes effect at the next keyframe of that rendition.
+ * A keyframe is requested from the video encoder when the pick changes.
+ */
+int
+encoder_simulcast_estimate(void *ctx, int kbps) {
+	int r, ch;
+	bool request[ENCODER_SIMULCAST_MAX];
+	map<void*, simulcast_sub_t>::iterator mi;
+	//
+	if(encoder_simulcast_load() <= 1)
+		return -1;
+	bzero(request, sizeof(request));
+	pthread_mutex_lock(&simulcast_mutex);
+	for(mi = simulcast_subs.begin(); mi != simulcast_subs.end(); mi++) {
+		if(ctx != NULL && mi->first != ctx)
+			continue;
+		r = simulcast_select(mi->second.target, kbps);
+		if(r == mi->second.target)
+			continue;
+		ga_error("encoder: simulcast client %p - estimate %dKbps, rendition #%d -> #%d\n",
+			mi->first, kbps, mi->second.target, r);
+		mi->second.target = r;
+		request[r] = true;
+	}
+	pthread_mutex_unlock(&simulcast_mutex);
+	//
+	if(vencoder == NULL || vencoder->ioctl == NULL)
+		return 0;
+	for(r = 0; r < simulcast_count; r++) {
+		ga_ioctl_keyframe_t kf;
+		if(request[r] == false)
+			continue;
+		for(ch = 0; ch < video_source_channels(); ch++) {
+			kf.id = ch;
+			kf.rendition = r;
+			vencoder->ioctl(GA_IOCTL_REQUEST_KEYFRAME, sizeof(kf), &kf);
+		}
+	}
+	return 0;
+}
+
+/**
+ * Check whether a packet should be delivered to a client.
+ *
+ * @param ctx [in] Pointer to the encoder client context,
+ *	or NULL for sink servers that share one stream among all clients.
+ * @param channelId [in] Channel id.
+ * @param rendition [in] Simulcast rendition index of the packet.
+ * @param pkt [in] The packet.
+ * @return 1 if the packet should be delivered, or 0 if not.
+ *
+ * Audio packets are always delivered.
+ * A client switches to its picked rendition when a keyframe of that
+ * rendition arrives, so decoders always restart from an IDR frame.
+ * A NULL \a ctx only receives rendition 0.
+ */
+int
+encoder_simulcast_accept(void *ctx, int channelId, int rendition, AVPacket *pkt) {
+	int ret;
+	simulcast_sub_t *sub;
+	map<void*, simulcast_sub_t>::iterator mi;
+	//
+	if(simulcast_count <= 1)
+		return 1;
+	if(channelId < 0 || channelId >= video_source_channels())
+		return 1;
+	if(ctx == NULL)
+		return rendition == 0 ? 1 : 0;
+	//
+	pthread_mutex_lock(&simulcast_mutex);
+	if((mi = simulcast_subs.find(ctx)) == simulcast_subs.end()) {
+		pthread_mutex_unlock(&simulcast_mutex);
+		return rendition == 0 ? 1 : 0;
+	}
+	sub = &mi->second;
+	if(rendition == sub->target
+	&& sub->current[channelId] != sub->target
+	&& (pkt->flags & AV_PKT_FLAG_KEY) != 0) {
+		ga_error("encoder: simulcast client %p - channel %d switched to rendition #%d\n",
+			ctx, channelId, sub->target);
+		sub->current[channelId] = sub->target;
+	}
+	ret = rendition == sub->current[channelId] ? 1 : 0;
+	pthread_mutex_unlock(&simulcast_mutex);
+	return ret;
+}
+
+/* build the governor ladder: frame rate steps first, then resolution steps */
+static void
+governor_load() {
+	int i, n, basefps, minfps, vals[GOVERNOR_LEVEL_MAX];
+	struct RTSPConf *conf = rtspconf_global();
+	//
+	governor_loaded = true;
+	if((governor_enabled = (ga_conf_readbool("encoder-governor", 0) != 0)) == false)
+		return;
+	if((n = ga_conf_readint("encoder-governor-budget")) > 0)
+		governor_budget = n;
+	if((n = ga_conf_readint("encoder-governor-recover")) > 0)
+		governor_recover = n;
+	if((n = ga_conf_readint("encoder-governor-backlog")) > 0)
+		governor_backlog = n;
+	if((n = ga_conf_readint("encoder-governor-holddown")) > 0)
+		governor_holddown = n;
+	//
+	basefps = minfps = conf->video_fps;
+	governor_levels[0].fps = basefps;
+	governor_levels[0].scale = 100;
+	governor_nlevels = 1;
+	if(vsource != NULL && vsource->ioctl != NULL) {
+		n = ga_conf_readints("encoder-governor-fps", vals, GOVERNOR_LEVEL_MAX/2);
+		for(i = 0; i < n; i++) {
+			if(vals[i] <= 0 || vals[i] >= minfps) {
+				ga_error("encoder: governor - fps step %d ignored.\n", vals[i]);
+				continue;
+			}
+			minfps = vals[i];
+			governor_levels[governor_nlevels].fps = minfps;
+			governor_levels[governor_nlevels].scale = 100;
+			governor_nlevels++;
+		}
+	} else {
+		ga_error("encoder: governor - no video source registered, frame rate is not throttled.\n");
+	}
+	n = ga_conf_readints("encoder-governor-scale", vals, GOVERNOR_LEVEL_MAX/2);
+	for(i = 0; i < n; i++) {
+		if(vals[i] <= 0 || vals[i] >= governor_levels[governor_nlevels-1].scale) {
+			ga_error("encoder: governor - scale step %d%% ignored.\n", vals[i]);
+			continue;
+		}
+		governor_levels[governor_nlevels].fps = minfps;
+		governor_levels[governor_nlevels].scale = vals[i];
+		governor_nlevels++;
+	}
+	bzero(governor_state, sizeof(governor_state));
+	for(i = 0; i < governor_nlevels; i++) {
+		ga_error("encoder: governor level #%d %dfps@%d%%\n", i,
+			governor_levels[i].fps, governor_levels[i].scale);
+	}
+	ga_error("encoder: governor enabled, budget=%d%%; recover=%d%%; backlog=%d; holddown=%d\n",
+		governor_budget, governor_recover, governor_backlog, governor_holddown);
+	return;
+}
+
+/* apply a governor level to the video source and the video encoder */
+static void
+governor_apply(int channelId, int level) {
+	int err;
+	governor_level_t *g = &governor_levels[level];
+	ga_ioctl_reconfigure_t reconf;
+	//
+	bzero(&reconf, sizeof(reconf));
+	reconf.id = channelId;
+	reconf.framerate_n = g->fps;
+	reconf.framerate_d = 1;
+	if(vsource != NULL && vsource->ioctl != NULL) {
+		if((err = vsource->ioctl(GA_IOCTL_RECONFIGURE, sizeof(reconf), &reconf)) < 0)
+			ga_error("encoder: governor - reconfigure video source failed, err=%d\n", err);
+	}
+	// even dimensions for yuv420p
+	reconf.width = (video_source_out_width(channelId) * g->scale / 100) & ~1;
+	reconf.height = (video_source_out_height(channelId) * g->scale / 100) & ~1;
+	if(vencoder != NULL && vencoder->ioctl != NULL) {
+		if((err = vencoder->ioctl(GA_IOCTL_RECONFIGURE, sizeof(reconf), &reconf)) < 0)
+			ga_error("encoder: governor - reconfigure video encoder failed, err=%d\n", err);
+	}
+	return;
+}
+
+/**
+ * Report the cost of an encoded frame to the overload governor.
+ *
+ * @param channelId [in] Channel id.
+ * @param encodeUs [in] Time spent in encoding the frame, in microseconds.
+ * @param backlog [in] Number of frames still queued in the source pipe.
+ * @return The current governor level, 0 means no degradation.
+ *
+ * Reports are evaluated once per second.
+ * A window is overloaded if the average encode time exceeds
+ * \\em encoder-governor-budget percent of the frame interval,
+ * or the backlog reaches \\em encoder-governor-backlog frames.
+ * An overloaded window steps one level down immediately.
+ * Stepping up requires \\em encoder-governor-holddown consecutive windows
+ * in which the predicted cost at the higher level stays below
+ * \\em encoder-governor-recover percent of the budget.
+ */
+int
+encoder_governor_report(int channelId, int encodeUs, int backlog) {
+	struct timeval now;
+	long long elapsed, avg, interval, budget;
+	governor_state_t *st;
+	int from, to = -1;
+	const char *reason = NULL;
+	//
+	if(channelId < 0 || channelId >= VIDEO_SOURCE_CHANNEL_MAX)
+		return 0;
+	pthread_mutex_lock(&governor_mutex);
+	if(governor_loaded == false)
+		governor_load();
+	if(governor_enabled == false || governor_nlevels <= 1) {
+		pthread_mutex_unlock(&governor_mutex);
+		return 0;
+	}
+	st = &governor_state[channelId];
+	gettimeofday(&now, NULL);
+	if(st->window.tv_sec == 0)
+		st->window = now;
+	st->sum_us += encodeUs;
+	if(encodeUs > st->max_us)
+		st->max_us = encodeUs;
+	if(backlog > st->max_backlog)
+		st->max_backlog = backlog;
+	st->frames++;
+	if((elapsed = tvdiff_us(&now, &st->window)) < GOVERNOR_WINDOW_US) {
+		pthread_mutex_unlock(&governor_mutex);
+		return st->level;
+	}
+	// evaluate the window
+	from = st->level;
+	avg = st->sum_us / st->frames;
+	interval = 1000000LL / governor_levels[from].fps;
+	budget = interval * governor_budget / 100;
+	if(st->settle) {
+		st->settle = false;
+	} else if(avg > budget || st->max_backlog >= governor_backlog) {
+		st->calm = 0;
+		if(from + 1 < governor_nlevels) {
+			to = from + 1;
+			reason = avg > budget ? "encode time over budget" : "pipe backlog";
+		} else if(st->floored == false) {
+			st->floored = true;
+			ga_error("encoder: governor channel %d - overloaded at the lowest level #%d, avg=%lldus; max=%lldus; budget=%lldus; backlog=%d\n",
+				channelId, from, avg, st->max_us, budget, st->max_backlog);
+		}
+	} else if(from > 0) {
+		governor_level_t *up = &governor_levels[from-1];
+		governor_level_t *cur = &governor_levels[from];
+		// encode time scales with the number of pixels
+		long long predict = avg * up->scale * up->scale / (cur->scale * cur->scale);
+		long long upbudget = (1000000LL / up->fps) * governor_budget / 100;
+		if(predict < upbudget * governor_recover / 100 && st->max_backlog == 0) {
+			if(++st->calm >= governor_holddown) {
+				to = from - 1;
+				reason = "spare capacity";
+			}
+		} else {
+			st->calm = 0;
+		}
+	}
+	if(to >= 0) {
+		ga_error("encoder: governor channel %d - %s, level #%d (%dfps@%d%%) -> #%d (%dfps@%d%%); avg=%lldus; max=%lldus; budget=%lldus; backlog=%d; frames=%d\n",
+			channelId, reason,
+			from, governor_levels[from].fps, governor_levels[from].scale,
+			to, governor_levels[to].fps, governor_levels[to].scale,
+			avg, st->max_us, budget, st->max_backlog, st->frames);
+		st->level = to;
+		st->calm = 0;
+		st->settle = true;
+		st->floored = false;
+	}
+	st->sum_us = st->max_us = 0;
+	st->frames = st->max_backlog = 0;
+	st->window = now;
+	pthread_mutex_unlock(&governor_mutex);
+	// reconfigure outside the lock: modules take their own locks
+	if(to >= 0)
+		governor_apply(channelId, to);
+	return to >= 0 ? to : from;
+}
+
 // encoder pts to ptv mapping function
 #define	MAX_PTS_QUEUE	8
 static list<encoder_pts_t> pts_queue[MAX_PTS_QUEUE];	// up to 8 queues
@@ -482,6 +1263,46 @@ encoder_pktqueue_size(int channelId) {
 	return pktqueue[channelId].datasize;
 }
 
+/* make room for size bytes at the queue tail; called with the queue locked */
+static int
+pktqueue_reserve(int channelId, int size) {
+	encoder_packet_queue_t *q = &pktqueue[channelId];
+	int padding = 0;
+size_check:
+	// size checking
+	if(q->datasize + size > q->bufsize) {
+		ga_error("encoder: packet queue #%d full, packet dropped (%d+%d)\n",
+			channelId, q->datasize, size);
+		return -1;
+	}
+	// end-of-buffer space is not sufficient
+	if(q->bufsize - q->tail < size) {
+		if(pktlist[channelId].size() == 0) {
+			q->datasize = q->tail = q->head = 0;
+		} else {
+			encoder_packet_t *last = &pktlist[channelId].back();
+			padding = q->bufsize - q->tail;
+			// measured from the end of the last packet, which may
+			// be followed by bytes skipped by pktqueue_pop()
+			last->padding = (q->buf + q->bufsize) - (last->data + last->size);
+			q->datasize += padding;
+			q->tail = 0;
+		}
+		goto size_check;
+	}
+	return 0;
+}
+
+/* notify the callbacks of a packet queue */
+static void
+pktqueue_notify(int channelId) {
+	map<qcallback_t,qcallback_t>::iterator mi;
+	for(mi = queue_cb[channelId].begin(); mi != queue_cb[channelId].end(); mi++) {
+		mi->second(channelId);
+	}
+	return;
+}
+
 /**
  * Add a packet into a packet queue.
  *
@@ -498,29 +1319,11 @@ int
 encoder_pktqueue_append(int channelId, AVPacket *pkt, int64_t encoderPts, struct timeval *ptv) {
 	encoder_packet_queue_t *q = &pktqueue[channelId];
 	encoder_packet_t qp;
-	map<qcallback_t,qcallback_t>::iterator mi;
-	int padding = 0;
 	pthread_mutex_lock(&q->mutex);
-size_check:
-	// size checking
-	if(q->datasize + pkt->size > q->bufsize) {
+	if(pktqueue_reserve(channelId, pkt->size) < 0) {
 		pthread_mutex_unlock(&q->mutex);
-		ga_error("encoder: packet queue #%d full, packet dropped (%d+%d)\n",
-			channelId, q->datasize, pkt->size);
 		return -1;
 	}
-	// end-of-buffer space is not sufficient
-	if(q->bufsize - q->tail < pkt->size) {
-		if(pktlist[channelId].size() == 0) {
-			q->datasize = q->tail = q->head = 0;
-		} else {
-			padding = q->bufsize - q->tail;
-			pktlist[channelId].back().padding = padding;
-			q->datasize += padding;
-			q->tail = 0;
-		}
-		goto size_check;
-	}
 	bcopy(pkt->data, q->buf + q->tail, pkt->size);
 	//
 	qp.data = q->buf + q->tail;
@@ -543,13 +1346,82 @@ size_check:
 	//
 	pthread_mutex_unlock(&q->mutex);
 	// notify client
-	for(mi = queue_cb[channelId].begin(); mi != queue_cb[channelId].end(); mi++) {
-		mi->second(channelId);
-	}
+	pktqueue_notify(channelId);
 	//
 	return 0;
 }
 
+/**
+ * Add an H.264 or H.265 access unit into a packet queue as NAL units.
+ *
+ * @param channelId [in] The channel id.
+ * @param pkt [in] The access unit, NAL units are prefixed with start codes.
+ * @param encoderPts [in] The presentation timestamp in an integer.
+ * @param ptv [in] The presentation timestamp in a \timeval structure.
+ * @return Number of queued NAL units, or -1 on error.
+ *
+ * The access unit is copied into the queue buffer once, and each NAL unit,
+ * without its start code, becomes a packet pointing into the copy. Start
+ * codes are located here, in the encoder thread, so the sink server reads
+ * ready-to-send NAL units. Callbacks are notified once per access unit.
+ * A packet without start codes is queued as a single packet.
+ */
+int
+encoder_pktqueue_append_nals(int channelId, AVPacket *pkt, int64_t encoderPts, struct timeval *ptv) {
+	encoder_packet_queue_t *q = &pktqueue[channelId];
+	encoder_packet_t qp;
+	unsigned char *base, *end, *ptr, *next;
+	int codelen, nextlen, n = 0;
+	pthread_mutex_lock(&q->mutex);
+	if(pktqueue_reserve(channelId, pkt->size) < 0) {
+		pthread_mutex_unlock(&q->mutex);
+		return -1;
+	}
+	base = (unsigned char*) q->buf + q->tail;
+	end = base + pkt->size;
+	bcopy(pkt->data, base, pkt->size);
+	//
+	qp.pts_int64 = pkt->pts;
+	if(ptv != NULL) {
+		qp.pts_tv = *ptv;
+	} else {
+		gettimeofday(&qp.pts_tv, NULL);
+	}
+	qp.padding = 0;
+	if((ptr = ga_find_startcode(base, end, &codelen)) == NULL) {
+		ptr = base;
+		codelen = 0;
+	}
+	// bytes before the first start code are skipped by the pointer-based
+	// head update in pktqueue_pop(), as are the start codes themselves
+	while(ptr != NULL) {
+		next = ga_find_startcode(ptr + codelen, end, &nextlen);
+		qp.data = (char*) ptr + codelen;
+		qp.size = (next != NULL ? next : end) - (ptr + codelen);
+		if(qp.size > 0) {
+			pktlist[channelId].push_back(qp);
+			n++;
+		}
+		ptr = next;
+		codelen = nextlen;
+	}
+	if(n == 0) {
+		// nothing but start codes
+		pthread_mutex_unlock(&q->mutex);
+		return 0;
+	}
+	q->tail += pkt->size;
+	q->datasize += pkt->size;
+	if(q->tail == q->bufsize)
+		q->tail = 0;
+	//
+	pthread_mutex_unlock(&q->mutex);
+	// notify client: once for all NAL units
+	pktqueue_notify(channelId);
+	//
+	return n;
+}
+
 /**
  * Read the first packet from the packet queue.
  *
@@ -624,33 +1496,82 @@ quit_split_packet:
  *
  * @parm channelId [in] The channel id.
  */
-void
-encoder_pktqueue_pop_front(int channelId) {
+/* remove the first packet; called with the queue locked */
+static void
+pktqueue_pop(int channelId) {
 	encoder_packet_queue_t *q = &pktqueue[channelId];
 	encoder_packet_t qp;
-	pthread_mutex_lock(&q->mutex);
-	if(pktlist[channelId].size() == 0) {
-		pthread_mutex_unlock(&q->mutex);
-		return;
-	}
+	int advance;
 	qp = pktlist[channelId].front();
 	pktlist[channelId].pop_front();
-	// update the packet queue
-	q->head += qp.size;
-	q->head += qp.padding;
-	q->datasize -= qp.size;
-	q->datasize -= qp.padding;
+	// update the packet queue: the head moves to the end of the packet,
+	// which also skips start codes stripped by encoder_pktqueue_append_nals
+	advance = (qp.data + qp.size + qp.padding) - (q->buf + q->head);
+	q->head += advance;
+	q->datasize -= advance;
 	if(q->head == q->bufsize) {
 		q->head = 0;
 	}
-	if(q->head == q->tail) {
+	if(q->head == q->tail || pktlist[channelId].size() == 0) {
 		q->head = q->tail = 0;
+		q->datasize = 0;
 	}
-	//
+	return;
+}
+
+void
+encoder_pktqueue_pop_front(int channelId) {
+	encoder_packet_queue_t *q = &pktqueue[channelId];
+	pthread_mutex_lock(&q->mutex);
+	if(pktlist[channelId].size() > 0)
+		pktqueue_pop(channelId);
 	pthread_mutex_unlock(&q->mutex);
 	return;
 }
 
+/**
+ * Copy the first packet from the packet queue and remove it.
+ *
+ * @param channelId [in] The channel id.
+ * @param buf [out] Buffer for the packet data.
+ * @param bufsize [in] Size of \a buf.
+ * @param split [in] What to do with a packet larger than \a buf: non-zero
+ *	keeps the remaining data queued as the next packet, zero drops it.
+ * @param pkt [out] The packet; \a pkt->data is \a buf and \a pkt->size
+ *	is the number of bytes copied.
+ * @return The size of the packet in the queue, or -1 if the queue is empty.
+ *
+ * This is encoder_pktqueue_front(), encoder_pktqueue_split_packet(), and
+ * encoder_pktqueue_pop_front() under a single lock, copying directly from
+ * the queue buffer.
+ */
+int
+encoder_pktqueue_read(int channelId, char *buf, int bufsize, int split, encoder_packet_t *pkt) {
+	encoder_packet_queue_t *q = &pktqueue[channelId];
+	encoder_packet_t *front;
+	int size;
+	pthread_mutex_lock(&q->mutex);
+	if(pktlist[channelId].size() == 0) {
+		pthread_mutex_unlock(&q->mutex);
+		return -1;
+	}
+	front = &pktlist[channelId].front();
+	size = front->size;
+	*pkt = *front;
+	pkt->data = buf;
+	pkt->size = size < bufsize ? size : bufsize;
+	pkt->padding = 0;
+	memcpy(buf, front->data, pkt->size);
+	if(split != 0 && pkt->size < front->size) {
+		front->data += pkt->size;
+		front->size -= pkt->size;
+	} else {
+		pktqueue_pop(channelId);
+	}
+	pthread_mutex_unlock(&q->mutex);
+	return size;
+}
+
 /**
  * Register a callback function for a packet queue.
  *
@@ -53,25 +53,76 @@ typedef struct encoder_packet_queue_s {
 	int tail;		/**< Position of queue tail */
 }	encoder_packet_queue_t;
 
+/** Define the maximum number of simulcast renditions per video channel */
+#define	ENCODER_SIMULCAST_MAX	4
+
+/**
+ * Simulcast rendition: one rung of the encoding ladder.
+ * Rendition 0 is always the native output resolution of a channel.
+ */
+typedef struct encoder_rendition_s {
+	int width;		/**< Encoded width */
+	int height;		/**< Encoded height */
+	int bitrateKbps;	/**< Target bitrate in Kbit-per-second */
+}	encoder_rendition_t;
+
 typedef struct encoder_pts_s {
 	long long pts;
 	struct timeval ptv;
 }	encoder_pts_t;
 
+/** Streams known to the media clock */
+#define	ENCODER_CLOCK_VIDEO	0
+#define	ENCODER_CLOCK_AUDIO	1
+
+/**
+ * Audio pts generator locked to the media clock.
+ */
+typedef struct encoder_aclock_s {
+	int samplerate;		/**< Nominal device sample rate */
+	long long ptsSync;	/**< pts of the first frame */
+	long long startUs;	/**< Monotonic clock at the first frame */
+	long long queued0;	/**< Frames queued behind the first frame */
+	long long frames;	/**< Frames encoded since the first frame */
+	double pts;		/**< pts of the next frame, in samples */
+	double error;		/**< Smoothed pts error, in samples */
+	double ratio;		/**< Measured device rate / nominal rate */
+	int windows;		/**< Rate measurement windows completed */
+	long long rateUs;	/**< Start of the rate measurement window */
+	long long rateFrames;	/**< Captured frames at \a rateUs */
+}	encoder_aclock_t;
+
 typedef void (*qcallback_t)(int);
 
 EXPORT int encoder_pts_sync(int samplerate);
+EXPORT long long encoder_clock_us();
+EXPORT void encoder_clock_report(int media, long long pts, int rate);
+EXPORT void encoder_aclock_init(encoder_aclock_t *c, int samplerate);
+EXPORT long long encoder_aclock_pts(encoder_aclock_t *c, int frames, int queued);
 EXPORT int encoder_running();
 EXPORT int encoder_register_vencoder(ga_module_t *m, void *param);
 EXPORT int encoder_register_aencoder(ga_module_t *m, void *param);
 EXPORT int encoder_register_sinkserver(ga_module_t *m);
+EXPORT int encoder_register_vsource(ga_module_t *m);
 EXPORT ga_module_t *encoder_get_vencoder();
 EXPORT ga_module_t *encoder_get_aencoder();
 EXPORT ga_module_t *encoder_get_sinkserver();
+EXPORT int encoder_warm_start();
 EXPORT int encoder_register_client(void *ctx);
 EXPORT int encoder_unregister_client(void *ctx);
 
 EXPORT int encoder_send_packet(const char *prefix, int channelId, AVPacket *pkt, int64_t encoderPts, struct timeval *ptv);
+EXPORT int encoder_send_rendition(const char *prefix, int channelId, int rendition, AVPacket *pkt, int64_t encoderPts, struct timeval *ptv);
+
+// simulcast encoding ladder
+EXPORT int encoder_simulcast_load();
+EXPORT int encoder_simulcast_renditions();
+EXPORT encoder_rendition_t * encoder_simulcast_rendition(int rendition);
+EXPORT int encoder_simulcast_estimate(void *ctx, int kbps);
+EXPORT int encoder_simulcast_accept(void *ctx, int channelId, int rendition, AVPacket *pkt);
+
+// overload governor
+EXPORT int encoder_governor_report(int channelId, int encodeUs, int backlog);
 
 // encoder pts to ptv mapping function
 EXPORT int encoder_pts_clear(unsigned queueid);
@@ -84,9 +135,11 @@ EXPORT int encoder_pktqueue_reset();
 EXPORT int encoder_pktqueue_reset_channel(int channelId);
 EXPORT int encoder_pktqueue_size(int channelId);
 EXPORT int encoder_pktqueue_append(int channelId, AVPacket *pkt, int64_t encoderPts, struct timeval *ptv);
+EXPORT int encoder_pktqueue_append_nals(int channelId, AVPacket *pkt, int64_t encoderPts, struct timeval *ptv);
 EXPORT char * encoder_pktqueue_front(int channelId, encoder_packet_t *pkt);
 EXPORT void encoder_pktqueue_split_packet(int channelId, char *offset);
 EXPORT void encoder_pktqueue_pop_front(int channelId);
+EXPORT int encoder_pktqueue_read(int channelId, char *buf, int bufsize, int split, encoder_packet_t *pkt);
 EXPORT int encoder_pktqueue_register_callback(int channelId, qcallback_t cb);
 EXPORT int encoder_pktqueue_unregister_callback(int channelId, qcallback_t cb);
 
@@ -90,6 +90,37 @@ tvdiff_us(struct timeval *tv1, struct timeval *tv2) {
 	return 1000000LL*delta.tv_sec + delta.tv_usec;
 }
 
+/**
+ * Read the monotonic clock.
+ *
+ * @return Micro seconds since an unspecified starting point.
+ *
+ * Unlike \em gettimeofday(), the clock is not affected by NTP steps or
+ * manual changes of the system time.
+ */
+EXPORT
+long long
+ga_monotonic_us() {
+#if defined(WIN32)
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER t;
+	if(freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&t);
+	return t.QuadPart / freq.QuadPart * 1000000LL
+		+ t.QuadPart % freq.QuadPart * 1000000LL / freq.QuadPart;
+#elif defined(__APPLE__)
+	// XXX: no clock_gettime() on older OS X
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return 1000000LL * tv.tv_sec + tv.tv_usec;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return 1000000LL * ts.tv_sec + ts.tv_nsec / 1000;
+#endif
+}
+
 /**
  * Sleep and wake up at \a ptv + \a interval (micro seconds).
  *
@@ -78,6 +78,7 @@ struct gaImage {
 };
 
 EXPORT long long tvdiff_us(struct timeval *tv1, struct timeval *tv2);
+EXPORT long long ga_monotonic_us();
 EXPORT long long ga_usleep(long long interval, struct timeval *ptv);
 EXPORT int	ga_log(const char *fmt, ...);
 EXPORT int	ga_error(const char *fmt, ...);
@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2013-2015 Chun-Ying Huang
+ *
+ * This file is part of GamingAnywhere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * @file
+ * XOR parity forward error correction for RTP: implementations
+ */
+
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define	GA_FEC_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "ga-fec.h"
+
+static inline unsigned int
+fec_get32(const unsigned char *p) {
+	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline void
+fec_put32(unsigned char *p, unsigned int v) {
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+/**
+ * XOR a buffer into another one: dst ^= src.
+ *
+ * @param dst [in,out] The destination buffer.
+ * @param src [in] The source buffer.
+ * @param len [in] Number of bytes.
+ *
+ * Uses AVX2, SSE2, or NEON when the compiler targets them.
+ */
+void
+ga_fec_xor(unsigned char *dst, const unsigned char *src, int len) {
+	int i = 0;
+#if defined(__AVX2__)
+	for(; i + 32 <= len; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i*) (dst+i));
+		__m256i b = _mm256_loadu_si256((const __m256i*) (src+i));
+		_mm256_storeu_si256((__m256i*) (dst+i), _mm256_xor_si256(a, b));
+	}
+#elif defined(GA_FEC_SSE2)
+	for(; i + 32 <= len; i += 32) {
+		__m128i a0 = _mm_loadu_si128((const __m128i*) (dst+i));
+		__m128i a1 = _mm_loadu_si128((const __m128i*) (dst+i+16));
+		__m128i b0 = _mm_loadu_si128((const __m128i*) (src+i));
+		__m128i b1 = _mm_loadu_si128((const __m128i*) (src+i+16));
+		_mm_storeu_si128((__m128i*) (dst+i), _mm_xor_si128(a0, b0));
+		_mm_storeu_si128((__m128i*) (dst+i+16), _mm_xor_si128(a1, b1));
+	}
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	for(; i + 16 <= len; i += 16) {
+		vst1q_u8(dst+i, veorq_u8(vld1q_u8(dst+i), vld1q_u8(src+i)));
+	}
+#endif
+	for(; i + 8 <= len; i += 8) {
+		unsigned long long a, b;
+		memcpy(&a, dst+i, 8);
+		memcpy(&b, src+i, 8);
+		a ^= b;
+		memcpy(dst+i, &a, 8);
+	}
+	for(; i < len; i++)
+		dst[i] ^= src[i];
+	return;
+}
+
+/**
+ * Build an FEC packet protecting a group of RTP packets.
+ *
+ * @param fec [out] Buffer for the FEC packet, including its RTP header.
+ * @param fecsize [in] Size of the \a fec buffer.
+ * @param pkts [in] The protected RTP packets.
+ * @param lens [in] Lengths of the protected RTP packets.
+ * @param n [in] Number of protected packets, up to \a GA_FEC_GROUP_MAX.
+ * @param pt [in] RTP payload type of FEC packets.
+ * @param seq [in] RTP sequence number of the FEC packet.
+ * @return Length of the FEC packet, or -1 on error.
+ *
+ * Sequence numbers of the protected packets must lie within 16 packets
+ * from the first one. The FEC packet carries the SSRC of the first packet
+ * and the timestamp of the last one.
+ */
+int
+ga_fec_encode(unsigned char *fec, int fecsize, const unsigned char **pkts, const int *lens, int n, int pt, unsigned short seq) {
+	unsigned short base, mask = 0, lenrec = 0, d;
+	unsigned int tsrec = 0;
+	int i, protlen = 0;
+	unsigned char *payload = fec + GA_FEC_HEADER_SIZE;
+	//
+	if(n <= 0 || n > GA_FEC_GROUP_MAX)
+		return -1;
+	for(i = 0; i < n; i++) {
+		if(lens[i] < 12)
+			return -1;
+		if(lens[i] - 12 > protlen)
+			protlen = lens[i] - 12;
+	}
+	if(GA_FEC_HEADER_SIZE + protlen > fecsize)
+		return -1;
+	memset(fec, 0, GA_FEC_HEADER_SIZE + protlen);
+	base = (pkts[0][2] << 8) | pkts[0][3];
+	for(i = 0; i < n; i++) {
+		d = ((pkts[i][2] << 8) | pkts[i][3]) - base;
+		if(d >= 16)
+			return -1;
+		mask |= (0x8000 >> d);
+		fec[12] ^= pkts[i][0];
+		fec[13] ^= pkts[i][1];
+		tsrec ^= fec_get32(&pkts[i][4]);
+		lenrec ^= (lens[i] - 12);
+		ga_fec_xor(payload, pkts[i] + 12, lens[i] - 12);
+	}
+	// RTP header
+	fec[0] = 0x80;
+	fec[1] = pt & 0x7f;
+	fec[2] = seq >> 8;
+	fec[3] = seq & 0x0ff;
+	memcpy(&fec[4], &pkts[n-1][4], 4);
+	memcpy(&fec[8], &pkts[0][8], 4);
+	// FEC header: E = 0, L = 0, and the recovery fields
+	fec[12] &= 0x3f;
+	fec[14] = base >> 8;
+	fec[15] = base & 0x0ff;
+	fec_put32(&fec[16], tsrec);
+	fec[20] = lenrec >> 8;
+	fec[21] = lenrec & 0x0ff;
+	// level 0 header
+	fec[22] = protlen >> 8;
+	fec[23] = protlen & 0x0ff;
+	fec[24] = mask >> 8;
+	fec[25] = mask & 0x0ff;
+	return GA_FEC_HEADER_SIZE + protlen;
+}
+
+/**
+ * Get sequence numbers protected by an FEC packet.
+ *
+ * @param fec [in] The FEC packet, including its RTP header.
+ * @param feclen [in] Length of the FEC packet.
+ * @param seqs [out] Protected sequence numbers, at least \a GA_FEC_GROUP_MAX entries.
+ * @return Number of protected packets, or -1 if the packet is malformed.
+ */
+int
+ga_fec_protected(const unsigned char *fec, int feclen, unsigned short *seqs) {
+	unsigned short base, mask;
+	int i, n = 0;
+	//
+	if(feclen < GA_FEC_HEADER_SIZE || (fec[12] & 0xc0) != 0)
+		return -1;
+	if(GA_FEC_HEADER_SIZE + ((fec[22] << 8) | fec[23]) > feclen)
+		return -1;
+	base = (fec[14] << 8) | fec[15];
+	mask = (fec[24] << 8) | fec[25];
+	for(i = 0; i < 16; i++) {
+		if(mask & (0x8000 >> i))
+			seqs[n++] = base + i;
+	}
+	return n;
+}
+
+/**
+ * Recover the only missing packet of a group protected by an FEC packet.
+ *
+ * @param pkt [out] Buffer for the recovered RTP packet.
+ * @param pktsize [in] Size of the \a pkt buffer.
+ * @param fec [in] The FEC packet, including its RTP header.
+ * @param feclen [in] Length of the FEC packet.
+ * @param pkts [in] The received packets of the group.
+ * @param lens [in] Lengths of the received packets.
+ * @param n [in] Number of received packets, one less than the group size.
+ * @return Length of the recovered packet, or -1 if it cannot be recovered.
+ */
+int
+ga_fec_recover(unsigned char *pkt, int pktsize, const unsigned char *fec, int feclen, const unsigned char **pkts, const int *lens, int n) {
+	unsigned short seqs[GA_FEC_GROUP_MAX], seq, lenrec;
+	unsigned int tsrec;
+	int i, j, count, protlen, missing = -1;
+	//
+	if((count = ga_fec_protected(fec, feclen, seqs)) != n + 1)
+		return -1;
+	protlen = (fec[22] << 8) | fec[23];
+	if(12 + protlen > pktsize)
+		return -1;
+	for(i = 0; i < count; i++) {
+		for(j = 0; j < n; j++) {
+			seq = (pkts[j][2] << 8) | pkts[j][3];
+			if(seq == seqs[i])
+				break;
+		}
+		if(j < n)
+			continue;
+		if(missing >= 0)
+			return -1;
+		missing = i;
+	}
+	if(missing < 0)
+		return -1;
+	//
+	pkt[0] = fec[12];
+	pkt[1] = fec[13];
+	tsrec = fec_get32(&fec[16]);
+	lenrec = (fec[20] << 8) | fec[21];
+	memcpy(pkt + 12, fec + GA_FEC_HEADER_SIZE, protlen);
+	for(i = 0; i < n; i++) {
+		if(lens[i] < 12 || lens[i] - 12 > protlen)
+			return -1;
+		pkt[0] ^= pkts[i][0];
+		pkt[1] ^= pkts[i][1];
+		tsrec ^= fec_get32(&pkts[i][4]);
+		lenrec ^= (lens[i] - 12);
+		ga_fec_xor(pkt + 12, pkts[i] + 12, lens[i] - 12);
+	}
+	if(lenrec > protlen)
+		return -1;
+	pkt[0] = 0x80 | (pkt[0] & 0x3f);
+	pkt[2] = seqs[missing] >> 8;
+	pkt[3] = seqs[missing] & 0x0ff;
+	fec_put32(&pkt[4], tsrec);
+	memcpy(&pkt[8], &fec[8], 4);
+	return 12 + lenrec;
+}
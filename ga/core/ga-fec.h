@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2013-2015 Chun-Ying Huang
+ *
+ * This file is part of GamingAnywhere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * @file
+ * XOR parity forward error correction for RTP: headers
+ *
+ * FEC packets follow the layout of RFC 5109 (ULPFEC) with a single
+ * protection level and the short 16-bit mask. They are sent as a
+ * separate payload type on the SSRC of the media stream they protect,
+ * with their own sequence numbers. This deviates from RFC 5109, where
+ * FEC in the same session shares the media sequence space or runs on a
+ * separate SSRC: receivers must demultiplex FEC by payload type before
+ * any per-SSRC sequence or loss accounting.
+ */
+
+#ifndef __GA_FEC_H__
+#define __GA_FEC_H__
+
+#include "ga-common.h"
+
+#define	GA_FEC_GROUP_MAX	16	/**< Media packets protected by one FEC packet */
+#define	GA_FEC_HEADER_SIZE	26	/**< RTP (12) + FEC (10) + level 0 (4) headers */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+EXPORT void ga_fec_xor(unsigned char *dst, const unsigned char *src, int len);
+EXPORT int ga_fec_encode(unsigned char *fec, int fecsize, const unsigned char **pkts, const int *lens, int n, int pt, unsigned short seq);
+EXPORT int ga_fec_protected(const unsigned char *fec, int feclen, unsigned short *seqs);
+EXPORT int ga_fec_recover(unsigned char *pkt, int pktsize, const unsigned char *fec, int feclen, const unsigned char **pkts, const int *lens, int n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
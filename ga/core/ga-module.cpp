@@ -330,6 +330,7 @@ ga_module_raw(ga_module_t *m, void *arg, int *size) {
  * @param m [in] Pointer to a module instance.
  * @param prefix [in] A name used to identify the sender.
  * @param channelId [in] Channel ID, used to determine audio or video data.
+ * @param rendition [in] Simulcast rendition of the packet, 0 for the main stream.
  * @param pkt [in] The packet data to be sent.
  * @param encoderPts [out] Presentation time stamp, store as a 64-bit sequence number.
  * @param ptv [out] Presentation time stamp, stored as a \a timeval structure.
@@ -341,13 +342,13 @@ ga_module_raw(ga_module_t *m, void *arg, int *size) {
  * before calling the interface.
  */
 int
-ga_module_send_packet(ga_module_t *m, const char *prefix, int channelId, AVPacket *pkt, int64_t encoderPts, struct timeval *ptv) {
+ga_module_send_packet(ga_module_t *m, const char *prefix, int channelId, int rendition, AVPacket *pkt, int64_t encoderPts, struct timeval *ptv) {
 #if 0	/* not checked: for performance considersation */
 	if(m == NULL)
 		return GA_IOCTL_ERR_NULLMODULE;
 	if(m->send_packet == NULL)
 		return GA_IOCTL_ERR_NOINTERFACE;
 #endif
-	return m->send_packet(prefix, channelId, pkt, encoderPts, ptv);
+	return m->send_packet(prefix, channelId, rendition, pkt, encoderPts, ptv);
 }
 
@@ -52,9 +52,13 @@ enum ga_module_types {
 enum ga_ioctl_commands {
 	GA_IOCTL_NULL = 0,		/**< Not used */
 	GA_IOCTL_RECONFIGURE,		/**< Reconfiguration */
+	GA_IOCTL_REQUEST_KEYFRAME,	/**< Force the next frame to be an IDR frame */
+	GA_IOCTL_PACKETLOSS,		/**< Expected packet loss hint: for encoders with FEC */
+	GA_IOCTL_CAPACITY,		/**< Measured network capacity hint: for sink servers */
 	GA_IOCTL_GETSPS = 0x100,	/**< Get SPS: for H.264 and H.265 */
 	GA_IOCTL_GETPPS,		/**< Get PPS: for H.264 and H.265 */
 	GA_IOCTL_GETVPS,		/**< Get VPS: for H.265 */
+	GA_IOCTL_GETEXTRADATA,		/**< Get codec configuration record: for VP8 and VP9 */
 	GA_IOCTL_CUSTOM = 0x40000000	/**< For user customization */
 };
 
@@ -97,6 +101,30 @@ typedef struct ga_ioctl_reconfigure_s {
 	int height;		/**< Height */
 }	ga_ioctl_reconfigure_t;
 
+/**
+ * Parameter for ioctl()'s request keyframe command.
+ */
+typedef struct ga_ioctl_keyframe_s {
+	int id;			/**< Channel id */
+	int rendition;		/**< Simulcast rendition, or -1 for all renditions */
+}	ga_ioctl_keyframe_t;
+
+/**
+ * Parameter for ioctl()'s packet loss hint command.
+ */
+typedef struct ga_ioctl_packetloss_s {
+	int id;			/**< Channel id */
+	int percent;		/**< Expected packet loss in percent */
+}	ga_ioctl_packetloss_t;
+
+/**
+ * Parameter for ioctl()'s network capacity hint command.
+ */
+typedef struct ga_ioctl_capacity_s {
+	int id;			/**< Channel id */
+	int kbps;		/**< Measured capacity in Kbps */
+}	ga_ioctl_capacity_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -117,7 +145,7 @@ typedef struct ga_module_s {
 	int (*ioctl)(int command, int argsize, void *arg);	/**< Pointer to ioctl function */
 	int (*notify)(void *arg);	/**< Pointer to the notify function */
 	void * (*raw)(void *arg, int *size);	/**< Pointer to the raw function */
-	int (*send_packet)(const char *prefix, int channelId, AVPacket *pkt, int64_t encoderPts, struct timeval *ptv);	/**< Pointer to the send packet function: sink only */
+	int (*send_packet)(const char *prefix, int channelId, int rendition, AVPacket *pkt, int64_t encoderPts, struct timeval *ptv);	/**< Pointer to the send packet function: sink only */
 	void * privdata;		/**< Private data of this module */
 }	ga_module_t;
 //////////////////////////////////////////////
@@ -146,7 +174,7 @@ EXPORT int ga_module_deinit(ga_module_t *m, void *arg);
 EXPORT int ga_module_ioctl(ga_module_t *m, int command, int argsize, void *arg);
 EXPORT int ga_module_notify(ga_module_t *m, void *arg);
 EXPORT void * ga_module_raw(ga_module_t *m, void *arg, int *size);
-EXPORT int ga_module_send_packet(ga_module_t *m, const char *prefix, int channelId, AVPacket *pkt, int64_t encoderPts, struct timeval *ptv);
+EXPORT int ga_module_send_packet(ga_module_t *m, const char *prefix, int channelId, int rendition, AVPacket *pkt, int64_t encoderPts, struct timeval *ptv);
 
 #ifdef GA_MODULE
 // a module must have exported the module_load function
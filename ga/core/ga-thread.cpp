@@ -0,0 +1,233 @@
+/*
+ * Copyright (c) 2013-2015 Chun-Ying Huang
+ *
+ * This file is part of GamingAnywhere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * @file
+ * Thread roles: CPU placement, scheduling policy, and names of pipeline threads
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#endif
+#include <map>
+
+#include "ga-common.h"
+#include "ga-conf.h"
+#include "ga-thread.h"
+
+using namespace std;
+
+#define	THREAD_CPUS_MAX		64	// CPUs in a role's CPU list
+
+struct ga_thread_s {
+	char role[GA_THREAD_ROLE_MAXLEN];
+	int index;
+	int policy;			// SCHED_*
+	int priority;			// real-time priority or nice level
+	// schedstat at the last report
+	unsigned long long runtime;	// ns on CPU
+	unsigned long long waittime;	// ns waiting on a run queue
+	unsigned long long slices;
+	long long since;		// us
+};
+
+static pthread_mutex_t thread_mutex = PTHREAD_MUTEX_INITIALIZER;
+static map<long/*tid*/, struct ga_thread_s> thread_registry;
+
+#ifdef __linux__
+/* apply the scheduling settings of a role to the calling thread */
+static void
+thread_apply(const char *role, int index, struct ga_thread_s *t) {
+	char key[64], name[16], sched[16];
+	int i, err, ncpus, cpus[THREAD_CPUS_MAX];
+	//
+	// thread names are limited to 15 characters: shorten the role, keep the index
+	i = snprintf(NULL, 0, "%d", index);
+	snprintf(name, sizeof(name), "ga-%.*s%d", i < 12 ? 12 - i : 0, role, index);
+	pthread_setname_np(pthread_self(), name);
+	// CPU set
+	snprintf(key, sizeof(key), "thread-%s-cpus", role);
+	if((ncpus = ga_conf_readints(key, cpus, THREAD_CPUS_MAX)) > 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for(i = 0; i < ncpus; i++) {
+			if(cpus[i] >= 0 && cpus[i] < CPU_SETSIZE)
+				CPU_SET(cpus[i], &set);
+		}
+		if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+			ga_error("thread: %s - cannot set CPU affinity.\n", name);
+	}
+	// policy and priority
+	t->policy = SCHED_OTHER;
+	snprintf(key, sizeof(key), "thread-%s-sched", role);
+	if(ga_conf_readv(key, sched, sizeof(sched)) != NULL) {
+		if(strcasecmp(sched, "fifo") == 0)
+			t->policy = SCHED_FIFO;
+		else if(strcasecmp(sched, "rr") == 0)
+			t->policy = SCHED_RR;
+	}
+	snprintf(key, sizeof(key), "thread-%s-priority", role);
+	t->priority = ga_conf_readint(key);
+	if(t->policy != SCHED_OTHER) {
+		struct sched_param param;
+		int pmin = sched_get_priority_min(t->policy);
+		int pmax = sched_get_priority_max(t->policy);
+		bzero(&param, sizeof(param));
+		param.sched_priority = t->priority < pmin ? pmin : (t->priority > pmax ? pmax : t->priority);
+		t->priority = param.sched_priority;
+		if((err = pthread_setschedparam(pthread_self(), t->policy, &param)) != 0) {
+			ga_error("thread: %s - cannot set %s priority %d (%s), keep SCHED_OTHER.\n",
+				name, t->policy == SCHED_FIFO ? "SCHED_FIFO" : "SCHED_RR",
+				t->priority, strerror(err));
+			t->policy = SCHED_OTHER;
+			t->priority = 0;
+		}
+	} else if(t->priority != 0) {
+		// nice levels are per thread on Linux
+		if(setpriority(PRIO_PROCESS, ga_gettid(), t->priority) != 0)
+			ga_error("thread: %s - cannot set nice %d (%s).\n",
+				name, t->priority, strerror(errno));
+	}
+	return;
+}
+
+/* read run time, run queue wait, and time slices of a thread */
+static int
+thread_schedstat(long tid, unsigned long long *runtime, unsigned long long *waittime, unsigned long long *slices) {
+	char path[64];
+	FILE *fp;
+	int n;
+	snprintf(path, sizeof(path), "/proc/self/task/%ld/schedstat", tid);
+	if((fp = fopen(path, "r")) == NULL)
+		return -1;
+	n = fscanf(fp, "%llu %llu %llu", runtime, waittime, slices);
+	fclose(fp);
+	return n == 3 ? 0 : -1;
+}
+
+/* get the CPU a thread last ran on */
+static int
+thread_lastcpu(long tid) {
+	char path[64], buf[1024], *ptr;
+	FILE *fp;
+	int i, cpu = -1;
+	snprintf(path, sizeof(path), "/proc/self/task/%ld/stat", tid);
+	if((fp = fopen(path, "r")) == NULL)
+		return -1;
+	ptr = fgets(buf, sizeof(buf), fp);
+	fclose(fp);
+	// the command name may contain spaces: fields are counted from
+	// its closing parenthesis, the processor is field 39
+	if(ptr == NULL || (ptr = strrchr(buf, ')')) == NULL)
+		return -1;
+	for(i = 2; i < 39 && ptr != NULL; i++)
+		ptr = strchr(ptr + 1, ' ');
+	if(ptr != NULL)
+		cpu = strtol(ptr + 1, NULL, 10);
+	return cpu;
+}
+#endif
+
+/**
+ * Declare the role of the calling thread.
+ *
+ * @param role [in] Role name, e.g., "vsource", "filter", "vencoder",
+ *	"aencoder", "server", or "controller".
+ * @param index [in] Instance of the role, e.g., the channel id.
+ * @return 0 on success.
+ *
+ * The thread is named ga-<role><index>, moved to the role's CPU set,
+ * and given the role's scheduling policy and priority (Linux only).
+ * Real-time policies need CAP_SYS_NICE or a suitable RLIMIT_RTPRIO;
+ * the thread stays in SCHED_OTHER if they cannot be set.
+ */
+int
+ga_thread_role(const char *role, int index) {
+	struct ga_thread_s t;
+	long tid = ga_gettid();
+	//
+	bzero(&t, sizeof(t));
+	strncpy(t.role, role, sizeof(t.role)-1);
+	t.index = index;
+#ifdef __linux__
+	thread_apply(t.role, index, &t);
+	thread_schedstat(tid, &t.runtime, &t.waittime, &t.slices);
+#endif
+	t.since = ga_monotonic_us();
+	pthread_mutex_lock(&thread_mutex);
+	thread_registry[tid] = t;
+	pthread_mutex_unlock(&thread_mutex);
+	return 0;
+}
+
+/**
+ * Log placement and scheduling statistics of all registered threads.
+ *
+ * @return Number of threads reported.
+ *
+ * For each thread, it reports the CPU it last ran on, its policy, the
+ * share of time it ran, and how long it waited on a run queue, per second
+ * and per time slice, since the previous report. Values come from
+ * /proc/self/task/<tid>/schedstat (Linux only). Threads that have exited
+ * are removed.
+ */
+int
+ga_thread_report() {
+	int n = 0;
+#ifdef __linux__
+	map<long, struct ga_thread_s>::iterator mi, next;
+	unsigned long long runtime, waittime, slices;
+	long long now = ga_monotonic_us(), elapsed;
+	//
+	pthread_mutex_lock(&thread_mutex);
+	for(mi = thread_registry.begin(); mi != thread_registry.end(); mi = next) {
+		struct ga_thread_s *t = &mi->second;
+		next = mi;
+		next++;
+		if(thread_schedstat(mi->first, &runtime, &waittime, &slices) < 0) {
+			thread_registry.erase(mi);
+			continue;
+		}
+		if((elapsed = now - t->since) <= 0)
+			continue;
+		ga_error("thread: ga-%s%d tid=%ld cpu=%d %s/%d run=%.1f%% runq-wait=%.2fms/s (%.1fus/slice)\n",
+			t->role, t->index, mi->first,
+			thread_lastcpu(mi->first),
+			t->policy == SCHED_FIFO ? "fifo" : (t->policy == SCHED_RR ? "rr" : "other"),
+			t->priority,
+			100.0 * (runtime - t->runtime) / (elapsed * 1000.0),
+			1000.0 * (waittime - t->waittime) / (elapsed * 1000.0),
+			slices > t->slices ? (waittime - t->waittime) / 1000.0 / (slices - t->slices) : 0.0);
+		t->runtime = runtime;
+		t->waittime = waittime;
+		t->slices = slices;
+		t->since = now;
+		n++;
+	}
+	pthread_mutex_unlock(&thread_mutex);
+#endif
+	return n;
+}
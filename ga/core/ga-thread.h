@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2013-2015 Chun-Ying Huang
+ *
+ * This file is part of GamingAnywhere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * @file
+ * Thread roles: CPU placement, scheduling policy, and names of pipeline threads
+ *
+ * A pipeline thread declares its role when it starts, e.g., "vencoder".
+ * The role's settings are read from the configuration:
+ * \em thread-<role>-cpus (CPU list), \em thread-<role>-sched
+ * (\em fifo, \em rr, or \em other), and \em thread-<role>-priority
+ * (real-time priority, or nice level for \em other).
+ */
+
+#ifndef __GA_THREAD_H__
+#define __GA_THREAD_H__
+
+#include "ga-common.h"
+
+#define	GA_THREAD_ROLE_MAXLEN	16	/**< Maximum length of a role name */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+EXPORT int ga_thread_role(const char *role, int index);
+EXPORT int ga_thread_report();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,268 @@
+/*
+ * Copyright (c) 2013-2015 Chun-Ying Huang
+ *
+ * This file is part of GamingAnywhere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * @file
+ * Shared worker pool for encoding and conversion jobs: implementations
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#endif
+#include <list>
+#include <map>
+
+#include "ga-common.h"
+#include "ga-conf.h"
+#include "ga-thread.h"
+#include "ga-workpool.h"
+
+using namespace std;
+
+struct ga_workpool_batch_s {
+	ga_workpool_func_t func;
+	void **args;
+	int n;
+	int next;		// the next job to claim
+	int done;		// finished jobs
+};
+
+static pthread_mutex_t workpool_init_mutex = PTHREAD_MUTEX_INITIALIZER;	// start and stop
+static int workpool_started = 0;
+static pthread_mutex_t workpool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workpool_cond = PTHREAD_COND_INITIALIZER;	// new jobs
+static pthread_cond_t workpool_done = PTHREAD_COND_INITIALIZER;	// finished batches
+static pthread_t workpool_tid[GA_WORKPOOL_THREADS_MAX];
+static int workpool_nthreads = 0;
+static int workpool_ncpus = 0;
+static int workpool_cpus[GA_WORKPOOL_THREADS_MAX];
+static int workpool_quit = 0;
+// batches with unclaimed jobs, per group
+static map<int, list<struct ga_workpool_batch_s*> > workpool_pending;
+static int workpool_lastgroup = -1;	// round-robin position
+
+/* claim a job from the group after the last served one; called with the mutex held */
+static struct ga_workpool_batch_s *
+workpool_claim(int *job) {
+	map<int, list<struct ga_workpool_batch_s*> >::iterator mi;
+	struct ga_workpool_batch_s *b;
+	if(workpool_pending.size() == 0)
+		return NULL;
+	if((mi = workpool_pending.upper_bound(workpool_lastgroup)) == workpool_pending.end())
+		mi = workpool_pending.begin();
+	b = mi->second.front();
+	*job = b->next++;
+	workpool_lastgroup = mi->first;
+	if(b->next == b->n) {
+		mi->second.pop_front();
+		if(mi->second.size() == 0)
+			workpool_pending.erase(mi);
+	}
+	return b;
+}
+
+/* mark a job finished; called with the mutex held */
+static void
+workpool_finish(struct ga_workpool_batch_s *b) {
+	if(++b->done == b->n)
+		pthread_cond_broadcast(&workpool_done);
+	return;
+}
+
+static void *
+workpool_threadproc(void *arg) {
+	struct ga_workpool_batch_s *b;
+	int job, id = (int) (intptr_t) arg;
+	//
+	ga_thread_role("worker", id);
+#ifdef __linux__
+	// worker i runs on CPU worker-cpus[i % ncpus]
+	if(workpool_ncpus > 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(workpool_cpus[id % workpool_ncpus], &set);
+		if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+			ga_error("workpool: cannot pin worker #%d to CPU %d.\n", id, workpool_cpus[id % workpool_ncpus]);
+	}
+#endif
+	pthread_mutex_lock(&workpool_mutex);
+	while(workpool_quit == 0) {
+		if((b = workpool_claim(&job)) == NULL) {
+			pthread_cond_wait(&workpool_cond, &workpool_mutex);
+			continue;
+		}
+		pthread_mutex_unlock(&workpool_mutex);
+		b->func(b->args[job]);
+		pthread_mutex_lock(&workpool_mutex);
+		workpool_finish(b);
+	}
+	pthread_mutex_unlock(&workpool_mutex);
+	return NULL;
+}
+
+/* create the worker threads; called with the init mutex held */
+static void
+workpool_start() {
+	int i;
+	//
+	workpool_started = 1;
+	if((workpool_nthreads = ga_conf_readint("worker-threads")) <= 0) {
+		workpool_nthreads = 0;
+		return;
+	}
+	if(workpool_nthreads > GA_WORKPOOL_THREADS_MAX)
+		workpool_nthreads = GA_WORKPOOL_THREADS_MAX;
+	workpool_ncpus = ga_conf_readints("worker-cpus", workpool_cpus, GA_WORKPOOL_THREADS_MAX);
+	workpool_quit = 0;
+	for(i = 0; i < workpool_nthreads; i++) {
+		if(pthread_create(&workpool_tid[i], NULL, workpool_threadproc, (void*) (intptr_t) i) != 0) {
+			ga_error("workpool: cannot create worker thread #%d.\n", i);
+			break;
+		}
+	}
+	workpool_nthreads = i;
+	ga_error("workpool: %d worker threads%s.\n",
+		workpool_nthreads, workpool_ncpus > 0 ? ", pinned" : "");
+	return;
+}
+
+/**
+ * Start the shared worker pool.
+ *
+ * @return Number of worker threads.
+ *
+ * The number of threads is read from \em worker-threads, and the CPUs to
+ * pin them to from \em worker-cpus. With no worker threads, batches run
+ * in the submitting thread. The pool is started on the first
+ * ga_workpool_run() if this function is not called, and again after
+ * ga_workpool_deinit().
+ */
+int
+ga_workpool_init() {
+	int n;
+	pthread_mutex_lock(&workpool_init_mutex);
+	if(workpool_started == 0)
+		workpool_start();
+	n = workpool_nthreads;
+	pthread_mutex_unlock(&workpool_init_mutex);
+	return n;
+}
+
+/**
+ * Stop the worker threads.
+ *
+ * Workers quit after their current job and are joined. Must not be
+ * called while batches are running.
+ */
+void
+ga_workpool_deinit() {
+	int i;
+	pthread_mutex_lock(&workpool_init_mutex);
+	if(workpool_started == 0) {
+		pthread_mutex_unlock(&workpool_init_mutex);
+		return;
+	}
+	pthread_mutex_lock(&workpool_mutex);
+	workpool_quit = 1;
+	pthread_cond_broadcast(&workpool_cond);
+	pthread_mutex_unlock(&workpool_mutex);
+	for(i = 0; i < workpool_nthreads; i++)
+		pthread_join(workpool_tid[i], NULL);
+	pthread_mutex_lock(&workpool_mutex);
+	workpool_quit = 0;
+	workpool_lastgroup = -1;
+	pthread_mutex_unlock(&workpool_mutex);
+	workpool_nthreads = 0;
+	workpool_ncpus = 0;
+	workpool_started = 0;
+	pthread_mutex_unlock(&workpool_init_mutex);
+	return;
+}
+
+/**
+ * Get the number of worker threads.
+ */
+int
+ga_workpool_threads() {
+	return ga_workpool_init();
+}
+
+/**
+ * Run a batch of jobs on the worker pool and wait for all of them.
+ *
+ * @param group [in] Submitter of the batch, e.g., a channel id. Batches of
+ *	different groups are served round-robin.
+ * @param func [in] The job function.
+ * @param args [in] Argument of each job.
+ * @param n [in] Number of jobs.
+ * @return 0 on success.
+ *
+ * The submitting thread runs jobs of its own batch as well, so a batch
+ * always makes progress even if all workers are busy.
+ */
+int
+ga_workpool_run(int group, ga_workpool_func_t func, void **args, int n) {
+	struct ga_workpool_batch_s b;
+	int i, job;
+	//
+	if(n <= 0)
+		return 0;
+	if(n == 1 || ga_workpool_init() <= 0) {
+		for(i = 0; i < n; i++)
+			func(args[i]);
+		return 0;
+	}
+	b.func = func;
+	b.args = args;
+	b.n = n;
+	b.next = 1;	// the first job is for the submitter
+	b.done = 0;
+	pthread_mutex_lock(&workpool_mutex);
+	workpool_pending[group].push_back(&b);
+	pthread_cond_broadcast(&workpool_cond);
+	pthread_mutex_unlock(&workpool_mutex);
+	//
+	job = 0;
+	while(job >= 0) {
+		func(args[job]);
+		pthread_mutex_lock(&workpool_mutex);
+		workpool_finish(&b);
+		// claim more jobs of this batch, if any
+		if(b.next < b.n) {
+			job = b.next++;
+			if(b.next == b.n) {
+				workpool_pending[group].remove(&b);
+				if(workpool_pending[group].size() == 0)
+					workpool_pending.erase(group);
+			}
+		} else {
+			job = -1;
+		}
+		pthread_mutex_unlock(&workpool_mutex);
+	}
+	pthread_mutex_lock(&workpool_mutex);
+	while(b.done < b.n)
+		pthread_cond_wait(&workpool_done, &workpool_mutex);
+	pthread_mutex_unlock(&workpool_mutex);
+	return 0;
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2013-2015 Chun-Ying Huang
+ *
+ * This file is part of GamingAnywhere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * @file
+ * Shared worker pool for encoding and conversion jobs: headers
+ *
+ * All channels of a server process share one pool of worker threads,
+ * optionally pinned to a set of CPUs, instead of each of them running
+ * its own helper threads. Jobs are submitted in batches; batches from
+ * different submitters (groups) are served round-robin.
+ */
+
+#ifndef __GA_WORKPOOL_H__
+#define __GA_WORKPOOL_H__
+
+#include "ga-common.h"
+
+#define	GA_WORKPOOL_THREADS_MAX	64	/**< Maximum number of worker threads */
+
+/** Job function: runs once for each argument of a batch */
+typedef void (*ga_workpool_func_t)(void *arg);
+
+EXPORT int ga_workpool_init();
+EXPORT void ga_workpool_deinit();
+EXPORT int ga_workpool_threads();
+EXPORT int ga_workpool_run(int group, ga_workpool_func_t func, void **args, int n);
+
+#endif
@@ -53,6 +53,14 @@
 #define	COLORCODE_SUFFIX	(COLORCODE_CRC + COLORCODE_ID)	/**< Digits
 					  * appended to the embedded color code sequence */
 
+// region-of-interest (ROI) feature
+#define	ROI_TILE_SIZE		64	/**< Tile size used to detect changed regions */
+#define	ROI_DEF_QP_DIRTY	-3	/**< Default QP offset for changed regions */
+#define	ROI_DEF_QP_IDLE		4	/**< Default QP offset for unchanged regions */
+#define	ROI_DEF_QP_STATIC	8	/**< Default QP offset for static regions */
+#define	ROI_DEF_QP_CURSOR	-6	/**< Default QP offset for regions near the cursor */
+#define	ROI_DEF_CURSOR_RADIUS	64	/**< Default radius of the cursor region */
+
 // golbal image structure
 static int gChannels;		/**< Total number of video channels */
 static vsource_t gVsource[VIDEO_SOURCE_CHANNEL_MAX];	/**< Video source */
@@ -98,6 +106,7 @@ vsource_frame_init(int channel, vsource_frame_t *frame) {
 	//ga_error("XXX: frame=%p, imgbuf=%p, sizeof(vframe)=%d, bzero(%d)\n",
 	//	frame, frame->imgbuf, sizeof(vsource_frame_t), frame->imgbufsize);
 	bzero(frame->imgbuf, frame->imgbufsize);
+	vsource_frame_roi_reset(frame);
 	return frame;
 }
 
@@ -129,6 +138,10 @@ vsource_dup_frame(vsource_frame_t *src, vsource_frame_t *dst) {
 	dst->realheight = src->realheight;
 	dst->realstride = src->realstride;
 	dst->realsize = src->realsize;
+	dst->cursor_x = src->cursor_x;
+	dst->cursor_y = src->cursor_y;
+	dst->nroi = src->nroi;
+	bcopy(src->roi, dst->roi, src->nroi * sizeof(vsource_roi_t));
 	bcopy(src->imgbuf, dst->imgbuf, src->realstride * src->realheight/*dst->imgbufsize*/);
 	return;
 }
@@ -486,6 +499,281 @@ vsource_embed_colorcode(vsource_frame_t *frame, unsigned int value) {
 	return;
 }
 
+/**
+ * Load ROI-based quantization settings from the configuration.
+ *
+ * @param conf [out] Pointer to the ROI configuration to be filled.
+ * @return 1 if ROI quantization is enabled, or 0 if it is disabled.
+ *
+ * The feature is enabled by the \em video-roi parameter.
+ * QP offsets are read from \em video-roi-qp-dirty, \em video-roi-qp-idle,
+ * \em video-roi-qp-static, and \em video-roi-qp-cursor.
+ * Static regions (e.g., HUDs) are read from \em video-roi-static,
+ * which contains groups of four integers: left top right bottom.
+ */
+int
+vsource_roi_config_load(vsource_roi_config_t *conf) {
+	int i, n, rect[4 * VIDEO_SOURCE_MAX_ROI];
+	char buf[64];
+	//
+	bzero(conf, sizeof(vsource_roi_config_t));
+	if(ga_conf_readbool("video-roi", 0) == 0)
+		return 0;
+	conf->enabled = 1;
+	conf->qp_dirty = ROI_DEF_QP_DIRTY;
+	conf->qp_idle = ROI_DEF_QP_IDLE;
+	conf->qp_static = ROI_DEF_QP_STATIC;
+	conf->qp_cursor = ROI_DEF_QP_CURSOR;
+	conf->cursor_radius = ROI_DEF_CURSOR_RADIUS;
+	if(ga_conf_readv("video-roi-qp-dirty", buf, sizeof(buf)) != NULL)
+		conf->qp_dirty = strtod(buf, NULL);
+	if(ga_conf_readv("video-roi-qp-idle", buf, sizeof(buf)) != NULL)
+		conf->qp_idle = strtod(buf, NULL);
+	if(ga_conf_readv("video-roi-qp-static", buf, sizeof(buf)) != NULL)
+		conf->qp_static = strtod(buf, NULL);
+	if(ga_conf_readv("video-roi-qp-cursor", buf, sizeof(buf)) != NULL)
+		conf->qp_cursor = strtod(buf, NULL);
+	if(ga_conf_readv("video-roi-cursor-radius", buf, sizeof(buf)) != NULL)
+		conf->cursor_radius = strtol(buf, NULL, 0);
+	//
+	n = ga_conf_readints("video-roi-static", rect, 4 * VIDEO_SOURCE_MAX_ROI);
+	for(i = 0; i + 3 < n; i += 4) {
+		vsource_roi_t *r = &conf->rstatic[conf->nstatic];
+		if(rect[i] >= rect[i+2] || rect[i+1] >= rect[i+3]) {
+			ga_error("video source: invalid static ROI (%d,%d)-(%d,%d), ignored.\n",
+				rect[i], rect[i+1], rect[i+2], rect[i+3]);
+			continue;
+		}
+		r->type = VSOURCE_ROI_STATIC;
+		r->left = rect[i];
+		r->top = rect[i+1];
+		r->right = rect[i+2];
+		r->bottom = rect[i+3];
+		conf->nstatic++;
+	}
+	ga_error("video source: ROI enabled - qp dirty=%.1f idle=%.1f static=%.1f cursor=%.1f (radius=%d), %d static region(s)\n",
+		conf->qp_dirty, conf->qp_idle, conf->qp_static,
+		conf->qp_cursor, conf->cursor_radius, conf->nstatic);
+	return 1;
+}
+
+/**
+ * Remove all ROI information from a video frame.
+ *
+ * @param frame [in] Pointer to the video frame.
+ */
+void
+vsource_frame_roi_reset(vsource_frame_t *frame) {
+	frame->cursor_x = -1;
+	frame->cursor_y = -1;
+	frame->nroi = 0;
+	return;
+}
+
+/**
+ * Attach a region-of-interest rectangle to a video frame.
+ *
+ * @param frame [in] Pointer to the video frame.
+ * @param type [in] ROI type, see \a vsource_roi_types.
+ * @param left [in] Left boundary (inclusive).
+ * @param top [in] Top boundary (inclusive).
+ * @param right [in] Right boundary (exclusive).
+ * @param bottom [in] Bottom boundary (exclusive).
+ * @return The number of ROI rectangles in the frame, or -1 on error.
+ *
+ * A rectangle that vertically touches and horizontally overlaps
+ * the last rectangle of the same type is merged into the last one.
+ * When the frame is full, the rectangle is merged into the last one as well.
+ */
+int
+vsource_frame_add_roi(vsource_frame_t *frame, int type, int left, int top, int right, int bottom) {
+	vsource_roi_t *last = NULL;
+	if(frame == NULL || left >= right || top >= bottom)
+		return -1;
+	if(frame->nroi > 0)
+		last = &frame->roi[frame->nroi - 1];
+	if(last != NULL && last->type == type
+	&& (frame->nroi == VIDEO_SOURCE_MAX_ROI
+	 || (last->bottom == top && last->left < right && left < last->right))) {
+		if(left < last->left)		last->left = left;
+		if(top < last->top)		last->top = top;
+		if(right > last->right)		last->right = right;
+		if(bottom > last->bottom)	last->bottom = bottom;
+		return frame->nroi;
+	}
+	if(frame->nroi == VIDEO_SOURCE_MAX_ROI)
+		return -1;
+	last = &frame->roi[frame->nroi++];
+	last->type = type;
+	last->left = left;
+	last->top = top;
+	last->right = right;
+	last->bottom = bottom;
+	return frame->nroi;
+}
+
+/**
+ * Detect changed regions of a RGBA/BGRA frame and attach them as ROIs.
+ *
+ * @param frame [in] Pointer to the captured video frame.
+ * @param prevbuf [in,out] Copy of the previously captured image.
+ * @param prevstride [in] Stride of \a prevbuf.
+ * @return The number of ROI rectangles in the frame, or -1 on error.
+ *
+ * The frame is compared against \a prevbuf in tiles of \em ROI_TILE_SIZE.
+ * Changed tiles are copied back into \a prevbuf, so the cost of keeping
+ * \a prevbuf up-to-date is proportional to the changed area.
+ */
+int
+vsource_frame_diff_roi(vsource_frame_t *frame, unsigned char *prevbuf, int prevstride) {
+	int x, y, yy, xend, yend, linelen;
+	int dirtyleft, dirtyright;
+	unsigned char *cur, *prev;
+	//
+	if(frame == NULL || prevbuf == NULL)
+		return -1;
+	if(frame->pixelformat != AV_PIX_FMT_RGBA && frame->pixelformat != AV_PIX_FMT_BGRA)
+		return -1;
+	for(y = 0; y < frame->realheight; y += ROI_TILE_SIZE) {
+		yend = y + ROI_TILE_SIZE;
+		if(yend > frame->realheight)
+			yend = frame->realheight;
+		dirtyleft = dirtyright = -1;
+		for(x = 0; x < frame->realwidth; x += ROI_TILE_SIZE) {
+			int dirty = 0;
+			xend = x + ROI_TILE_SIZE;
+			if(xend > frame->realwidth)
+				xend = frame->realwidth;
+			linelen = (xend - x) * RGBA_SIZE;
+			cur = frame->imgbuf + y * frame->realstride + x * RGBA_SIZE;
+			prev = prevbuf + y * prevstride + x * RGBA_SIZE;
+			for(yy = y; yy < yend; yy++) {
+				if(dirty != 0 || memcmp(cur, prev, linelen) != 0) {
+					bcopy(cur, prev, linelen);
+					dirty = 1;
+				}
+				cur += frame->realstride;
+				prev += prevstride;
+			}
+			if(dirty == 0)
+				continue;
+			if(dirtyleft < 0)
+				dirtyleft = x;
+			dirtyright = xend;
+		}
+		if(dirtyleft >= 0) {
+			vsource_frame_add_roi(frame, VSOURCE_ROI_DIRTY,
+				dirtyleft, y, dirtyright, yend);
+		}
+	}
+	return frame->nroi;
+}
+
+/**
+ * Copy ROI information between two frames of different resolutions.
+ *
+ * @param src [in] Pointer to the source video frame.
+ * @param dst [in] Pointer to the destination video frame.
+ *
+ * Both \a realwidth and \a realheight of the two frames must have been set.
+ * Coordinates are scaled from the source to the destination resolution.
+ */
+void
+vsource_frame_copy_roi(vsource_frame_t *src, vsource_frame_t *dst) {
+	int i;
+	if(src->realwidth <= 0 || src->realheight <= 0) {
+		vsource_frame_roi_reset(dst);
+		return;
+	}
+#define	SCALE_X(v)	((int) ((long long) (v) * dst->realwidth / src->realwidth))
+#define	SCALE_Y(v)	((int) ((long long) (v) * dst->realheight / src->realheight))
+#define	SCALE_X_UP(v)	((int) (((long long) (v) * dst->realwidth + src->realwidth - 1) / src->realwidth))
+#define	SCALE_Y_UP(v)	((int) (((long long) (v) * dst->realheight + src->realheight - 1) / src->realheight))
+	dst->cursor_x = src->cursor_x < 0 ? -1 : SCALE_X(src->cursor_x);
+	dst->cursor_y = src->cursor_y < 0 ? -1 : SCALE_Y(src->cursor_y);
+	for(i = 0; i < src->nroi; i++) {
+		dst->roi[i].type = src->roi[i].type;
+		dst->roi[i].left = SCALE_X(src->roi[i].left);
+		dst->roi[i].top = SCALE_Y(src->roi[i].top);
+		// round up the exclusive boundaries
+		dst->roi[i].right = SCALE_X_UP(src->roi[i].right);
+		dst->roi[i].bottom = SCALE_Y_UP(src->roi[i].bottom);
+	}
+#undef	SCALE_X
+#undef	SCALE_Y
+#undef	SCALE_X_UP
+#undef	SCALE_Y_UP
+	dst->nroi = src->nroi;
+	return;
+}
+
+/**
+ * Fill an ROI rectangle into a macroblock QP offset map. This is an internal function.
+ */
+static void
+vsource_roi_fill_qpmap(float *qpmap, int mbw, int mbh, int left, int top, int right, int bottom, float qp) {
+	int x, y, x0, y0, x1, y1;
+	x0 = left < 0 ? 0 : (left >> 4);
+	y0 = top < 0 ? 0 : (top >> 4);
+	x1 = (right + 15) >> 4;
+	y1 = (bottom + 15) >> 4;
+	if(x1 > mbw)	x1 = mbw;
+	if(y1 > mbh)	y1 = mbh;
+	for(y = y0; y < y1; y++) {
+		for(x = x0; x < x1; x++) {
+			qpmap[y * mbw + x] = qp;
+		}
+	}
+	return;
+}
+
+/**
+ * Convert the ROI information of a frame into a macroblock QP offset map.
+ *
+ * @param frame [in] Pointer to the video frame.
+ * @param conf [in] The ROI configuration.
+ * @param qpmap [out] QP offsets for each 16x16 macroblock, in raster order.
+ * @param mbw [in] Number of macroblocks in a row.
+ * @param mbh [in] Number of macroblocks in a column.
+ * @return 0 on success, or -1 if no ROI information can be applied.
+ *
+ * Unchanged regions receive \a qp_idle, changed regions receive \a qp_dirty,
+ * and the static regions and the cursor region override the above values.
+ * If a frame carries no ROI at all, \a qpmap is not touched and -1 is
+ * returned, so the encoder should not apply any offsets.
+ */
+int
+vsource_frame_roi_qpmap(vsource_frame_t *frame, vsource_roi_config_t *conf, float *qpmap, int mbw, int mbh) {
+	int i, r;
+	if(conf == NULL || conf->enabled == 0)
+		return -1;
+	if(frame->nroi == 0 && frame->cursor_x < 0)
+		return -1;
+	for(i = 0; i < mbw * mbh; i++)
+		qpmap[i] = conf->qp_idle;
+	for(i = 0; i < frame->nroi; i++) {
+		vsource_roi_t *roi = &frame->roi[i];
+		if(roi->type != VSOURCE_ROI_DIRTY)
+			continue;
+		vsource_roi_fill_qpmap(qpmap, mbw, mbh,
+			roi->left, roi->top, roi->right, roi->bottom, conf->qp_dirty);
+	}
+	for(i = 0; i < frame->nroi; i++) {
+		vsource_roi_t *roi = &frame->roi[i];
+		if(roi->type != VSOURCE_ROI_STATIC)
+			continue;
+		vsource_roi_fill_qpmap(qpmap, mbw, mbh,
+			roi->left, roi->top, roi->right, roi->bottom, conf->qp_static);
+	}
+	if(frame->cursor_x >= 0 && frame->cursor_y >= 0) {
+		r = conf->cursor_radius;
+		vsource_roi_fill_qpmap(qpmap, mbw, mbh,
+			frame->cursor_x - r, frame->cursor_y - r,
+			frame->cursor_x + r, frame->cursor_y + r, conf->qp_cursor);
+	}
+	return 0;
+}
+
 /**
  * Get the number of channels of the video source.
  *
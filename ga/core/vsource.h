@@ -46,6 +46,41 @@
 #define	VIDEO_SOURCE_PIPEFORMAT		"video-%d"
 /** Define the default video source pipe pool size (frames in the pipe) */
 #define	VIDEO_SOURCE_POOLSIZE		8
+/** Define the maximum number of region-of-interest rectangles in a frame */
+#define	VIDEO_SOURCE_MAX_ROI		16
+
+/**
+ * Enumeration for types of a region-of-interest (ROI) rectangle.
+ */
+enum vsource_roi_types {
+	VSOURCE_ROI_DIRTY = 0,	/**< Region changed since the previous frame */
+	VSOURCE_ROI_STATIC	/**< Static region (e.g., HUD) from configuration */
+};
+
+/**
+ * Data structure to store a region-of-interest rectangle.
+ * The region covers [\a left, \a right) x [\a top, \a bottom).
+ */
+typedef struct vsource_roi_s {
+	int type;		/**< ROI type, see \a vsource_roi_types */
+	int left, top;		/**< Top-left corner (inclusive) */
+	int right, bottom;	/**< Bottom-right corner (exclusive) */
+}	vsource_roi_t;
+
+/**
+ * Data structure to store ROI-based quantization settings.
+ */
+typedef struct vsource_roi_config_s {
+	int enabled;		/**< ROI quantization is enabled? */
+	float qp_dirty;		/**< QP offset for changed regions */
+	float qp_idle;		/**< QP offset for unchanged regions */
+	float qp_static;	/**< QP offset for static regions */
+	float qp_cursor;	/**< QP offset for regions near the cursor */
+	int cursor_radius;	/**< Radius of the cursor region, in pixels */
+	int nstatic;		/**< Number of static regions */
+	vsource_roi_t rstatic[VIDEO_SOURCE_MAX_ROI];	/**< Static regions,
+				 * in captured frame coordinates */
+}	vsource_roi_config_t;
 
 /**
  * Data structure to store a video frame in RGBA or YUV420 format.
@@ -66,6 +101,11 @@ typedef struct vsource_frame_s {
 	int realstride;		/**< stride for RGBA and BGRA video frame */
 	int realsize;		/**< Total size of the video frame data */
 	struct timeval timestamp;	/**< Captured timestamp */
+	int cursor_x;		/**< Cursor position x, or -1 if unknown */
+	int cursor_y;		/**< Cursor position y, or -1 if unknown */
+	int nroi;		/**< Number of region-of-interest rectangles */
+	vsource_roi_t roi[VIDEO_SOURCE_MAX_ROI];	/**< Region-of-interest
+				 * rectangles, in frame coordinates */
 	// internal data - should not change after initialized
 	int maxstride;		/**< */
 	int imgbufsize;		/**< Allocated video frame buffer size */
@@ -129,6 +169,13 @@ EXPORT int vsource_embed_colorcode_init(int RGBmode);
 EXPORT void vsource_embed_colorcode_reset();
 EXPORT void vsource_embed_colorcode_inc(vsource_frame_t *frame);
 EXPORT void vsource_embed_colorcode(vsource_frame_t *frame, unsigned int value);
+// region-of-interest (ROI) feature
+EXPORT int vsource_roi_config_load(vsource_roi_config_t *conf);
+EXPORT void vsource_frame_roi_reset(vsource_frame_t *frame);
+EXPORT int vsource_frame_add_roi(vsource_frame_t *frame, int type, int left, int top, int right, int bottom);
+EXPORT int vsource_frame_diff_roi(vsource_frame_t *frame, unsigned char *prevbuf, int prevstride);
+EXPORT void vsource_frame_copy_roi(vsource_frame_t *src, vsource_frame_t *dst);
+EXPORT int vsource_frame_roi_qpmap(vsource_frame_t *frame, vsource_roi_config_t *conf, float *qpmap, int mbw, int mbh);
 
 EXPORT int video_source_channels();
 EXPORT vsource_t * video_source(int channel);
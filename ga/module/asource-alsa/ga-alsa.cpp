@@ -20,6 +20,7 @@
 #include <sys/time.h>
 
 #include "ga-common.h"
+#include "asource.h"
 #include "ga-alsa.h"
 
 static snd_output_t *sndlog = NULL;
@@ -34,6 +35,7 @@ ga_alsa_set_param(struct ga_alsa_param *param) {
 	unsigned int period_time = 125000;	// = buffer_time/4;
 	int monotonic = 0;
 	snd_pcm_uframes_t start_threshold, stop_threshold;
+	snd_pcm_uframes_t period_size, buffer_size;
 	int err;
 	//
 	snd_pcm_hw_params_alloca(&hwparams);
@@ -62,15 +64,27 @@ ga_alsa_set_param(struct ga_alsa_param *param) {
 	if((double)param->samplerate*1.05 < rate || (double)param->samplerate*0.95 > rate) {
 		ga_error("ALSA: set_param/warning - inaccurate rate (req=%iHz, got=%iHz)\n", param->samplerate, rate);
 	}
-	//
-	period_time = buffer_time/4;
-	if((err = snd_pcm_hw_params_set_period_time_near(param->handle, hwparams, &period_time, 0)) < 0) {
-		ga_error("ALSA: set_param - set period time failed.\n");
-		return -1;
-	}
-	if((err = snd_pcm_hw_params_set_buffer_time_near(param->handle, hwparams, &buffer_time, 0)) < 0) {
-		ga_error("ALSA: set_param - set buffer time failed.\n");
-		return -1;
+	// low-delay codecs: one period per codec frame
+	if((period_size = audio_source_chunk_hint(rate)) > 0) {
+		buffer_size = period_size * 8;
+		if((err = snd_pcm_hw_params_set_period_size_near(param->handle, hwparams, &period_size, 0)) < 0) {
+			ga_error("ALSA: set_param - set period size failed.\n");
+			return -1;
+		}
+		if((err = snd_pcm_hw_params_set_buffer_size_near(param->handle, hwparams, &buffer_size)) < 0) {
+			ga_error("ALSA: set_param - set buffer size failed.\n");
+			return -1;
+		}
+	} else {
+		period_time = buffer_time/4;
+		if((err = snd_pcm_hw_params_set_period_time_near(param->handle, hwparams, &period_time, 0)) < 0) {
+			ga_error("ALSA: set_param - set period time failed.\n");
+			return -1;
+		}
+		if((err = snd_pcm_hw_params_set_buffer_time_near(param->handle, hwparams, &buffer_time, 0)) < 0) {
+			ga_error("ALSA: set_param - set buffer time failed.\n");
+			return -1;
+		}
 	}
 	//
 	monotonic = snd_pcm_hw_params_is_monotonic(hwparams);
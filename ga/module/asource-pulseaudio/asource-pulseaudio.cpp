@@ -18,8 +18,7 @@
 
 #include <stdio.h>
 #include <unistd.h>
-#include <pulse/simple.h>
-#include <pulse/error.h>
+#include <pulse/pulseaudio.h>
 
 #include "ga-common.h"
 #include "ga-conf.h"
@@ -31,20 +30,126 @@
 
 #define	PULSEAUDIO_CHUNKSIZE	1024
 #define AUDIOBUF_BUFSIZE	16384
+#define	LATENCY_REPORT_INTERVAL	10	/* seconds */
 
 static int asource_initialized = 0;
 static int asource_started = 0;
-static pthread_t asource_tid;
 
-static pa_simple	*pa_ctx = NULL;
+static pa_threaded_mainloop	*pa_mainloop = NULL;
+static pa_context	*pa_ctx = NULL;
+static pa_stream	*pa_strm = NULL;
 static pa_sample_spec	pa_spec;
+static int		pa_chunkbytes = PULSEAUDIO_CHUNKSIZE;
+static int		pa_framesize = 4;
+// capture latency statistics, updated in the mainloop thread
+static long long	lat_sum = 0;
+static int		lat_count = 0, lat_min = -1, lat_max = -1;
+static struct timeval	lat_reporttime;
+
+static void
+pa_context_state_cb(pa_context *c, void *userdata) {
+	switch(pa_context_get_state(c)) {
+	case PA_CONTEXT_READY:
+	case PA_CONTEXT_FAILED:
+	case PA_CONTEXT_TERMINATED:
+		pa_threaded_mainloop_signal(pa_mainloop, 0);
+		break;
+	default:
+		break;
+	}
+	return;
+}
+
+static void
+pa_stream_state_cb(pa_stream *s, void *userdata) {
+	switch(pa_stream_get_state(s)) {
+	case PA_STREAM_READY:
+	case PA_STREAM_FAILED:
+	case PA_STREAM_TERMINATED:
+		pa_threaded_mainloop_signal(pa_mainloop, 0);
+		break;
+	default:
+		break;
+	}
+	return;
+}
+
+/* sample the capture latency: time from the source to our read pointer */
+static void
+pa_latency_update(pa_stream *s) {
+	pa_usec_t usec;
+	int negative = 0, us;
+	struct timeval now;
+	if(pa_stream_get_latency(s, &usec, &negative) < 0)
+		return;
+	us = negative ? 0 : (int) usec;
+	audio_source_set_latency(us);
+	lat_sum += us;
+	lat_count++;
+	if(lat_min < 0 || us < lat_min)	lat_min = us;
+	if(us > lat_max)		lat_max = us;
+	gettimeofday(&now, NULL);
+	if(tvdiff_us(&now, &lat_reporttime) < LATENCY_REPORT_INTERVAL * 1000000LL)
+		return;
+	ga_error("audio source: pulseaudio capture latency avg=%lldus min=%dus max=%dus (%d samples)\n",
+		lat_sum / lat_count, lat_min, lat_max, lat_count);
+	lat_sum = lat_count = 0;
+	lat_min = lat_max = -1;
+	lat_reporttime = now;
+	return;
+}
+
+/* runs in the mainloop thread: move captured fragments straight into the audio ring */
+static void
+pa_stream_read_cb(pa_stream *s, size_t nbytes, void *userdata) {
+	const void *data;
+	while(pa_stream_readable_size(s) > 0) {
+		if(pa_stream_peek(s, &data, &nbytes) < 0) {
+			ga_error("audio source: pulseaudio peek failed - %s\n",
+				pa_strerror(pa_context_errno(pa_ctx)));
+			return;
+		}
+		if(nbytes == 0)
+			break;
+		// data == NULL: a hole in the stream, skip it
+		if(data != NULL && asource_started != 0)
+			audio_source_buffer_fill((const unsigned char*) data, nbytes / pa_framesize);
+		pa_stream_drop(s);
+	}
+	pa_latency_update(s);
+	return;
+}
+
+static int 
+asource_deinit(void *arg) {
+	if(pa_mainloop != NULL)
+		pa_threaded_mainloop_stop(pa_mainloop);
+	if(pa_strm != NULL) {
+		pa_stream_disconnect(pa_strm);
+		pa_stream_unref(pa_strm);
+	}
+	if(pa_ctx != NULL) {
+		pa_context_disconnect(pa_ctx);
+		pa_context_unref(pa_ctx);
+	}
+	if(pa_mainloop != NULL)
+		pa_threaded_mainloop_free(pa_mainloop);
+	pa_strm = NULL;
+	pa_ctx = NULL;
+	pa_mainloop = NULL;
+	asource_initialized = 0;
+	return 0;
+}
 
 static int
 asource_init(void *arg) {
-	int error;
+	int hint;
 	const char *dev = "auto_null.monitor";
 	char pa_devname[64];
 	pa_usec_t delay = 0;
+	pa_buffer_attr pa_attr;
+	pa_stream_state_t sstate;
+	pa_context_state_t cstate;
 	struct RTSPConf *rtspconf = rtspconf_global();
 	if(asource_initialized != 0)
 		return 0;
@@ -71,94 +176,123 @@ asource_init(void *arg) {
 	pa_spec.channels = rtspconf->audio_channels;
 	pa_spec.rate = rtspconf->audio_samplerate;
 	pa_spec.format = PA_SAMPLE_S16LE;
-	pa_ctx = pa_simple_new(NULL, "gaminganywhere-asource-pulseaudio",
-			PA_STREAM_RECORD, dev,
-			"gaminganywhere-record-stream", &pa_spec, NULL, NULL, &error);
-	if(pa_ctx == NULL) {
-		ga_error("audio source: pulseaudio initialization failed - %d:%s.\n",
-			error, pa_strerror(error));
+	pa_framesize = pa_spec.channels * 2;	// 2: bytes-per-sample
+	// low-delay codecs: read one codec frame at a time
+	pa_chunkbytes = PULSEAUDIO_CHUNKSIZE;
+	if((hint = audio_source_chunk_hint(pa_spec.rate)) > 0)
+		pa_chunkbytes = hint * pa_framesize;
+	pa_attr.maxlength = (uint32_t) -1;
+	pa_attr.tlength = (uint32_t) -1;
+	pa_attr.prebuf = (uint32_t) -1;
+	pa_attr.minreq = (uint32_t) -1;
+	pa_attr.fragsize = pa_chunkbytes;
+	// mainloop and context
+	if((pa_mainloop = pa_threaded_mainloop_new()) == NULL) {
+		ga_error("audio source: pulseaudio cannot create mainloop.\n");
 		return -1;
 	}
-
-	pa_simple_get_latency(pa_ctx, &error);
-	if(error) {
-		ga_error("audio source: pulseaudio unable to retrieve latency - %d:%s\n",
-			error, pa_strerror(error));
-	} else {
-		ga_error("audio source: pulseaudio latency = %dus\n", delay);
+	if((pa_ctx = pa_context_new(pa_threaded_mainloop_get_api(pa_mainloop),
+			"gaminganywhere-asource-pulseaudio")) == NULL) {
+		ga_error("audio source: pulseaudio cannot create context.\n");
+		goto init_failed;
+	}
+	pa_context_set_state_callback(pa_ctx, pa_context_state_cb, NULL);
+	if(pa_context_connect(pa_ctx, NULL, PA_CONTEXT_NOFLAGS, NULL) < 0) {
+		ga_error("audio source: pulseaudio connect failed - %s.\n",
+			pa_strerror(pa_context_errno(pa_ctx)));
+		goto init_failed;
+	}
+	pa_threaded_mainloop_lock(pa_mainloop);
+	if(pa_threaded_mainloop_start(pa_mainloop) < 0) {
+		pa_threaded_mainloop_unlock(pa_mainloop);
+		ga_error("audio source: pulseaudio cannot start mainloop.\n");
+		goto init_failed;
+	}
+	while((cstate = pa_context_get_state(pa_ctx)) != PA_CONTEXT_READY) {
+		if(!PA_CONTEXT_IS_GOOD(cstate)) {
+			pa_threaded_mainloop_unlock(pa_mainloop);
+			ga_error("audio source: pulseaudio initialization failed - %s.\n",
+				pa_strerror(pa_context_errno(pa_ctx)));
+			goto init_failed;
+		}
+		pa_threaded_mainloop_wait(pa_mainloop);
+	}
+	// record stream, corked until started
+	if((pa_strm = pa_stream_new(pa_ctx, "gaminganywhere-record-stream", &pa_spec, NULL)) == NULL) {
+		pa_threaded_mainloop_unlock(pa_mainloop);
+		ga_error("audio source: pulseaudio cannot create stream - %s.\n",
+			pa_strerror(pa_context_errno(pa_ctx)));
+		goto init_failed;
 	}
+	pa_stream_set_state_callback(pa_strm, pa_stream_state_cb, NULL);
+	pa_stream_set_read_callback(pa_strm, pa_stream_read_cb, NULL);
+	if(pa_stream_connect_record(pa_strm, dev, &pa_attr, (pa_stream_flags_t) (
+			PA_STREAM_ADJUST_LATENCY
+			| PA_STREAM_INTERPOLATE_TIMING
+			| PA_STREAM_AUTO_TIMING_UPDATE
+			| PA_STREAM_START_CORKED)) < 0) {
+		pa_threaded_mainloop_unlock(pa_mainloop);
+		ga_error("audio source: pulseaudio record failed - %s.\n",
+			pa_strerror(pa_context_errno(pa_ctx)));
+		goto init_failed;
+	}
+	while((sstate = pa_stream_get_state(pa_strm)) != PA_STREAM_READY) {
+		if(!PA_STREAM_IS_GOOD(sstate)) {
+			pa_threaded_mainloop_unlock(pa_mainloop);
+			ga_error("audio source: pulseaudio stream failed - %s.\n",
+				pa_strerror(pa_context_errno(pa_ctx)));
+			goto init_failed;
+		}
+		pa_threaded_mainloop_wait(pa_mainloop);
+	}
+	if(pa_stream_get_buffer_attr(pa_strm) != NULL)
+		pa_chunkbytes = pa_stream_get_buffer_attr(pa_strm)->fragsize;
+	gettimeofday(&lat_reporttime, NULL);
+	pa_threaded_mainloop_unlock(pa_mainloop);
 	
 	if(audio_source_setup(AUDIOBUF_BUFSIZE, pa_spec.rate, 16, pa_spec.channels) < 0) {
 		ga_error("audio source: setup failed.\n");
-		pa_simple_free(pa_ctx);
-		pa_ctx = NULL;
-		return -1;
+		goto init_failed;
 	}
 
 	asource_initialized = 1;
-	ga_error("audio source: setup chunk=%d, bufsize=%d, samplerate=%d, bits-per-sample=%d, channels=%d\n",
-		PULSEAUDIO_CHUNKSIZE,
+	ga_error("audio source: setup fragment=%d, bufsize=%d, samplerate=%d, bits-per-sample=%d, channels=%d\n",
+		pa_chunkbytes,
 		AUDIOBUF_BUFSIZE,
 		pa_spec.rate,
 		16,
 		pa_spec.channels);
 
 	return 0;
+init_failed:
+	asource_deinit(NULL);
+	return -1;
 }
 
-static void *
-asource_threadproc(void *arg) {
-	int error;
-	int framesize;
-	unsigned char *fbuffer = NULL;
-	//
-	if(asource_init(NULL) < 0) {
-		exit(-1);
-	}
-	if((fbuffer = (unsigned char*) malloc(PULSEAUDIO_CHUNKSIZE)) == NULL) {
-		ga_error("audio source: malloc failed (%d bytes) - %s\n",
-			PULSEAUDIO_CHUNKSIZE, strerror(errno));
-		exit(-1);
-	}
-	framesize = pa_spec.channels * 2;	// 2: bytes-per-sample
-	//
-	ga_error("audio source thread started: tid=%ld\n", ga_gettid());
-	//
-	while(asource_started != 0) {
-		if(pa_simple_read(pa_ctx, fbuffer, PULSEAUDIO_CHUNKSIZE, &error) < 0) {
-			ga_error("audio source: pulseaudio read failed (%d)\n", error);
-			break;
-		}
-		audio_source_buffer_fill(fbuffer, PULSEAUDIO_CHUNKSIZE/framesize);
-	}
-	//
-	if(fbuffer)
-		free(fbuffer);
-	ga_error("audio source: capture thread terminated.\n");
-	//
-	return NULL;
-}
-
-static int 
-asource_deinit(void *arg) {
-	if(pa_ctx != NULL)
-		pa_simple_free(pa_ctx);
-	pa_ctx = NULL;
-	asource_initialized = 0;
-	return 0;
+/* (un)cork the record stream */
+static int
+asource_cork(int cork) {
+	pa_operation *op;
+	pa_threaded_mainloop_lock(pa_mainloop);
+	if((op = pa_stream_cork(pa_strm, cork, NULL, NULL)) != NULL)
+		pa_operation_unref(op);
+	pa_threaded_mainloop_unlock(pa_mainloop);
+	return op != NULL ? 0 : -1;
 }
 
 static int
 asource_start(void *arg) {
 	if(asource_started != 0)
 		return 0;
+	if(asource_init(NULL) < 0)
+		return -1;
 	asource_started = 1;
-	if(pthread_create(&asource_tid, NULL, asource_threadproc, arg) != 0) {
+	if(asource_cork(0) < 0) {
 		asource_started = 0;
-		ga_error("audio source: create thread failed.\n");
+		ga_error("audio source: pulseaudio start capture failed.\n");
 		return -1;
 	}
-	pthread_detach(asource_tid);
+	ga_error("audio source: pulseaudio capture started.\n");
 	return 0;
 }
 
@@ -167,7 +301,7 @@ asource_stop(void *arg) {
 	if(asource_started == 0)
 		return 0;
 	asource_started = 0;
-	pthread_cancel(asource_tid);
+	asource_cork(1);
 	return 0;
 }
 
@@ -186,3 +320,4 @@ module_load() {
 }
 
 #endif	/* ENABLE_AUDIO */
+
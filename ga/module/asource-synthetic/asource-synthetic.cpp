@@ -0,0 +1,392 @@
+/*
+ * Copyright (c) 2013-2014 Chun-Ying Huang
+ *
+ * This file is part of GamingAnywhere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Synthetic audio source: generates a test signal (or replays a WAV/PCM
+ * file) at real-time pace, without any sound device. Useful for headless
+ * benchmarks of audio encoding and A/V synchronization.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ga-common.h"
+#include "ga-conf.h"
+#include "ga-thread.h"
+#include "ga-module.h"
+#include "rtspconf.h"
+#include "asource.h"
+
+#ifdef ENABLE_AUDIO
+
+#define	SYNTHETIC_CHUNK_MS	10
+#define	SYNTHETIC_CLICK_MS	5
+
+enum synthetic_signal {
+	SIGNAL_SINE = 0,
+	SIGNAL_SQUARE,
+	SIGNAL_NOISE,
+	SIGNAL_CLICK,
+	SIGNAL_SILENCE,
+	SIGNAL_FILE
+};
+
+static int asource_initialized = 0;
+static int asource_started = 0;
+static pthread_t asource_tid;
+
+static enum synthetic_signal signal_type = SIGNAL_SINE;
+static int samplerate = 0;
+static int channels = 0;
+static int bytespersample = 0;
+static int isfloat = 0;
+static int chunkframes = 0;
+static double frequency = 440.0;
+static double amplitude = 0.5;
+static int click_interval = 1000;	// ms
+static int drift_ppm = 0;
+static unsigned int noise_state = 0x12345678;
+// mmap'ed replay file
+static unsigned char *file_map = NULL;
+static size_t file_mapsize = 0;
+static const unsigned char *file_data = NULL;
+static long long file_frames = 0;
+
+/* parse a RIFF/WAVE header, returns -1 if data is not a WAV file */
+static int
+wav_parse(const unsigned char *buf, size_t size, int *fmt, int *ch, int *rate, int *bits,
+		const unsigned char **data, size_t *datasize) {
+	size_t off = 12;
+	int gotfmt = 0;
+	if(size < 12 || memcmp(buf, "RIFF", 4) != 0 || memcmp(buf+8, "WAVE", 4) != 0)
+		return -1;
+	while(off + 8 <= size) {
+		const unsigned char *ck = buf + off;
+		size_t cksize = ck[4] | (ck[5]<<8) | (ck[6]<<16) | ((size_t) ck[7]<<24);
+		if(memcmp(ck, "fmt ", 4) == 0 && cksize >= 16 && off + 8 + 16 <= size) {
+			*fmt = ck[8] | (ck[9]<<8);
+			*ch = ck[10] | (ck[11]<<8);
+			*rate = ck[12] | (ck[13]<<8) | (ck[14]<<16) | (ck[15]<<24);
+			*bits = ck[22] | (ck[23]<<8);
+			gotfmt = 1;
+		} else if(memcmp(ck, "data", 4) == 0 && gotfmt) {
+			*data = ck + 8;
+			*datasize = cksize;
+			if(off + 8 + cksize > size)
+				*datasize = size - off - 8;
+			return 0;
+		}
+		off += 8 + cksize + (cksize & 1);
+	}
+	return -1;
+}
+
+static int
+file_open(const char *filename) {
+	struct stat st;
+	size_t datasize;
+	int fd;
+	int fmt, ch, rate, bits;
+	//
+	if((fd = open(filename, O_RDONLY)) < 0) {
+		ga_error("audio source: cannot open %s - %s\n", filename, strerror(errno));
+		return -1;
+	}
+	if(fstat(fd, &st) < 0 || st.st_size <= 0) {
+		ga_error("audio source: cannot stat %s (or empty file)\n", filename);
+		close(fd);
+		return -1;
+	}
+	file_mapsize = st.st_size;
+	file_map = (unsigned char*) mmap(NULL, file_mapsize, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(file_map == MAP_FAILED) {
+		ga_error("audio source: mmap %s failed - %s\n", filename, strerror(errno));
+		file_map = NULL;
+		return -1;
+	}
+	madvise(file_map, file_mapsize, MADV_SEQUENTIAL);
+	//
+	if(wav_parse(file_map, file_mapsize, &fmt, &ch, &rate, &bits, &file_data, &datasize) == 0) {
+		// fmt: 1 = PCM, 3 = IEEE float
+		if(ch != channels || rate != samplerate
+		|| bits != bytespersample * 8 || fmt != (isfloat ? 3 : 1)) {
+			ga_error("audio source: %s is %dch@%dHz, %d bits (%s); %dch@%dHz, %d bits (%s) expected\n",
+				filename, ch, rate, bits, fmt == 3 ? "float" : "pcm",
+				channels, samplerate, bytespersample * 8, isfloat ? "float" : "pcm");
+			return -1;
+		}
+	} else {
+		// raw PCM in the device format
+		file_data = file_map;
+		datasize = file_mapsize;
+	}
+	if((file_frames = datasize / (channels * bytespersample)) <= 0) {
+		ga_error("audio source: %s has no audio frames\n", filename);
+		return -1;
+	}
+	ga_error("audio source: replay %s - %lld frames (%.3fs)\n",
+		filename, file_frames, 1.0 * file_frames / samplerate);
+	return 0;
+}
+
+static void
+file_close() {
+	if(file_map != NULL)
+		munmap(file_map, file_mapsize);
+	file_map = NULL;
+	file_data = NULL;
+	file_mapsize = 0;
+	file_frames = 0;
+	return;
+}
+
+/* store one sample in the device format */
+static inline unsigned char *
+sample_put(unsigned char *ptr, double v) {
+	if(v > 1.0)	v = 1.0;
+	if(v < -1.0)	v = -1.0;
+	if(isfloat) {
+		*((float*) ptr) = (float) v;
+	} else {
+		*((short*) ptr) = (short) (v * 32767.0);
+	}
+	return ptr + bytespersample;
+}
+
+/* generate frames [pos, pos+frames) of the signal */
+static void
+signal_generate(unsigned char *buf, long long pos, int frames) {
+	int i, j;
+	double v = 0.0;
+	long long clickperiod = 1LL * samplerate * click_interval / 1000;
+	long long clicklen = 1LL * samplerate * SYNTHETIC_CLICK_MS / 1000;
+	//
+	if(signal_type == SIGNAL_FILE) {
+		int framebytes = channels * bytespersample;
+		long long off = pos % file_frames;
+		while(frames > 0) {
+			int n = frames;
+			if(off + n > file_frames)
+				n = (int) (file_frames - off);
+			bcopy(file_data + off * framebytes, buf, n * framebytes);
+			buf += n * framebytes;
+			frames -= n;
+			off = 0;
+		}
+		return;
+	}
+	for(i = 0; i < frames; i++, pos++) {
+		double phase = fmod(frequency * pos / samplerate, 1.0);
+		switch(signal_type) {
+		case SIGNAL_SINE:
+			v = amplitude * sin(2.0 * M_PI * phase);
+			break;
+		case SIGNAL_SQUARE:
+			v = phase < 0.5 ? amplitude : -amplitude;
+			break;
+		case SIGNAL_NOISE:
+			// xorshift32: deterministic across runs
+			noise_state ^= noise_state << 13;
+			noise_state ^= noise_state >> 17;
+			noise_state ^= noise_state << 5;
+			v = amplitude * (2.0 * noise_state / 4294967295.0 - 1.0);
+			break;
+		case SIGNAL_CLICK:
+			// a short tone burst at the start of each interval
+			v = (pos % clickperiod) < clicklen ? amplitude * sin(2.0 * M_PI * phase) : 0.0;
+			break;
+		default:
+			v = 0.0;
+			break;
+		}
+		for(j = 0; j < channels; j++)
+			buf = sample_put(buf, v);
+	}
+	return;
+}
+
+static int
+asource_init(void *arg) {
+	struct RTSPConf *rtspconf = rtspconf_global();
+	char buf[256];
+	int hint, val;
+	if(asource_initialized != 0)
+		return 0;
+	//
+	if(rtspconf->audio_device_format == AV_SAMPLE_FMT_S16) {
+		bytespersample = 2;
+		isfloat = 0;
+	} else if(rtspconf->audio_device_format == AV_SAMPLE_FMT_FLT) {
+		bytespersample = 4;
+		isfloat = 1;
+	} else {
+		ga_error("audio source: unsupported audio format (%d).\n",
+			rtspconf->audio_device_format);
+		return -1;
+	}
+	samplerate = rtspconf->audio_samplerate;
+	channels = rtspconf->audio_channels;
+	if(samplerate <= 0 || channels <= 0) {
+		ga_error("audio source: invalid audio parameters (%dch@%dHz).\n", channels, samplerate);
+		return -1;
+	}
+	// signal
+	signal_type = SIGNAL_SINE;
+	if(ga_conf_readv("audio-synthetic-signal", buf, sizeof(buf)) != NULL) {
+		if(strcmp(buf, "sine") == 0)		signal_type = SIGNAL_SINE;
+		else if(strcmp(buf, "square") == 0)	signal_type = SIGNAL_SQUARE;
+		else if(strcmp(buf, "noise") == 0)	signal_type = SIGNAL_NOISE;
+		else if(strcmp(buf, "click") == 0)	signal_type = SIGNAL_CLICK;
+		else if(strcmp(buf, "silence") == 0)	signal_type = SIGNAL_SILENCE;
+		else if(strcmp(buf, "file") == 0)	signal_type = SIGNAL_FILE;
+		else {
+			ga_error("audio source: unknown synthetic signal '%s'.\n", buf);
+			return -1;
+		}
+	}
+	if((val = ga_conf_readint("audio-synthetic-frequency")) > 0)
+		frequency = val;
+	if(ga_conf_readv("audio-synthetic-amplitude", buf, sizeof(buf)) != NULL)
+		amplitude = ga_conf_readint("audio-synthetic-amplitude") / 100.0;
+	if((val = ga_conf_readint("audio-synthetic-click-interval")) > SYNTHETIC_CLICK_MS)
+		click_interval = val;
+	drift_ppm = ga_conf_readint("audio-synthetic-drift");
+	if(signal_type == SIGNAL_FILE) {
+		if(ga_conf_readv("audio-synthetic-file", buf, sizeof(buf)) == NULL) {
+			ga_error("audio source: audio-synthetic-file is not set.\n");
+			return -1;
+		}
+		if(file_open(buf) < 0) {
+			file_close();
+			return -1;
+		}
+	}
+	// one codec frame per chunk if the encoder asks for it
+	if((hint = audio_source_chunk_hint(samplerate)) > 0)
+		chunkframes = hint;
+	else
+		chunkframes = samplerate * SYNTHETIC_CHUNK_MS / 1000;
+	//
+	if(audio_source_setup(chunkframes, samplerate, bytespersample * 8, channels) < 0) {
+		ga_error("audio source: setup failed.\n");
+		file_close();
+		return -1;
+	}
+	asource_initialized = 1;
+	ga_error("audio source: synthetic signal=%d, chunk=%d frames, samplerate=%d, bits-per-sample=%d, channels=%d, drift=%dppm\n",
+		signal_type, chunkframes, samplerate, bytespersample * 8, channels, drift_ppm);
+	return 0;
+}
+
+static void *
+asource_threadproc(void *arg) {
+	unsigned char *fbuffer = NULL;
+	struct timeval tv0, tv;
+	long long produced = 0, due;
+	long long elapsed;
+	//
+	if(asource_init(NULL) < 0) {
+		exit(-1);
+	}
+	if((fbuffer = (unsigned char*) malloc(chunkframes * channels * bytespersample)) == NULL) {
+		ga_error("audio source: malloc failed (%d bytes) - %s\n",
+			chunkframes * channels * bytespersample, strerror(errno));
+		exit(-1);
+	}
+	//
+	ga_thread_role("asource", 0);
+	ga_error("audio source thread started: tid=%ld\n", ga_gettid());
+	//
+	gettimeofday(&tv0, NULL);
+	while(asource_started != 0) {
+		// frames due so far, running (1 + drift) times as fast as the wall clock
+		gettimeofday(&tv, NULL);
+		elapsed = tvdiff_us(&tv, &tv0);
+		due = (long long) (1.0 * elapsed * samplerate * (1000000.0 + drift_ppm) / 1e12);
+		while(produced + chunkframes <= due) {
+			signal_generate(fbuffer, produced, chunkframes);
+			audio_source_buffer_fill(fbuffer, chunkframes);
+			produced += chunkframes;
+		}
+		// sleep until the next chunk is due
+		elapsed = (long long) (1e12 * (produced + chunkframes) / samplerate / (1000000.0 + drift_ppm));
+		gettimeofday(&tv, NULL);
+		elapsed -= tvdiff_us(&tv, &tv0);
+		if(elapsed > 0)
+			usleep(elapsed);
+	}
+	//
+	free(fbuffer);
+	ga_error("audio source: synthetic thread terminated.\n");
+	//
+	return NULL;
+}
+
+static int
+asource_deinit(void *arg) {
+	file_close();
+	asource_initialized = 0;
+	return 0;
+}
+
+static int
+asource_start(void *arg) {
+	if(asource_started != 0)
+		return 0;
+	asource_started = 1;
+	if(pthread_create(&asource_tid, NULL, asource_threadproc, arg) != 0) {
+		asource_started = 0;
+		ga_error("audio source: create thread failed.\n");
+		return -1;
+	}
+	pthread_detach(asource_tid);
+	return 0;
+}
+
+static int
+asource_stop(void *arg) {
+	if(asource_started == 0)
+		return 0;
+	asource_started = 0;
+	pthread_cancel(asource_tid);
+	return 0;
+}
+
+ga_module_t *
+module_load() {
+	static ga_module_t m;
+	bzero(&m, sizeof(m));
+	m.type = GA_MODULE_TYPE_ASOURCE;
+	m.name = strdup("asource-synthetic");
+	m.init = asource_init;
+	m.start = asource_start;
+	m.stop = asource_stop;
+	m.deinit = asource_deinit;
+	return &m;
+}
+
+#endif	/* ENABLE_AUDIO */
+
@@ -20,6 +20,7 @@
 
 #include "ga-common.h"
 #include "ga-conf.h"
+#include "ga-thread.h"
 #include "rtspconf.h"
 #include "asource.h"
 #include "asource-system.h"
@@ -127,6 +128,7 @@ asource_threadproc(void *arg) {
 		exit(-1);
 	}
 	//
+	ga_thread_role("asource", 0);
 	ga_error("audio source thread started: tid=%ld\n", ga_gettid());
 	//
 	while(asource_started != 0) {
@@ -28,6 +28,7 @@
 
 #include "ga-common.h"
 #include "ga-conf.h"
+#include "ga-thread.h"
 #include "ga-avcodec.h"
 #include "ga-module.h"
 
@@ -142,8 +143,9 @@ aencoder_init(void *arg) {
 		}
 	} while(0);
 #endif
-	// need live format conversion?
-	if(rtspconf->audio_device_format != encoder->sample_fmt) {
+	// need live format conversion? identical formats are encoded in place
+	if(rtspconf->audio_device_format != encoder->sample_fmt
+	|| rtspconf->audio_device_channel_layout != encoder->channel_layout) {
 		if((swrctx = swr_alloc_set_opts(NULL, 
 				encoder->channel_layout,
 				encoder->sample_fmt,
@@ -197,203 +199,164 @@ init_failed:
 static void *
 aencoder_threadproc(void *arg) {
 	struct RTSPConf *rtspconf = rtspconf_global();
-	int r, frameunit;
+	int avail;
 	// input frame
 	AVFrame frame0, *snd_in = &frame0;
 	int got_packet;
 	// buffer used to store encoder outputs
 	unsigned char *buf = NULL;
 	int bufsize;
-	// buffer used to store captured data
+	// captured samples are encoded in place from the audio ring
 	unsigned char *samples = NULL;
-	int nsamples, samplebytes, maxsamples, samplesize;
-	int offset;
+	int samplesize;
 	// for a/v sync
-#ifdef WIN32
-	LARGE_INTEGER baseT, currT, freq;
-#else
-	struct timeval baseT, currT;
-#endif
+	encoder_aclock_t aclock;
 	struct timeval tv;
-	long long pts = -1LL, newpts = 0LL, ptsOffset = 0LL, ptsSync = 0LL;
+	long long pts = -1LL;
 	//
 	audio_buffer_t *ab = NULL;
 	int audio_written = 0;
 	int buffer_purged = 0;
 	//
-	nsamples = 0;
-	samplebytes = 0;
-	maxsamples = encoder->frame_size;
+	if(aencoder_initialized == 0 || encoder == NULL) {
+		ga_error("audio encoder: started without an initialized encoder, terminated.\n");
+		return NULL;
+	}
 	samplesize = encoder->frame_size * audio_source_channels() * audio_source_bitspersample() / 8;
 	//
 	encoder_pts_clear(rtp_id);
 	//
+	if(encoder->frame_size <= 0 || encoder->frame_size > AUDIO_SOURCE_PEEK_MAX) {
+		ga_error("audio encoder: unsupported frame size %d (max %d).\n",
+			encoder->frame_size, AUDIO_SOURCE_PEEK_MAX);
+		return NULL;
+	}
 	if((ab = audio_source_buffer_init()) == NULL) {
 		ga_error("audio encoder: cannot initialize audio source buffer.\n");
 		return NULL;
 	}
 	audio_source_client_register(ga_gettid(), ab);
 	//
-	if((samples = (unsigned char*) malloc(samplesize)) == NULL) {
-		ga_error("audio encoder: cannot allocate sample buffer (%d bytes), terminated.\n", samplesize);
-		goto audio_quit;
-	}
-	//
 	bufsize = samplesize;
 	if((buf = (unsigned char*) malloc(bufsize)) == NULL) {
 		ga_error("audio encoder: cannot allocate encoding buffer (%d bytes), terminated.\n", bufsize);
 		goto audio_quit;
 	}
 	//
-	frameunit = audio_source_channels() * audio_source_bitspersample() / 8;
-	//
 	bzero(snd_in, sizeof(*snd_in));
 	av_frame_unref(snd_in);
 	// start encoding
-	ga_error("audio encoding started: tid=%ld channels=%d, frames=%d (%d/%d bytes), chunk_size=%ld (%d bytes), delay=%d\n",
+	ga_thread_role("aencoder", 0);
+	ga_error("audio encoding started: tid=%ld channels=%d, frames=%d (%d/%d bytes), chunk_size=%ld (%d bytes), delay=%d, conversion=%s\n",
 		ga_gettid(),
 		encoder->channels, encoder->frame_size,
 		encoder->frame_size * encoder->channels * audio_source_bitspersample() / 8,
 		encoder_size,
 		audio_source_chunksize(),	//audio->chunk_size
 		audio_source_chunkbytes(),	//audio->chunk_bytes
-		encoder->delay);
+		encoder->delay,
+		swrctx != NULL ? "on" : "off");
 	//
-#ifdef WIN32
-	QueryPerformanceFrequency(&freq);
-#endif
+	encoder_aclock_init(&aclock, rtspconf->audio_samplerate);
 	//
 	while(aencoder_started != 0 && encoder_running() > 0) {
+		AVPacket pkt1, *pkt = &pkt1;
+		unsigned char *srcbuf;
+		int srcsize;
 		//
 		if(buffer_purged == 0) {
 			audio_source_buffer_purge(ab);
 			buffer_purged = 1;
 		}
-		// read audio frames
-		r = audio_source_buffer_read(ab, samples + samplebytes, maxsamples - nsamples);
-		gettimeofday(&tv, NULL);
-		if(r <= 0) {
-			usleep(1000);
+		// block until a whole codec frame has been captured
+		if((samples = audio_source_buffer_peek(ab, encoder->frame_size, &avail)) == NULL)
 			continue;
+		gettimeofday(&tv, NULL);
+		// the newest captured frame is (avail) frames after this one
+		pts = encoder_aclock_pts(&aclock, encoder->frame_size, avail);
+		// encode
+		av_init_packet(pkt);
+		snd_in->nb_samples = encoder->frame_size;
+		snd_in->format = encoder->sample_fmt;
+		snd_in->channel_layout = encoder->channel_layout;
+		//
+		srcbuf = samples;
+		srcsize = source_size;
+		//
+		if(swrctx != NULL) {
+			// format conversion: using libswresample/swr_convert
+			// assume source is always in packed (interleaved) format
+			srcplanes[0] = srcbuf;
+			srcplanes[1] = NULL;
+			swr_convert(swrctx, dstplanes, encoder->frame_size,
+					    srcplanes, encoder->frame_size);
+			srcbuf = convbuf;
+			srcsize = encoder_size;
 		}
-#ifdef WIN32
-		QueryPerformanceCounter(&currT);
-#else
-		gettimeofday(&currT, NULL);
-#endif
-		if(pts == -1LL) {
-			baseT = currT;
-			ptsSync = encoder_pts_sync(rtspconf->audio_samplerate);
-			pts = newpts = ptsSync;
-			ptsOffset = r;
-		} else {
-#ifdef WIN32
-			newpts = ptsSync + pcdiff_us(currT, baseT, freq) * rtspconf->audio_samplerate / 1000000LL;
-#else
-			newpts = ptsSync + tvdiff_us(&currT, &baseT) * rtspconf->audio_samplerate / 1000000LL;
-#endif
-			newpts -= r;
-			newpts -= ptsOffset;
+		//
+		if(avcodec_fill_audio_frame(snd_in, encoder->channels,
+				encoder->sample_fmt, srcbuf,
+				srcsize, 1/*no-alignment*/) < 0) {
+			// error
+			ga_error("DEBUG: avcodec_fill_audio_frame failed.\n");
 		}
+		snd_in->pts = pts;
+		encoder_pts_put(rtp_id, pts, &tv);
 		//
-		if(newpts > pts) {
-			pts = newpts;
+		pkt->data = buf;
+		pkt->size = bufsize;
+		got_packet = 0;
+		if(avcodec_encode_audio2(encoder, pkt, snd_in, &got_packet) != 0) {
+			ga_error("audio encoder: encoding failed, terminated\n");
+			goto audio_quit;
 		}
-		// encode
-		nsamples += r;
-		samplebytes += r*frameunit;
-		offset = 0;
-		while(nsamples >= encoder->frame_size) {
-			AVPacket pkt1, *pkt = &pkt1;
-			unsigned char *srcbuf;
-			int srcsize;
-			//
-			av_init_packet(pkt);
-			snd_in->nb_samples = encoder->frame_size;
-			snd_in->format = encoder->sample_fmt;
-			snd_in->channel_layout = encoder->channel_layout;
-			//
-			srcbuf = samples+offset;
-			srcsize = source_size;
-			//
-			if(swrctx != NULL) {
-				// format conversion: using libswresample/swr_convert
-				// assume source is always in packed (interleaved) format
-				srcplanes[0] = srcbuf;
-				srcplanes[1] = NULL;
-				swr_convert(swrctx, dstplanes, encoder->frame_size,
-						    srcplanes, encoder->frame_size);
-				srcbuf = convbuf;
-				srcsize = encoder_size;
-			}
-			//
-			if(avcodec_fill_audio_frame(snd_in, encoder->channels,
-					encoder->sample_fmt, srcbuf/*samples+offset*/,
-					srcsize/*encoder_size*/, 1/*no-alignment*/) < 0) {
-				// error
-				ga_error("DEBUG: avcodec_fill_audio_frame failed.\n");
-			}
-			snd_in->pts = pts;
-			encoder_pts_put(rtp_id, pts, &tv);
-			//
-			pkt->data = buf;
-			pkt->size = bufsize;
-			got_packet = 0;
-			if(avcodec_encode_audio2(encoder, pkt, snd_in, &got_packet) != 0) {
-				ga_error("audio encoder: encoding failed, terminated\n");
-				goto audio_quit;
-			}
-			if(got_packet == 0/* || encoder->coded_frame == NULL*/)
-				goto drop_audio_frame;
-			// pts rescale is done in encoder_send_packet
-			// XXX: some encoder does not produce pts ...
-			if(pkt->pts == (int64_t) AV_NOPTS_VALUE) {
-				pkt->pts = pts;
-			}
-			//
-#if 0			// XXX: not working since ffmpeg 2.0?
-			if(encoder->coded_frame->key_frame)
-				pkt->flags |= AV_PKT_FLAG_KEY;
+		// the encoder has copied the input: release it to the ring
+		if(audio_source_buffer_consume(ab, encoder->frame_size) < 0) {
+			// encoded from samples the capture thread was replacing
+			ga_error("audio encoder: input overwritten while encoding, packet dropped.\n");
+			if(got_packet)
+				av_free_packet(pkt);
+			continue;
+		}
+		if(got_packet == 0/* || encoder->coded_frame == NULL*/)
+			continue;
+		// pts rescale is done in encoder_send_packet
+		// XXX: some encoder does not produce pts ...
+		if(pkt->pts == (int64_t) AV_NOPTS_VALUE) {
+			pkt->pts = pts;
+		}
+		//
+#if 0		// XXX: not working since ffmpeg 2.0?
+		if(encoder->coded_frame->key_frame)
+			pkt->flags |= AV_PKT_FLAG_KEY;
 #endif
-			if(snd_in->extended_data && snd_in->extended_data != snd_in->data)
-				av_freep(snd_in->extended_data);
-			pkt->stream_index = 0;
-			//
-			if(encoder_ptv_get(rtp_id, pkt->pts, &tv, rtspconf->audio_samplerate) == NULL) {
-				gettimeofday(&tv, NULL);
-			}
-			// send the packet
-			if(encoder_send_packet("audio-encoder",
-				rtp_id/*rtspconf->audio_id*/, pkt,
-				/*encoder->coded_frame->*/pkt->pts == AV_NOPTS_VALUE ? pts : /*encoder->coded_frame->*/pkt->pts,
-				&tv) < 0) {
-				goto audio_quit;
-			}
-			//
-			if(audio_written == 0) {
-				audio_written = 1;
-				ga_error("first audio frame written (pts=%lld)\n", pts);
-			}
-drop_audio_frame:
-			nsamples -= encoder->frame_size;
-			offset += encoder->frame_size * frameunit;
-			pts += encoder->frame_size;
+		if(snd_in->extended_data && snd_in->extended_data != snd_in->data)
+			av_freep(snd_in->extended_data);
+		pkt->stream_index = 0;
+		//
+		if(encoder_ptv_get(rtp_id, pkt->pts, &tv, rtspconf->audio_samplerate) == NULL) {
+			gettimeofday(&tv, NULL);
 		}
-		// if something has been processed
-		if(offset > 0) {
-			if(samplebytes-offset > 0) {
-				bcopy(&samples[offset], samples, samplebytes-offset);
-			}
-			samplebytes -= offset;
+		// send the packet
+		if(encoder_send_packet("audio-encoder",
+			rtp_id/*rtspconf->audio_id*/, pkt,
+			/*encoder->coded_frame->*/pkt->pts == AV_NOPTS_VALUE ? pts : /*encoder->coded_frame->*/pkt->pts,
+			&tv) < 0) {
+			goto audio_quit;
+		}
+		//
+		if(audio_written == 0) {
+			audio_written = 1;
+			ga_error("first audio frame written (pts=%lld)\n", pts);
 		}
 	}
 audio_quit:
 	audio_source_client_unregister(ga_gettid());
 	audio_source_buffer_deinit(ab);
 	//
-	if(samples)	free(samples);
 	if(buf)		free(buf);
-	aencoder_deinit(NULL);
+	// the encoder is released by aencoder_deinit() after aencoder_stop(),
+	// or kept for the next session in warm-pool mode
 	ga_error("audio encoder: thread terminated (tid=%ld).\n", ga_gettid());
 	//
 	return NULL;
@@ -419,6 +382,8 @@ aencoder_stop(void *arg) {
 	if(aencoder_started == 0)
 		return 0;
 	aencoder_started = 0;
+	// release the encoder thread blocked on the audio ring
+	audio_source_buffer_wakeup();
 	//pthread_cancel(aencoder_tid);
 	pthread_join(aencoder_tid, &ignored);
 	return 0;
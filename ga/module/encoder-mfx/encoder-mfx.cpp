@@ -221,6 +221,8 @@ mfx_threadproc(void *arg) {
 		} else {
 			newpts = ptsSync + frame->imgpts - basePts;
 		}
+		if(cid == 0)
+			encoder_clock_report(ENCODER_CLOCK_VIDEO, newpts, rtspconf->video_fps);
 		//
 		if(fa_lock(NULL, svppin->Data.MemId, &svppin->Data) != MFX_ERR_NONE) {
 			ga_error("video encoder: Unable to lock VPP frame\n");
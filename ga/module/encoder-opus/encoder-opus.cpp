@@ -0,0 +1,341 @@
+/*
+ * Copyright (c) 2013-2014 Chun-Ying Huang
+ *
+ * This file is part of GamingAnywhere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+#include "vsource.h"	// for getting the current audio-id
+#include "asource.h"
+#include "rtspconf.h"
+#include "encoder-common.h"
+
+#include "ga-common.h"
+#include "ga-conf.h"
+#include "ga-thread.h"
+#include "ga-avcodec.h"
+#include "ga-module.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <opus/opus.h>
+#ifdef __cplusplus
+}
+#endif
+
+#define	OPUS_MAX_PACKET		1500	/**< Max encoded size of one Opus frame */
+
+static int aencoder_initialized = 0;
+static int aencoder_started = 0;
+static pthread_t aencoder_tid;
+
+// internal configuration
+static int rtp_id = -1;
+// for audio encoding
+static OpusEncoder *encoder = NULL;
+static int frame_size = 0;		/**< Samples per channel in an Opus frame */
+static int float_input = 0;		/**< Device format is float, otherwise s16 */
+static int fec = 0;
+// packet loss hint from client reports, applied by the encoder thread
+static pthread_mutex_t loss_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int loss_percent = -1;
+static int loss_applied = -1;
+
+static int
+aencoder_deinit(void *arg) {
+	if(aencoder_initialized == 0)
+		return 0;
+	if(encoder)	opus_encoder_destroy(encoder);
+	encoder = NULL;
+	frame_size = 0;
+	//
+	aencoder_initialized = 0;
+	ga_error("audio encoder: deinitialized.\n");
+	//
+	return 0;
+}
+
+/* Opus only accepts 2.5, 5, 10, 20, 40, or 60 ms frames; capture chunks
+ * are snapped the same way by audio_source_chunk_hint() */
+static int
+opus_frame_size(int samplerate, double ms) {
+	return (int) (samplerate * audio_source_frame_duration(ms) / 1000);
+}
+
+static int
+aencoder_init(void *arg) {
+	struct RTSPConf *rtspconf = rtspconf_global();
+	char buf[64];
+	int err, application, v;
+	double ms = 10;
+	//
+	rtp_id = video_source_channels();
+	if(aencoder_initialized != 0)
+		return 0;
+	if(rtspconf == NULL) {
+		ga_error("audio encoder: no valid global configuration available.\n");
+		return -1;
+	}
+	// input is the captured audio as-is
+	if(rtspconf->audio_device_format == AV_SAMPLE_FMT_S16) {
+		float_input = 0;
+	} else if(rtspconf->audio_device_format == AV_SAMPLE_FMT_FLT) {
+		float_input = 1;
+	} else {
+		ga_error("audio encoder: opus - unsupported device format %s.\n",
+			av_get_sample_fmt_name(rtspconf->audio_device_format));
+		return -1;
+	}
+	//
+	application = OPUS_APPLICATION_RESTRICTED_LOWDELAY;
+	if(ga_conf_readv("audio-opus-application", buf, sizeof(buf)) != NULL) {
+		if(strcmp(buf, "voip") == 0)
+			application = OPUS_APPLICATION_VOIP;
+		else if(strcmp(buf, "audio") == 0)
+			application = OPUS_APPLICATION_AUDIO;
+		else if(strcmp(buf, "restricted-lowdelay") != 0)
+			ga_error("audio encoder: opus - unknown application %s, use restricted-lowdelay.\n", buf);
+	}
+	if(ga_conf_readv("audio-frame-duration", buf, sizeof(buf)) != NULL)
+		ms = strtod(buf, NULL);
+	frame_size = opus_frame_size(rtspconf->audio_samplerate, ms);
+	//
+	encoder = opus_encoder_create(rtspconf->audio_samplerate,
+			rtspconf->audio_channels, application, &err);
+	if(encoder == NULL) {
+		ga_error("audio encoder: opus - create encoder failed: %s\n", opus_strerror(err));
+		goto init_failed;
+	}
+	opus_encoder_ctl(encoder, OPUS_SET_BITRATE(rtspconf->audio_bitrate));
+	if((v = ga_conf_readint("audio-opus-complexity")) > 0)
+		opus_encoder_ctl(encoder, OPUS_SET_COMPLEXITY(v));
+	// constrained VBR keeps packets close to the average size
+	opus_encoder_ctl(encoder, OPUS_SET_VBR(1));
+	opus_encoder_ctl(encoder, OPUS_SET_VBR_CONSTRAINT(1));
+	// in-band FEC is carried by SILK frames of 10 ms or longer:
+	// it has no effect in restricted-lowdelay (CELT-only) mode
+	fec = ga_conf_readbool("audio-opus-fec", 1);
+	opus_encoder_ctl(encoder, OPUS_SET_INBAND_FEC(fec));
+	if(fec && (application == OPUS_APPLICATION_RESTRICTED_LOWDELAY
+			|| frame_size * 1000 < rtspconf->audio_samplerate * 10)) {
+		ga_error("audio encoder: opus - warning, in-band FEC needs voip/audio application and >= 10ms frames.\n");
+	}
+	loss_applied = ga_conf_readint("audio-opus-packet-loss");
+	opus_encoder_ctl(encoder, OPUS_SET_PACKET_LOSS_PERC(loss_applied));
+	pthread_mutex_lock(&loss_mutex);
+	loss_percent = loss_applied;
+	pthread_mutex_unlock(&loss_mutex);
+	//
+	aencoder_initialized = 1;
+	ga_error("audio encoder: initialized. %s; application=%d; frame=%d samples (%.1fms); bitrate=%d; fec=%d; packet-loss=%d%%\n",
+		opus_get_version_string(), application,
+		frame_size, 1000.0 * frame_size / rtspconf->audio_samplerate,
+		rtspconf->audio_bitrate, fec, loss_applied);
+	//
+	return 0;
+init_failed:
+	aencoder_deinit(NULL);
+	return -1;
+}
+
+/* apply the latest loss hint: encoder ctls are not thread-safe */
+static void
+aencoder_update_loss() {
+	int percent;
+	pthread_mutex_lock(&loss_mutex);
+	percent = loss_percent;
+	pthread_mutex_unlock(&loss_mutex);
+	if(percent == loss_applied)
+		return;
+	opus_encoder_ctl(encoder, OPUS_SET_PACKET_LOSS_PERC(percent));
+	ga_error("audio encoder: opus - packet loss hint %d%% -> %d%%\n", loss_applied, percent);
+	loss_applied = percent;
+	return;
+}
+
+static void *
+aencoder_threadproc(void *arg) {
+	struct RTSPConf *rtspconf = rtspconf_global();
+	int avail, size;
+	// buffer used to store encoder outputs
+	unsigned char buf[OPUS_MAX_PACKET];
+	// captured samples are encoded in place from the audio ring
+	unsigned char *samples = NULL;
+	// for a/v sync
+	encoder_aclock_t aclock;
+	struct timeval tv;
+	long long pts = -1LL;
+	//
+	audio_buffer_t *ab = NULL;
+	int audio_written = 0;
+	int buffer_purged = 0;
+	//
+	if(aencoder_initialized == 0 || encoder == NULL) {
+		ga_error("audio encoder: started without an initialized encoder, terminated.\n");
+		return NULL;
+	}
+	encoder_pts_clear(rtp_id);
+	//
+	if((ab = audio_source_buffer_init()) == NULL) {
+		ga_error("audio encoder: cannot initialize audio source buffer.\n");
+		return NULL;
+	}
+	audio_source_client_register(ga_gettid(), ab);
+	// start encoding
+	ga_thread_role("aencoder", 0);
+	ga_error("audio encoding started: tid=%ld channels=%d, frames=%d, chunk_size=%d (%d bytes)\n",
+		ga_gettid(),
+		rtspconf->audio_channels, frame_size,
+		audio_source_chunksize(),
+		audio_source_chunkbytes());
+	//
+	encoder_aclock_init(&aclock, rtspconf->audio_samplerate);
+	//
+	while(aencoder_started != 0 && encoder_running() > 0) {
+		AVPacket pkt;
+		//
+		if(buffer_purged == 0) {
+			audio_source_buffer_purge(ab);
+			buffer_purged = 1;
+		}
+		// block until a whole opus frame has been captured
+		if((samples = audio_source_buffer_peek(ab, frame_size, &avail)) == NULL)
+			continue;
+		gettimeofday(&tv, NULL);
+		// the newest captured frame is (avail) frames after this one
+		pts = encoder_aclock_pts(&aclock, frame_size, avail);
+		// encode
+		aencoder_update_loss();
+		if(float_input) {
+			size = opus_encode_float(encoder, (const float*) samples, frame_size, buf, sizeof(buf));
+		} else {
+			size = opus_encode(encoder, (const opus_int16*) samples, frame_size, buf, sizeof(buf));
+		}
+		if(size < 0) {
+			ga_error("audio encoder: encoding failed, terminated: %s\n", opus_strerror(size));
+			break;
+		}
+		if(audio_source_buffer_consume(ab, frame_size) < 0) {
+			// encoded from samples the capture thread was replacing
+			ga_error("audio encoder: input overwritten while encoding, packet dropped.\n");
+			continue;
+		}
+		encoder_pts_put(rtp_id, pts, &tv);
+		// DTX: nothing to send
+		if(size <= 2)
+			continue;
+		//
+		av_init_packet(&pkt);
+		pkt.data = buf;
+		pkt.size = size;
+		pkt.pts = pts;
+		pkt.stream_index = 0;
+		if(encoder_ptv_get(rtp_id, pkt.pts, &tv, rtspconf->audio_samplerate) == NULL) {
+			gettimeofday(&tv, NULL);
+		}
+		// send the packet
+		if(encoder_send_packet("audio-encoder",
+			rtp_id/*rtspconf->audio_id*/, &pkt, pkt.pts, &tv) < 0) {
+			break;
+		}
+		//
+		if(audio_written == 0) {
+			audio_written = 1;
+			ga_error("first audio frame written (pts=%lld)\n", pts);
+		}
+	}
+	//
+	audio_source_client_unregister(ga_gettid());
+	audio_source_buffer_deinit(ab);
+	// the encoder is released by aencoder_deinit() after aencoder_stop(),
+	// or kept for the next session in warm-pool mode
+	ga_error("audio encoder: thread terminated (tid=%ld).\n", ga_gettid());
+	//
+	return NULL;
+}
+
+static int
+aencoder_start(void *arg) {
+	if(aencoder_started != 0)
+		return 0;
+	aencoder_started = 1;
+	if(pthread_create(&aencoder_tid, NULL, aencoder_threadproc, arg) != 0) {
+		aencoder_started = 0;
+		ga_error("audio source: create thread failed.\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int
+aencoder_stop(void *arg) {
+	void *ignored;
+	if(aencoder_started == 0)
+		return 0;
+	aencoder_started = 0;
+	// release the encoder thread blocked on the audio ring
+	audio_source_buffer_wakeup();
+	pthread_join(aencoder_tid, &ignored);
+	return 0;
+}
+
+static int
+aencoder_ioctl(int command, int argsize, void *arg) {
+	int ret = 0;
+	ga_ioctl_packetloss_t *loss = (ga_ioctl_packetloss_t*) arg;
+	//
+	if(aencoder_initialized == 0)
+		return GA_IOCTL_ERR_NOTINITIALIZED;
+	//
+	switch(command) {
+	case GA_IOCTL_PACKETLOSS:
+		if(argsize != sizeof(ga_ioctl_packetloss_t))
+			return GA_IOCTL_ERR_INVALID_ARGUMENT;
+		pthread_mutex_lock(&loss_mutex);
+		loss_percent = loss->percent < 0 ? 0 : (loss->percent > 100 ? 100 : loss->percent);
+		pthread_mutex_unlock(&loss_mutex);
+		break;
+	default:
+		ret = GA_IOCTL_ERR_NOTSUPPORTED;
+		break;
+	}
+	return ret;
+}
+
+ga_module_t *
+module_load() {
+	static ga_module_t m;
+	char mime[64];
+	bzero(&m, sizeof(m));
+	m.type = GA_MODULE_TYPE_AENCODER;
+	m.name = strdup("opus-audio-encoder");
+	if(ga_conf_readv("audio-mimetype", mime, sizeof(mime)) != NULL) {
+		m.mimetype = strdup(mime);
+	} else {
+		m.mimetype = strdup("audio/OPUS");
+	}
+	m.init = aencoder_init;
+	m.start = aencoder_start;
+	m.stop = aencoder_stop;
+	m.deinit = aencoder_deinit;
+	m.ioctl = aencoder_ioctl;
+	return &m;
+}
+
@@ -25,6 +25,7 @@
 #include "ga-common.h"
 #include "ga-avcodec.h"
 #include "ga-conf.h"
+#include "ga-thread.h"
 #include "ga-module.h"
 
 #include "dpipe.h"
@@ -32,6 +33,11 @@
 //// Prevent use of GLOBAL_HEADER to pass parameters, disabled by default
 //#define STANDALONE_SDP	1
 
+//// Region-of-interest side data requires ffmpeg 4.2 or later
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(56, 31, 100)
+#define	HAVE_AV_ROI	1
+#endif
+
 static struct RTSPConf *rtspconf = NULL;
 
 static int vencoder_initialized = 0;
@@ -42,6 +48,10 @@ static AVCodecContext *vencoder[VIDEO_SOURCE_CHANNEL_MAX];
 // Mutex for reconfiguration settings
 static pthread_mutex_t vencoder_reconf_mutex[VIDEO_SOURCE_CHANNEL_MAX];
 static ga_ioctl_reconfigure_t vencoder_reconf[VIDEO_SOURCE_CHANNEL_MAX];
+// pending keyframe requests, protected by vencoder_reconf_mutex
+static int vencoder_forceidr[VIDEO_SOURCE_CHANNEL_MAX];
+// last encoder pts: kept across restarts of a warm encoder
+static long long vencoder_lastpts[VIDEO_SOURCE_CHANNEL_MAX];
 #ifdef STANDALONE_SDP
 //// encoders for generating SDP
 /* separate encoder and encoder_sdp because some ffmpeg codecs
@@ -58,6 +68,9 @@ static int _ppslen[VIDEO_SOURCE_CHANNEL_MAX];
 static char *_vps[VIDEO_SOURCE_CHANNEL_MAX];
 static int _vpslen[VIDEO_SOURCE_CHANNEL_MAX];
 
+// region-of-interest quantization
+static vsource_roi_config_t roiconf;
+
 static int
 vencoder_deinit(void *arg) {
 	int iid;
@@ -100,6 +113,13 @@ vencoder_init(void *arg) {
 	if(vencoder_initialized != 0)
 		return 0;
 	//
+	if(vsource_roi_config_load(&roiconf) > 0) {
+#ifndef HAVE_AV_ROI
+		ga_error("video encoder: ROI is not supported by this ffmpeg version, disabled.\n");
+		roiconf.enabled = 0;
+#endif
+	}
+	//
 	for(iid = 0; iid < video_source_channels(); iid++) {
 		char pipename[64];
 		int outputW, outputH;
@@ -109,6 +129,8 @@ vencoder_init(void *arg) {
 		_spslen[iid] = _ppslen[iid] = 0;
 		pthread_mutex_init(&vencoder_reconf_mutex[iid], NULL);
 		vencoder_reconf[iid].id = -1;
+		vencoder_forceidr[iid] = 0;
+		vencoder_lastpts[iid] = -1LL;
 		snprintf(pipename, sizeof(pipename), pipefmt, iid);
 		outputW = video_source_out_width(iid);
 		outputH = video_source_out_height(iid);
@@ -215,6 +237,72 @@ vencoder_reconfigure(int iid) {
 	return ret;
 }
 
+#ifdef HAVE_AV_ROI
+/* fill an AVRegionOfInterest: qoffset is scaled by the codec's QP range */
+static void
+vencoder_set_roi(AVRegionOfInterest *roi, int left, int top, int right, int bottom, float qp) {
+	if(qp > 51)	qp = 51;
+	if(qp < -51)	qp = -51;
+	roi->self_size = sizeof(AVRegionOfInterest);
+	roi->left = left;
+	roi->top = top;
+	roi->right = right;
+	roi->bottom = bottom;
+	roi->qoffset = av_make_q((int) (qp * 100), 5100);
+	return;
+}
+
+/* attach ROI side data to pic_in: the first region takes precedence */
+static int
+vencoder_attach_roi(AVFrame *pic, vsource_frame_t *frame) {
+	int i, n = 0, r = roiconf.cursor_radius;
+	AVFrameSideData *sd;
+	AVRegionOfInterest *roi;
+	//
+	av_frame_remove_side_data(pic, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+	if(roiconf.enabled == 0)
+		return 0;
+	if(frame->nroi == 0 && frame->cursor_x < 0)
+		return 0;
+	sd = av_frame_new_side_data(pic, AV_FRAME_DATA_REGIONS_OF_INTEREST,
+			sizeof(AVRegionOfInterest) * (frame->nroi + 2));
+	if(sd == NULL)
+		return -1;
+	roi = (AVRegionOfInterest*) sd->data;
+	if(frame->cursor_x >= 0 && frame->cursor_y >= 0) {
+		vencoder_set_roi(&roi[n++],
+			frame->cursor_x - r < 0 ? 0 : frame->cursor_x - r,
+			frame->cursor_y - r < 0 ? 0 : frame->cursor_y - r,
+			frame->cursor_x + r, frame->cursor_y + r,
+			roiconf.qp_cursor);
+	}
+	for(i = 0; i < frame->nroi; i++) {
+		if(frame->roi[i].type != VSOURCE_ROI_STATIC)
+			continue;
+		vencoder_set_roi(&roi[n++], frame->roi[i].left, frame->roi[i].top,
+			frame->roi[i].right, frame->roi[i].bottom, roiconf.qp_static);
+	}
+	for(i = 0; i < frame->nroi; i++) {
+		if(frame->roi[i].type != VSOURCE_ROI_DIRTY)
+			continue;
+		vencoder_set_roi(&roi[n++], frame->roi[i].left, frame->roi[i].top,
+			frame->roi[i].right, frame->roi[i].bottom, roiconf.qp_dirty);
+	}
+	vencoder_set_roi(&roi[n++], 0, 0, pic->width, pic->height, roiconf.qp_idle);
+	return n;
+}
+#endif
+
+static int
+vencoder_keyframe_requested(int iid) {
+	int ret;
+	pthread_mutex_lock(&vencoder_reconf_mutex[iid]);
+	ret = vencoder_forceidr[iid];
+	vencoder_forceidr[iid] = 0;
+	pthread_mutex_unlock(&vencoder_reconf_mutex[iid]);
+	return ret;
+}
+
 static void *
 vencoder_threadproc(void *arg) {
 	// arg is pointer to source pipename
@@ -245,6 +333,7 @@ vencoder_threadproc(void *arg) {
 	// init variables
 	iid = pipe->channel_id;
 	encoder = vencoder[iid];
+	pts = vencoder_lastpts[iid];
 	//
 	outputW = video_source_out_width(iid);
 	outputH = video_source_out_height(iid);
@@ -274,6 +363,7 @@ vencoder_threadproc(void *arg) {
 			AV_PIX_FMT_YUV420P, outputW, outputH);
 	//ga_error("video encoder: linesize = %d|%d|%d\n", pic_in->linesize[0], pic_in->linesize[1], pic_in->linesize[2]);
 	// start encoding
+	ga_thread_role("vencoder", iid);
 	ga_error("video encoding started: tid=%ld %dx%d@%dfps, nalbuf_size=%d, pic_in_size=%d.\n",
 		ga_gettid(),
 		outputW, outputH, rtspconf->video_fps,
@@ -284,8 +374,9 @@ vencoder_threadproc(void *arg) {
 		vencoder_reconfigure(iid);
 		AVPacket pkt;
 		int got_packet = 0;
+		int backlog;
 		// wait for notification
-		struct timeval tv;
+		struct timeval tv, encstart, encend;
 		struct timespec to;
 		gettimeofday(&tv, NULL);
 		to.tv_sec = tv.tv_sec+1;
@@ -295,6 +386,9 @@ vencoder_threadproc(void *arg) {
 			ga_error("viedo encoder: image source timed out.\n");
 			continue;
 		}
+		// frames still queued behind this one
+		backlog = pipe->out_count;
+		gettimeofday(&encstart, NULL);
 		frame = (vsource_frame_t*) data->pointer;
 		// handle pts
 		if(basePts == -1LL) {
@@ -304,6 +398,8 @@ vencoder_threadproc(void *arg) {
 		} else {
 			newpts = ptsSync + frame->imgpts - basePts;
 		}
+		if(iid == 0)
+			encoder_clock_report(ENCODER_CLOCK_VIDEO, newpts, rtspconf->video_fps);
 		// XXX: assume always YUV420P
 		if(pic_in->linesize[0] == frame->linesize[0]
 		&& pic_in->linesize[1] == frame->linesize[1]
@@ -317,6 +413,9 @@ vencoder_threadproc(void *arg) {
 			goto video_quit;
 		}
 		tv = frame->timestamp;
+#ifdef HAVE_AV_ROI
+		vencoder_attach_roi(pic_in, frame);
+#endif
 		dpipe_put(pipe, data);
 		// pts must be monotonically increasing
 		if(newpts > pts) {
@@ -324,9 +423,17 @@ vencoder_threadproc(void *arg) {
 		} else {
 			pts++;
 		}
+		vencoder_lastpts[iid] = pts;
 		// encode
 		encoder_pts_put(iid, pts, &tv);
 		pic_in->pts = pts;
+		if(vencoder_keyframe_requested(iid)) {
+			pic_in->pict_type = AV_PICTURE_TYPE_I;
+			pic_in->key_frame = 1;
+		} else {
+			pic_in->pict_type = AV_PICTURE_TYPE_NONE;
+			pic_in->key_frame = 0;
+		}
 		av_init_packet(&pkt);
 		pkt.data = nalbuf_a;
 		pkt.size = nalbuf_size;
@@ -334,6 +441,8 @@ vencoder_threadproc(void *arg) {
 			ga_error("video encoder: encode failed, terminated.\n");
 			goto video_quit;
 		}
+		gettimeofday(&encend, NULL);
+		encoder_governor_report(iid, (int) tvdiff_us(&encend, &encstart), backlog);
 		if(got_packet) {
 			if(pkt.pts == (int64_t) AV_NOPTS_VALUE) {
 				pkt.pts = pts;
@@ -389,6 +498,9 @@ video_quit:
 	}
 	//
 	if(pic_in_buf)	av_free(pic_in_buf);
+#ifdef HAVE_AV_ROI
+	if(pic_in)	av_frame_remove_side_data(pic_in, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+#endif
 	if(pic_in)	av_free(pic_in);
 	if(nalbuf)	free(nalbuf);
 	//
@@ -579,6 +691,19 @@ vencoder_ioctl(int command, int argsize, void *arg) {
 		bcopy(arg, &vencoder_reconf[((ga_ioctl_reconfigure_t *) arg)->id], sizeof(ga_ioctl_reconfigure_t));
 		pthread_mutex_unlock(&vencoder_reconf_mutex[((ga_ioctl_reconfigure_t *) arg)->id]);
 		return ret; // 0
+	case GA_IOCTL_REQUEST_KEYFRAME:
+		if(argsize != sizeof(ga_ioctl_keyframe_t))
+			return GA_IOCTL_ERR_INVALID_ARGUMENT;
+		if(vencoder_initialized == 0)
+			return GA_IOCTL_ERR_NOTINITIALIZED;
+		if(((ga_ioctl_keyframe_t*) arg)->id < 0
+		|| ((ga_ioctl_keyframe_t*) arg)->id >= video_source_channels())
+			return GA_IOCTL_ERR_BADID;
+		// no simulcast renditions: any rendition maps to the only one
+		pthread_mutex_lock(&vencoder_reconf_mutex[((ga_ioctl_keyframe_t*) arg)->id]);
+		vencoder_forceidr[((ga_ioctl_keyframe_t*) arg)->id] = 1;
+		pthread_mutex_unlock(&vencoder_reconf_mutex[((ga_ioctl_keyframe_t*) arg)->id]);
+		return ret; // 0
 	case GA_IOCTL_GETSPS:
 	case GA_IOCTL_GETPPS:
 	case GA_IOCTL_GETVPS:
@@ -173,6 +173,8 @@ vencoder_threadproc(void *arg) {
 		} else {
 			newpts = ptsSync + frame->imgpts - basePts;
 		}
+		if(cid == 0)
+			encoder_clock_report(ENCODER_CLOCK_VIDEO, newpts, rtspconf->video_fps);
 		// encode!
 		gettimeofday(&pkttv, NULL);
 		enc = vpu_encoder_encode(&vpu[cid], frame->imgbuf, vpu[cid].vpu_framesize, &encsize);
@@ -0,0 +1,640 @@
+/*
+ * Copyright (c) 2013-2014 Chun-Ying Huang
+ *
+ * This file is part of GamingAnywhere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+
+#include "vsource.h"
+#include "rtspconf.h"
+#include "encoder-common.h"
+
+#include "ga-common.h"
+#include "ga-avcodec.h"
+#include "ga-conf.h"
+#include "ga-thread.h"
+#include "ga-module.h"
+
+#include "dpipe.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <vpx/vpx_encoder.h>
+#include <vpx/vp8cx.h>
+#ifdef __cplusplus
+}
+#endif
+
+#define	VPX_TEMPORAL_LAYERS_MAX	3
+
+static struct RTSPConf *rtspconf = NULL;
+
+static int vencoder_initialized = 0;
+static int vencoder_started = 0;
+static pthread_t vencoder_tid[VIDEO_SOURCE_CHANNEL_MAX];
+static pthread_mutex_t vencoder_reconf_mutex[VIDEO_SOURCE_CHANNEL_MAX];
+static ga_ioctl_reconfigure_t vencoder_reconf[VIDEO_SOURCE_CHANNEL_MAX];
+// pending keyframe requests, protected by vencoder_reconf_mutex
+static int vencoder_forceidr[VIDEO_SOURCE_CHANNEL_MAX];
+//// encoders for encoding
+static int vp9 = 0;			/**< Use VP9, otherwise VP8 */
+static unsigned long deadline = VPX_DL_REALTIME;
+static vpx_codec_ctx_t vencoder[VIDEO_SOURCE_CHANNEL_MAX];
+static vpx_codec_enc_cfg_t vencoder_cfg[VIDEO_SOURCE_CHANNEL_MAX];
+static int vencoder_opened[VIDEO_SOURCE_CHANNEL_MAX];
+// encoder pts: kept across restarts of a warm encoder
+static int64_t vencoder_pts[VIDEO_SOURCE_CHANNEL_MAX];
+
+// temporal layers: reference and update patterns
+static int tl_layers = 1;
+static int tl_periodicity = 1;
+static int tl_layer_id[4];
+static vpx_enc_frame_flags_t tl_flags[4];
+
+static int
+vencoder_deinit(void *arg) {
+	int iid;
+	for(iid = 0; iid < video_source_channels(); iid++) {
+		if(vencoder_opened[iid] != 0)
+			vpx_codec_destroy(&vencoder[iid]);
+		vencoder_opened[iid] = 0;
+		pthread_mutex_destroy(&vencoder_reconf_mutex[iid]);
+	}
+	vencoder_initialized = 0;
+	ga_error("video encoder: deinitialized.\n");
+	return 0;
+}
+
+/* temporal-layer patterns, refer to libvpx's vpx_temporal_svc_encoder.c:
+ * - layer 0 references and updates LAST only,
+ * - layer 1 references LAST and updates GOLDEN,
+ * - layer 2 references LAST and GOLDEN and updates nothing,
+ * so dropping the upper layers never breaks the lower ones. */
+static void
+vpx_temporal_layers_setup(vpx_codec_enc_cfg_t *cfg, int layers) {
+	const vpx_enc_frame_flags_t tl0 =
+		VP8_EFLAG_NO_REF_GF | VP8_EFLAG_NO_REF_ARF |
+		VP8_EFLAG_NO_UPD_GF | VP8_EFLAG_NO_UPD_ARF;
+	const vpx_enc_frame_flags_t tl1 =
+		VP8_EFLAG_NO_REF_GF | VP8_EFLAG_NO_REF_ARF |
+		VP8_EFLAG_NO_UPD_LAST | VP8_EFLAG_NO_UPD_ARF;
+	const vpx_enc_frame_flags_t tl2 =
+		VP8_EFLAG_NO_REF_ARF |
+		VP8_EFLAG_NO_UPD_LAST | VP8_EFLAG_NO_UPD_GF | VP8_EFLAG_NO_UPD_ARF |
+		VP8_EFLAG_NO_UPD_ENTROPY;
+	//
+	tl_layers = layers;
+	if(layers == 2) {
+		tl_periodicity = 2;
+		tl_layer_id[0] = 0;	tl_flags[0] = tl0;
+		tl_layer_id[1] = 1;	tl_flags[1] = tl1;
+		cfg->ts_rate_decimator[0] = 2;
+		cfg->ts_rate_decimator[1] = 1;
+	} else if(layers == 3) {
+		tl_periodicity = 4;
+		tl_layer_id[0] = 0;	tl_flags[0] = tl0;
+		tl_layer_id[1] = 2;	tl_flags[1] = tl2;
+		tl_layer_id[2] = 1;	tl_flags[2] = tl1;
+		tl_layer_id[3] = 2;	tl_flags[3] = tl2;
+		cfg->ts_rate_decimator[0] = 4;
+		cfg->ts_rate_decimator[1] = 2;
+		cfg->ts_rate_decimator[2] = 1;
+	} else {
+		tl_layers = 1;
+		tl_periodicity = 1;
+		tl_layer_id[0] = 0;	tl_flags[0] = 0;
+		cfg->ts_rate_decimator[0] = 1;
+	}
+	cfg->ts_number_layers = tl_layers;
+	cfg->ts_periodicity = tl_periodicity;
+	for(int i = 0; i < tl_periodicity; i++)
+		cfg->ts_layer_id[i] = tl_layer_id[i];
+	return;
+}
+
+/* split the target bitrate among temporal layers (cumulative values) */
+static void
+vpx_temporal_layers_bitrate(vpx_codec_enc_cfg_t *cfg) {
+	static const int share[VPX_TEMPORAL_LAYERS_MAX+1][VPX_TEMPORAL_LAYERS_MAX] = {
+		{ 100, 0, 0 }, { 100, 0, 0 }, { 60, 100, 0 }, { 40, 60, 100 } };
+	for(int i = 0; i < tl_layers; i++)
+		cfg->ts_target_bitrate[i] = cfg->rc_target_bitrate * share[tl_layers][i] / 100;
+	return;
+}
+
+static int
+vencoder_open(int iid, int outputW, int outputH) {
+	vpx_codec_iface_t *iface = vp9 ? vpx_codec_vp9_cx() : vpx_codec_vp8_cx();
+	vpx_codec_enc_cfg_t *cfg = &vencoder_cfg[iid];
+	vpx_codec_ctx_t *ctx = &vencoder[iid];
+	char tmpbuf[64];
+	int v, layers;
+	//
+	if(vpx_codec_enc_config_default(iface, cfg, 0) != VPX_CODEC_OK) {
+		ga_error("video encoder: vpx - get default config failed.\n");
+		return -1;
+	}
+	cfg->g_w = outputW;
+	cfg->g_h = outputH;
+	cfg->g_timebase.num = 1;
+	cfg->g_timebase.den = rtspconf->video_fps;
+	cfg->g_pass = VPX_RC_ONE_PASS;
+	cfg->g_lag_in_frames = 0;	// no look-ahead for real-time
+	cfg->rc_end_usage = VPX_CBR;
+	cfg->rc_dropframe_thresh = 0;
+	cfg->rc_resize_allowed = 0;
+	cfg->kf_mode = VPX_KF_AUTO;
+	// generic options, names are compatible with encoder-video
+	if((v = ga_conf_mapreadint("video-specific", "b")) > 0)
+		cfg->rc_target_bitrate = v / 1000;
+	if((v = ga_conf_mapreadint("video-specific", "g")) > 0)
+		cfg->kf_max_dist = v;
+	if((v = ga_conf_mapreadint("video-specific", "threads")) > 0)
+		cfg->g_threads = v;
+	if((v = ga_conf_mapreadint("video-specific", "qmin")) > 0)
+		cfg->rc_min_quantizer = v;
+	if((v = ga_conf_mapreadint("video-specific", "qmax")) > 0)
+		cfg->rc_max_quantizer = v;
+	if(ga_conf_mapreadv("video-specific", "bufsize", tmpbuf, sizeof(tmpbuf)) != NULL
+	&& cfg->rc_target_bitrate > 0) {
+		// bits to milliseconds; 0 keeps libvpx defaults
+		if((v = strtol(tmpbuf, NULL, 0)) > 0) {
+			cfg->rc_buf_sz = v / cfg->rc_target_bitrate;
+			cfg->rc_buf_optimal_sz = cfg->rc_buf_sz * 5 / 6;
+			cfg->rc_buf_initial_sz = cfg->rc_buf_sz * 4 / 6;
+		}
+	}
+	if((v = ga_conf_mapreadint("video-specific", "rc_init_occupancy")) > 0
+	&& cfg->rc_target_bitrate > 0)
+		cfg->rc_buf_initial_sz = v / cfg->rc_target_bitrate;
+	if((v = ga_conf_mapreadint("video-specific", "undershoot-pct")) > 0)
+		cfg->rc_undershoot_pct = v;
+	if((v = ga_conf_mapreadint("video-specific", "overshoot-pct")) > 0)
+		cfg->rc_overshoot_pct = v;
+	// error resilience: frames decodable without prior (lost) frames
+	if(ga_conf_mapreadbool("video-specific", "error-resilient", 1) != 0) {
+		cfg->g_error_resilient = VPX_ERROR_RESILIENT_DEFAULT;
+		if(vp9 == 0)
+			cfg->g_error_resilient |= VPX_ERROR_RESILIENT_PARTITIONS;
+	}
+	// temporal layers
+	layers = ga_conf_mapreadint("video-specific", "temporal-layers");
+	if(layers > VPX_TEMPORAL_LAYERS_MAX) {
+		ga_error("video encoder: vpx - temporal-layers %d too large, use %d.\n",
+			layers, VPX_TEMPORAL_LAYERS_MAX);
+		layers = VPX_TEMPORAL_LAYERS_MAX;
+	}
+	vpx_temporal_layers_setup(cfg, layers);
+	vpx_temporal_layers_bitrate(cfg);
+	//
+	if(vpx_codec_enc_init(ctx, iface, cfg, 0) != VPX_CODEC_OK) {
+		ga_error("video encoder: vpx - init %s failed: %s\n",
+			vpx_codec_iface_name(iface), vpx_codec_error(ctx));
+		return -1;
+	}
+	vencoder_opened[iid] = 1;
+	// codec controls
+	v = ga_conf_mapreadv("video-specific", "cpu-used", tmpbuf, sizeof(tmpbuf)) != NULL ?
+		strtol(tmpbuf, NULL, 0) : (vp9 ? 7 : 8);
+	vpx_codec_control(ctx, VP8E_SET_CPUUSED, v);
+	vpx_codec_control(ctx, VP8E_SET_NOISE_SENSITIVITY, ga_conf_mapreadint("video-specific", "noise-sensitivity"));
+	vpx_codec_control(ctx, VP8E_SET_STATIC_THRESHOLD, ga_conf_mapreadint("video-specific", "static-thresh"));
+	if((v = ga_conf_mapreadint("video-specific", "max-intra-rate")) > 0)
+		vpx_codec_control(ctx, VP8E_SET_MAX_INTRA_BITRATE_PCT, v);
+	if(vp9) {
+		// tile-columns is log2 of the number of tile columns
+		vpx_codec_control(ctx, VP9E_SET_TILE_COLUMNS, ga_conf_mapreadint("video-specific", "tile-columns"));
+#ifdef VPX_CTRL_VP9E_SET_ROW_MT
+		// row-based multi-threading, libvpx 1.7+
+		vpx_codec_control(ctx, VP9E_SET_ROW_MT, ga_conf_mapreadbool("video-specific", "row-mt", 1));
+#endif
+		// cyclic refresh suits real-time
+		vpx_codec_control(ctx, VP9E_SET_AQ_MODE, ga_conf_mapreadv("video-specific", "aq-mode", tmpbuf, sizeof(tmpbuf)) != NULL ?
+			(int) strtol(tmpbuf, NULL, 0) : 3);
+		if(tl_layers > 1)
+			vpx_codec_control(ctx, VP9E_SET_SVC, 1);
+	} else {
+		// token partitions are the VP8 counterpart of tiles
+		if((v = ga_conf_mapreadint("video-specific", "token-partitions")) > 0)
+			vpx_codec_control(ctx, VP8E_SET_TOKEN_PARTITIONS, v);
+	}
+	ga_error("video encoder: opened! codec=%s; bitrate=%dKbps; deadline=%lu; g=%d; threads=%d; width=%d; height=%d; error-resilient=%d; temporal-layers=%d\n",
+		vpx_codec_iface_name(iface),
+		cfg->rc_target_bitrate, deadline,
+		cfg->kf_max_dist, cfg->g_threads,
+		cfg->g_w, cfg->g_h,
+		cfg->g_error_resilient, tl_layers);
+	return 0;
+}
+
+static int
+vencoder_init(void *arg) {
+	int iid;
+	char *pipefmt = (char*) arg;
+	char tmpbuf[64];
+	//
+	rtspconf = rtspconf_global();
+	if(rtspconf == NULL) {
+		ga_error("video encoder: no configuration found\n");
+		return -1;
+	}
+	if(vencoder_initialized != 0)
+		return 0;
+	//
+	deadline = VPX_DL_REALTIME;
+	if(ga_conf_mapreadv("video-specific", "deadline", tmpbuf, sizeof(tmpbuf)) != NULL) {
+		if(strcmp(tmpbuf, "good") == 0)
+			deadline = VPX_DL_GOOD_QUALITY;
+		else if(strcmp(tmpbuf, "best") == 0)
+			deadline = VPX_DL_BEST_QUALITY;
+	}
+	bzero(vencoder_pts, sizeof(vencoder_pts));
+	//
+	for(iid = 0; iid < video_source_channels(); iid++) {
+		char pipename[64];
+		int outputW, outputH;
+		dpipe_t *pipe;
+		//
+		pthread_mutex_init(&vencoder_reconf_mutex[iid], NULL);
+		vencoder_reconf[iid].id = -1;
+		vencoder_forceidr[iid] = 0;
+		//
+		snprintf(pipename, sizeof(pipename), pipefmt, iid);
+		outputW = video_source_out_width(iid);
+		outputH = video_source_out_height(iid);
+		if(outputW % 2 != 0 || outputH % 2 != 0) {
+			ga_error("video encoder: unsupported resolutin %dx%d\n", outputW, outputH);
+			goto init_failed;
+		}
+		if((pipe = dpipe_lookup(pipename)) == NULL) {
+			ga_error("video encoder: pipe %s is not found\n", pipename);
+			goto init_failed;
+		}
+		ga_error("video encoder: video source #%d from '%s' (%dx%d).\n",
+			iid, pipe->name, outputW, outputH);
+		//
+		if(vencoder_open(iid, outputW, outputH) < 0)
+			goto init_failed;
+	}
+	vencoder_initialized = 1;
+	ga_error("video encoder: initialized.\n");
+	return 0;
+init_failed:
+	vencoder_deinit(NULL);
+	return -1;
+}
+
+static int
+vencoder_reconfigure(int iid) {
+	int ret = 0;
+	vpx_codec_enc_cfg_t *cfg = &vencoder_cfg[iid];
+	ga_ioctl_reconfigure_t *reconf = &vencoder_reconf[iid];
+	//
+	pthread_mutex_lock(&vencoder_reconf_mutex[iid]);
+	if(vencoder_reconf[iid].id >= 0) {
+		int doit = 0;
+		//
+		if(reconf->framerate_n > 0) {
+			cfg->g_timebase.num = reconf->framerate_d > 0 ? reconf->framerate_d : 1;
+			cfg->g_timebase.den = reconf->framerate_n;
+			doit++;
+		}
+		if(reconf->bitrateKbps > 0) {
+			cfg->rc_target_bitrate = reconf->bitrateKbps;
+			vpx_temporal_layers_bitrate(cfg);
+			doit++;
+		}
+		if(reconf->bufsize > 0 && cfg->rc_target_bitrate > 0) {
+			// vbv-bufsize is in Kbits, libvpx buffer is in milliseconds
+			cfg->rc_buf_sz = 1000 * reconf->bufsize / cfg->rc_target_bitrate;
+			doit++;
+		}
+		//
+		if(doit > 0) {
+			if(vpx_codec_enc_config_set(&vencoder[iid], cfg) != VPX_CODEC_OK) {
+				ga_error("video encoder: reconfigure failed. framerate=%d/%d; bitrate=%d; bufsize=%d: %s\n",
+						reconf->framerate_n, reconf->framerate_d,
+						reconf->bitrateKbps, reconf->bufsize,
+						vpx_codec_error(&vencoder[iid]));
+				ret = -1;
+			} else {
+				ga_error("video encoder: reconfigured. framerate=%d/%d; bitrate=%dKbps; bufsize=%dms.\n",
+						cfg->g_timebase.den, cfg->g_timebase.num,
+						cfg->rc_target_bitrate, cfg->rc_buf_sz);
+			}
+		}
+		reconf->id = -1;
+	}
+	pthread_mutex_unlock(&vencoder_reconf_mutex[iid]);
+	return ret;
+}
+
+static int
+vencoder_keyframe_requested(int iid) {
+	int ret;
+	pthread_mutex_lock(&vencoder_reconf_mutex[iid]);
+	ret = vencoder_forceidr[iid];
+	vencoder_forceidr[iid] = 0;
+	pthread_mutex_unlock(&vencoder_reconf_mutex[iid]);
+	return ret;
+}
+
+static void *
+vencoder_threadproc(void *arg) {
+	// arg is pointer to source pipename
+	int iid, outputW, outputH;
+	long long basePts = -1LL, newpts = 0LL, ptsSync = 0LL;
+	vsource_frame_t *frame = NULL;
+	char *pipename = (char*) arg;
+	dpipe_t *pipe = dpipe_lookup(pipename);
+	dpipe_buffer_t *data = NULL;
+	vpx_codec_ctx_t *encoder = NULL;
+	vpx_image_t pic_in;
+	int video_written = 0;
+	//
+	if(pipe == NULL) {
+		ga_error("video encoder: invalid pipeline specified (%s).\n", pipename);
+		goto video_quit;
+	}
+	//
+	rtspconf = rtspconf_global();
+	// init variables
+	iid = pipe->channel_id;
+	encoder = &vencoder[iid];
+	//
+	outputW = video_source_out_width(iid);
+	outputH = video_source_out_height(iid);
+	// planes are pointed to frame buffers later
+	bzero(&pic_in, sizeof(pic_in));
+	vpx_img_wrap(&pic_in, VPX_IMG_FMT_I420, outputW, outputH, 1, NULL);
+	// start encoding
+	ga_thread_role("vencoder", iid);
+	ga_error("video encoding started: tid=%ld %dx%d@%dfps.\n",
+		ga_gettid(),
+		outputW, outputH, rtspconf->video_fps);
+	//
+	while(vencoder_started != 0 && encoder_running() > 0) {
+		const vpx_codec_cx_pkt_t *cxpkt;
+		vpx_codec_iter_t iter = NULL;
+		vpx_enc_frame_flags_t flags;
+		int64_t pts;
+		int tlidx, backlog;
+		struct timeval tv, encstart, encend;
+		struct timespec to;
+		gettimeofday(&tv, NULL);
+		// need reconfigure?
+		vencoder_reconfigure(iid);
+		// wait for notification
+		to.tv_sec = tv.tv_sec+1;
+		to.tv_nsec = tv.tv_usec * 1000;
+		data = dpipe_load(pipe, &to);
+		if(data == NULL) {
+			ga_error("viedo encoder: image source timed out.\n");
+			continue;
+		}
+		// frames still queued behind this one
+		backlog = pipe->out_count;
+		gettimeofday(&encstart, NULL);
+		frame = (vsource_frame_t*) data->pointer;
+		// media clock pts of the captured frame
+		if(basePts == -1LL) {
+			basePts = frame->imgpts;
+			ptsSync = encoder_pts_sync(rtspconf->video_fps);
+			newpts = ptsSync;
+		} else {
+			newpts = ptsSync + frame->imgpts - basePts;
+		}
+		//
+		pic_in.planes[VPX_PLANE_Y] = frame->imgbuf;
+		pic_in.planes[VPX_PLANE_U] = frame->imgbuf + outputW*outputH;
+		pic_in.planes[VPX_PLANE_V] = pic_in.planes[VPX_PLANE_U] + ((outputW*outputH) >> 2);
+		pic_in.stride[VPX_PLANE_Y] = frame->linesize[0];
+		pic_in.stride[VPX_PLANE_U] = frame->linesize[1];
+		pic_in.stride[VPX_PLANE_V] = frame->linesize[2];
+		//
+		pts = vencoder_pts[iid]++;
+		tlidx = (int) (pts % tl_periodicity);
+		flags = tl_flags[tlidx];
+		if(tl_layers > 1) {
+			if(vp9) {
+				vpx_svc_layer_id_t layer_id;
+				layer_id.spatial_layer_id = 0;
+				layer_id.temporal_layer_id = tl_layer_id[tlidx];
+				vpx_codec_control(encoder, VP9E_SET_SVC_LAYER_ID, &layer_id);
+			} else {
+				vpx_codec_control(encoder, VP8E_SET_TEMPORAL_LAYER_ID, tl_layer_id[tlidx]);
+			}
+		}
+		if(vencoder_keyframe_requested(iid))
+			flags |= VPX_EFLAG_FORCE_KF;
+		// encode
+		if(vpx_codec_encode(encoder, &pic_in, pts, 1, flags, deadline) != VPX_CODEC_OK) {
+			ga_error("video encoder: encode failed: %s\n", vpx_codec_error_detail(encoder));
+			dpipe_put(pipe, data);
+			break;
+		}
+		dpipe_put(pipe, data);
+		gettimeofday(&encend, NULL);
+		encoder_governor_report(iid, (int) tvdiff_us(&encend, &encstart), backlog);
+		if(iid == 0)
+			encoder_clock_report(ENCODER_CLOCK_VIDEO, newpts, rtspconf->video_fps);
+		// deliver one packet per compressed frame
+		while((cxpkt = vpx_codec_get_cx_data(encoder, &iter)) != NULL) {
+			AVPacket pkt;
+			if(cxpkt->kind != VPX_CODEC_CX_FRAME_PKT)
+				continue;
+			av_init_packet(&pkt);
+			pkt.pts = cxpkt->data.frame.pts;
+			pkt.stream_index = 0;
+			if(cxpkt->data.frame.flags & VPX_FRAME_IS_KEY)
+				pkt.flags |= AV_PKT_FLAG_KEY;
+			pkt.data = (uint8_t*) cxpkt->data.frame.buf;
+			pkt.size = cxpkt->data.frame.sz;
+			if(encoder_send_packet("video-encoder",
+					iid/*rtspconf->video_id*/, &pkt,
+					pkt.pts, NULL) < 0) {
+				goto video_quit;
+			}
+			if(video_written == 0) {
+				video_written = 1;
+				ga_error("first video frame written (pts=%lld)\n", pkt.pts);
+			}
+		}
+	}
+	//
+video_quit:
+	if(pipe) {
+		pipe = NULL;
+	}
+	//
+	ga_error("video encoder: thread terminated (tid=%ld).\n", ga_gettid());
+	//
+	return NULL;
+}
+
+static int
+vencoder_start(void *arg) {
+	int iid;
+	char *pipefmt = (char*) arg;
+#define	MAXPARAMLEN	64
+	static char pipename[VIDEO_SOURCE_CHANNEL_MAX][MAXPARAMLEN];
+	if(vencoder_started != 0)
+		return 0;
+	vencoder_started = 1;
+	for(iid = 0; iid < video_source_channels(); iid++) {
+		snprintf(pipename[iid], MAXPARAMLEN, pipefmt, iid);
+		if(pthread_create(&vencoder_tid[iid], NULL, vencoder_threadproc, pipename[iid]) != 0) {
+			vencoder_started = 0;
+			ga_error("video encoder: create thread failed.\n");
+			return -1;
+		}
+	}
+	ga_error("video encdoer: all started (%d)\n", iid);
+	return 0;
+}
+
+static int
+vencoder_stop(void *arg) {
+	int iid;
+	void *ignored;
+	if(vencoder_started == 0)
+		return 0;
+	vencoder_started = 0;
+	for(iid = 0; iid < video_source_channels(); iid++) {
+		pthread_join(vencoder_tid[iid], &ignored);
+	}
+	ga_error("video encdoer: all stopped (%d)\n", iid);
+	return 0;
+}
+
+static void *
+vencoder_raw(void *arg, int *size) {
+#if defined __APPLE__
+	int64_t in = (int64_t) arg;
+	int iid = (int) (in & 0xffffffffLL);
+#elif defined __x86_64__
+	int iid = (long long) arg;
+#else
+	int iid = (int) arg;
+#endif
+	if(vencoder_initialized == 0)
+		return NULL;
+	if(size)
+		*size = sizeof(vencoder[iid]);
+	return &vencoder[iid];
+}
+
+static int
+vpx_reconfigure(ga_ioctl_reconfigure_t *reconf) {
+	if(vencoder_started == 0 || encoder_running() == 0) {
+		ga_error("video encoder: reconfigure - not running.\n");
+		return 0;
+	}
+	pthread_mutex_lock(&vencoder_reconf_mutex[reconf->id]);
+	bcopy(reconf, &vencoder_reconf[reconf->id], sizeof(ga_ioctl_reconfigure_t));
+	pthread_mutex_unlock(&vencoder_reconf_mutex[reconf->id]);
+	return 0;
+}
+
+/* build a VP codec configuration record (the payload of an ISO-BMFF vpcC box),
+ * VP8/VP9 over RTP carries no out-of-band parameters, so this is the only
+ * codec-specific data an SDP or a container may need */
+static int
+vpx_get_extradata(ga_ioctl_buffer_t *buf) {
+	unsigned char rec[12];
+	if(buf->id < 0 || buf->id >= video_source_channels())
+		return GA_IOCTL_ERR_BADID;
+	if(buf->size < (int) sizeof(rec))
+		return GA_IOCTL_ERR_BUFFERSIZE;
+	bzero(rec, sizeof(rec));
+	rec[0] = 1;		// version, flags (3 bytes) are zero
+	rec[4] = vencoder_cfg[buf->id].g_profile;
+	rec[5] = 0;		// level: unspecified
+	rec[6] = (8 << 4)	// 8-bit
+		| (1 << 1)	// 4:2:0 colocated with luma (0,0)
+		| 0;		// limited range
+	rec[7] = 2;		// colour primaries: unspecified
+	rec[8] = 2;		// transfer characteristics: unspecified
+	rec[9] = 2;		// matrix coefficients: unspecified
+	rec[10] = rec[11] = 0;	// no codec initialization data
+	bcopy(rec, buf->ptr, sizeof(rec));
+	buf->size = sizeof(rec);
+	return 0;
+}
+
+static int
+vencoder_ioctl(int command, int argsize, void *arg) {
+	int ret = 0;
+	ga_ioctl_keyframe_t *kf = (ga_ioctl_keyframe_t*) arg;
+	//
+	if(vencoder_initialized == 0)
+		return GA_IOCTL_ERR_NOTINITIALIZED;
+	//
+	switch(command) {
+	case GA_IOCTL_RECONFIGURE:
+		if(argsize != sizeof(ga_ioctl_reconfigure_t))
+			return GA_IOCTL_ERR_INVALID_ARGUMENT;
+		vpx_reconfigure((ga_ioctl_reconfigure_t*) arg);
+		break;
+	case GA_IOCTL_REQUEST_KEYFRAME:
+		if(argsize != sizeof(ga_ioctl_keyframe_t))
+			return GA_IOCTL_ERR_INVALID_ARGUMENT;
+		if(kf->id < 0 || kf->id >= video_source_channels())
+			return GA_IOCTL_ERR_BADID;
+		pthread_mutex_lock(&vencoder_reconf_mutex[kf->id]);
+		vencoder_forceidr[kf->id] = 1;
+		pthread_mutex_unlock(&vencoder_reconf_mutex[kf->id]);
+		break;
+	case GA_IOCTL_GETEXTRADATA:
+		if(argsize != sizeof(ga_ioctl_buffer_t))
+			return GA_IOCTL_ERR_INVALID_ARGUMENT;
+		ret = vpx_get_extradata((ga_ioctl_buffer_t*) arg);
+		break;
+	default:
+		ret = GA_IOCTL_ERR_NOTSUPPORTED;
+		break;
+	}
+	return ret;
+}
+
+ga_module_t *
+module_load() {
+	static ga_module_t m;
+	char mime[64];
+	//
+	bzero(&m, sizeof(m));
+	m.type = GA_MODULE_TYPE_VENCODER;
+	m.name = strdup("vpx-video-encoder");
+	if(ga_conf_readv("video-mimetype", mime, sizeof(mime)) != NULL
+	&& strcasecmp(mime, "video/VP9") == 0) {
+		vp9 = 1;
+		m.mimetype = strdup("video/VP9");
+	} else {
+		vp9 = 0;
+		m.mimetype = strdup("video/VP8");
+	}
+	m.init = vencoder_init;
+	m.start = vencoder_start;
+	//m.threadproc = vencoder_threadproc;
+	m.stop = vencoder_stop;
+	m.deinit = vencoder_deinit;
+	//
+	m.raw = vencoder_raw;
+	m.ioctl = vencoder_ioctl;
+	return &m;
+}
+
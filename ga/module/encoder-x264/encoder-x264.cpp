@@ -25,7 +25,9 @@
 #include "ga-common.h"
 #include "ga-avcodec.h"
 #include "ga-conf.h"
+#include "ga-thread.h"
 #include "ga-module.h"
+#include "ga-workpool.h"
 
 #include "dpipe.h"
 
@@ -46,6 +48,13 @@ static pthread_mutex_t vencoder_reconf_mutex[VIDEO_SOURCE_CHANNEL_MAX];
 static ga_ioctl_reconfigure_t vencoder_reconf[VIDEO_SOURCE_CHANNEL_MAX];
 //// encoders for encoding
 static x264_t* vencoder[VIDEO_SOURCE_CHANNEL_MAX];
+// encoder pts: kept across restarts of a warm encoder
+static int64_t vencoder_pts[VIDEO_SOURCE_CHANNEL_MAX];
+// runtime downscaling of rendition 0, requested by the overload governor
+static int vencoder_width[VIDEO_SOURCE_CHANNEL_MAX];
+static int vencoder_height[VIDEO_SOURCE_CHANNEL_MAX];
+static struct SwsContext *vencoder_sws[VIDEO_SOURCE_CHANNEL_MAX];
+static unsigned char *vencoder_scalebuf[VIDEO_SOURCE_CHANNEL_MAX];
 
 // specific data for h.264
 static char *_sps[VIDEO_SOURCE_CHANNEL_MAX];
@@ -53,6 +62,23 @@ static int _spslen[VIDEO_SOURCE_CHANNEL_MAX];
 static char *_pps[VIDEO_SOURCE_CHANNEL_MAX];
 static int _ppslen[VIDEO_SOURCE_CHANNEL_MAX];
 
+// region-of-interest quantization
+static vsource_roi_config_t roiconf;
+
+// simulcast renditions: rendition 0 is vencoder[]
+#define	SIMULCAST_PIPEFORMAT	"simulcast-%d-%d"
+#define	SIMULCAST_POOLSIZE	4
+static int vencoder_renditions = 1;
+static x264_t* vsimulcast[VIDEO_SOURCE_CHANNEL_MAX][ENCODER_SIMULCAST_MAX];
+static dpipe_t *vsimulcast_pipe[VIDEO_SOURCE_CHANNEL_MAX][ENCODER_SIMULCAST_MAX];
+static pthread_t vsimulcast_tid[VIDEO_SOURCE_CHANNEL_MAX][ENCODER_SIMULCAST_MAX];
+static int vsimulcast_arg[VIDEO_SOURCE_CHANNEL_MAX][ENCODER_SIMULCAST_MAX];
+static struct SwsContext *vsimulcast_sws[VIDEO_SOURCE_CHANNEL_MAX][ENCODER_SIMULCAST_MAX];
+// renditions of a channel share one RTP stream per client
+static pthread_mutex_t vencoder_send_mutex[VIDEO_SOURCE_CHANNEL_MAX];
+// pending keyframe requests, protected by vencoder_reconf_mutex
+static int vencoder_forceidr[VIDEO_SOURCE_CHANNEL_MAX][ENCODER_SIMULCAST_MAX];
+
 //#define	SAVEENC	"save.264"
 #ifdef SAVEENC
 static FILE *fsaveenc = NULL;
@@ -60,7 +86,7 @@ static FILE *fsaveenc = NULL;
 
 static int
 vencoder_deinit(void *arg) {
-	int iid;
+	int iid, r;
 #ifdef SAVEENC
 	if(fsaveenc != NULL) {
 		fclose(fsaveenc);
@@ -74,7 +100,25 @@ vencoder_deinit(void *arg) {
 			free(_pps[iid]);
 		if(vencoder[iid] != NULL)
 			x264_encoder_close(vencoder[iid]);
+		if(vencoder_sws[iid] != NULL)
+			sws_freeContext(vencoder_sws[iid]);
+		if(vencoder_scalebuf[iid] != NULL)
+			free(vencoder_scalebuf[iid]);
+		vencoder_sws[iid] = NULL;
+		vencoder_scalebuf[iid] = NULL;
+		for(r = 1; r < ENCODER_SIMULCAST_MAX; r++) {
+			if(vsimulcast[iid][r] != NULL)
+				x264_encoder_close(vsimulcast[iid][r]);
+			if(vsimulcast_pipe[iid][r] != NULL)
+				dpipe_destroy(vsimulcast_pipe[iid][r]);
+			if(vsimulcast_sws[iid][r] != NULL)
+				sws_freeContext(vsimulcast_sws[iid][r]);
+			vsimulcast[iid][r] = NULL;
+			vsimulcast_pipe[iid][r] = NULL;
+			vsimulcast_sws[iid][r] = NULL;
+		}
 		pthread_mutex_destroy(&vencoder_reconf_mutex[iid]);
+		pthread_mutex_destroy(&vencoder_send_mutex[iid]);
 		vencoder[iid] = NULL;
 	}
 	bzero(_sps, sizeof(_sps));
@@ -94,14 +138,126 @@ ga_x264_param_parse_bit(x264_param_t *params, const char *name, const char *bitv
 	return x264_param_parse(params, name, kbit);
 }
 
+static x264_t *
+vencoder_open(int outputW, int outputH, int bitrateKbps) {
+	x264_t *encoder;
+	x264_param_t params;
+	char profile[16], preset[16], tune[16];
+	char x264params[1024];
+	char tmpbuf[64];
+	//
+	bzero(&params, sizeof(params));
+	x264_param_default(&params);
+	// fill params
+	preset[0] = tune[0] = '\0';
+	ga_conf_mapreadv("video-specific", "preset", preset, sizeof(preset));
+	ga_conf_mapreadv("video-specific", "tune", tune, sizeof(tune));
+	if(preset[0] != '\0' || tune[0] != '\0') {
+		if(x264_param_default_preset(&params, preset, tune) < 0) {
+			ga_error("video encoder: bad x264 preset=%s; tune=%s\n", preset, tune);
+			return NULL;
+		} else {
+			ga_error("video encoder: x264 preset=%s; tune=%s\n", preset, tune); 
+		}
+	}
+	//
+	if(ga_conf_mapreadv("video-specific", "b", tmpbuf, sizeof(tmpbuf)) != NULL)
+		ga_x264_param_parse_bit(&params, "bitrate", tmpbuf);
+	if(ga_conf_mapreadv("video-specific", "crf", tmpbuf, sizeof(tmpbuf)) != NULL)
+		x264_param_parse(&params, "crf", tmpbuf);
+	if(ga_conf_mapreadv("video-specific", "vbv-init", tmpbuf, sizeof(tmpbuf)) != NULL)
+		x264_param_parse(&params, "vbv-init", tmpbuf);
+	if(ga_conf_mapreadv("video-specific", "maxrate", tmpbuf, sizeof(tmpbuf)) != NULL)
+		ga_x264_param_parse_bit(&params, "vbv-maxrate", tmpbuf);
+	if(ga_conf_mapreadv("video-specific", "bufsize", tmpbuf, sizeof(tmpbuf)) != NULL)
+		ga_x264_param_parse_bit(&params, "vbv-bufsize", tmpbuf);
+	if(ga_conf_mapreadv("video-specific", "refs", tmpbuf, sizeof(tmpbuf)) != NULL)
+		x264_param_parse(&params, "ref", tmpbuf);
+	if(ga_conf_mapreadv("video-specific", "me_method", tmpbuf, sizeof(tmpbuf)) != NULL)
+		x264_param_parse(&params, "me", tmpbuf);
+	if(ga_conf_mapreadv("video-specific", "me_range", tmpbuf, sizeof(tmpbuf)) != NULL)
+		x264_param_parse(&params, "merange", tmpbuf);
+	if(ga_conf_mapreadv("video-specific", "g", tmpbuf, sizeof(tmpbuf)) != NULL)
+		x264_param_parse(&params, "keyint", tmpbuf);
+	if(ga_conf_mapreadv("video-specific", "intra-refresh", tmpbuf, sizeof(tmpbuf)) != NULL)
+		x264_param_parse(&params, "intra-refresh", tmpbuf);
+	//
+	x264_param_parse(&params, "bframes", "0");
+	x264_param_apply_fastfirstpass(&params);
+	if(ga_conf_mapreadv("video-specific", "profile", profile, sizeof(profile)) != NULL) {
+		if(x264_param_apply_profile(&params, profile) < 0) {
+			ga_error("video encoder: x264 - bad profile %s\n", profile);
+			return NULL;
+		}
+	}
+	//
+	if(ga_conf_readv("video-fps", tmpbuf, sizeof(tmpbuf)) != NULL)
+		x264_param_parse(&params, "fps", tmpbuf);
+	if(ga_conf_mapreadv("video-specific", "threads", tmpbuf, sizeof(tmpbuf)) != NULL)
+		x264_param_parse(&params, "threads", tmpbuf);
+	if(ga_conf_mapreadv("video-specific", "slices", tmpbuf, sizeof(tmpbuf)) != NULL)
+		x264_param_parse(&params, "slices", tmpbuf);
+	//
+	params.i_log_level = X264_LOG_INFO;
+	params.i_csp = X264_CSP_I420;
+	params.i_width  = outputW;
+	params.i_height = outputH;
+	//params.vui.b_fullrange = 1;
+	params.b_repeat_headers = 1;
+	params.b_annexb = 1;
+	// handle x264-params
+	if(ga_conf_mapreadv("video-specific", "x264-params", x264params, sizeof(x264params)) != NULL) {
+		char *saveptr, *value;
+		char *name = strtok_r(x264params, ":", &saveptr);
+		while(name != NULL) {
+			if((value = strchr(name, '=')) != NULL) {
+				*value++ = '\0';
+			}
+			if(x264_param_parse(&params, name, value) < 0) {
+				ga_error("video encoder: warning - bad x264 param [%s=%s]\n", name, value);
+			}
+			name = strtok_r(NULL, ":", &saveptr);
+		}
+	}
+	// quant_offsets only work with adaptive quantization
+	if(roiconf.enabled != 0 && params.rc.i_aq_mode == X264_AQ_NONE) {
+		params.rc.i_aq_mode = X264_AQ_VARIANCE;
+		if(params.rc.f_aq_strength <= 0)
+			params.rc.f_aq_strength = 1.0;
+		ga_error("video encoder: ROI enabled, force aq-mode=%d\n", params.rc.i_aq_mode);
+	}
+	// simulcast renditions have their own bitrates
+	if(bitrateKbps > 0) {
+		if(params.rc.i_vbv_buffer_size > 0 && params.rc.i_vbv_max_bitrate > 0) {
+			params.rc.i_vbv_buffer_size = (int) (1LL * params.rc.i_vbv_buffer_size
+					* bitrateKbps / params.rc.i_vbv_max_bitrate);
+		}
+		if(params.rc.i_vbv_max_bitrate > 0)
+			params.rc.i_vbv_max_bitrate = bitrateKbps;
+		params.rc.i_bitrate = bitrateKbps;
+	}
+	//
+	if((encoder = x264_encoder_open(&params)) == NULL)
+		return NULL;
+	ga_error("video encoder: opened! bitrate=%dKbps; me_method=%d; me_range=%d; refs=%d; g=%d; intra-refresh=%d; width=%d; height=%d; crop=%d,%d,%d,%d; threads=%d; slices=%d; repeat-hdr=%d; annexb=%d\n",
+		params.rc.i_bitrate,
+		params.analyse.i_me_method, params.analyse.i_me_range,
+		params.i_frame_reference,
+		params.i_keyint_max,
+		params.b_intra_refresh,
+		params.i_width, params.i_height,
+		params.crop_rect.i_left, params.crop_rect.i_top,
+		params.crop_rect.i_right, params.crop_rect.i_bottom,
+		params.i_threads, params.i_slice_count,
+		params.b_repeat_headers, params.b_annexb);
+	return encoder;
+}
+
 static int
 vencoder_init(void *arg) {
 	int iid;
 	char *pipefmt = (char*) arg;
 	struct RTSPConf *rtspconf = rtspconf_global();
-	char profile[16], preset[16], tune[16];
-	char x264params[1024];
-	char tmpbuf[64];
 	//
 	if(rtspconf == NULL) {
 		ga_error("video encoder: no configuration found\n");
@@ -110,15 +266,20 @@ vencoder_init(void *arg) {
 	if(vencoder_initialized != 0)
 		return 0;
 	//
+	vsource_roi_config_load(&roiconf);
+	vencoder_renditions = encoder_simulcast_renditions();
+	bzero(vencoder_forceidr, sizeof(vencoder_forceidr));
+	bzero(vencoder_pts, sizeof(vencoder_pts));
+	//
 	for(iid = 0; iid < video_source_channels(); iid++) {
 		char pipename[64];
-		int outputW, outputH;
+		int r, outputW, outputH;
 		dpipe_t *pipe;
-		x264_param_t params;
 		//
 		_sps[iid] = _pps[iid] = NULL;
 		_spslen[iid] = _ppslen[iid] = 0;
 		pthread_mutex_init(&vencoder_reconf_mutex[iid], NULL);
+		pthread_mutex_init(&vencoder_send_mutex[iid], NULL);
 		vencoder_reconf[iid].id = -1;
 		//
 		snprintf(pipename, sizeof(pipename), pipefmt, iid);
@@ -135,94 +296,39 @@ vencoder_init(void *arg) {
 		ga_error("video encoder: video source #%d from '%s' (%dx%d).\n",
 			iid, pipe->name, outputW, outputH, iid);
 		//
-		bzero(&params, sizeof(params));
-		x264_param_default(&params);
-		// fill params
-		preset[0] = tune[0] = '\0';
-		ga_conf_mapreadv("video-specific", "preset", preset, sizeof(preset));
-		ga_conf_mapreadv("video-specific", "tune", tune, sizeof(tune));
-		if(preset[0] != '\0' || tune[0] != '\0') {
-			if(x264_param_default_preset(&params, preset, tune) < 0) {
-				ga_error("video encoder: bad x264 preset=%s; tune=%s\n", preset, tune);
+		if((vencoder[iid] = vencoder_open(outputW, outputH, 0)) == NULL)
+			goto init_failed;
+		vencoder_width[iid] = outputW;
+		vencoder_height[iid] = outputH;
+		// simulcast renditions: scaled from the same source frame
+		for(r = 1; r < vencoder_renditions; r++) {
+			encoder_rendition_t *rend = encoder_simulcast_rendition(r);
+			dpipe_buffer_t *data;
+			//
+			if(rend->width % 4 != 0 || rend->height % 4 != 0
+			|| rend->width > outputW || rend->height > outputH) {
+				ga_error("video encoder: unsupported simulcast resolution %dx%d\n",
+					rend->width, rend->height);
 				goto init_failed;
-			} else {
-				ga_error("video encoder: x264 preset=%s; tune=%s\n", preset, tune); 
 			}
-		}
-		//
-		if(ga_conf_mapreadv("video-specific", "b", tmpbuf, sizeof(tmpbuf)) != NULL)
-			ga_x264_param_parse_bit(&params, "bitrate", tmpbuf);
-		if(ga_conf_mapreadv("video-specific", "crf", tmpbuf, sizeof(tmpbuf)) != NULL)
-			x264_param_parse(&params, "crf", tmpbuf);
-		if(ga_conf_mapreadv("video-specific", "vbv-init", tmpbuf, sizeof(tmpbuf)) != NULL)
-			x264_param_parse(&params, "vbv-init", tmpbuf);
-		if(ga_conf_mapreadv("video-specific", "maxrate", tmpbuf, sizeof(tmpbuf)) != NULL)
-			ga_x264_param_parse_bit(&params, "vbv-maxrate", tmpbuf);
-		if(ga_conf_mapreadv("video-specific", "bufsize", tmpbuf, sizeof(tmpbuf)) != NULL)
-			ga_x264_param_parse_bit(&params, "vbv-bufsize", tmpbuf);
-		if(ga_conf_mapreadv("video-specific", "refs", tmpbuf, sizeof(tmpbuf)) != NULL)
-			x264_param_parse(&params, "ref", tmpbuf);
-		if(ga_conf_mapreadv("video-specific", "me_method", tmpbuf, sizeof(tmpbuf)) != NULL)
-			x264_param_parse(&params, "me", tmpbuf);
-		if(ga_conf_mapreadv("video-specific", "me_range", tmpbuf, sizeof(tmpbuf)) != NULL)
-			x264_param_parse(&params, "merange", tmpbuf);
-		if(ga_conf_mapreadv("video-specific", "g", tmpbuf, sizeof(tmpbuf)) != NULL)
-			x264_param_parse(&params, "keyint", tmpbuf);
-		if(ga_conf_mapreadv("video-specific", "intra-refresh", tmpbuf, sizeof(tmpbuf)) != NULL)
-			x264_param_parse(&params, "intra-refresh", tmpbuf);
-		//
-		x264_param_parse(&params, "bframes", "0");
-		x264_param_apply_fastfirstpass(&params);
-		if(ga_conf_mapreadv("video-specific", "profile", profile, sizeof(profile)) != NULL) {
-			if(x264_param_apply_profile(&params, profile) < 0) {
-				ga_error("video encoder: x264 - bad profile %s\n", profile);
+			snprintf(pipename, sizeof(pipename), SIMULCAST_PIPEFORMAT, iid, r);
+			vsimulcast_pipe[iid][r] = dpipe_create(iid, pipename, SIMULCAST_POOLSIZE,
+					sizeof(vsource_frame_t) + video_source_mem_size(iid));
+			if(vsimulcast_pipe[iid][r] == NULL) {
+				ga_error("video encoder: create simulcast pipe %s failed.\n", pipename);
 				goto init_failed;
 			}
-		}
-		//
-		if(ga_conf_readv("video-fps", tmpbuf, sizeof(tmpbuf)) != NULL)
-			x264_param_parse(&params, "fps", tmpbuf);
-		if(ga_conf_mapreadv("video-specific", "threads", tmpbuf, sizeof(tmpbuf)) != NULL)
-			x264_param_parse(&params, "threads", tmpbuf);
-		if(ga_conf_mapreadv("video-specific", "slices", tmpbuf, sizeof(tmpbuf)) != NULL)
-			x264_param_parse(&params, "slices", tmpbuf);
-		//
-		params.i_log_level = X264_LOG_INFO;
-		params.i_csp = X264_CSP_I420;
-		params.i_width  = outputW;
-		params.i_height = outputH;
-		//params.vui.b_fullrange = 1;
-		params.b_repeat_headers = 1;
-		params.b_annexb = 1;
-		// handle x264-params
-		if(ga_conf_mapreadv("video-specific", "x264-params", x264params, sizeof(x264params)) != NULL) {
-			char *saveptr, *value;
-			char *name = strtok_r(x264params, ":", &saveptr);
-			while(name != NULL) {
-				if((value = strchr(name, '=')) != NULL) {
-					*value++ = '\0';
-				}
-				if(x264_param_parse(&params, name, value) < 0) {
-					ga_error("video encoder: warning - bad x264 param [%s=%s]\n", name, value);
+			for(data = vsimulcast_pipe[iid][r]->in; data != NULL; data = data->next) {
+				if(vsource_frame_init(iid, (vsource_frame_t*) data->pointer) == NULL) {
+					ga_error("video encoder: init frame failed for %s.\n", pipename);
+					goto init_failed;
 				}
-				name = strtok_r(NULL, ":", &saveptr);
 			}
+			if((vsimulcast[iid][r] = vencoder_open(rend->width, rend->height, rend->bitrateKbps)) == NULL)
+				goto init_failed;
+			ga_error("video encoder: simulcast rendition #%d.%d (%dx%d@%dKbps).\n",
+				iid, r, rend->width, rend->height, rend->bitrateKbps);
 		}
-		//
-		vencoder[iid] = x264_encoder_open(&params);
-		if(vencoder[iid] == NULL)
-			goto init_failed;
-		ga_error("video encoder: opened! bitrate=%dKbps; me_method=%d; me_range=%d; refs=%d; g=%d; intra-refresh=%d; width=%d; height=%d; crop=%d,%d,%d,%d; threads=%d; slices=%d; repeat-hdr=%d; annexb=%d\n",
-			params.rc.i_bitrate,
-			params.analyse.i_me_method, params.analyse.i_me_range,
-			params.i_frame_reference,
-			params.i_keyint_max,
-			params.b_intra_refresh,
-			params.i_width, params.i_height,
-			params.crop_rect.i_left, params.crop_rect.i_top,
-			params.crop_rect.i_right, params.crop_rect.i_bottom,
-			params.i_threads, params.i_slice_count,
-			params.b_repeat_headers, params.b_annexb);
 	}
 #ifdef SAVEENC
 	fsaveenc = fopen(SAVEENC, "wb");
@@ -235,16 +341,84 @@ init_failed:
 	return -1;
 }
 
+/* reopen rendition 0 at a new resolution: x264_encoder_reconfig cannot resize */
+static int
+vencoder_resize(int iid, int width, int height) {
+	x264_param_t params;
+	x264_t *encoder;
+	struct SwsContext *sws = NULL;
+	unsigned char *scalebuf = NULL;
+	int srcW = video_source_out_width(iid);
+	int srcH = video_source_out_height(iid);
+	//
+	if(width > srcW || height > srcH || width % 2 != 0 || height % 2 != 0) {
+		ga_error("video encoder: resize to %dx%d is not supported (source %dx%d).\n",
+			width, height, srcW, srcH);
+		return -1;
+	}
+	// build the converter and the encoder first, the current ones are
+	// replaced only when both are ready
+	if(width != srcW || height != srcH) {
+		sws = sws_getContext(
+			srcW, srcH, AV_PIX_FMT_YUV420P,
+			width, height, AV_PIX_FMT_YUV420P,
+			SWS_BICUBIC, NULL, NULL, NULL);
+		scalebuf = (unsigned char*) malloc(width * height * 3 / 2);
+		if(sws == NULL || scalebuf == NULL) {
+			ga_error("video encoder: cannot create converter (%dx%d)->(%dx%d)\n",
+				srcW, srcH, width, height);
+			goto resize_failed;
+		}
+	}
+	x264_encoder_parameters(vencoder[iid], &params);
+	if((encoder = vencoder_open(width, height, params.rc.i_bitrate)) == NULL) {
+		ga_error("video encoder: resize to %dx%d failed.\n", width, height);
+		goto resize_failed;
+	}
+	x264_encoder_close(vencoder[iid]);
+	if(vencoder_sws[iid] != NULL)
+		sws_freeContext(vencoder_sws[iid]);
+	if(vencoder_scalebuf[iid] != NULL)
+		free(vencoder_scalebuf[iid]);
+	vencoder[iid] = encoder;
+	vencoder_sws[iid] = sws;
+	vencoder_scalebuf[iid] = scalebuf;
+	vencoder_width[iid] = width;
+	vencoder_height[iid] = height;
+	// the cached parameter sets describe the old size
+	if(_sps[iid] != NULL)
+		free(_sps[iid]);
+	if(_pps[iid] != NULL)
+		free(_pps[iid]);
+	_sps[iid] = _pps[iid] = NULL;
+	_spslen[iid] = _ppslen[iid] = 0;
+	ga_error("video encoder: channel %d resized to %dx%d.\n", iid, width, height);
+	return 0;
+resize_failed:
+	if(sws != NULL)
+		sws_freeContext(sws);
+	if(scalebuf != NULL)
+		free(scalebuf);
+	return -1;
+}
+
 static int
 vencoder_reconfigure(int iid) {
 	int ret = 0;
 	x264_param_t params;
-	x264_t *encoder = vencoder[iid];
+	x264_t *encoder;
 	ga_ioctl_reconfigure_t *reconf = &vencoder_reconf[iid];
 	//
 	pthread_mutex_lock(&vencoder_reconf_mutex[iid]);
 	if(vencoder_reconf[iid].id >= 0) {
 		int doit = 0;
+		// a new resolution takes effect with an IDR frame and in-band SPS/PPS
+		if(reconf->width > 0 && reconf->height > 0
+		&& (reconf->width != vencoder_width[iid] || reconf->height != vencoder_height[iid])) {
+			if(vencoder_resize(iid, reconf->width, reconf->height) < 0)
+				ret = -1;
+		}
+		encoder = vencoder[iid];
 		x264_encoder_parameters(encoder, &params);
 		//
 		if(reconf->crf > 0) {
@@ -290,6 +464,242 @@ vencoder_reconfigure(int iid) {
 	return ret;
 }
 
+static int
+vencoder_keyframe_requested(int iid, int rendition) {
+	int ret;
+	pthread_mutex_lock(&vencoder_reconf_mutex[iid]);
+	ret = vencoder_forceidr[iid][rendition];
+	vencoder_forceidr[iid][rendition] = 0;
+	pthread_mutex_unlock(&vencoder_reconf_mutex[iid]);
+	return ret;
+}
+
+static int
+vencoder_send_packet(int iid, int rendition, AVPacket *pkt) {
+	int ret;
+	pthread_mutex_lock(&vencoder_send_mutex[iid]);
+	ret = encoder_send_rendition("video-encoder",
+			iid/*rtspconf->video_id*/, rendition, pkt, pkt->pts, NULL);
+	pthread_mutex_unlock(&vencoder_send_mutex[iid]);
+	return ret;
+}
+
+/* copy the SPS and PPS of an encoder into a keyframe that lacks them, so
+ * that a client switching renditions gets the parameter sets of the new
+ * rendition with its first frame; returns the number of bytes copied */
+static int
+vencoder_put_headers(x264_t *encoder, x264_nal_t *nal, int nnal, unsigned char *buf, int bufmax) {
+	x264_nal_t *hnal;
+	int i, hnnal, size = 0;
+	for(i = 0; i < nnal; i++) {
+		if(nal[i].i_type == NAL_SPS)
+			return 0;
+	}
+	if(x264_encoder_headers(encoder, &hnal, &hnnal) < 0)
+		return 0;
+	for(i = 0; i < hnnal; i++) {
+		if(hnal[i].i_type != NAL_SPS && hnal[i].i_type != NAL_PPS)
+			continue;
+		if(size + hnal[i].i_payload > bufmax)
+			return 0;
+		bcopy(hnal[i].p_payload, buf + size, hnal[i].i_payload);
+		size += hnal[i].i_payload;
+	}
+	return size;
+}
+
+/* a rendition scaling job for the shared worker pool */
+struct vencoder_scale_job {
+	struct SwsContext *sws;
+	vsource_frame_t *src, *dst;
+	unsigned char *srcplane[4], *dstplane[4];
+};
+
+static void
+vencoder_scale_job_run(void *arg) {
+	struct vencoder_scale_job *job = (struct vencoder_scale_job*) arg;
+	sws_scale(job->sws,
+		job->srcplane, job->src->linesize, 0, job->src->realheight,
+		job->dstplane, job->dst->linesize);
+	return;
+}
+
+/* scale a source frame once for each simulcast rendition, in parallel on
+ * the shared worker pool */
+static void
+vencoder_scale_renditions(int iid, vsource_frame_t *frame, int64_t pts) {
+	int r, njobs = 0;
+	unsigned char *src[4], *dst[4];
+	struct vencoder_scale_job jobs[ENCODER_SIMULCAST_MAX];
+	dpipe_buffer_t *jobdata[ENCODER_SIMULCAST_MAX];
+	int jobrend[ENCODER_SIMULCAST_MAX];
+	void *args[ENCODER_SIMULCAST_MAX];
+	//
+	src[0] = frame->imgbuf;
+	src[1] = src[0] + frame->realwidth * frame->realheight;
+	src[2] = src[1] + ((frame->realwidth * frame->realheight) >> 2);
+	src[3] = NULL;
+	for(r = 1; r < vencoder_renditions; r++) {
+		encoder_rendition_t *rend = encoder_simulcast_rendition(r);
+		dpipe_buffer_t *data;
+		vsource_frame_t *dstframe;
+		//
+		if(vsimulcast_sws[iid][r] == NULL) {
+			vsimulcast_sws[iid][r] = sws_getContext(
+				frame->realwidth, frame->realheight, AV_PIX_FMT_YUV420P,
+				rend->width, rend->height, AV_PIX_FMT_YUV420P,
+				SWS_BICUBIC, NULL, NULL, NULL);
+			if(vsimulcast_sws[iid][r] == NULL) {
+				ga_error("video encoder: cannot create simulcast converter (%dx%d)->(%dx%d)\n",
+					frame->realwidth, frame->realheight,
+					rend->width, rend->height);
+				continue;
+			}
+		}
+		data = dpipe_get(vsimulcast_pipe[iid][r]);
+		dstframe = (vsource_frame_t*) data->pointer;
+		// renditions share the timeline of rendition 0
+		dstframe->imgpts = pts;
+		dstframe->timestamp = frame->timestamp;
+		dstframe->pixelformat = AV_PIX_FMT_YUV420P;
+		dstframe->realwidth = rend->width;
+		dstframe->realheight = rend->height;
+		dstframe->realstride = rend->width;
+		dstframe->realsize = rend->width * rend->height * 3 / 2;
+		vsource_frame_copy_roi(frame, dstframe);
+		//
+		dst[0] = dstframe->imgbuf;
+		dst[1] = dst[0] + rend->width * rend->height;
+		dst[2] = dst[1] + ((rend->width * rend->height) >> 2);
+		dst[3] = NULL;
+		dstframe->linesize[0] = rend->width;
+		dstframe->linesize[1] = rend->width >> 1;
+		dstframe->linesize[2] = rend->width >> 1;
+		dstframe->linesize[3] = 0;
+		//
+		jobs[njobs].sws = vsimulcast_sws[iid][r];
+		jobs[njobs].src = frame;
+		jobs[njobs].dst = dstframe;
+		bcopy(src, jobs[njobs].srcplane, sizeof(src));
+		bcopy(dst, jobs[njobs].dstplane, sizeof(dst));
+		jobdata[njobs] = data;
+		jobrend[njobs] = r;
+		args[njobs] = &jobs[njobs];
+		njobs++;
+	}
+	ga_workpool_run(iid, vencoder_scale_job_run, args, njobs);
+	for(r = 0; r < njobs; r++)
+		dpipe_store(vsimulcast_pipe[iid][jobrend[r]], jobdata[r]);
+	return;
+}
+
+static void *
+vencoder_simulcast_threadproc(void *arg) {
+	// arg is pointer to channel * ENCODER_SIMULCAST_MAX + rendition
+	int iid = *((int*) arg) / ENCODER_SIMULCAST_MAX;
+	int r = *((int*) arg) % ENCODER_SIMULCAST_MAX;
+	dpipe_t *pipe = vsimulcast_pipe[iid][r];
+	x264_t *encoder = vsimulcast[iid][r];
+	encoder_rendition_t *rend = encoder_simulcast_rendition(r);
+	dpipe_buffer_t *data = NULL;
+	vsource_frame_t *frame = NULL;
+	//
+	unsigned char *pktbuf = NULL;
+	int pktbufsize = 0, pktbufmax = 0;
+	//
+	float *qpmap = NULL;
+	int mbw = 0, mbh = 0;
+	//
+	pktbufmax = rend->width * rend->height * 2;
+	if((pktbuf = (unsigned char*) malloc(pktbufmax)) == NULL) {
+		ga_error("video encoder: allocate memory failed.\n");
+		goto simulcast_quit;
+	}
+	if(roiconf.enabled != 0) {
+		mbw = (rend->width + 15) >> 4;
+		mbh = (rend->height + 15) >> 4;
+		if((qpmap = (float*) malloc(sizeof(float) * mbw * mbh)) == NULL) {
+			ga_error("video encoder: allocate ROI map failed.\n");
+			goto simulcast_quit;
+		}
+	}
+	ga_thread_role("vencoder", VIDEO_SOURCE_CHANNEL_MAX + iid * ENCODER_SIMULCAST_MAX + r);
+	ga_error("video encoding started: simulcast #%d.%d tid=%ld %dx%d@%dKbps.\n",
+		iid, r, ga_gettid(), rend->width, rend->height, rend->bitrateKbps);
+	//
+	while(vencoder_started != 0 && encoder_running() > 0) {
+		x264_picture_t pic_in, pic_out = {0};
+		x264_nal_t *nal;
+		int i, size, nnal;
+		struct timeval tv;
+		struct timespec to;
+		AVPacket pkt;
+		//
+		gettimeofday(&tv, NULL);
+		to.tv_sec = tv.tv_sec+1;
+		to.tv_nsec = tv.tv_usec * 1000;
+		if((data = dpipe_load(pipe, &to)) == NULL)
+			continue;
+		frame = (vsource_frame_t*) data->pointer;
+		//
+		x264_picture_init(&pic_in);
+		pic_in.img.i_csp = X264_CSP_I420;
+		pic_in.img.i_plane = 3;
+		pic_in.img.i_stride[0] = frame->linesize[0];
+		pic_in.img.i_stride[1] = frame->linesize[1];
+		pic_in.img.i_stride[2] = frame->linesize[2];
+		pic_in.img.plane[0] = frame->imgbuf;
+		pic_in.img.plane[1] = pic_in.img.plane[0] + rend->width*rend->height;
+		pic_in.img.plane[2] = pic_in.img.plane[1] + ((rend->width*rend->height) >> 2);
+		pic_in.i_pts = frame->imgpts;
+		if(vencoder_keyframe_requested(iid, r))
+			pic_in.i_type = X264_TYPE_IDR;
+		if(qpmap != NULL
+		&& vsource_frame_roi_qpmap(frame, &roiconf, qpmap, mbw, mbh) == 0) {
+			pic_in.prop.quant_offsets = qpmap;
+			pic_in.prop.quant_offsets_free = NULL;
+		}
+		//
+		size = x264_encoder_encode(encoder, &nal, &nnal, &pic_in, &pic_out);
+		dpipe_put(pipe, data);
+		if(size < 0) {
+			ga_error("video encoder: simulcast #%d.%d encode failed, err = %d\n", iid, r, size);
+			break;
+		}
+		if(size == 0)
+			continue;
+		// concatenate nals
+		pktbufsize = 0;
+		if(pic_out.b_keyframe)
+			pktbufsize = vencoder_put_headers(encoder, nal, nnal, pktbuf, pktbufmax);
+		for(i = 0; i < nnal; i++) {
+			if(pktbufsize + nal[i].i_payload > pktbufmax) {
+				ga_error("video encoder: nal dropped (%d < %d).\n", i+1, nnal);
+				break;
+			}
+			bcopy(nal[i].p_payload, pktbuf + pktbufsize, nal[i].i_payload);
+			pktbufsize += nal[i].i_payload;
+		}
+		av_init_packet(&pkt);
+		pkt.pts = pic_in.i_pts;
+		pkt.stream_index = 0;
+		if(pic_out.b_keyframe)
+			pkt.flags |= AV_PKT_FLAG_KEY;
+		pkt.size = pktbufsize;
+		pkt.data = pktbuf;
+		if(vencoder_send_packet(iid, r, &pkt) < 0)
+			break;
+	}
+	//
+simulcast_quit:
+	if(pktbuf != NULL)
+		free(pktbuf);
+	if(qpmap != NULL)
+		free(qpmap);
+	ga_error("video encoder: simulcast #%d.%d terminated (tid=%ld).\n", iid, r, ga_gettid());
+	return NULL;
+}
+
 static void *
 vencoder_threadproc(void *arg) {
 	// arg is pointer to source pipename
@@ -307,7 +717,9 @@ vencoder_threadproc(void *arg) {
 	unsigned char *pktbuf = NULL;
 	int pktbufsize = 0, pktbufmax = 0;
 	int video_written = 0;
-	int64_t x264_pts = 0;
+	//
+	float *qpmap = NULL;
+	int mbw = 0, mbh = 0;
 	//
 	if(pipe == NULL) {
 		ga_error("video encoder: invalid pipeline specified (%s).\n", pipename);
@@ -326,7 +738,16 @@ vencoder_threadproc(void *arg) {
 		ga_error("video encoder: allocate memory failed.\n");
 		goto video_quit;
 	}
+	if(roiconf.enabled != 0) {
+		mbw = (outputW + 15) >> 4;
+		mbh = (outputH + 15) >> 4;
+		if((qpmap = (float*) malloc(sizeof(float) * mbw * mbh)) == NULL) {
+			ga_error("video encoder: allocate ROI map failed.\n");
+			goto video_quit;
+		}
+	}
 	// start encoding
+	ga_thread_role("vencoder", iid);
 	ga_error("video encoding started: tid=%ld %dx%d@%dfps.\n",
 		ga_gettid(),
 		outputW, outputH, rtspconf->video_fps);
@@ -337,9 +758,12 @@ vencoder_threadproc(void *arg) {
 		int i, size, nnal;
 		struct timeval tv;
 		struct timespec to;
+		struct timeval encstart, encend;
+		int backlog;
 		gettimeofday(&tv, NULL);
 		// need reconfigure?
 		vencoder_reconfigure(iid);
+		encoder = vencoder[iid];
 		// wait for notification
 		to.tv_sec = tv.tv_sec+1;
 		to.tv_nsec = tv.tv_usec * 1000;
@@ -348,6 +772,9 @@ vencoder_threadproc(void *arg) {
 			ga_error("viedo encoder: image source timed out.\n");
 			continue;
 		}
+		// frames still queued behind this one
+		backlog = pipe->out_count;
+		gettimeofday(&encstart, NULL);
 		frame = (vsource_frame_t*) data->pointer;
 		// handle pts
 		if(basePts == -1LL) {
@@ -357,6 +784,8 @@ vencoder_threadproc(void *arg) {
 		} else {
 			newpts = ptsSync + frame->imgpts - basePts;
 		}
+		if(iid == 0)
+			encoder_clock_report(ENCODER_CLOCK_VIDEO, newpts, rtspconf->video_fps);
 		//
 		x264_picture_init(&pic_in);
 		//
@@ -368,6 +797,24 @@ vencoder_threadproc(void *arg) {
 		pic_in.img.plane[0] = frame->imgbuf;
 		pic_in.img.plane[1] = pic_in.img.plane[0] + outputW*outputH;
 		pic_in.img.plane[2] = pic_in.img.plane[1] + ((outputW * outputH) >> 2);
+		// downscaled by the overload governor?
+		if(vencoder_sws[iid] != NULL) {
+			int w = vencoder_width[iid], h = vencoder_height[iid];
+			unsigned char *dst[4];
+			dst[0] = vencoder_scalebuf[iid];
+			dst[1] = dst[0] + w * h;
+			dst[2] = dst[1] + ((w * h) >> 2);
+			dst[3] = NULL;
+			pic_in.img.i_stride[0] = w;
+			pic_in.img.i_stride[1] = w >> 1;
+			pic_in.img.i_stride[2] = w >> 1;
+			sws_scale(vencoder_sws[iid],
+				pic_in.img.plane, frame->linesize, 0, outputH,
+				dst, pic_in.img.i_stride);
+			pic_in.img.plane[0] = dst[0];
+			pic_in.img.plane[1] = dst[1];
+			pic_in.img.plane[2] = dst[2];
+		}
 		// pts must be monotonically increasing
 		if(newpts > pts) {
 			pts = newpts;
@@ -375,7 +822,18 @@ vencoder_threadproc(void *arg) {
 			pts++;
 		}
 		//pic_in.i_pts = pts;
-		pic_in.i_pts = x264_pts++;
+		pic_in.i_pts = vencoder_pts[iid]++;
+		if(vencoder_keyframe_requested(iid, 0))
+			pic_in.i_type = X264_TYPE_IDR;
+		// feed simulcast renditions before rendition 0 occupies the cpu
+		if(vencoder_renditions > 1)
+			vencoder_scale_renditions(iid, frame, pic_in.i_pts);
+		// region-of-interest: consumed synchronously by x264_encoder_encode
+		if(qpmap != NULL && vencoder_sws[iid] == NULL
+		&& vsource_frame_roi_qpmap(frame, &roiconf, qpmap, mbw, mbh) == 0) {
+			pic_in.prop.quant_offsets = qpmap;
+			pic_in.prop.quant_offsets_free = NULL;
+		}
 		// encode
 		if((size = x264_encoder_encode(encoder, &nal, &nnal, &pic_in, &pic_out)) < 0) {
 			ga_error("video encoder: encode failed, err = %d\n", size);
@@ -383,6 +841,8 @@ vencoder_threadproc(void *arg) {
 			break;
 		}
 		dpipe_put(pipe, data);
+		gettimeofday(&encend, NULL);
+		encoder_governor_report(iid, (int) tvdiff_us(&encend, &encstart), backlog);
 		// encode
 		if(size > 0) {
 			AVPacket pkt;
@@ -390,8 +850,12 @@ vencoder_threadproc(void *arg) {
 			av_init_packet(&pkt);
 			pkt.pts = pic_in.i_pts;
 			pkt.stream_index = 0;
+			if(pic_out.b_keyframe)
+				pkt.flags |= AV_PKT_FLAG_KEY;
 			// concatenate nals
 			pktbufsize = 0;
+			if(pic_out.b_keyframe && vencoder_renditions > 1)
+				pktbufsize = vencoder_put_headers(encoder, nal, nnal, pktbuf, pktbufmax);
 			for(i = 0; i < nnal; i++) {
 				if(pktbufsize + nal[i].i_payload > pktbufmax) {
 					ga_error("video encoder: nal dropped (%d < %d).\n", i+1, nnal);
@@ -417,9 +881,7 @@ vencoder_threadproc(void *arg) {
 			} while(0);
 #endif
 			// send the packet
-			if(encoder_send_packet("video-encoder",
-					iid/*rtspconf->video_id*/, &pkt,
-					pkt.pts, NULL) < 0) {
+			if(vencoder_send_packet(iid, 0, &pkt) < 0) {
 				goto video_quit;
 			}
 #ifdef SAVEENC
@@ -502,6 +964,10 @@ video_quit:
 		free(pktbuf);
 	}
 	pktbuf = NULL;
+	if(qpmap != NULL) {
+		free(qpmap);
+	}
+	qpmap = NULL;
 	//
 	ga_error("video encoder: thread terminated (tid=%ld).\n", ga_gettid());
 	//
@@ -510,7 +976,7 @@ video_quit:
 
 static int
 vencoder_start(void *arg) {
-	int iid;
+	int iid, r;
 	char *pipefmt = (char*) arg;
 #define	MAXPARAMLEN	64
 	static char pipename[VIDEO_SOURCE_CHANNEL_MAX][MAXPARAMLEN];
@@ -524,6 +990,15 @@ vencoder_start(void *arg) {
 			ga_error("video encoder: create thread failed.\n");
 			return -1;
 		}
+		for(r = 1; r < vencoder_renditions; r++) {
+			vsimulcast_arg[iid][r] = iid * ENCODER_SIMULCAST_MAX + r;
+			if(pthread_create(&vsimulcast_tid[iid][r], NULL,
+					vencoder_simulcast_threadproc, &vsimulcast_arg[iid][r]) != 0) {
+				vencoder_started = 0;
+				ga_error("video encoder: create simulcast thread failed.\n");
+				return -1;
+			}
+		}
 	}
 	ga_error("video encdoer: all started (%d)\n", iid);
 	return 0;
@@ -531,13 +1006,15 @@ vencoder_start(void *arg) {
 
 static int
 vencoder_stop(void *arg) {
-	int iid;
+	int iid, r;
 	void *ignored;
 	if(vencoder_started == 0)
 		return 0;
 	vencoder_started = 0;
 	for(iid = 0; iid < video_source_channels(); iid++) {
 		pthread_join(vencoder_tid[iid], &ignored);
+		for(r = 1; r < vencoder_renditions; r++)
+			pthread_join(vsimulcast_tid[iid][r], &ignored);
 	}
 	ga_error("video encdoer: all stopped (%d)\n", iid);
 	return 0;
@@ -572,6 +1049,22 @@ x264_reconfigure(ga_ioctl_reconfigure_t *reconf) {
 	return 0;
 }
 
+static int
+x264_request_keyframe(ga_ioctl_keyframe_t *kf) {
+	int r;
+	if(kf->id < 0 || kf->id >= video_source_channels())
+		return GA_IOCTL_ERR_BADID;
+	if(kf->rendition >= vencoder_renditions)
+		return GA_IOCTL_ERR_BADID;
+	pthread_mutex_lock(&vencoder_reconf_mutex[kf->id]);
+	for(r = 0; r < vencoder_renditions; r++) {
+		if(kf->rendition < 0 || kf->rendition == r)
+			vencoder_forceidr[kf->id][r] = 1;
+	}
+	pthread_mutex_unlock(&vencoder_reconf_mutex[kf->id]);
+	return 0;
+}
+
 static int
 x264_get_sps_pps(int iid) {
 	x264_nal_t *p_nal;
@@ -629,25 +1122,37 @@ vencoder_ioctl(int command, int argsize, void *arg) {
 			return GA_IOCTL_ERR_INVALID_ARGUMENT;
 		x264_reconfigure((ga_ioctl_reconfigure_t*) arg);
 		break;
-	case GA_IOCTL_GETSPS:
-		if(argsize != sizeof(ga_ioctl_buffer_t))
+	case GA_IOCTL_REQUEST_KEYFRAME:
+		if(argsize != sizeof(ga_ioctl_keyframe_t))
 			return GA_IOCTL_ERR_INVALID_ARGUMENT;
-		if(x264_get_sps_pps(buf->id) < 0)
-			return GA_IOCTL_ERR_NOTFOUND;
-		if(buf->size < _spslen[buf->id])
-			return GA_IOCTL_ERR_BUFFERSIZE;
-		buf->size = _spslen[buf->id];
-		bcopy(_sps[buf->id], buf->ptr, buf->size);
+		ret = x264_request_keyframe((ga_ioctl_keyframe_t*) arg);
 		break;
+	case GA_IOCTL_GETSPS:
 	case GA_IOCTL_GETPPS:
 		if(argsize != sizeof(ga_ioctl_buffer_t))
 			return GA_IOCTL_ERR_INVALID_ARGUMENT;
-		if(x264_get_sps_pps(buf->id) < 0)
-			return GA_IOCTL_ERR_NOTFOUND;
-		if(buf->size < _ppslen[buf->id])
-			return GA_IOCTL_ERR_BUFFERSIZE;
-		buf->size = _ppslen[buf->id];
-		bcopy(_pps[buf->id], buf->ptr, buf->size);
+		if(buf->id < 0 || buf->id >= video_source_channels())
+			return GA_IOCTL_ERR_BADID;
+		// the cache is replaced by a resize, under the same lock
+		pthread_mutex_lock(&vencoder_reconf_mutex[buf->id]);
+		if(x264_get_sps_pps(buf->id) < 0) {
+			ret = GA_IOCTL_ERR_NOTFOUND;
+		} else if(command == GA_IOCTL_GETSPS) {
+			if(buf->size < _spslen[buf->id]) {
+				ret = GA_IOCTL_ERR_BUFFERSIZE;
+			} else {
+				buf->size = _spslen[buf->id];
+				bcopy(_sps[buf->id], buf->ptr, buf->size);
+			}
+		} else {
+			if(buf->size < _ppslen[buf->id]) {
+				ret = GA_IOCTL_ERR_BUFFERSIZE;
+			} else {
+				buf->size = _ppslen[buf->id];
+				bcopy(_pps[buf->id], buf->ptr, buf->size);
+			}
+		}
+		pthread_mutex_unlock(&vencoder_reconf_mutex[buf->id]);
 		break;
 	default:
 		ret = GA_IOCTL_ERR_NOTSUPPORTED;
@@ -27,6 +27,7 @@
 
 #include "ga-common.h"
 #include "ga-conf.h"
+#include "ga-thread.h"
 #include "ga-avcodec.h"
 
 #include "dpipe.h"
@@ -202,6 +203,7 @@ filter_RGB2YUV_threadproc(void *arg) {
 #endif
 	//
 	iid = dstpipe->channel_id;
+	ga_thread_role("filter", iid);
 	outputW = video_source_out_width(iid);
 	outputH = video_source_out_height(iid);
 	//
@@ -232,6 +234,7 @@ filter_RGB2YUV_threadproc(void *arg) {
 		dstframe->realheight = outputH;
 		dstframe->realstride = outputW;
 		dstframe->realsize = outputW * outputH * 3 / 2;
+		vsource_frame_copy_roi(srcframe, dstframe);
 		// scale image: RGBA, BGRA, or YUV
 		swsctx = lookup_frame_converter(
 				srcframe->realwidth,
@@ -33,10 +33,23 @@
 #include <sys/time.h>
 #include <arpa/inet.h>
 #endif	/* ifndef WIN32 */
+#ifndef WIN32
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#endif
+#ifdef __linux__
+#include <fcntl.h>
+#include <netinet/udp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#endif
 
 #include "ga-common.h"
 #include "ga-avcodec.h"
 #include "ga-conf.h"
+#include "ga-thread.h"
 
 #include "vsource.h"
 #include "asource.h"
@@ -45,11 +58,50 @@
 
 #include "rtspserver.h"
 
+#include <map>
+#include <vector>
+using namespace std;
+
+extern "C" {
+#include <libavutil/random_seed.h>
+}
+
 #define	RTSP_STREAM_FORMAT	"streamid=%d"
 #define	RTSP_STREAM_FORMAT_MAXLEN	64
 
 static struct RTSPConf *rtspconf = NULL;
 
+#if defined(HOLE_PUNCHING) && defined(__linux__)
+#define	RTP_SENDMMSG		// batched RTP/UDP transmission
+#ifndef SOL_UDP
+#define	SOL_UDP			17
+#endif
+#ifndef UDP_SEGMENT
+#define	UDP_SEGMENT		103
+#endif
+#define	RTP_BATCH_MAX		64	// datagrams per sendmmsg call
+#define	RTP_BATCH_IOV		256	// packets per sendmmsg call
+#define	RTP_GSO_SEGMENTS	64	// packets per GSO datagram
+#define	RTP_GSO_BYTES		65000	// bytes per GSO datagram
+static int rtp_mmsg_disabled = 0;	// sendmmsg is not supported
+static int rtp_gso_disabled = 0;	// UDP_SEGMENT is not supported
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_RECVSEND_FIXED_BUF
+#define	RTP_URING		// io_uring zero-copy RTP/UDP transmission
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define	RTP_URING_ENTRIES	1024		// submission queue entries
+#define	RTP_URING_ARENA		(4*1024*1024)	// registered buffer per ring
+#define	RTP_URING_BATCHES	256		// frames in flight per ring
+#define	RTP_URING_FAILURES	64		// failed sends in a row before falling back
+static int rtp_uring_disabled = 0;	// io_uring send_zc is not supported
+#endif
+#endif
+#endif
+#endif
+
 #ifndef NIPQUAD
 #define NIPQUAD(x)	((unsigned char*)&(x))[0],	\
 			((unsigned char*)&(x))[1],	\
@@ -68,8 +120,22 @@ rtsp_cleanup(RTSPContext *rtsp, int retcode) {
 	return;
 }
 
+#ifdef RTSP_SEND_QUEUE
+static int rtsp_sendq_text(RTSPContext *ctx, const void *buf, int count);
+#endif
+#ifdef RTSP_REACTOR
+static void rtsp_reactor_arm(RTSPContext *ctx, int writable);
+static void rtsp_reactor_watch(RTSPContext *ctx, int streamid);
+static void rtsp_reactor_play(RTSPContext *ctx);
+#endif
+
 static int
 rtsp_write(RTSPContext *ctx, const void *buf, size_t count) {
+#ifdef RTSP_SEND_QUEUE
+	// once a send queue exists, it is the only writer of the socket
+	if(ctx->sendq.buf != NULL)
+		return rtsp_sendq_text(ctx, buf, count);
+#endif
 	return write(ctx->fd, buf, count);
 }
 
@@ -82,17 +148,317 @@ rtsp_printf(RTSPContext *ctx, const char *fmt, ...) {
 	va_start(ap, fmt);
 	buflen = vsnprintf(buf, sizeof(buf), fmt, ap);
 	va_end(ap);
-	return rtsp_write(ctx, buf, buflen);
+	// do not interleave with queued RTP packets
+	pthread_mutex_lock(&ctx->rtsp_writer_mutex);
+	buflen = rtsp_write(ctx, buf, buflen);
+	pthread_mutex_unlock(&ctx->rtsp_writer_mutex);
+	return buflen;
+}
+
+#ifdef RTSP_SEND_QUEUE
+#define	RTSP_SENDQ_KEYFRAME_RETRY	500000LL	// us between IDR requests while dropping
+#define	RTSP_SENDQ_MINFRAMES	2		// largest frames a send queue must hold
+#define	RTSP_SENDQ_REPLIES	65536		// room for RTSP replies
+static int rtsp_sendq_count = 0;		// I/O threads started, names them
+
+/* the smallest send queue: a frame that cannot fit would keep a dropping
+ * stream from ever resuming at a keyframe */
+static int
+rtsp_sendq_minsize() {
+	int i, frame, maxframe = 0;
+	for(i = 0; i < video_source_channels(); i++) {
+		// encoder packet buffers hold two bytes per pixel
+		frame = video_source_out_width(i) * video_source_out_height(i) * 2;
+		if(frame > maxframe)
+			maxframe = frame;
+	}
+	return RTSP_SENDQ_MINFRAMES * maxframe + RTSP_SENDQ_REPLIES;
+}
+
+/* copy data into the send queue ring at the write position */
+static void
+rtsp_sendq_put(struct RTSPSendQueue *q, const void *data, int len) {
+	int off = q->wpos % q->size;
+	int n = q->size - off;
+	if(n > len)
+		n = len;
+	bcopy(data, q->buf + off, n);
+	if(n < len)
+		bcopy((const char*) data + n, q->buf, len - n);
+	q->wpos += len;
+	return;
+}
+
+static void
+rtsp_sendq_report(RTSPContext *ctx, long long now) {
+	struct RTSPSendQueue *q = &ctx->sendq;
+	int inflight = -1;
+#ifdef __linux__
+	if(ioctl(ctx->fd, TIOCOUTQ, &inflight) < 0)
+		inflight = -1;
+#endif
+	pthread_mutex_lock(&q->mutex);
+	ga_error("RTSP: client %s:%d queue %d bytes (max %d/%d), in flight %d bytes, sent %llu bytes, dropped %u frames\n",
+		inet_ntoa(ctx->client.sin_addr), ntohs(ctx->client.sin_port),
+		(int) (q->wpos - q->rpos), q->maxdepth, q->size,
+		inflight, q->sent, q->dropped);
+	q->maxdepth = (int) (q->wpos - q->rpos);
+	q->dropped = 0;
+	q->sent = 0;
+	q->since = now;
+	pthread_mutex_unlock(&q->mutex);
+	return;
+}
+
+/* I/O thread: flush the send queue with writev batches */
+static void *
+rtsp_sendq_threadproc(void *arg) {
+	RTSPContext *ctx = (RTSPContext*) arg;
+	struct RTSPSendQueue *q = &ctx->sendq;
+	struct iovec iov[2];
+	int iovcnt, off, len;
+	ssize_t wlen;
+	//
+	ga_thread_role("sendq", __atomic_fetch_add(&rtsp_sendq_count, 1, __ATOMIC_RELAXED));
+	ga_error("RTSP: send queue started (%d bytes, policy=%s).\n",
+		q->size, q->policy == RTSP_SENDQ_DISCONNECT ? "disconnect" : "drop");
+	pthread_mutex_lock(&q->mutex);
+	while(q->running) {
+		// after a write failure, nothing is sent until the queue stops
+		if(q->wpos == q->rpos || q->failed) {
+			struct timespec to;
+			clock_gettime(CLOCK_REALTIME, &to);
+			to.tv_sec++;
+			pthread_cond_timedwait(&q->cond, &q->mutex, &to);
+		}
+		if(q->report > 0) {
+			long long now = ga_monotonic_us();
+			if(q->since == 0) {
+				q->since = now;
+			} else if(now - q->since >= q->report) {
+				pthread_mutex_unlock(&q->mutex);
+				rtsp_sendq_report(ctx, now);
+				pthread_mutex_lock(&q->mutex);
+			}
+		}
+		if(q->wpos == q->rpos || q->failed)
+			continue;
+		// the queue holds whole frames only, so are the batches
+		off = q->rpos % q->size;
+		len = (int) (q->wpos - q->rpos);
+		iov[0].iov_base = q->buf + off;
+		if(off + len <= q->size) {
+			iov[0].iov_len = len;
+			iovcnt = 1;
+		} else {
+			iov[0].iov_len = q->size - off;
+			iov[1].iov_base = q->buf;
+			iov[1].iov_len = len - iov[0].iov_len;
+			iovcnt = 2;
+		}
+		pthread_mutex_unlock(&q->mutex);
+		// replies are queued too, so the socket is written without locks
+		while(iovcnt > 0) {
+			if((wlen = writev(ctx->fd, iov, iovcnt)) < 0) {
+				if(errno == EINTR)
+					continue;
+				break;
+			}
+			pthread_mutex_lock(&q->mutex);
+			q->rpos += wlen;
+			q->sent += wlen;
+			pthread_mutex_unlock(&q->mutex);
+			while(iovcnt > 0 && wlen >= (ssize_t) iov[0].iov_len) {
+				wlen -= iov[0].iov_len;
+				iov[0] = iov[1];
+				iovcnt--;
+			}
+			if(iovcnt > 0) {
+				iov[0].iov_base = (char*) iov[0].iov_base + wlen;
+				iov[0].iov_len -= wlen;
+			}
+		}
+		pthread_mutex_lock(&q->mutex);
+		if(iovcnt > 0) {
+			ga_error("RTSP: send queue write failed - %s\n", strerror(errno));
+			q->failed = 1;
+		}
+	}
+	pthread_mutex_unlock(&q->mutex);
+	ga_error("RTSP: send queue stopped.\n");
+	return NULL;
+}
+
+/* start the I/O thread of a client, for RTP over RTSP/TCP */
+static int
+rtsp_sendq_start(RTSPContext *ctx) {
+	struct RTSPSendQueue *q = &ctx->sendq;
+	if(q->size <= 0 || q->running || q->buf != NULL)
+		return 0;
+	if((q->buf = (unsigned char*) malloc(q->size)) == NULL) {
+		ga_error("RTSP: cannot allocate send queue (%d bytes)\n", q->size);
+		return -1;
+	}
+	q->running = 1;
+	if(pthread_create(&q->thread, NULL, rtsp_sendq_threadproc, ctx) != 0) {
+		ga_error("RTSP: cannot create send queue thread.\n");
+		q->running = 0;
+		free(q->buf);
+		q->buf = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/* stop the I/O thread; queued frames are discarded */
+static void
+rtsp_sendq_stop(RTSPContext *ctx) {
+	struct RTSPSendQueue *q = &ctx->sendq;
+	if(q->running == 0)
+		return;
+	pthread_mutex_lock(&q->mutex);
+	q->running = 0;
+	q->failed = 1;
+	pthread_cond_signal(&q->cond);
+	pthread_mutex_unlock(&q->mutex);
+	// unblock a pending write to a stalled client
+	shutdown(ctx->fd, SHUT_RDWR);
+	pthread_join(q->thread, NULL);
+	return;
+}
+
+/* ask the video encoder for an IDR frame of a channel */
+static void
+rtsp_sendq_keyframe(int streamid) {
+	ga_module_t *m = encoder_get_vencoder();
+	ga_ioctl_keyframe_t kf;
+	kf.id = streamid;
+	kf.rendition = -1;
+	if(m != NULL && m->ioctl != NULL)
+		m->ioctl(GA_IOCTL_REQUEST_KEYFRAME, sizeof(kf), &kf);
+	return;
+}
+
+/* enqueue a dynamic packet buffer as interleaved frames; never blocks */
+static int
+rtsp_sendq_write(RTSPContext *ctx, int streamid, uint8_t *buf, int buflen, int keyframe) {
+	struct RTSPSendQueue *q = &ctx->sendq;
+	unsigned char header[4];
+	int i, pktlen, need = 0;
+	int reqkey = 0, depth;
+	// audio packets carry no keyframe flag: they are dropped one by one
+	int video = streamid < video_source_channels() ? 1 : 0;
+	long long now;
+	// frame size after interleaving
+	for(i = 0; i + 4 <= buflen; i += 4 + pktlen) {
+		pktlen = (buf[i] << 24) | (buf[i+1] << 16) | (buf[i+2] << 8) | buf[i+3];
+		if(pktlen > 0)
+			need += 4 + pktlen;
+	}
+	pthread_mutex_lock(&q->mutex);
+	if(q->failed) {
+		pthread_mutex_unlock(&q->mutex);
+		return -1;
+	}
+	if(q->dropping[streamid] && keyframe == 0) {
+		q->dropped++;
+		// the requested IDR frame may have been lost as well
+		now = ga_monotonic_us();
+		if(now - q->keyreq[streamid] >= RTSP_SENDQ_KEYFRAME_RETRY) {
+			q->keyreq[streamid] = now;
+			reqkey = 1;
+		}
+		pthread_mutex_unlock(&q->mutex);
+		if(reqkey)
+			rtsp_sendq_keyframe(streamid);
+		return buflen;
+	}
+	if(q->wpos - q->rpos + need > (unsigned) q->size) {
+		q->dropped++;
+		if(q->policy == RTSP_SENDQ_DISCONNECT) {
+			ga_error("RTSP: send queue overflow (stream %d), disconnect client.\n", streamid);
+			q->failed = 1;
+			pthread_mutex_unlock(&q->mutex);
+			shutdown(ctx->fd, SHUT_RDWR);
+			return -1;
+		}
+		if(video && q->dropping[streamid] == 0) {
+			ga_error("RTSP: send queue overflow (stream %d), drop until the next keyframe.\n", streamid);
+			q->dropping[streamid] = 1;
+			q->keyreq[streamid] = ga_monotonic_us();
+			reqkey = 1;
+		}
+		pthread_mutex_unlock(&q->mutex);
+		if(reqkey)
+			rtsp_sendq_keyframe(streamid);
+		return buflen;
+	}
+	q->dropping[streamid] = 0;
+	for(i = 0; i + 4 <= buflen; i += 4 + pktlen) {
+		pktlen = (buf[i] << 24) | (buf[i+1] << 16) | (buf[i+2] << 8) | buf[i+3];
+		if(pktlen == 0)
+			continue;
+		header[0] = '$';
+		header[1] = (streamid<<1) & 0x0ff;
+		header[2] = pktlen>>8;
+		header[3] = pktlen & 0x0ff;
+		rtsp_sendq_put(q, header, 4);
+		rtsp_sendq_put(q, &buf[i+4], pktlen);
+	}
+	depth = (int) (q->wpos - q->rpos);
+	if(depth > q->maxdepth)
+		q->maxdepth = depth;
+	pthread_cond_signal(&q->cond);
+#ifdef RTSP_REACTOR
+	if(ctx->session != NULL && q->armed == 0) {
+		q->armed = 1;
+		rtsp_reactor_arm(ctx, 1);
+	}
+#endif
+	pthread_mutex_unlock(&q->mutex);
+	return buflen;
+}
+
+/* enqueue an RTSP reply behind the queued frames */
+static int
+rtsp_sendq_text(RTSPContext *ctx, const void *buf, int count) {
+	struct RTSPSendQueue *q = &ctx->sendq;
+	pthread_mutex_lock(&q->mutex);
+	if(q->failed) {
+		pthread_mutex_unlock(&q->mutex);
+		return -1;
+	}
+	if(q->wpos - q->rpos + count > (unsigned) q->size) {
+		ga_error("RTSP: send queue overflow on reply, disconnect client.\n");
+		q->failed = 1;
+		pthread_mutex_unlock(&q->mutex);
+		return -1;
+	}
+	rtsp_sendq_put(q, buf, count);
+	pthread_cond_signal(&q->cond);
+#ifdef RTSP_REACTOR
+	if(ctx->session != NULL && q->armed == 0) {
+		q->armed = 1;
+		rtsp_reactor_arm(ctx, 1);
+	}
+#endif
+	pthread_mutex_unlock(&q->mutex);
+	return count;
 }
+#endif
 
 int
-rtsp_write_bindata(RTSPContext *ctx, int streamid, uint8_t *buf, int buflen) {
+rtsp_write_bindata(RTSPContext *ctx, int streamid, uint8_t *buf, int buflen, int keyframe) {
 	int i, pktlen;
 	char header[4];
 	//
 	if(buflen < 4) {
 		return buflen;
 	}
+#ifdef RTSP_SEND_QUEUE
+	if(ctx->sendq.buf != NULL)
+		return rtsp_sendq_write(ctx, streamid, buf, buflen, keyframe);
+#endif
 	// XXX: buffer is the reuslt from avio_open_dyn_buf.
 	// Multiple RTP packets can be placed in a single buffer.
 	// Format == 4-bytes (big-endian) packet size + packet-data
@@ -117,6 +483,7 @@ rtsp_write_bindata(RTSPContext *ctx, int streamid, uint8_t *buf, int buflen) {
 			return i;
 		}
 		if(rtsp_write(ctx, &buf[i+4], pktlen) != pktlen) {
+			pthread_mutex_unlock(&ctx->rtsp_writer_mutex);
 			return i;
 		}
 		pthread_mutex_unlock(&ctx->rtsp_writer_mutex);
@@ -154,6 +521,16 @@ rtp_open_internal(unsigned short *port) {
 		return -1;
 	}
 	*port = ntohs(sin.sin_port);
+#ifdef RTP_SENDMMSG
+	if(rtp_gso_disabled == 0) {
+		int segsize = 0;
+		socklen_t optlen = sizeof(segsize);
+		if(getsockopt(s, SOL_UDP, UDP_SEGMENT, &segsize, &optlen) < 0) {
+			ga_error("RTP: UDP GSO is not supported by the kernel.\n");
+			rtp_gso_disabled = 1;
+		}
+	}
+#endif
 	return s;
 }
 
@@ -181,6 +558,10 @@ rtp_open_ports(RTSPContext *ctx, int streamid) {
 		(int) ctx->rtpSocket[streamid],
 		(unsigned int) ctx->rtpLocalPort[streamid+1],
 		(int) ctx->rtpSocket[streamid+1]);
+#ifdef RTSP_REACTOR
+	if(ctx->session != NULL)
+		rtsp_reactor_watch(ctx, streamid/2);
+#endif
 	return 0;
 }
 
@@ -196,18 +577,10 @@ rtp_close_ports(RTSPContext *ctx, int streamid) {
 	return 0;
 }
 
-int
-rtp_write_bindata(RTSPContext *ctx, int streamid, uint8_t *buf, int buflen) {
+/* send RTP packets in a dynamic packet buffer one by one */
+static int
+rtp_write_single(RTSPContext *ctx, int streamid, struct sockaddr_in *sin, uint8_t *buf, int buflen, struct RTPSendStats *st) {
 	int i, pktlen;
-	struct sockaddr_in sin;
-	if(ctx->rtpSocket[streamid*2] == 0)
-		return -1;
-	if(buf==NULL)
-		return 0;
-	if(buflen < 4)
-		return buflen;
-	bcopy(&ctx->client, &sin, sizeof(sin));
-	sin.sin_port = ctx->rtpPeerPort[streamid*2];
 	// XXX: buffer is the reuslt from avio_open_dyn_buf.
 	// Multiple RTP packets can be placed in a single buffer.
 	// Format == 4-bytes (big-endian) packet size + packet-data
@@ -228,125 +601,967 @@ rtp_write_bindata(RTSPContext *ctx, int streamid, uint8_t *buf, int buflen) {
 			buflen);
 #endif
 		sendto(ctx->rtpSocket[streamid*2], (const char*) &buf[i+4], pktlen, 0,
-			(struct sockaddr*) &sin, sizeof(struct sockaddr_in));
+			(struct sockaddr*) sin, sizeof(struct sockaddr_in));
+		st->packets++;
+		st->syscalls++;
 		i += (4+pktlen);
 	}
 	return i;
 }
-#endif
 
-static int
-rtsp_read_internal(RTSPContext *ctx) {
-	int rlen;
-	if((rlen = read(ctx->fd, 
-		ctx->rbuffer + ctx->rbuftail,
-		ctx->rbufsize - ctx->rbuftail)) <= 0) {
-		return -1;
+#ifdef RTP_SENDMMSG
+/* send the segments of a (GSO) datagram as individual packets */
+static void
+rtp_write_msg_split(int fd, struct msghdr *msg, struct RTPSendStats *st) {
+	size_t j;
+	for(j = 0; j < msg->msg_iovlen; j++) {
+		sendto(fd, msg->msg_iov[j].iov_base, msg->msg_iov[j].iov_len, 0,
+			(struct sockaddr*) msg->msg_name, msg->msg_namelen);
+		st->syscalls++;
 	}
-	ctx->rbuftail += rlen;
-	return ctx->rbuftail - ctx->rbufhead;
+	return;
 }
 
-static int
-rtsp_read_text(RTSPContext *ctx, char *buf, size_t count) {
-	int i;
-	size_t textlen;
-again:
-	for(i = ctx->rbufhead; i < ctx->rbuftail; i++) {
-		if(ctx->rbuffer[i] == '\n') {
-			textlen = i - ctx->rbufhead + 1;
-			if(textlen > count-1) {
-				ga_error("Insufficient string buffer length.\n");
-				return -1;
-			}
-			bcopy(ctx->rbuffer + ctx->rbufhead, buf, textlen);
-			buf[textlen] = '\0';
-			ctx->rbufhead += textlen;
-			if(ctx->rbufhead == ctx->rbuftail)
-				ctx->rbufhead = ctx->rbuftail = 0;
-			return textlen;
+/* send a batch of datagrams with sendmmsg, falling back on errors */
+static void
+rtp_write_flush(int fd, struct mmsghdr *msgs, int nmsg, struct RTPSendStats *st) {
+	int sent = 0, r;
+	while(sent < nmsg) {
+		if(rtp_mmsg_disabled) {
+			rtp_write_msg_split(fd, &msgs[sent++].msg_hdr, st);
+			continue;
 		}
+		r = sendmmsg(fd, &msgs[sent], nmsg - sent, 0);
+		st->syscalls++;
+		if(r > 0) {
+			sent += r;
+			continue;
+		}
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r < 0 && errno == ENOSYS) {
+			ga_error("RTP: sendmmsg is not supported, fallback to sendto.\n");
+			rtp_mmsg_disabled = 1;
+			continue;
+		}
+		if(msgs[sent].msg_hdr.msg_controllen > 0
+		&& (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP)) {
+			if(rtp_gso_disabled == 0)
+				ga_error("RTP: UDP GSO send failed (%s), disabled.\n", strerror(errno));
+			rtp_gso_disabled = 1;
+			rtp_write_msg_split(fd, &msgs[sent].msg_hdr, st);
+		}
+		// drop the datagram, as a failed sendto does
+		sent++;
 	}
-	// buffer full?
-	if(ctx->rbuftail - ctx->rbufhead == ctx->rbufsize) {
-		ga_error("Buffer full: Extremely long text data encountered?\n");
-		return -1;
-	}
-	// did not found '\n', read more
-	bcopy(ctx->rbuffer + ctx->rbufhead, ctx->rbuffer, ctx->rbuftail - ctx->rbufhead);
-	ctx->rbuftail = ctx->rbuftail - ctx->rbufhead;
-	ctx->rbufhead = 0;
-	//
-	if(rtsp_read_internal(ctx) < 0)
-		return -1;
-	goto again;
-	// unreachable, but to meet compiler's requirement
-	return -1;
+	return;
 }
 
-static int
-rtsp_read_binary(RTSPContext *ctx, char *buf, size_t count) {
-	int reqlength;
-	if(ctx->rbuftail - ctx->rbufhead < 4)
-		goto readmore;
-again:
-	reqlength = (unsigned char) ctx->rbuffer[ctx->rbufhead+2];
-	reqlength <<= 8;
-	reqlength += (unsigned char) ctx->rbuffer[ctx->rbufhead+3];
-	// data is ready
-	if(4+reqlength <= ctx->rbuftail - ctx->rbufhead) {
-		bcopy(ctx->rbuffer + ctx->rbufhead, buf, 4+reqlength);
-		ctx->rbufhead += (4+reqlength);
-		if(ctx->rbufhead == ctx->rbuftail)
-			ctx->rbufhead = ctx->rbuftail = 0;
-		return 4+reqlength;
-	}
-	// second trail?
-	if(ctx->rbuftail - ctx->rbufhead == ctx->rbufsize) {
-		ga_error("Buffer full: Extremely long binary data encountered?\n");
-		return -1;
+union RTPGsoControl {
+	char buf[CMSG_SPACE(sizeof(uint16_t))];
+	struct cmsghdr align;
+};
+
+/* attach the segment sizes to coalesced datagrams, must be done before
+ * every sendmmsg: a multi-iov message without it is a single datagram */
+static void
+rtp_write_segments(struct mmsghdr *msgs, union RTPGsoControl *ctrl, const int *segsize, int nmsg) {
+	int j;
+	for(j = 0; j < nmsg; j++) {
+		struct msghdr *m = &msgs[j].msg_hdr;
+		struct cmsghdr *cm;
+		if(m->msg_iovlen <= 1) {
+			m->msg_control = NULL;
+			m->msg_controllen = 0;
+			continue;
+		}
+		m->msg_control = ctrl[j].buf;
+		m->msg_controllen = sizeof(ctrl[j].buf);
+		cm = CMSG_FIRSTHDR(m);
+		cm->cmsg_level = SOL_UDP;
+		cm->cmsg_type = UDP_SEGMENT;
+		cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+		*((uint16_t*) CMSG_DATA(cm)) = segsize[j];
 	}
-readmore:
-	bcopy(ctx->rbuffer + ctx->rbufhead, ctx->rbuffer, ctx->rbuftail - ctx->rbufhead);
-	ctx->rbuftail = ctx->rbuftail - ctx->rbufhead;
-	ctx->rbufhead = 0;
-	//
-	if(rtsp_read_internal(ctx) < 0)
-		return -1;
-	goto again;
-	// unreachable, but to meet compiler's requirement
-	return -1;
+	return;
 }
 
+/* send RTP packets in a dynamic packet buffer with sendmmsg; runs of
+ * equal-size packets are coalesced into UDP GSO datagrams if enabled */
 static int
-rtsp_getnext(RTSPContext *ctx, char *buf, size_t count) {
-	// initialize if necessary
-	if(ctx->rbuffer == NULL) {
-		ctx->rbufsize = 65536;
-		if((ctx->rbuffer = (char*) malloc(ctx->rbufsize)) == NULL) {
-			ctx->rbufsize = 0;
-			return -1;
+rtp_write_batch(RTSPContext *ctx, int streamid, struct sockaddr_in *sin, uint8_t *buf, int buflen, struct RTPSendStats *st) {
+	struct mmsghdr msgs[RTP_BATCH_MAX];
+	struct iovec iov[RTP_BATCH_IOV];
+	union RTPGsoControl ctrl[RTP_BATCH_MAX];
+	int segsize[RTP_BATCH_MAX], segbytes[RTP_BATCH_MAX], closed[RTP_BATCH_MAX];
+	int fd = ctx->rtpSocket[streamid*2];
+	int gso = (ctx->rtpSendBatch > 1 && rtp_gso_disabled == 0);
+	int i, pktlen, nmsg = 0, niov = 0;
+	//
+	i = 0;
+	while(i < buflen) {
+		struct msghdr *m;
+		pktlen  = (buf[i+0] << 24);
+		pktlen += (buf[i+1] << 16);
+		pktlen += (buf[i+2] << 8);
+		pktlen += (buf[i+3]);
+		if(pktlen == 0) {
+			i += 4;
+			continue;
 		}
-		ctx->rbufhead = 0;
-		ctx->rbuftail = 0;
-	}
-	// buffer is empty, force read
-	if(ctx->rbuftail == ctx->rbufhead) {
-		if(rtsp_read_internal(ctx) < 0)
-			return -1;
+		if(i + 4 + pktlen > buflen)
+			break;
+		// extend the current GSO datagram: equal-size segments,
+		// optionally terminated by a single shorter one
+		m = nmsg > 0 ? &msgs[nmsg-1].msg_hdr : NULL;
+		if(gso && m != NULL && closed[nmsg-1] == 0
+		&& niov < RTP_BATCH_IOV
+		&& pktlen <= segsize[nmsg-1]
+		&& (int) m->msg_iovlen < RTP_GSO_SEGMENTS
+		&& segbytes[nmsg-1] + pktlen <= RTP_GSO_BYTES) {
+			iov[niov].iov_base = &buf[i+4];
+			iov[niov].iov_len = pktlen;
+			niov++;
+			m->msg_iovlen++;
+			segbytes[nmsg-1] += pktlen;
+			if(pktlen < segsize[nmsg-1])
+				closed[nmsg-1] = 1;
+			st->packets++;
+			i += (4+pktlen);
+			continue;
+		}
+		// start a new datagram
+		if(nmsg == RTP_BATCH_MAX || niov == RTP_BATCH_IOV) {
+			rtp_write_segments(msgs, ctrl, segsize, nmsg);
+			rtp_write_flush(fd, msgs, nmsg, st);
+			nmsg = niov = 0;
+		}
+		iov[niov].iov_base = &buf[i+4];
+		iov[niov].iov_len = pktlen;
+		bzero(&msgs[nmsg], sizeof(msgs[nmsg]));
+		m = &msgs[nmsg].msg_hdr;
+		m->msg_name = sin;
+		m->msg_namelen = sizeof(struct sockaddr_in);
+		m->msg_iov = &iov[niov];
+		m->msg_iovlen = 1;
+		segsize[nmsg] = segbytes[nmsg] = pktlen;
+		closed[nmsg] = 0;
+		niov++;
+		nmsg++;
+		st->packets++;
+		i += (4+pktlen);
 	}
-	// buffer is not empty
-	if(ctx->rbuffer[ctx->rbufhead] != '$') {
-		// text data
-		return rtsp_read_text(ctx, buf, count);
+	if(nmsg > 0) {
+		rtp_write_segments(msgs, ctrl, segsize, nmsg);
+		rtp_write_flush(fd, msgs, nmsg, st);
 	}
-	// binary data
-	return rtsp_read_binary(ctx, buf, count);
+	return i;
+}
+#endif
+
+#ifdef RTP_URING
+// io_uring transmission: every sending thread owns a ring and a registered
+// buffer arena. The packets of a frame are copied into the arena once and
+// submitted as IORING_OP_SEND_ZC requests with a single io_uring_enter.
+// The arena is used as a ring allocator; the space of a frame is released
+// after the kernel has notified that all of its packets left the buffer.
+// The copy cannot be avoided here: the packets come from the shared
+// packetizer's dynamic buffer, whose headers are rewritten in place for
+// the next client and which is freed as soon as the frame is handed out,
+// long before the zero-copy completion arrives. What SEND_ZC saves is
+// the kernel-side copy, and with it one syscall per packet.
+struct RTPUringBatch {
+	struct sockaddr_in sin;		// destination, referenced by the SQEs
+	unsigned long long end;		// arena offset after the frame
+	int pending;			// packets whose buffers are in use
+};
+
+struct RTPUring {
+	int fd;
+	unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+	unsigned *cqhead, *cqtail, *cqmask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *ringmap, *sqemap;
+	size_t ringsize, sqesize;
+	unsigned sqentries;
+	unsigned char *arena;
+	unsigned long long head, tail;	// arena bytes allocated/released
+	unsigned long long bhead, btail;	// frames submitted/released
+	int inflight;			// SQEs not yet completed
+	unsigned int errors;		// failed sends, not yet in the statistics
+	int failures;			// failed sends in a row
+	struct RTPUringBatch batch[RTP_URING_BATCHES];
+};
+
+static pthread_key_t rtp_uring_key;
+static pthread_once_t rtp_uring_once = PTHREAD_ONCE_INIT;
+
+/* release the ring of an exiting thread */
+static void
+rtp_uring_free(void *arg) {
+	struct RTPUring *u = (struct RTPUring*) arg;
+	if(u == NULL)
+		return;
+	if(u->fd >= 0)
+		close(u->fd);
+	if(u->arena != NULL)
+		munmap(u->arena, RTP_URING_ARENA);
+	if(u->sqemap != NULL)
+		munmap(u->sqemap, u->sqesize);
+	if(u->ringmap != NULL)
+		munmap(u->ringmap, u->ringsize);
+	free(u);
+	return;
+}
+
+static void
+rtp_uring_key_init() {
+	pthread_key_create(&rtp_uring_key, rtp_uring_free);
+	return;
 }
 
+/* check that the kernel supports send_zc with fixed buffers */
 static int
-per_client_init(RTSPContext *ctx) {
-	int i;
+rtp_uring_probe(int fd) {
+	struct io_uring_probe *p;
+	int ret = -1;
+	size_t size = sizeof(*p) + 256 * sizeof(struct io_uring_probe_op);
+	if((p = (struct io_uring_probe*) calloc(1, size)) == NULL)
+		return -1;
+	if(syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, p, 256) == 0
+	&& p->last_op >= IORING_OP_SEND_ZC
+	&& (p->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED))
+		ret = 0;
+	free(p);
+	return ret;
+}
+
+/* get the ring of the calling thread, create it on first use */
+static struct RTPUring *
+rtp_uring_get() {
+	struct RTPUring *u;
+	struct io_uring_params p;
+	struct iovec iov;
+	unsigned char *ring;
+	size_t sqsize, cqsize;
+	//
+	pthread_once(&rtp_uring_once, rtp_uring_key_init);
+	if((u = (struct RTPUring*) pthread_getspecific(rtp_uring_key)) != NULL)
+		return u;
+	if(rtp_uring_disabled)
+		return NULL;
+	if((u = (struct RTPUring*) calloc(1, sizeof(*u))) == NULL)
+		return NULL;
+	bzero(&p, sizeof(p));
+	if((u->fd = syscall(__NR_io_uring_setup, RTP_URING_ENTRIES, &p)) < 0) {
+		ga_error("RTP: io_uring_setup failed (%s).\n", strerror(errno));
+		goto failed;
+	}
+	if((p.features & IORING_FEAT_SINGLE_MMAP) == 0 || rtp_uring_probe(u->fd) < 0) {
+		ga_error("RTP: io_uring send_zc is not supported.\n");
+		goto failed;
+	}
+	sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	u->ringsize = sqsize > cqsize ? sqsize : cqsize;
+	u->ringmap = mmap(NULL, u->ringsize, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	u->sqesize = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqemap = mmap(NULL, u->sqesize, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	u->arena = (unsigned char*) mmap(NULL, RTP_URING_ARENA, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, -1, 0);
+	if(u->ringmap == MAP_FAILED || u->sqemap == MAP_FAILED || u->arena == MAP_FAILED) {
+		ga_error("RTP: io_uring mmap failed (%s).\n", strerror(errno));
+		if(u->ringmap == MAP_FAILED)	u->ringmap = NULL;
+		if(u->sqemap == MAP_FAILED)	u->sqemap = NULL;
+		if(u->arena == MAP_FAILED)	u->arena = NULL;
+		goto failed;
+	}
+	iov.iov_base = u->arena;
+	iov.iov_len = RTP_URING_ARENA;
+	if(syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0) {
+		ga_error("RTP: io_uring buffer registration failed (%s).\n", strerror(errno));
+		goto failed;
+	}
+	ring = (unsigned char*) u->ringmap;
+	u->sqhead = (unsigned*) (ring + p.sq_off.head);
+	u->sqtail = (unsigned*) (ring + p.sq_off.tail);
+	u->sqmask = (unsigned*) (ring + p.sq_off.ring_mask);
+	u->sqarray = (unsigned*) (ring + p.sq_off.array);
+	u->cqhead = (unsigned*) (ring + p.cq_off.head);
+	u->cqtail = (unsigned*) (ring + p.cq_off.tail);
+	u->cqmask = (unsigned*) (ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe*) (ring + p.cq_off.cqes);
+	u->sqes = (struct io_uring_sqe*) u->sqemap;
+	u->sqentries = p.sq_entries;
+	pthread_setspecific(rtp_uring_key, u);
+	ga_error("RTP: io_uring transmission enabled, tid=%ld.\n", ga_gettid());
+	return u;
+failed:
+	rtp_uring_disabled = 1;
+	rtp_uring_free(u);
+	return NULL;
+}
+
+/* reap completions and release the arena space of finished frames */
+static void
+rtp_uring_reap(struct RTPUring *u) {
+	unsigned head = *u->cqhead;
+	unsigned tail = __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE);
+	struct RTPUringBatch *b;
+	for(; head != tail; head++) {
+		struct io_uring_cqe *cqe = &u->cqes[head & *u->cqmask];
+		if((cqe->flags & IORING_CQE_F_NOTIF) == 0) {
+			if(cqe->res >= 0) {
+				u->failures = 0;
+			} else if(u->errors++ == 0) {
+				ga_error("RTP: io_uring send failed (%s).\n", strerror(-cqe->res));
+			}
+			if(cqe->res < 0)
+				u->failures++;
+		}
+		// a send with IORING_CQE_F_MORE is followed by a notification
+		// once the kernel no longer references the buffer
+		if(cqe->flags & IORING_CQE_F_MORE)
+			continue;
+		b = &u->batch[cqe->user_data % RTP_URING_BATCHES];
+		b->pending--;
+		u->inflight--;
+	}
+	__atomic_store_n(u->cqhead, head, __ATOMIC_RELEASE);
+	while(u->btail < u->bhead) {
+		b = &u->batch[u->btail % RTP_URING_BATCHES];
+		if(b->pending > 0)
+			break;
+		u->tail = b->end;
+		u->btail++;
+	}
+	return;
+}
+
+/* submit queued SQEs, optionally waiting for a completion */
+static int
+rtp_uring_enter(struct RTPUring *u, unsigned submit, unsigned wait, struct RTPSendStats *st) {
+	int r;
+	do {
+		r = syscall(__NR_io_uring_enter, u->fd, submit, wait,
+			wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		st->syscalls++;
+	} while(r < 0 && errno == EINTR);
+	return r;
+}
+
+/* stop using io_uring for a client, sendmmsg + GSO takes over */
+static void
+rtp_uring_fallback(RTSPContext *ctx, const char *reason) {
+	if(ctx->rtpSendBatch <= 2)
+		return;
+	ga_error("RTP: io_uring %s, client %s falls back to sendmmsg.\n",
+		reason, inet_ntoa(ctx->client.sin_addr));
+	ctx->rtpSendBatch = 2;
+	return;
+}
+
+/* send RTP packets in a dynamic packet buffer through io_uring;
+ * returns -1 if the buffer has to be sent by other means */
+static int
+rtp_write_uring(RTSPContext *ctx, int streamid, struct sockaddr_in *sin, uint8_t *buf, int buflen, struct RTPSendStats *st) {
+	struct RTPUring *u;
+	struct RTPUringBatch *b;
+	unsigned long long off, waste;
+	unsigned sqtail, submitted;
+	int i, pktlen, n = 0, bytes = 0, r;
+	//
+	if((u = rtp_uring_get()) == NULL)
+		return -1;
+	for(i = 0; i + 4 <= buflen; i += (4+pktlen)) {
+		pktlen = (buf[i] << 24) | (buf[i+1] << 16) | (buf[i+2] << 8) | buf[i+3];
+		if(i + 4 + pktlen > buflen)
+			break;
+		if(pktlen == 0)
+			continue;
+		bytes += pktlen;
+		n++;
+	}
+	if(n == 0)
+		return buflen;
+	if(n > (int) u->sqentries || bytes > RTP_URING_ARENA / 2)
+		return -1;
+	// wait for arena space, SQ entries, and a frame slot
+	rtp_uring_reap(u);
+	st->errors += u->errors;
+	u->errors = 0;
+	if(u->failures >= RTP_URING_FAILURES) {
+		u->failures = 0;
+		rtp_uring_fallback(ctx, "sends keep failing");
+		return -1;
+	}
+	for(;;) {
+		off = u->head % RTP_URING_ARENA;
+		waste = off + bytes > RTP_URING_ARENA ? RTP_URING_ARENA - off : 0;
+		if(u->head + waste + bytes - u->tail <= RTP_URING_ARENA
+		&& u->inflight + n <= (int) u->sqentries
+		&& u->bhead - u->btail < RTP_URING_BATCHES)
+			break;
+		if(rtp_uring_enter(u, 0, 1, st) < 0) {
+			ga_error("RTP: io_uring wait failed (%s).\n", strerror(errno));
+			rtp_uring_fallback(ctx, "wait failed");
+			return -1;
+		}
+		rtp_uring_reap(u);
+	}
+	u->head += waste;
+	off = u->head % RTP_URING_ARENA;
+	b = &u->batch[u->bhead % RTP_URING_BATCHES];
+	bcopy(sin, &b->sin, sizeof(b->sin));
+	b->pending = n;
+	// one send_zc request per packet, all from the registered arena
+	sqtail = *u->sqtail;
+	for(i = 0; i + 4 <= buflen; i += (4+pktlen)) {
+		struct io_uring_sqe *sqe;
+		pktlen = (buf[i] << 24) | (buf[i+1] << 16) | (buf[i+2] << 8) | buf[i+3];
+		if(i + 4 + pktlen > buflen)
+			break;
+		if(pktlen == 0)
+			continue;
+		bcopy(&buf[i+4], u->arena + off, pktlen);
+		sqe = &u->sqes[sqtail & *u->sqmask];
+		bzero(sqe, sizeof(*sqe));
+		sqe->opcode = IORING_OP_SEND_ZC;
+		sqe->fd = ctx->rtpSocket[streamid*2];
+		sqe->addr = (unsigned long long) (uintptr_t) (u->arena + off);
+		sqe->len = pktlen;
+		sqe->ioprio = IORING_RECVSEND_FIXED_BUF;
+		sqe->buf_index = 0;
+		sqe->addr2 = (unsigned long long) (uintptr_t) &b->sin;
+		sqe->addr_len = sizeof(struct sockaddr_in);
+		sqe->user_data = u->bhead;
+		u->sqarray[sqtail & *u->sqmask] = sqtail & *u->sqmask;
+		sqtail++;
+		off += pktlen;
+	}
+	__atomic_store_n(u->sqtail, sqtail, __ATOMIC_RELEASE);
+	u->head += bytes;
+	b->end = u->head;
+	u->bhead++;
+	u->inflight += n;
+	st->packets += n;
+	// submit the whole frame
+	for(submitted = 0; submitted < (unsigned) n; ) {
+		r = rtp_uring_enter(u, n - submitted, 0, st);
+		if(r > 0) {
+			submitted += r;
+			continue;
+		}
+		if(r < 0 && (errno == EAGAIN || errno == EBUSY)) {
+			rtp_uring_enter(u, 0, 1, st);
+			rtp_uring_reap(u);
+			continue;
+		}
+		// withdraw the requests the kernel has not taken
+		ga_error("RTP: io_uring submission failed (%s).\n", r < 0 ? strerror(errno) : "none submitted");
+		__atomic_store_n(u->sqtail, sqtail - (n - submitted), __ATOMIC_RELEASE);
+		u->inflight -= (n - submitted);
+		st->packets -= (n - submitted);
+		b->pending -= (n - submitted);
+		if(submitted == 0) {
+			// nothing refers to the frame: release its arena space
+			u->bhead--;
+			u->head = b->end - bytes - waste;
+		} else {
+			st->errors += (n - submitted);
+		}
+		rtp_uring_fallback(ctx, "submission failed");
+		return submitted == 0 ? -1 : i;
+	}
+	return i;
+}
+#endif
+
+int
+rtp_write_bindata(RTSPContext *ctx, int streamid, uint8_t *buf, int buflen) {
+	int sent, report = 0;
+	long long t0, t1;
+	struct sockaddr_in sin;
+	struct RTPSendStats delta, *st, rst;
+	if(ctx->rtpSocket[streamid*2] == 0)
+		return -1;
+	if(buf==NULL)
+		return 0;
+	if(buflen < 4)
+		return buflen;
+	bcopy(&ctx->client, &sin, sizeof(sin));
+	sin.sin_port = ctx->rtpPeerPort[streamid*2];
+	// counted locally, then merged under the statistics lock
+	st = &delta;
+	bzero(st, sizeof(*st));
+	t0 = ga_monotonic_us();
+	sent = -1;
+#ifdef RTP_URING
+	if(ctx->rtpSendBatch > 2)
+		sent = rtp_write_uring(ctx, streamid, &sin, buf, buflen, st);
+#endif
+#ifdef RTP_SENDMMSG
+	if(sent < 0 && ctx->rtpSendBatch > 0)
+		sent = rtp_write_batch(ctx, streamid, &sin, buf, buflen, st);
+#endif
+	if(sent < 0)
+		sent = rtp_write_single(ctx, streamid, &sin, buf, buflen, st);
+	t1 = ga_monotonic_us();
+	pthread_mutex_lock(&ctx->rtpStatsMutex);
+	st = &ctx->rtpSendStats[streamid];
+	st->frames++;
+	st->packets += delta.packets;
+	st->syscalls += delta.syscalls;
+	st->elapsed += (t1 - t0);
+	if(ctx->rtpSendReport > 0) {
+		if(st->since == 0) {
+			st->since = t1;
+		} else if(t1 - st->since >= ctx->rtpSendReport) {
+			rst = *st;
+			report = 1;
+			bzero(st, sizeof(*st));
+			st->since = t1;
+		}
+	}
+	pthread_mutex_unlock(&ctx->rtpStatsMutex);
+	// send-path statistics
+	if(report) {
+		ga_error("RTP: stream %d [%s], %u frames, %.1f pkts/frame, %.2f syscalls/frame, %.1f us/frame\n",
+			streamid,
+#ifdef RTP_URING
+			ctx->rtpSendBatch > 2 && rtp_uring_disabled == 0 ? "io_uring" :
+#endif
+			ctx->rtpSendBatch > 1 ? "sendmmsg+gso" :
+				(ctx->rtpSendBatch > 0 ? "sendmmsg" : "sendto"),
+			rst.frames,
+			1.0 * rst.packets / rst.frames,
+			1.0 * rst.syscalls / rst.frames,
+			1.0 * rst.elapsed / rst.frames);
+		if(rst.errors > 0) {
+			ga_error("RTP: stream %d, %u io_uring sends failed\n",
+				streamid, rst.errors);
+		}
+		if(rst.nacks > 0) {
+			ga_error("RTP: stream %d, %u NACKs, %u packets resent, %u expired\n",
+				streamid, rst.nacks, rst.resent, rst.expired);
+		}
+	}
+	return sent;
+}
+#endif
+
+#ifdef RTP_PACER
+// Send-side pacer: each video frame of a client is spread over a fraction
+// of the frame interval in bursts of a few packets, so that keyframes do
+// not leave at line rate. Frames of the same stream are sent in order.
+
+struct RTPPaceJob {
+	RTSPContext *ctx;
+	int streamid;
+	uint8_t *buf;			// [4-byte length][RTP packet] entries
+	int buflen, pos;
+	long long enqueued;
+	long long interval;		// time between bursts, in us
+	struct RTPPaceJob *follow;	// the next frame of the same stream
+};
+
+struct RTPPaceStats {
+	unsigned int frames;
+	long long delay, delaymax;	// enqueue to the last burst, in us
+	unsigned int bursts;
+	long long bytes;
+	int burstmax;			// bytes of the largest burst
+	long long since;
+};
+
+static pthread_mutex_t pacer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pacer_cond;
+static pthread_t pacer_thread;
+static int pacer_running = 0;
+static multimap<long long, struct RTPPaceJob*> pacer_jobs;	// by the time of the next burst
+static int pacer_fraction = 50;		// % of the frame interval
+static int pacer_burst = 4;		// packets per burst
+static int pacer_gain = 150;		// % of the measured capacity
+static int pacer_capacity = 0;		// in Kbps, 0 = unknown
+static long long pacer_report = 0;	// statistics interval in us, 0 = off
+static struct RTPPaceStats pacer_stats;
+// the pacer sends without holding pacer_mutex
+static pthread_cond_t pacer_idle = PTHREAD_COND_INITIALIZER;
+static struct RTPPaceJob *pacer_busy = NULL;	// the job being sent
+static RTSPContext *pacer_dropctx = NULL;	// client being dropped
+
+/* schedule the first burst of a frame and pick its pacing rate */
+static void
+rtp_pacer_activate(struct RTPPaceJob *j, long long now) {
+	long long window, duration;
+	int i, pktlen, packets = 0, bursts;
+	//
+	for(i = 0; i + 4 <= j->buflen; i += 4 + pktlen) {
+		pktlen = (j->buf[i] << 24) | (j->buf[i+1] << 16) | (j->buf[i+2] << 8) | j->buf[i+3];
+		packets++;
+	}
+	bursts = (packets + pacer_burst - 1) / pacer_burst;
+	window = 10000LL * pacer_fraction / (rtspconf->video_fps > 0 ? rtspconf->video_fps : 30);
+	// not slower than the measured capacity allows
+	duration = window;
+	if(pacer_capacity > 0) {
+		long long d = 800000LL * j->buflen / pacer_capacity / pacer_gain;
+		if(d < duration)
+			duration = d;
+	}
+	// a backlogged frame is sent at once to catch up
+	if(now - j->enqueued >= window)
+		duration = 0;
+	j->interval = bursts > 0 ? duration / bursts : 0;
+	pacer_jobs.insert(pair<long long, struct RTPPaceJob*>(now, j));
+	return;
+}
+
+/* send the next burst of a frame, without the pacer lock; returns the burst size */
+static int
+rtp_pacer_send(struct RTPPaceJob *j) {
+	int end, pktlen, count, size;
+	//
+	for(end = j->pos, count = 0; end + 4 <= j->buflen && count < pacer_burst; count++) {
+		pktlen = (j->buf[end] << 24) | (j->buf[end+1] << 16) | (j->buf[end+2] << 8) | j->buf[end+3];
+		end += 4 + pktlen;
+	}
+	if(end > j->buflen || count == 0)
+		end = j->buflen;
+	rtp_write_bindata(j->ctx, j->streamid, j->buf + j->pos, end - j->pos);
+	size = end - j->pos;
+	j->pos = end;
+	return size;
+}
+
+/* free a frame and the queued frames that follow it */
+static void
+rtp_pacer_free(struct RTPPaceJob *j) {
+	struct RTPPaceJob *next;
+	for(; j != NULL; j = next) {
+		next = j->follow;
+		free(j->buf);
+		free(j);
+	}
+	return;
+}
+
+static void
+rtp_pacer_report(long long now) {
+	if(pacer_report <= 0)
+		return;
+	if(pacer_stats.since == 0) {
+		pacer_stats.since = now;
+		return;
+	}
+	if(now - pacer_stats.since < pacer_report || pacer_stats.frames == 0)
+		return;
+	ga_error("RTP: pacer %u frames, delay %.1f/%lld us (avg/max), burst %.0f/%d bytes (avg/max)\n",
+		pacer_stats.frames,
+		1.0 * pacer_stats.delay / pacer_stats.frames, pacer_stats.delaymax,
+		1.0 * pacer_stats.bytes / pacer_stats.bursts, pacer_stats.burstmax);
+	bzero(&pacer_stats, sizeof(pacer_stats));
+	pacer_stats.since = now;
+	return;
+}
+
+static void *
+rtp_pacer_threadproc(void *arg) {
+	multimap<long long, struct RTPPaceJob*>::iterator mi;
+	struct RTPPaceJob *j;
+	struct timespec ts;
+	long long now;
+	int size;
+	//
+	// wake up close to the deadlines (the default slack is 50us)
+	ga_thread_role("pacer", 0);
+	prctl(PR_SET_TIMERSLACK, 1000UL, 0, 0, 0);
+	pthread_mutex_lock(&pacer_mutex);
+	while(pacer_running) {
+		if(pacer_jobs.empty()) {
+			pthread_cond_wait(&pacer_cond, &pacer_mutex);
+			continue;
+		}
+		mi = pacer_jobs.begin();
+		now = ga_monotonic_us();
+		if(mi->first > now) {
+			ts.tv_sec = mi->first / 1000000LL;
+			ts.tv_nsec = (mi->first % 1000000LL) * 1000;
+			pthread_cond_timedwait(&pacer_cond, &pacer_mutex, &ts);
+			continue;
+		}
+		j = mi->second;
+		pacer_jobs.erase(mi);
+		// encoder threads keep queueing frames while the burst goes out
+		pacer_busy = j;
+		pthread_mutex_unlock(&pacer_mutex);
+		size = rtp_pacer_send(j);
+		pthread_mutex_lock(&pacer_mutex);
+		pacer_busy = NULL;
+		pthread_cond_broadcast(&pacer_idle);
+		if(j->ctx == pacer_dropctx) {
+			// rtp_pacer_drop() resets the tails
+			rtp_pacer_free(j);
+			continue;
+		}
+		pacer_stats.bursts++;
+		pacer_stats.bytes += size;
+		if(size > pacer_stats.burstmax)
+			pacer_stats.burstmax = size;
+		if(j->pos < j->buflen) {
+			pacer_jobs.insert(pair<long long, struct RTPPaceJob*>(now + j->interval, j));
+			continue;
+		}
+		// frame done: start the next one of the stream
+		now = ga_monotonic_us();
+		pacer_stats.frames++;
+		pacer_stats.delay += (now - j->enqueued);
+		if(now - j->enqueued > pacer_stats.delaymax)
+			pacer_stats.delaymax = now - j->enqueued;
+		if(j->follow != NULL)
+			rtp_pacer_activate(j->follow, now);
+		else
+			j->ctx->rtpPaceTail[j->streamid] = NULL;
+		j->follow = NULL;
+		rtp_pacer_free(j);
+		rtp_pacer_report(now);
+	}
+	pthread_mutex_unlock(&pacer_mutex);
+	return NULL;
+}
+
+/**
+ * Start the send-side pacer, if enabled by the rtp-pacing option.
+ *
+ * @return 0 on success or if pacing is disabled, -1 on error.
+ */
+int
+rtp_pacer_start() {
+	pthread_condattr_t attr;
+	//
+	if(pacer_running || ga_conf_readbool("rtp-pacing", 0) == 0)
+		return 0;
+	rtspconf = rtspconf_global();
+	if(ga_conf_readint("rtp-pacing-fraction") > 0)
+		pacer_fraction = ga_conf_readint("rtp-pacing-fraction");
+	if(ga_conf_readint("rtp-pacing-burst") > 0)
+		pacer_burst = ga_conf_readint("rtp-pacing-burst");
+	if(ga_conf_readint("rtp-pacing-gain") > 0)
+		pacer_gain = ga_conf_readint("rtp-pacing-gain");
+	pacer_report = 1000000LL * ga_conf_readint("rtp-send-report");
+	// deadlines are on the monotonic clock of ga_monotonic_us()
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&pacer_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	pacer_running = 1;
+	if(pthread_create(&pacer_thread, NULL, rtp_pacer_threadproc, NULL) != 0) {
+		ga_error("RTP: cannot start the pacer thread.\n");
+		pacer_running = 0;
+		return -1;
+	}
+	pthread_detach(pacer_thread);
+	ga_error("RTP: pacer started, %d%% of the frame interval, %d packets per burst\n",
+		pacer_fraction, pacer_burst);
+	return 0;
+}
+
+/**
+ * Update the network capacity used to pick pacing rates.
+ *
+ * @param kbps [in] Capacity measured by a client in Kbps, or 0 if unknown.
+ */
+void
+rtp_pacer_capacity(int kbps) {
+	pacer_capacity = kbps > 0 ? kbps : 0;
+	return;
+}
+
+/* discard the queued frames of a client */
+static void
+rtp_pacer_drop(RTSPContext *ctx) {
+	multimap<long long, struct RTPPaceJob*>::iterator mi;
+	//
+	pthread_mutex_lock(&pacer_mutex);
+	for(mi = pacer_jobs.begin(); mi != pacer_jobs.end(); ) {
+		if(mi->second->ctx != ctx) {
+			mi++;
+			continue;
+		}
+		rtp_pacer_free(mi->second);
+		pacer_jobs.erase(mi++);
+	}
+	// a burst of this client may be on its way: the pacer frees it
+	pacer_dropctx = ctx;
+	while(pacer_busy != NULL && pacer_busy->ctx == ctx)
+		pthread_cond_wait(&pacer_idle, &pacer_mutex);
+	pacer_dropctx = NULL;
+	bzero(ctx->rtpPaceTail, sizeof(ctx->rtpPaceTail));
+	pthread_mutex_unlock(&pacer_mutex);
+	return;
+}
+#endif
+
+#ifdef HOLE_PUNCHING
+/**
+ * Send RTP packets to a client over UDP through the pacer.
+ *
+ * @param ctx [in] The client context.
+ * @param streamid [in] The stream (channel) id.
+ * @param buf [in] A dynamic packet buffer: [4-byte length][RTP packet] entries.
+ * @param buflen [in] Size of the buffer.
+ * @return \a buflen if the packets are queued, or as returned by rtp_write_bindata().
+ *
+ * Only video frames are paced; the buffer is copied, so the caller may
+ * reuse it right away. Without the pacer the packets are sent at once.
+ */
+int
+rtp_pace_bindata(RTSPContext *ctx, int streamid, uint8_t *buf, int buflen) {
+#ifdef RTP_PACER
+	struct RTPPaceJob *j;
+	if(pacer_running == 0 || streamid >= video_source_channels() || buflen < 4)
+		return rtp_write_bindata(ctx, streamid, buf, buflen);
+	if((j = (struct RTPPaceJob*) calloc(1, sizeof(*j))) == NULL
+	|| (j->buf = (uint8_t*) malloc(buflen)) == NULL) {
+		if(j)	free(j);
+		return rtp_write_bindata(ctx, streamid, buf, buflen);
+	}
+	bcopy(buf, j->buf, buflen);
+	j->ctx = ctx;
+	j->streamid = streamid;
+	j->buflen = buflen;
+	j->enqueued = ga_monotonic_us();
+	pthread_mutex_lock(&pacer_mutex);
+	if(ctx->rtpPaceTail[streamid] != NULL) {
+		ctx->rtpPaceTail[streamid]->follow = j;
+	} else {
+		rtp_pacer_activate(j, j->enqueued);
+		pthread_cond_signal(&pacer_cond);
+	}
+	ctx->rtpPaceTail[streamid] = j;
+	pthread_mutex_unlock(&pacer_mutex);
+	return buflen;
+#else
+	return rtp_write_bindata(ctx, streamid, buf, buflen);
+#endif
+}
+#endif
+
+static int
+rtsp_read_internal(RTSPContext *ctx) {
+	int rlen;
+	if((rlen = read(ctx->fd, 
+		ctx->rbuffer + ctx->rbuftail,
+		ctx->rbufsize - ctx->rbuftail)) <= 0) {
+		return -1;
+	}
+	ctx->rbuftail += rlen;
+	return ctx->rbuftail - ctx->rbufhead;
+}
+
+static int
+rtsp_read_text(RTSPContext *ctx, char *buf, size_t count) {
+	int i;
+	size_t textlen;
+again:
+	for(i = ctx->rbufhead; i < ctx->rbuftail; i++) {
+		if(ctx->rbuffer[i] == '\n') {
+			textlen = i - ctx->rbufhead + 1;
+			if(textlen > count-1) {
+				ga_error("Insufficient string buffer length.\n");
+				return -1;
+			}
+			bcopy(ctx->rbuffer + ctx->rbufhead, buf, textlen);
+			buf[textlen] = '\0';
+			ctx->rbufhead += textlen;
+			if(ctx->rbufhead == ctx->rbuftail)
+				ctx->rbufhead = ctx->rbuftail = 0;
+			return textlen;
+		}
+	}
+	// buffer full?
+	if(ctx->rbuftail - ctx->rbufhead == ctx->rbufsize) {
+		ga_error("Buffer full: Extremely long text data encountered?\n");
+		return -1;
+	}
+	// did not found '\n', read more
+	bcopy(ctx->rbuffer + ctx->rbufhead, ctx->rbuffer, ctx->rbuftail - ctx->rbufhead);
+	ctx->rbuftail = ctx->rbuftail - ctx->rbufhead;
+	ctx->rbufhead = 0;
+	//
+	if(rtsp_read_internal(ctx) < 0)
+		return -1;
+	goto again;
+	// unreachable, but to meet compiler's requirement
+	return -1;
+}
+
+static int
+rtsp_read_binary(RTSPContext *ctx, char *buf, size_t count) {
+	int reqlength;
+	if(ctx->rbuftail - ctx->rbufhead < 4)
+		goto readmore;
+again:
+	reqlength = (unsigned char) ctx->rbuffer[ctx->rbufhead+2];
+	reqlength <<= 8;
+	reqlength += (unsigned char) ctx->rbuffer[ctx->rbufhead+3];
+	// data is ready
+	if(4+reqlength <= ctx->rbuftail - ctx->rbufhead) {
+		bcopy(ctx->rbuffer + ctx->rbufhead, buf, 4+reqlength);
+		ctx->rbufhead += (4+reqlength);
+		if(ctx->rbufhead == ctx->rbuftail)
+			ctx->rbufhead = ctx->rbuftail = 0;
+		return 4+reqlength;
+	}
+	// second trail?
+	if(ctx->rbuftail - ctx->rbufhead == ctx->rbufsize) {
+		ga_error("Buffer full: Extremely long binary data encountered?\n");
+		return -1;
+	}
+readmore:
+	bcopy(ctx->rbuffer + ctx->rbufhead, ctx->rbuffer, ctx->rbuftail - ctx->rbufhead);
+	ctx->rbuftail = ctx->rbuftail - ctx->rbufhead;
+	ctx->rbufhead = 0;
+	//
+	if(rtsp_read_internal(ctx) < 0)
+		return -1;
+	goto again;
+	// unreachable, but to meet compiler's requirement
+	return -1;
+}
+
+static int
+rtsp_getnext(RTSPContext *ctx, char *buf, size_t count) {
+	// initialize if necessary
+	if(ctx->rbuffer == NULL) {
+		ctx->rbufsize = 65536;
+		if((ctx->rbuffer = (char*) malloc(ctx->rbufsize)) == NULL) {
+			ctx->rbufsize = 0;
+			return -1;
+		}
+		ctx->rbufhead = 0;
+		ctx->rbuftail = 0;
+	}
+	// buffer is empty, force read
+	if(ctx->rbuftail == ctx->rbufhead) {
+		if(rtsp_read_internal(ctx) < 0)
+			return -1;
+	}
+	// buffer is not empty
+	if(ctx->rbuffer[ctx->rbufhead] != '$') {
+		// text data
+		return rtsp_read_text(ctx, buf, count);
+	}
+	// binary data
+	return rtsp_read_binary(ctx, buf, count);
+}
+
+static int
+per_client_init(RTSPContext *ctx) {
+	int i;
 	AVOutputFormat *fmt;
 	//
 	if((fmt = av_guess_format("rtp", NULL, NULL)) == NULL) {
@@ -403,6 +1618,47 @@ per_client_init(RTSPContext *ctx) {
 #endif
 	if((ctx->mtu = ga_conf_readint("packet-size")) <= 0)
 		ctx->mtu = RTSP_TCP_MAX_PACKET_SIZE;
+#ifdef HOLE_PUNCHING
+	ctx->rtpSendBatch = 0;
+#ifdef RTP_SENDMMSG
+	if(ga_conf_readbool("rtp-send-batch", 1) != 0) {
+		ctx->rtpSendBatch = 1;
+		if(ga_conf_readbool("rtp-send-gso", 1) != 0)
+			ctx->rtpSendBatch = 2;
+#ifdef RTP_URING
+		if(ga_conf_readbool("rtp-send-uring", 0) != 0)
+			ctx->rtpSendBatch = 3;
+#endif
+	}
+#endif
+	ctx->rtpSendReport = 1000000LL * ga_conf_readint("rtp-send-report");
+#endif
+#ifdef RTSP_SEND_QUEUE
+	do {
+		char policy[64];
+		struct RTSPSendQueue *q = &ctx->sendq;
+		pthread_mutex_init(&q->mutex, NULL);
+		pthread_cond_init(&q->cond, NULL);
+		// queue size in KB; 0 writes directly from the encoder threads
+		if(ga_conf_readv("rtsp-send-queue", policy, sizeof(policy)) == NULL) {
+			q->size = 2048 * 1024;
+			if(q->size < rtsp_sendq_minsize())
+				q->size = rtsp_sendq_minsize();
+		} else {
+			q->size = ga_conf_readint("rtsp-send-queue") * 1024;
+		}
+		if(q->size > 0 && q->size < rtsp_sendq_minsize()) {
+			ga_error("RTSP: send queue of %d bytes is too small for a keyframe, using %d bytes.\n",
+				q->size, rtsp_sendq_minsize());
+			q->size = rtsp_sendq_minsize();
+		}
+		q->policy = RTSP_SENDQ_DROP;
+		if(ga_conf_readv("rtsp-send-overflow", policy, sizeof(policy)) != NULL
+		&& strcmp(policy, "disconnect") == 0)
+			q->policy = RTSP_SENDQ_DISCONNECT;
+		q->report = 1000000LL * ga_conf_readint("rtp-send-report");
+	} while(0);
+#endif
 	//
 	return 0;
 }
@@ -470,6 +1726,13 @@ per_client_deinit(RTSPContext *ctx) {
 	if(ctx->rbuffer) {
 		free(ctx->rbuffer);
 	}
+#ifdef RTSP_SEND_QUEUE
+	if(ctx->sendq.buf)
+		free(ctx->sendq.buf);
+	ctx->sendq.buf = NULL;
+	pthread_cond_destroy(&ctx->sendq.cond);
+	pthread_mutex_destroy(&ctx->sendq.mutex);
+#endif
 	ctx->rbufsize = 0;
 	ctx->rbufhead = ctx->rbuftail = 0;
 	//
@@ -543,12 +1806,50 @@ rtsp_reply_error(RTSPContext *c, enum RTSPStatusCode error_number) {
 	rtsp_printf(c, "\r\n");
 }
 
+/* libavformat writes no fmtp for VP9: add the profile-id of the codec
+ * configuration record from the video encoder after each VP9 rtpmap */
+static void
+sdp_add_vp9_profile(char *buf, int bufsize) {
+	ga_module_t *m = encoder_get_vencoder();
+	ga_ioctl_buffer_t mb;
+	unsigned char vpcc[64];
+	char line[64], *p = buf, *q;
+	int ch, pt, len;
+	const char *rtpmap = " VP9/90000\r\n";
+	//
+	if(m == NULL || m->ioctl == NULL)
+		return;
+	for(ch = 0; ch < video_source_channels(); ch++) {
+		if((p = strstr(p, rtpmap)) == NULL)
+			break;
+		for(q = p; q > buf && q[-1] != '\n'; q--)
+			;
+		p += strlen(rtpmap);
+		if(sscanf(q, "a=rtpmap:%d", &pt) != 1)
+			continue;
+		mb.id = ch;
+		mb.ptr = vpcc;
+		mb.size = sizeof(vpcc);
+		if(ga_module_ioctl(m, GA_IOCTL_GETEXTRADATA, sizeof(mb), &mb) < 0 || mb.size < 5)
+			continue;
+		len = snprintf(line, sizeof(line), "a=fmtp:%d profile-id=%d\r\n", pt, vpcc[4]);
+		if((int) strlen(buf) + len >= bufsize)
+			break;
+		memmove(p + len, p, strlen(p) + 1);
+		bcopy(line, p, len);
+		p += len;
+	}
+	return;
+}
+
 static int
 prepare_sdp_description(RTSPContext *ctx, char *buf, int bufsize) {
 	buf[0] = '\0';
 	av_dict_set(&ctx->sdp_fmtctx->metadata, "title", rtspconf->title, 0);
 	snprintf(ctx->sdp_fmtctx->filename, sizeof(ctx->sdp_fmtctx->filename), "rtp://0.0.0.0");
 	av_sdp_create(&ctx->sdp_fmtctx, 1, buf, bufsize);
+	if(rtspconf->video_encoder_codec->id == AV_CODEC_ID_VP9)
+		sdp_add_vp9_profile(buf, bufsize);
 	return strlen(buf);
 }
 
@@ -610,6 +1911,45 @@ find_transport(RTSPMessageHeader *h, enum RTSPLowerTransport lower_transport) {
 	return NULL;
 }
 
+/* create the stream and its codec context for an RTP muxer */
+static AVCodecContext *
+rtp_new_encoder_stream(AVFormatContext *fmtctx, int streamid, enum AVCodecID codecid, AVStream **pstream) {
+	AVStream *stream;
+	AVCodecContext *encoder = NULL;
+	//
+	if((stream = ga_avformat_new_stream(fmtctx, 0,
+			codecid == rtspconf->video_encoder_codec->id ?
+				rtspconf->video_encoder_codec : rtspconf->audio_encoder_codec)) == NULL) {
+		ga_error("Cannot create new stream (%d)\n", codecid);
+		return NULL;
+	}
+	//
+	if(codecid == rtspconf->video_encoder_codec->id) {
+		encoder = ga_avcodec_vencoder_init(
+				stream->codec,
+				rtspconf->video_encoder_codec,
+				video_source_out_width(streamid),
+				video_source_out_height(streamid),
+				rtspconf->video_fps,
+				rtspconf->vso);
+	} else if(codecid == rtspconf->audio_encoder_codec->id) {
+		encoder = ga_avcodec_aencoder_init(
+				stream->codec,
+				rtspconf->audio_encoder_codec,
+				rtspconf->audio_bitrate,
+				rtspconf->audio_samplerate,
+				rtspconf->audio_channels,
+				rtspconf->audio_codec_format,
+				rtspconf->audio_codec_channel_layout);
+	}
+	if(encoder == NULL) {
+		ga_error("Cannot init encoder\n");
+		return NULL;
+	}
+	*pstream = stream;
+	return encoder;
+}
+
 static int
 rtp_new_av_stream(RTSPContext *ctx, struct sockaddr_in *sin, int streamid, enum AVCodecID codecid) {
 	AVOutputFormat *fmt = NULL;
@@ -687,39 +2027,19 @@ rtp_new_av_stream(RTSPContext *ctx, struct sockaddr_in *sin, int streamid, enum
 #endif
 	fmtctx->pb->seekable = 0;
 	//
-	if((stream = ga_avformat_new_stream(fmtctx, 0,
-			codecid == rtspconf->video_encoder_codec->id ?
-				rtspconf->video_encoder_codec : rtspconf->audio_encoder_codec)) == NULL) {
-		ga_error("Cannot create new stream (%d)\n", codecid);
-		return -1;
-	}
-	//
-	if(codecid == rtspconf->video_encoder_codec->id) {
-		encoder = ga_avcodec_vencoder_init(
-				stream->codec,
-				rtspconf->video_encoder_codec,
-				video_source_out_width(streamid),
-				video_source_out_height(streamid),
-				rtspconf->video_fps,
-				rtspconf->vso);
-	} else if(codecid == rtspconf->audio_encoder_codec->id) {
-		encoder = ga_avcodec_aencoder_init(
-				stream->codec,
-				rtspconf->audio_encoder_codec,
-				rtspconf->audio_bitrate,
-				rtspconf->audio_samplerate,
-				rtspconf->audio_channels,
-				rtspconf->audio_codec_format,
-				rtspconf->audio_codec_channel_layout);
-	}
-	if(encoder == NULL) {
-		ga_error("Cannot init encoder\n");
+	if((encoder = rtp_new_encoder_stream(fmtctx, streamid, codecid, &stream)) == NULL)
 		return -1;
-	}
 	//
 	ctx->encoder[streamid] = encoder;
 	ctx->stream[streamid] = stream;
 	ctx->fmtctx[streamid] = fmtctx;
+#ifdef HOLE_PUNCHING
+	// identity of this client's view of the shared packetizer output
+	ctx->rtpSSRC[streamid] = av_get_random_seed();
+	ctx->rtpSeqOffset[streamid] = (unsigned short) av_get_random_seed();
+	ctx->rtpTsOffset[streamid] = av_get_random_seed();
+	ctx->rtpRendition[streamid] = -1;
+#endif
 	// write header
 	if(avformat_write_header(ctx->fmtctx[streamid], NULL) < 0) {
 		ga_error("Cannot write stream id %d.\n", streamid);
@@ -738,6 +2058,70 @@ rtp_new_av_stream(RTSPContext *ctx, struct sockaddr_in *sin, int streamid, enum
 	return 0;
 }
 
+#ifdef HOLE_PUNCHING
+/**
+ * Create the shared RTP muxer of a channel.
+ *
+ * The shared muxer packetizes each encoded packet once on behalf of all
+ * the clients subscribed to the channel. Its output is always a dynamic
+ * packet buffer, and per-client header fields are rewritten at send time.
+ *
+ * @param streamid [in] The channel id (the audio channel is video_source_channels()).
+ * @param mtu [in] The maximum RTP packet size.
+ * @param pfmtctx [out] The created muxer.
+ * @param pstream [out] The stream of the muxer.
+ * @param pencoder [out] The codec context of the stream.
+ * @return 0 on success, or -1 on error.
+ */
+int
+rtp_new_shared_stream(int streamid, int mtu, AVFormatContext **pfmtctx, AVStream **pstream, AVCodecContext **pencoder) {
+	AVOutputFormat *fmt = NULL;
+	AVFormatContext *fmtctx = NULL;
+	AVStream *stream = NULL;
+	AVCodecContext *encoder = NULL;
+	uint8_t *dummybuf = NULL;
+	enum AVCodecID codecid;
+	//
+	if(rtspconf == NULL)
+		rtspconf = rtspconf_global();
+	codecid = streamid == video_source_channels() ?
+			rtspconf->audio_encoder_codec->id : rtspconf->video_encoder_codec->id;
+	if((fmt = av_guess_format("rtp", NULL, NULL)) == NULL) {
+		ga_error("RTP: not supported.\n");
+		return -1;
+	}
+	if((fmtctx = avformat_alloc_context()) == NULL) {
+		ga_error("RTP: create shared avformat context failed.\n");
+		return -1;
+	}
+	fmtctx->oformat = fmt;
+	fmtctx->packet_size = mtu;
+	if(ffio_open_dyn_packet_buf(&fmtctx->pb, mtu) < 0) {
+		ga_error("RTP: cannot open shared dynamic packet buffer\n");
+		goto error;
+	}
+	fmtctx->pb->seekable = 0;
+	if((encoder = rtp_new_encoder_stream(fmtctx, streamid, codecid, &stream)) == NULL)
+		goto error;
+	if(avformat_write_header(fmtctx, NULL) < 0) {
+		ga_error("RTP: cannot write shared stream header (%d).\n", streamid);
+		goto error;
+	}
+	avio_close_dyn_buf(fmtctx->pb, &dummybuf);
+	av_free(dummybuf);
+	//
+	*pfmtctx = fmtctx;
+	*pstream = stream;
+	*pencoder = encoder;
+	ga_error("RTP: shared packetizer created for stream %d, packet size=%d\n",
+		streamid, mtu);
+	return 0;
+error:
+	close_av(fmtctx, stream, encoder, RTSP_LOWER_TRANSPORT_TCP);
+	return -1;
+}
+#endif
+
 static void
 rtsp_cmd_setup(RTSPContext *ctx, const char *url, RTSPMessageHeader *h) {
 	int i;
@@ -862,6 +2246,10 @@ rtsp_cmd_setup(RTSPContext *ctx, const char *url, RTSPMessageHeader *h) {
 			streamid*2, streamid*2+1);
 		rtsp_printf(ctx, "Transport: RTP/AVP/TCP;unicast;interleaved=%d-%d\r\n",
 			streamid*2, streamid*2+1, streamid*2);
+#ifdef RTSP_SEND_QUEUE
+		// failure falls back to writing from the encoder threads
+		rtsp_sendq_start(ctx);
+#endif
 		break;
 	default:
 		// should not happen
@@ -887,6 +2275,23 @@ error_setup:
 	rtsp_reply_error(ctx, errcode);
 	return;
 }
+/* register the client to the encoders and reply to PLAY */
+static void
+rtsp_play_start(RTSPContext *ctx) {
+	// 2014-05-20: support only shared-encoder model
+	if(ff_server_register_client(ctx) < 0) {
+		ga_error("cannot register encoder client.\n");
+		rtsp_reply_error(ctx, RTSP_STATUS_INTERNAL);
+		return;
+	}
+	//
+	ctx->state = SERVER_STATE_PLAYING;
+	rtsp_reply_header(ctx, RTSP_STATUS_OK);
+	rtsp_printf(ctx, "Session: %s\r\n", ctx->session_id);
+	rtsp_printf(ctx, "\r\n");
+	return;
+}
+
 static void
 rtsp_cmd_play(RTSPContext *ctx, const char *url, RTSPMessageHeader *h) {
 	char path[4096];
@@ -906,17 +2311,14 @@ rtsp_cmd_play(RTSPContext *ctx, const char *url, RTSPMessageHeader *h) {
 		rtsp_reply_error(ctx, RTSP_STATUS_STATE);
 		return;
 	}
-	// 2014-05-20: support only shared-encoder model
-	if(ff_server_register_client(ctx) < 0) {
-		ga_error("cannot register encoder client.\n");
-		rtsp_reply_error(ctx, RTSP_STATUS_INTERNAL);
+#ifdef RTSP_REACTOR
+	// the first client starts the encoders, which must not stall a reactor
+	if(ctx->session != NULL) {
+		rtsp_reactor_play(ctx);
 		return;
 	}
-	//
-	ctx->state = SERVER_STATE_PLAYING;
-	rtsp_reply_header(ctx, RTSP_STATUS_OK);
-	rtsp_printf(ctx, "Session: %s\r\n", ctx->session_id);
-	rtsp_printf(ctx, "\r\n");
+#endif
+	rtsp_play_start(ctx);
 	return;
 }
 
@@ -1004,82 +2406,289 @@ handle_rtcp(RTSPContext *ctx, const char *buf, size_t buflen) {
 		snprintf(ptr, sizeof(msg)-(ptr-msg),
 			"%2.2x ", (unsigned char) buf[i]);
 	}
-	ga_error("HEX: %s\n", msg);
-#endif
-	return 0;
+	ga_error("HEX: %s\n", msg);
+#endif
+	return 0;
+}
+
+static void
+skip_spaces(const char **pp) {
+	const char *p;
+	p = *pp;
+	while (*p == ' ' || *p == '\t')
+		p++;
+	*pp = p;
+}
+
+static void
+get_word(char *buf, int buf_size, const char **pp) {
+	const char *p;
+	char *q;
+
+	p = *pp;
+	skip_spaces(&p);
+	q = buf;
+	while (!isspace(*p) && *p != '\0') {
+		if ((q - buf) < buf_size - 1)
+			*q++ = *p;
+		p++;
+	}
+	if (buf_size > 0)
+		*q = '\0';
+	*pp = p;
+}
+
+/* initialize the context of a newly accepted RTSP connection */
+static int
+rtsp_session_open(RTSPContext *ctx, int s) {
+	struct sockaddr_in sin;
+#ifdef WIN32
+	int sinlen = sizeof(struct sockaddr_in);
+#else
+	socklen_t sinlen = sizeof(struct sockaddr_in);
+#endif
+	//
+	rtspconf = rtspconf_global();
+	sinlen = sizeof(sin);
+	getpeername(s, (struct sockaddr*) &sin, &sinlen);
+	//
+	bzero(ctx, sizeof(*ctx));
+	if(per_client_init(ctx) < 0) {
+		ga_error("server initialization failed.\n");
+		return -1;
+	}
+	bcopy(&sin, &ctx->client, sizeof(ctx->client));
+	ctx->state = SERVER_STATE_IDLE;
+	// XXX: hasVideo is used to sync audio/video
+	// This value is increased by 1 for each captured frame until it is gerater than zero
+	// when this value is greater than zero, audio encoding then starts ...
+	//ctx->hasVideo = -(rtspconf->video_fps>>1);	// for slow encoders?
+	ctx->hasVideo = 0;	// with 'zerolatency'
+	pthread_mutex_init(&ctx->rtsp_writer_mutex, NULL);
+#ifdef HOLE_PUNCHING
+	pthread_mutex_init(&ctx->rtpStatsMutex, NULL);
+#endif
+	//
+	ga_error("[tid %ld] client connected from %s:%d\n",
+		ga_gettid(),
+		inet_ntoa(sin.sin_addr), htons(sin.sin_port));
+	//
+	ctx->fd = s;
+	return 0;
+}
+
+/* release the context of a closed RTSP connection */
+static void
+rtsp_session_close(RTSPContext *ctx) {
+	ctx->state = SERVER_STATE_TEARDOWN;
+	//
+#ifdef RTSP_SEND_QUEUE
+	rtsp_sendq_stop(ctx);
+#endif
+	// 2014-05-20: support only share-encoder model
+	// unregister first: encoders must not touch a closed (reused) fd
+	ff_server_unregister_client(ctx);
+#ifdef RTP_PACER
+	rtp_pacer_drop(ctx);
+#endif
+	close(ctx->fd);
+	//
+	per_client_deinit(ctx);
+	//ga_error("RTSP client thread terminated (%d/%d clients left).\n",
+	//	video_source_client_count(), audio_source_client_count());
+	return;
+}
+
+#ifdef HOLE_PUNCHING
+#define	RTCP_RTPFB	205	// transport layer feedback
+#define	RTCP_FMT_NACK	1	// generic NACK
+
+/* walk an RTCP compound packet from a client and pass generic NACKs
+ * (RFC 4585) to the retransmission history */
+static void
+rtcp_handle_feedback(RTSPContext *ctx, int streamid, const unsigned char *p, int len) {
+	int off, plen, i;
+	for(off = 0; off + 4 <= len; off += plen) {
+		if((p[off] & 0xc0) != 0x80)
+			break;
+		plen = (((p[off+2] << 8) | p[off+3]) + 1) * 4;
+		if(off + plen > len)
+			break;
+		if(p[off+1] != RTCP_RTPFB || (p[off] & 0x1f) != RTCP_FMT_NACK || plen < 16)
+			continue;
+		pthread_mutex_lock(&ctx->rtpStatsMutex);
+		ctx->rtpSendStats[streamid].nacks++;
+		pthread_mutex_unlock(&ctx->rtpStatsMutex);
+		// FCI entries: PID (16 bits) + BLP (16 bits)
+		for(i = 12; i + 4 <= plen; i += 4) {
+			ff_server_handle_nack(ctx, streamid,
+				(p[off+i] << 8) | p[off+i+1],
+				(p[off+i+2] << 8) | p[off+i+3]);
+		}
+	}
+	return;
 }
 
+/* handle a datagram on a hole-punching RTP/RTCP socket */
 static void
-skip_spaces(const char **pp) {
-	const char *p;
-	p = *pp;
-	while (*p == ' ' || *p == '\t')
-		p++;
-	*pp = p;
+rtsp_handle_rtp(RTSPContext *ctx, int i, char *buf, int bufsize) {
+	struct sockaddr_in xsin;
+#ifdef WIN32
+	int xsinlen = sizeof(xsin);
+#else
+	socklen_t xsinlen = sizeof(xsin);
+#endif
+	int rlen;
+	if((rlen = recvfrom(ctx->rtpSocket[i], buf, bufsize, 0,
+		(struct sockaddr*) &xsin, &xsinlen)) < 0)
+		return;
+	// RTCP feedback may arrive on any hole-punching socket of a channel
+	if(rlen >= 8 && xsin.sin_addr.s_addr == ctx->client.sin_addr.s_addr
+	&& (buf[0] & 0xc0) == 0x80
+	&& (unsigned char) buf[1] >= 200 && (unsigned char) buf[1] <= 206) {
+		rtcp_handle_feedback(ctx, i/2, (const unsigned char*) buf, rlen);
+		return;
+	}
+	if(ctx->rtpPortChecked[i] != 0)
+		return;
+	// XXX: port should not flip-flop, so check only once
+	if(xsin.sin_addr.s_addr != ctx->client.sin_addr.s_addr) {
+		ga_error("RTP: client address mismatched? %u.%u.%u.%u != %u.%u.%u.%u\n",
+			NIPQUAD(ctx->client.sin_addr.s_addr),
+			NIPQUAD(xsin.sin_addr.s_addr));
+		return;
+	}
+	if(xsin.sin_port != ctx->rtpPeerPort[i]) {
+		ga_error("RTP: client port reconfigured: %u -> %u\n",
+			(unsigned int) ntohs(ctx->rtpPeerPort[i]),
+			(unsigned int) ntohs(xsin.sin_port));
+		ctx->rtpPeerPort[i] = xsin.sin_port;
+	} else {
+		ga_error("RTP: client is not under an NAT, port %d confirmed\n",
+			(int) ntohs(ctx->rtpPeerPort[i]));
+	}
+	ctx->rtpPortChecked[i] = 1;
+	return;
 }
+#endif
 
-static void
-get_word(char *buf, int buf_size, const char **pp) {
+/* read and handle one RTSP request or interleaved frame;
+ * returns -1 if the connection should be closed */
+static int
+rtsp_handle_message(RTSPContext *ctx, char *buf, int bufsize) {
 	const char *p;
-	char *q;
-
-	p = *pp;
-	skip_spaces(&p);
-	q = buf;
-	while (!isspace(*p) && *p != '\0') {
-		if ((q - buf) < buf_size - 1)
-			*q++ = *p;
-		p++;
+	char cmd[32], url[1024], protocol[32];
+	int rlen;
+	RTSPMessageHeader header1, *header = &header1;
+	//
+	// read commands
+	if((rlen = rtsp_getnext(ctx, buf, bufsize)) < 0) {
+		return -1;
 	}
-	if (buf_size > 0)
-		*q = '\0';
-	*pp = p;
+	// Interleaved binary data?
+	if(buf[0] == '$') {
+		handle_rtcp(ctx, buf, rlen);
+		return 0;
+	}
+	// REQUEST line
+	ga_error("%s", buf);
+	p = buf;
+	get_word(cmd, sizeof(cmd), &p);
+	get_word(url, sizeof(url), &p);
+	get_word(protocol, sizeof(protocol), &p);
+	// check protocol
+	if(strcmp(protocol, "RTSP/1.0") != 0) {
+		rtsp_reply_error(ctx, RTSP_STATUS_VERSION);
+		return -1;
+	}
+	// read headers
+	bzero(header, sizeof(*header));
+	do {
+		int myseq = -1;
+		char mysession[sizeof(header->session_id)] = "";
+		if((rlen = rtsp_getnext(ctx, buf, bufsize)) < 0)
+			return -1;
+		if(buf[0]=='\n' || (buf[0]=='\r' && buf[1]=='\n'))
+			break;
+#if 0
+		ga_error("HEADER: %s", buf);
+#endif
+		// Special handling to CSeq & Session header
+		// ff_rtsp_parse_line cannot handle CSeq & Session properly on Windows
+		// any more?
+		if(strncasecmp("CSeq: ", buf, 6) == 0) {
+			myseq = strtol(buf+6, NULL, 10);
+		}
+		if(strncasecmp("Session: ", buf, 9) == 0) {
+			strcpy(mysession, buf+9);
+		}
+		//
+		ff_rtsp_parse_line(header, buf, NULL, NULL);
+		//
+		if(myseq > 0 && header->seq <= 0) {
+			ga_error("WARNING: CSeq fixes applied (%d->%d).\n",
+				header->seq, myseq);
+			header->seq = myseq;
+		}
+		if(mysession[0] != '\0' && header->session_id[0]=='\0') {
+			unsigned i;
+			for(i = 0; i < sizeof(header->session_id)-1; i++) {
+				if(mysession[i] == '\0'
+				|| isspace(mysession[i])
+				|| mysession[i] == ';')
+					break;
+				header->session_id[i] = mysession[i];
+			}
+			header->session_id[i+1] = '\0';
+			ga_error("WARNING: Session fixes applied (%s)\n",
+				header->session_id);
+		}
+	} while(1);
+	// special handle to session_id
+	if(header->session_id != NULL) {
+		char *p = header->session_id;
+		while(*p != '\0') {
+			if(*p == '\r' || *p == '\n') {
+				*p = '\0';
+				break;
+			}
+			p++;
+		}
+	}
+	// handle commands
+	ctx->seq = header->seq;
+	if (!strcmp(cmd, "DESCRIBE"))
+		rtsp_cmd_describe(ctx, url);
+	else if (!strcmp(cmd, "OPTIONS"))
+		rtsp_cmd_options(ctx, url);
+	else if (!strcmp(cmd, "SETUP"))
+		rtsp_cmd_setup(ctx, url, header);
+	else if (!strcmp(cmd, "PLAY"))
+		rtsp_cmd_play(ctx, url, header);
+	else if (!strcmp(cmd, "PAUSE"))
+		rtsp_cmd_pause(ctx, url, header);
+	else if (!strcmp(cmd, "TEARDOWN"))
+		rtsp_cmd_teardown(ctx, url, header, 1);
+	else
+		rtsp_reply_error(ctx, RTSP_STATUS_METHOD);
+	if(ctx->state == SERVER_STATE_TEARDOWN) {
+		return -1;
+	}
+	return 0;
 }
 
 void*
 rtspserver(void *arg) {
 #ifdef WIN32
 	SOCKET s = *((SOCKET*) arg);
-	int sinlen = sizeof(struct sockaddr_in);
 #else
 	int s = *((int*) arg);
-	socklen_t sinlen = sizeof(struct sockaddr_in);
 #endif
-	const char *p;
 	char buf[8192];
-	char cmd[32], url[1024], protocol[32];
-	int rlen;
-	struct sockaddr_in sin;
 	RTSPContext ctx;
-	RTSPMessageHeader header1, *header = &header1;
-	//int thread_ret;
-	// image info
-	//int iwidth = video_source_maxwidth(0);
-	//int iheight = video_source_maxheight(0);
-	//
-	rtspconf = rtspconf_global();
-	sinlen = sizeof(sin);
-	getpeername(s, (struct sockaddr*) &sin, &sinlen);
 	//
-	bzero(&ctx, sizeof(ctx));
-	if(per_client_init(&ctx) < 0) {
-		ga_error("server initialization failed.\n");
+	if(rtsp_session_open(&ctx, s) < 0)
 		return NULL;
-	}
-	bcopy(&sin, &ctx.client, sizeof(ctx.client));
-	ctx.state = SERVER_STATE_IDLE;
-	// XXX: hasVideo is used to sync audio/video
-	// This value is increased by 1 for each captured frame until it is gerater than zero
-	// when this value is greater than zero, audio encoding then starts ...
-	//ctx.hasVideo = -(rtspconf->video_fps>>1);	// for slow encoders?
-	ctx.hasVideo = 0;	// with 'zerolatency'
-	pthread_mutex_init(&ctx.rtsp_writer_mutex, NULL);
-	//
-	ga_error("[tid %ld] client connected from %s:%d\n",
-		ga_gettid(),
-		inet_ntoa(sin.sin_addr), htons(sin.sin_port));
-	//
-	ctx.fd = s;
 	//
 	do {
 		int i, fdmax, active;
@@ -1099,7 +2708,7 @@ rtspserver(void *arg) {
 		to.tv_usec = 500000;
 		if((active = select(fdmax+1, &rfds, NULL, NULL, &to)) < 0) {
 			ga_error("select() failed: %s\n", strerror(errno));
-			goto quit;
+			break;
 		}
 		if(active == 0) {
 			// try again!
@@ -1107,146 +2716,540 @@ rtspserver(void *arg) {
 		}
 #ifdef HOLE_PUNCHING
 		for(i = 0; i < 2*ctx.streamCount; i++) {
-			struct sockaddr_in xsin;
-#ifdef WIN32
-			int xsinlen = sizeof(xsin);
-#else
-			socklen_t xsinlen = sizeof(xsin);
-#endif
 			if(FD_ISSET(ctx.rtpSocket[i], &rfds) == 0)
 				continue;
-			recvfrom(ctx.rtpSocket[i], buf, sizeof(buf), 0,
-				(struct sockaddr*) &xsin, &xsinlen);
-			if(ctx.rtpPortChecked[i] != 0)
-				continue;
-			// XXX: port should not flip-flop, so check only once
-			if(xsin.sin_addr.s_addr != ctx.client.sin_addr.s_addr) {
-				ga_error("RTP: client address mismatched? %u.%u.%u.%u != %u.%u.%u.%u\n",
-					NIPQUAD(ctx.client.sin_addr.s_addr),
-					NIPQUAD(xsin.sin_addr.s_addr));
-				continue;
-			}
-			if(xsin.sin_port != ctx.rtpPeerPort[i]) {
-				ga_error("RTP: client port reconfigured: %u -> %u\n",
-					(unsigned int) ntohs(ctx.rtpPeerPort[i]),
-					(unsigned int) ntohs(xsin.sin_port));
-				ctx.rtpPeerPort[i] = xsin.sin_port;
-			} else {
-				ga_error("RTP: client is not under an NAT, port %d confirmed\n",
-					(int) ntohs(ctx.rtpPeerPort[i]));
-			}
-			ctx.rtpPortChecked[i] = 1;
+			rtsp_handle_rtp(&ctx, i, buf, sizeof(buf));
 		}
 		// is RTSP connection?
 		if(FD_ISSET(ctx.fd, &rfds) == 0)
 			continue;
 #endif
-		// read commands
-		if((rlen = rtsp_getnext(&ctx, buf, sizeof(buf))) < 0) {
-			goto quit;
+		if(rtsp_handle_message(&ctx, buf, sizeof(buf)) < 0)
+			break;
+	} while(1);
+	//
+	rtsp_session_close(&ctx);
+	ga_error("RTSP client thread terminated.\n");
+	//
+	return NULL;
+}
+
+#ifdef RTSP_REACTOR
+//
+// epoll reactor: a fixed set of threads serves all RTSP sessions; each
+// session lives in a slab entry, and all its output (replies and
+// interleaved RTP) is flushed from the send queue on EPOLLOUT.
+//
+#define	RTSP_REACTOR_MAX	16
+#define	RTSP_SLAB_CHUNK		64	// sessions per slab allocation
+#define	RTSP_REACTOR_EVENTS	256
+
+struct RTSPSession;
+struct RTSPReactor;
+
+struct RTSPEventHandle {
+	struct RTSPSession *session;
+	int index;			// -1: RTSP connection; otherwise RTP socket index
+};
+
+struct RTSPSession {
+	RTSPContext ctx;
+	struct RTSPReactor *reactor;
+	int active;
+	int busy;			// PLAY runs on a worker, the connection is not watched
+	struct RTSPSession *next;	// slab free list or close list
+	struct RTSPEventHandle handle[1+RTSP_CHANNEL_MAXx2];
+};
+
+struct RTSPReactor {
+	int id;
+	int epfd;
+	int evfd;			// wakes up the reactor for new connections
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	vector<int> pending;		// accepted sockets not yet attached
+	vector<struct RTSPSession*> resumed;	// sessions back from a PLAY worker
+	int sessions;
+	unsigned int events;
+	long long since;
+	char buf[8192];
+};
+
+static struct RTSPReactor reactors[RTSP_REACTOR_MAX];
+static int reactor_count = 0;
+static unsigned int reactor_next = 0;
+static long long reactor_report = 0;
+// session slab: chunks are never released, free entries are reused
+static pthread_mutex_t slab_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct RTSPSession *slab_free = NULL;
+static vector<struct RTSPSession*> slab_chunks;
+
+static struct RTSPSession *
+rtsp_slab_alloc() {
+	struct RTSPSession *ss;
+	pthread_mutex_lock(&slab_mutex);
+	if(slab_free == NULL) {
+		int i;
+		struct RTSPSession *chunk;
+		if((chunk = (struct RTSPSession*) calloc(RTSP_SLAB_CHUNK, sizeof(struct RTSPSession))) == NULL) {
+			pthread_mutex_unlock(&slab_mutex);
+			return NULL;
+		}
+		for(i = 0; i < RTSP_SLAB_CHUNK; i++) {
+			chunk[i].next = slab_free;
+			slab_free = &chunk[i];
 		}
-		// Interleaved binary data?
-		if(buf[0] == '$') {
-			handle_rtcp(&ctx, buf, rlen);
+		slab_chunks.push_back(chunk);
+		ga_error("RTSP: session slab grown to %d entries\n",
+			(int) slab_chunks.size() * RTSP_SLAB_CHUNK);
+	}
+	ss = slab_free;
+	slab_free = ss->next;
+	pthread_mutex_unlock(&slab_mutex);
+	ss->next = NULL;
+	return ss;
+}
+
+static void
+rtsp_slab_free(struct RTSPSession *ss) {
+	pthread_mutex_lock(&slab_mutex);
+	ss->active = 0;
+	ss->reactor = NULL;
+	ss->next = slab_free;
+	slab_free = ss;
+	pthread_mutex_unlock(&slab_mutex);
+	return;
+}
+
+/* toggle EPOLLOUT of a session's RTSP connection; called with sendq.mutex held */
+static void
+rtsp_reactor_arm(RTSPContext *ctx, int writable) {
+	struct RTSPSession *ss = (struct RTSPSession*) ctx->session;
+	struct epoll_event ev;
+	ev.events = EPOLLIN | (writable ? EPOLLOUT : 0);
+	ev.data.ptr = &ss->handle[0];
+	epoll_ctl(ss->reactor->epfd, EPOLL_CTL_MOD, ctx->fd, &ev);
+	return;
+}
+
+/* watch the hole-punching sockets of a stream */
+static void
+rtsp_reactor_watch(RTSPContext *ctx, int streamid) {
+	struct RTSPSession *ss = (struct RTSPSession*) ctx->session;
+	struct epoll_event ev;
+	int i;
+	for(i = streamid*2; i < streamid*2+2; i++) {
+		ss->handle[1+i].session = ss;
+		ss->handle[1+i].index = i;
+		ev.events = EPOLLIN;
+		ev.data.ptr = &ss->handle[1+i];
+		if(epoll_ctl(ss->reactor->epfd, EPOLL_CTL_ADD, ctx->rtpSocket[i], &ev) < 0)
+			ga_error("RTSP: reactor cannot watch RTP socket %d - %s\n",
+				ctx->rtpSocket[i], strerror(errno));
+	}
+	return;
+}
+
+/* attach an accepted connection to a reactor */
+static void
+rtsp_reactor_attach(struct RTSPReactor *r, int fd) {
+	struct RTSPSession *ss;
+	struct RTSPSendQueue *q;
+	struct epoll_event ev;
+	//
+	if((ss = rtsp_slab_alloc()) == NULL) {
+		ga_error("RTSP: cannot allocate session.\n");
+		close(fd);
+		return;
+	}
+	if(rtsp_session_open(&ss->ctx, fd) < 0) {
+		close(fd);
+		rtsp_slab_free(ss);
+		return;
+	}
+	q = &ss->ctx.sendq;
+	// reactor sessions always queue, even with rtsp-send-queue = 0
+	if(q->size <= 0)
+		q->size = rtsp_sendq_minsize();
+	if((q->buf = (unsigned char*) malloc(q->size)) == NULL) {
+		ga_error("RTSP: cannot allocate send queue (%d bytes)\n", q->size);
+		goto error;
+	}
+	if((ss->ctx.rbuffer = (char*) malloc(65536)) == NULL)
+		goto error;
+	ss->ctx.rbufsize = 65536;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	//
+	ss->reactor = r;
+	ss->handle[0].session = ss;
+	ss->handle[0].index = -1;
+	ss->ctx.session = ss;
+	ev.events = EPOLLIN;
+	ev.data.ptr = &ss->handle[0];
+	if(epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		ga_error("RTSP: reactor cannot watch connection - %s\n", strerror(errno));
+		ss->ctx.session = NULL;
+		goto error;
+	}
+	ss->active = 1;
+	r->sessions++;
+	return;
+error:
+	rtsp_session_close(&ss->ctx);
+	rtsp_slab_free(ss);
+	return;
+}
+
+/* flush the send queue of a session without blocking */
+static int
+rtsp_reactor_flush(struct RTSPSession *ss) {
+	RTSPContext *ctx = &ss->ctx;
+	struct RTSPSendQueue *q = &ctx->sendq;
+	struct iovec iov[2];
+	struct msghdr msg;
+	int off, len;
+	ssize_t wlen;
+	//
+	pthread_mutex_lock(&q->mutex);
+	if(q->wpos == q->rpos) {
+		q->armed = 0;
+		rtsp_reactor_arm(ctx, 0);
+		pthread_mutex_unlock(&q->mutex);
+		return 0;
+	}
+	off = q->rpos % q->size;
+	len = (int) (q->wpos - q->rpos);
+	bzero(&msg, sizeof(msg));
+	msg.msg_iov = iov;
+	iov[0].iov_base = q->buf + off;
+	if(off + len <= q->size) {
+		iov[0].iov_len = len;
+		msg.msg_iovlen = 1;
+	} else {
+		iov[0].iov_len = q->size - off;
+		iov[1].iov_base = q->buf;
+		iov[1].iov_len = len - iov[0].iov_len;
+		msg.msg_iovlen = 2;
+	}
+	pthread_mutex_unlock(&q->mutex);
+	// producers only append, so the region stays valid
+	if((wlen = sendmsg(ctx->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+		ga_error("RTSP: send failed - %s\n", strerror(errno));
+		return -1;
+	}
+	pthread_mutex_lock(&q->mutex);
+	q->rpos += wlen;
+	q->sent += wlen;
+	if(q->wpos == q->rpos) {
+		q->armed = 0;
+		rtsp_reactor_arm(ctx, 0);
+	}
+	pthread_mutex_unlock(&q->mutex);
+	return 0;
+}
+
+/* check if the read buffer holds a complete request or interleaved frame */
+static int
+rtsp_message_complete(RTSPContext *ctx) {
+	const unsigned char *b = (const unsigned char*) ctx->rbuffer + ctx->rbufhead;
+	int i, n = ctx->rbuftail - ctx->rbufhead;
+	if(n <= 0)
+		return 0;
+	if(b[0] == '$')
+		return n >= 4 && n >= 4 + ((b[2] << 8) | b[3]);
+	for(i = 0; i < n; i++) {
+		if(b[i] != '\n')
 			continue;
+		if(i+1 < n && b[i+1] == '\n')
+			return 1;
+		if(i+2 < n && b[i+1] == '\r' && b[i+2] == '\n')
+			return 1;
+	}
+	return 0;
+}
+
+/* handle the complete messages in the read buffer, until one of them
+ * hands the session over to a worker */
+static int
+rtsp_reactor_handle(struct RTSPSession *ss) {
+	RTSPContext *ctx = &ss->ctx;
+	while(ss->busy == 0 && rtsp_message_complete(ctx)) {
+		if(rtsp_handle_message(ctx, ss->reactor->buf, sizeof(ss->reactor->buf)) < 0)
+			return -1;
+		if(ctx->sendq.failed)
+			return -1;
+	}
+	return 0;
+}
+
+/* watch the RTSP connection of a session again, after a worker is done */
+static void
+rtsp_reactor_rewatch(struct RTSPSession *ss) {
+	struct RTSPSendQueue *q = &ss->ctx.sendq;
+	struct epoll_event ev;
+	// replies queued meanwhile could not arm the connection
+	pthread_mutex_lock(&q->mutex);
+	ev.events = EPOLLIN | (q->armed ? EPOLLOUT : 0);
+	ev.data.ptr = &ss->handle[0];
+	if(epoll_ctl(ss->reactor->epfd, EPOLL_CTL_ADD, ss->ctx.fd, &ev) < 0)
+		ga_error("RTSP: reactor cannot watch connection - %s\n", strerror(errno));
+	ss->busy = 0;
+	pthread_mutex_unlock(&q->mutex);
+	return;
+}
+
+static void *
+rtsp_reactor_playproc(void *arg) {
+	struct RTSPSession *ss = (struct RTSPSession*) arg;
+	struct RTSPReactor *r = ss->reactor;
+	uint64_t one = 1;
+	//
+	rtsp_play_start(&ss->ctx);
+	pthread_mutex_lock(&r->mutex);
+	r->resumed.push_back(ss);
+	pthread_mutex_unlock(&r->mutex);
+	if(write(r->evfd, &one, sizeof(one)) < 0) {
+		// nothing
+	}
+	return NULL;
+}
+
+/* run PLAY on a worker; the connection is not watched until it is done,
+ * so the session is neither read nor closed in the meantime */
+static void
+rtsp_reactor_play(RTSPContext *ctx) {
+	struct RTSPSession *ss = (struct RTSPSession*) ctx->session;
+	pthread_t t;
+	//
+	ss->busy = 1;
+	epoll_ctl(ss->reactor->epfd, EPOLL_CTL_DEL, ctx->fd, NULL);
+	if(pthread_create(&t, NULL, rtsp_reactor_playproc, ss) != 0) {
+		ga_error("RTSP: cannot create PLAY worker, run it on the reactor.\n");
+		rtsp_play_start(ctx);
+		rtsp_reactor_rewatch(ss);
+		return;
+	}
+	pthread_detach(t);
+	return;
+}
+
+/* read from a session's RTSP connection and handle complete messages */
+static int
+rtsp_reactor_read(struct RTSPSession *ss) {
+	RTSPContext *ctx = &ss->ctx;
+	int rlen;
+	//
+	if(ctx->rbufhead > 0) {
+		bcopy(ctx->rbuffer + ctx->rbufhead, ctx->rbuffer, ctx->rbuftail - ctx->rbufhead);
+		ctx->rbuftail -= ctx->rbufhead;
+		ctx->rbufhead = 0;
+	}
+	if(ctx->rbuftail == ctx->rbufsize) {
+		ga_error("Buffer full: Extremely long request encountered?\n");
+		return -1;
+	}
+	if((rlen = read(ctx->fd, ctx->rbuffer + ctx->rbuftail, ctx->rbufsize - ctx->rbuftail)) == 0)
+		return -1;
+	if(rlen < 0) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+		return -1;
+	}
+	ctx->rbuftail += rlen;
+	// requests are parsed only when complete, so reads never block
+	return rtsp_reactor_handle(ss);
+}
+
+static void
+rtsp_reactor_close(struct RTSPSession *ss) {
+	// best effort to deliver the last reply, e.g., of TEARDOWN
+	rtsp_reactor_flush(ss);
+	// reports of other reactors walk the slab under slab_mutex
+	pthread_mutex_lock(&slab_mutex);
+	ss->active = 0;
+	pthread_mutex_unlock(&slab_mutex);
+	epoll_ctl(ss->reactor->epfd, EPOLL_CTL_DEL, ss->ctx.fd, NULL);
+	rtsp_session_close(&ss->ctx);
+	ss->reactor->sessions--;
+	ga_error("RTSP: reactor %d session closed (%d left).\n",
+		ss->reactor->id, ss->reactor->sessions);
+	return;
+}
+
+static void
+rtsp_reactor_report(struct RTSPReactor *r, long long now) {
+	unsigned int i, j;
+	ga_error("RTSP: reactor %d, %d sessions, %.1f events/s\n",
+		r->id, r->sessions, 1000000.0 * r->events / (now - r->since));
+	pthread_mutex_lock(&slab_mutex);
+	for(i = 0; i < slab_chunks.size(); i++) {
+		for(j = 0; j < RTSP_SLAB_CHUNK; j++) {
+			struct RTSPSession *ss = &slab_chunks[i][j];
+			if(ss->active && ss->reactor == r)
+				rtsp_sendq_report(&ss->ctx, now);
 		}
-		// REQUEST line
-		ga_error("%s", buf);
-		p = buf;
-		get_word(cmd, sizeof(cmd), &p);
-		get_word(url, sizeof(url), &p);
-		get_word(protocol, sizeof(protocol), &p);
-		// check protocol
-		if(strcmp(protocol, "RTSP/1.0") != 0) {
-			rtsp_reply_error(&ctx, RTSP_STATUS_VERSION);
-			goto quit;
-		}
-		// read headers
-		bzero(header, sizeof(*header));
-		do {
-			int myseq = -1;
-			char mysession[sizeof(header->session_id)] = "";
-			if((rlen = rtsp_getnext(&ctx, buf, sizeof(buf))) < 0)
-				goto quit;
-			if(buf[0]=='\n' || (buf[0]=='\r' && buf[1]=='\n'))
-				break;
-#if 0
-			ga_error("HEADER: %s", buf);
-#endif
-			// Special handling to CSeq & Session header
-			// ff_rtsp_parse_line cannot handle CSeq & Session properly on Windows
-			// any more?
-			if(strncasecmp("CSeq: ", buf, 6) == 0) {
-				myseq = strtol(buf+6, NULL, 10);
-			}
-			if(strncasecmp("Session: ", buf, 9) == 0) {
-				strcpy(mysession, buf+9);
+	}
+	pthread_mutex_unlock(&slab_mutex);
+	r->events = 0;
+	r->since = now;
+	return;
+}
+
+static void *
+rtsp_reactor_threadproc(void *arg) {
+	struct RTSPReactor *r = (struct RTSPReactor*) arg;
+	struct epoll_event evs[RTSP_REACTOR_EVENTS];
+	int i, n;
+	//
+	ga_thread_role("server", 1 + r->id);
+	ga_error("RTSP: reactor %d started (tid %ld).\n", r->id, ga_gettid());
+	r->since = ga_monotonic_us();
+	while(1) {
+		struct RTSPSession *closed = NULL;
+		if((n = epoll_wait(r->epfd, evs, RTSP_REACTOR_EVENTS, 1000)) < 0) {
+			if(errno == EINTR)
+				continue;
+			ga_error("RTSP: reactor %d epoll_wait failed - %s\n", r->id, strerror(errno));
+			break;
+		}
+		r->events += n;
+		for(i = 0; i < n; i++) {
+			struct RTSPEventHandle *h = (struct RTSPEventHandle*) evs[i].data.ptr;
+			struct RTSPSession *ss;
+			// new connections
+			if(h == NULL) {
+				uint64_t count;
+				vector<int> fds;
+				vector<struct RTSPSession*> resumed;
+				if(read(r->evfd, &count, sizeof(count)) < 0) {
+					// nothing
+				}
+				pthread_mutex_lock(&r->mutex);
+				fds.swap(r->pending);
+				resumed.swap(r->resumed);
+				pthread_mutex_unlock(&r->mutex);
+				for(unsigned j = 0; j < fds.size(); j++)
+					rtsp_reactor_attach(r, fds[j]);
+				// and sessions whose PLAY worker is done, with
+				// the requests that arrived meanwhile
+				for(unsigned j = 0; j < resumed.size(); j++) {
+					ss = resumed[j];
+					rtsp_reactor_rewatch(ss);
+					if(rtsp_reactor_handle(ss) < 0) {
+						rtsp_reactor_close(ss);
+						ss->next = closed;
+						closed = ss;
+					}
+				}
+				continue;
 			}
-			//
-			ff_rtsp_parse_line(header, buf, NULL, NULL);
-			//
-			if(myseq > 0 && header->seq <= 0) {
-				ga_error("WARNING: CSeq fixes applied (%d->%d).\n",
-					header->seq, myseq);
-				header->seq = myseq;
+			// sessions closed in this round stay in the list until
+			// the round ends, so stale events are ignored safely
+			ss = h->session;
+			if(ss->active == 0)
+				continue;
+			if(h->index >= 0) {
+				rtsp_handle_rtp(&ss->ctx, h->index, r->buf, sizeof(r->buf));
+				continue;
 			}
-			if(mysession[0] != '\0' && header->session_id[0]=='\0') {
-				unsigned i;
-				for(i = 0; i < sizeof(header->session_id)-1; i++) {
-					if(mysession[i] == '\0'
-					|| isspace(mysession[i])
-					|| mysession[i] == ';')
-						break;
-					header->session_id[i] = mysession[i];
+			if(evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+				if(rtsp_reactor_read(ss) < 0) {
+					rtsp_reactor_close(ss);
+					ss->next = closed;
+					closed = ss;
+					continue;
 				}
-				header->session_id[i+1] = '\0';
-				ga_error("WARNING: Session fixes applied (%s)\n",
-					header->session_id);
 			}
-		} while(1);
-		// special handle to session_id
-		if(header->session_id != NULL) {
-			char *p = header->session_id;
-			while(*p != '\0') {
-				if(*p == '\r' || *p == '\n') {
-					*p = '\0';
-					break;
+			if(evs[i].events & EPOLLOUT) {
+				if(rtsp_reactor_flush(ss) < 0) {
+					rtsp_reactor_close(ss);
+					ss->next = closed;
+					closed = ss;
+					continue;
 				}
-				p++;
 			}
 		}
-		// handle commands
-		ctx.seq = header->seq;
-		if (!strcmp(cmd, "DESCRIBE"))
-			rtsp_cmd_describe(&ctx, url);
-		else if (!strcmp(cmd, "OPTIONS"))
-			rtsp_cmd_options(&ctx, url);
-		else if (!strcmp(cmd, "SETUP"))
-			rtsp_cmd_setup(&ctx, url, header);
-		else if (!strcmp(cmd, "PLAY"))
-			rtsp_cmd_play(&ctx, url, header);
-		else if (!strcmp(cmd, "PAUSE"))
-			rtsp_cmd_pause(&ctx, url, header);
-		else if (!strcmp(cmd, "TEARDOWN"))
-			rtsp_cmd_teardown(&ctx, url, header, 1);
-		else
-			rtsp_reply_error(&ctx, RTSP_STATUS_METHOD);
-		if(ctx.state == SERVER_STATE_TEARDOWN) {
-			break;
+		while(closed != NULL) {
+			struct RTSPSession *ss = closed;
+			closed = closed->next;
+			rtsp_slab_free(ss);
 		}
-	} while(1);
-quit:
-	ctx.state = SERVER_STATE_TEARDOWN;
-	//
-	close(ctx.fd);
-	// 2014-05-20: support only share-encoder model
-	ff_server_unregister_client(&ctx);
-	//
-	per_client_deinit(&ctx);
-	//ga_error("RTSP client thread terminated (%d/%d clients left).\n",
-	//	video_source_client_count(), audio_source_client_count());
-	ga_error("RTSP client thread terminated.\n");
-	//
+		if(reactor_report > 0) {
+			long long now = ga_monotonic_us();
+			if(now - r->since >= reactor_report)
+				rtsp_reactor_report(r, now);
+		}
+	}
 	return NULL;
 }
 
+/**
+ * Start the RTSP reactor threads if enabled.
+ *
+ * Configured by \a rtsp-reactor (default: true) and
+ * \a rtsp-reactor-threads (default: 1).
+ *
+ * @return Number of reactor threads, or 0 if thread-per-client is used.
+ */
+int
+rtsp_reactor_start() {
+	int i, threads;
+	//
+	if(reactor_count > 0)
+		return reactor_count;
+	if(ga_conf_readbool("rtsp-reactor", 1) == 0)
+		return 0;
+	rtspconf = rtspconf_global();
+	if((threads = ga_conf_readint("rtsp-reactor-threads")) <= 0)
+		threads = 1;
+	if(threads > RTSP_REACTOR_MAX)
+		threads = RTSP_REACTOR_MAX;
+	reactor_report = 1000000LL * ga_conf_readint("rtp-send-report");
+	for(i = 0; i < threads; i++) {
+		struct RTSPReactor *r = &reactors[i];
+		struct epoll_event ev;
+		r->id = i;
+		pthread_mutex_init(&r->mutex, NULL);
+		if((r->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0
+		|| (r->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+			ga_error("RTSP: cannot create reactor - %s\n", strerror(errno));
+			break;
+		}
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->evfd, &ev);
+		if(pthread_create(&r->thread, NULL, rtsp_reactor_threadproc, r) != 0) {
+			ga_error("RTSP: cannot create reactor thread.\n");
+			break;
+		}
+		pthread_detach(r->thread);
+		reactor_count++;
+	}
+	ga_error("RTSP: %d reactor thread(s) started.\n", reactor_count);
+	return reactor_count;
+}
+
+/**
+ * Hand an accepted RTSP connection to a reactor thread.
+ *
+ * @param fd [in] The accepted socket.
+ * @return 0 on success, or -1 if no reactor is running.
+ */
+int
+rtsp_reactor_add(int fd) {
+	struct RTSPReactor *r;
+	uint64_t one = 1;
+	if(reactor_count <= 0)
+		return -1;
+	r = &reactors[__sync_fetch_and_add(&reactor_next, 1) % reactor_count];
+	pthread_mutex_lock(&r->mutex);
+	r->pending.push_back(fd);
+	pthread_mutex_unlock(&r->mutex);
+	if(write(r->evfd, &one, sizeof(one)) < 0) {
+		// counter overflow only
+	}
+	return 0;
+}
+#endif
@@ -42,6 +42,14 @@ int ffio_open_dyn_packet_buf(AVIOContext **, int);
 #define	RTSP_CHANNEL_MAX	8	// must be at least VIDEO_SOURCE_CHANNEL_MAX+1
 #define	RTSP_CHANNEL_MAXx2	16	// must be RTSP_CHANNEL_MAX * 2
 
+#ifndef WIN32
+#define	RTSP_SEND_QUEUE		// queued RTP over RTSP/TCP output
+#endif
+#if defined(__linux__) && defined(HOLE_PUNCHING)
+#define	RTSP_REACTOR		// epoll event loop instead of thread-per-client
+#define	RTP_PACER		// send-side pacing of RTP/UDP video frames
+#endif
+
 enum RTSPServerState {
 	SERVER_STATE_IDLE = 0,
 	SERVER_STATE_READY,
@@ -50,6 +58,48 @@ enum RTSPServerState {
 	SERVER_STATE_TEARDOWN
 };
 
+#ifdef HOLE_PUNCHING
+struct RTPSendStats {
+	unsigned int frames;		// rtp_write_bindata calls
+	unsigned int packets;
+	unsigned int syscalls;
+	long long elapsed;		// time spent sending, in us
+	unsigned int nacks;		// generic NACKs received
+	unsigned int resent;		// packets retransmitted
+	unsigned int expired;		// lost packets no longer in the history
+	unsigned int errors;		// failed io_uring sends
+	long long since;		// start of the current report interval
+};
+#endif
+
+#ifdef RTSP_SEND_QUEUE
+enum RTSPSendQueuePolicy {
+	RTSP_SENDQ_DROP = 0,		// drop until the next keyframe
+	RTSP_SENDQ_DISCONNECT		// close the connection
+};
+
+struct RTSPSendQueue {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int running;
+	int failed;
+	int policy;
+	// ring of interleaved frames ('$' + channel + length + RTP packet)
+	unsigned char *buf;
+	int size;
+	unsigned long long rpos, wpos;
+	char dropping[RTSP_CHANNEL_MAX];	// video: drop until the next keyframe
+	long long keyreq[RTSP_CHANNEL_MAX];	// last IDR request while dropping
+	int armed;			// reactor is watching for writability
+	// statistics
+	int maxdepth;
+	unsigned int dropped;
+	unsigned long long sent;
+	long long report, since;
+};
+#endif
+
 struct RTSPContext {
 #ifdef WIN32
 	SOCKET fd;
@@ -57,6 +107,7 @@ struct RTSPContext {
 	int fd;
 #endif
 	struct sockaddr_in client;
+	void *session;			// reactor session, NULL for thread-per-client
 	//
 	int state;
 	int hasVideo;
@@ -90,6 +141,9 @@ struct RTSPContext {
 	int mtu;
 	URLContext *rtp[RTSP_CHANNEL_MAX];	// RTP over UDP
 	pthread_mutex_t rtsp_writer_mutex;	// RTP over RTSP/TCP
+#ifdef RTSP_SEND_QUEUE
+	struct RTSPSendQueue sendq;		// RTP over RTSP/TCP, queued
+#endif
 #ifdef HOLE_PUNCHING
 	int streamCount;
 #ifdef WIN32
@@ -100,15 +154,43 @@ struct RTSPContext {
 	unsigned short rtpLocalPort[RTSP_CHANNEL_MAXx2];
 	unsigned short rtpPeerPort[RTSP_CHANNEL_MAXx2];
 	char rtpPortChecked[RTSP_CHANNEL_MAXx2];
+	// per-client RTP header fields over the shared packetizer
+	unsigned int rtpSSRC[RTSP_CHANNEL_MAX];
+	unsigned short rtpSeqOffset[RTSP_CHANNEL_MAX];
+	unsigned int rtpTsOffset[RTSP_CHANNEL_MAX];
+	// simulcast: the rendition delivered, the next sequence number sent,
+	// and the first one sent from the current rendition
+	int rtpRendition[RTSP_CHANNEL_MAX];
+	unsigned short rtpSeqNext[RTSP_CHANNEL_MAX];
+	unsigned short rtpSeqSwitch[RTSP_CHANNEL_MAX];
+	// RTP/UDP transmission: 0 = sendto, 1 = sendmmsg, 2 = sendmmsg + UDP GSO,
+	// 3 = io_uring send_zc (falls back to 2)
+	int rtpSendBatch;
+	long long rtpSendReport;		// statistics interval in us, 0 = off
+	struct RTPSendStats rtpSendStats[RTSP_CHANNEL_MAX];
+	pthread_mutex_t rtpStatsMutex;		// rtpSendStats: encoder, pacer, and RTCP threads
+#endif
+#ifdef RTP_PACER
+	struct RTPPaceJob *rtpPaceTail[RTSP_CHANNEL_MAX];	// the last queued frame
 #endif
 };
 
 void rtsp_cleanup(RTSPContext *rtsp, int retcode);
-int rtsp_write_bindata(RTSPContext *ctx, int streamid, uint8_t *buf, int buflen);
+int rtsp_write_bindata(RTSPContext *ctx, int streamid, uint8_t *buf, int buflen, int keyframe);
 void* rtspserver(void *arg);
+#ifdef RTSP_REACTOR
+int rtsp_reactor_start();
+int rtsp_reactor_add(int fd);
+#endif
+#ifdef RTP_PACER
+int rtp_pacer_start();
+void rtp_pacer_capacity(int kbps);
+#endif
 #ifdef HOLE_PUNCHING
 int rtp_open_ports(RTSPContext *ctx, int streamid);
 int rtp_write_bindata(RTSPContext *ctx, int streamid, uint8_t *buf, int buflen);
+int rtp_pace_bindata(RTSPContext *ctx, int streamid, uint8_t *buf, int buflen);
+int rtp_new_shared_stream(int streamid, int mtu, AVFormatContext **pfmtctx, AVStream **pstream, AVCodecContext **pencoder);
 #endif
 
 #endif
@@ -31,6 +31,9 @@
 
 #include "ga-common.h"
 #include "ga-module.h"
+#include "ga-conf.h"
+#include "ga-thread.h"
+#include "ga-fec.h"
 #include "encoder-common.h"
 #include "rtspconf.h"
 
@@ -50,6 +53,52 @@ static int server_started = 0;
 static pthread_rwlock_t cclock = PTHREAD_RWLOCK_INITIALIZER;
 static map<void *, void *> client_context;
 
+#ifdef HOLE_PUNCHING
+/* one packetizer per channel and simulcast rendition, shared by all clients */
+static struct ff_shared_packetizer_s {
+	AVFormatContext *fmtctx;
+	AVStream *stream;
+	AVCodecContext *encoder;
+	int failed;
+	unsigned short fecseq;		// sequence number of FEC packets
+	unsigned int tsbase;		// RTP timestamp minus pts of the last packet
+}	shared[RTSP_CHANNEL_MAX][ENCODER_SIMULCAST_MAX];
+
+/* recently sent RTP packets of a channel and rendition, kept for NACK
+ * retransmissions; packets are stored as packetized, i.e., before
+ * per-client rewriting */
+struct ff_rtp_history_slot_s {
+	int len;			// 0 = empty
+	unsigned short seq;
+	long long sent;			// ga_monotonic_us
+};
+
+static struct ff_rtp_history_s {
+	unsigned int mask;		// number of slots - 1
+	int slotsize;
+	unsigned char *data;		// (mask+1) * slotsize bytes
+	struct ff_rtp_history_slot_s *slot;
+}	history[RTSP_CHANNEL_MAX][ENCODER_SIMULCAST_MAX];
+static pthread_mutex_t history_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define	RTP_FEC_FRAME_MAX	1024	// packets per frame covered by FEC
+static int nack_enabled = 1;
+static long long nack_budget = 250000LL;	// retransmit only younger packets, in us
+
+/* XOR parity FEC for video channels over RTP/UDP */
+static int fec_enabled = 0;
+static int fec_fixed = 0;		// fixed group size, 0 = adapt to the reported loss
+static int fec_group = 0;		// current group size, 0 = no parity packets
+static int fec_pt = 127;		// payload type of FEC packets
+static long long fec_report = 0;	// statistics interval in us, 0 = off
+static struct ff_fec_stats_s {
+	unsigned int frames;
+	unsigned int packets;		// media packets protected
+	unsigned int parity;		// FEC packets generated
+	long long elapsed;		// time spent encoding, in us
+	long long since;
+}	fec_stats;
+#endif
+
 int
 ff_server_register_client(void *ccontext) {
 	if(encoder_register_client(ccontext) < 0)
@@ -83,6 +132,7 @@ ff_server_main(void *arg) {
 #endif
 	struct sockaddr_in csin;
 	//
+	ga_thread_role("server", 0);
 	server_started = 1;
 	//
 	do {
@@ -103,6 +153,10 @@ ff_server_main(void *arg) {
 				ga_error("ffmpeg-server: set TCP sending buffer failed.\n");
 			}
 		} while(0);
+#ifdef RTSP_REACTOR
+		if(rtsp_reactor_add(cs) == 0)
+			continue;
+#endif
 		//
 		pthread_cancel_init();
 		if(pthread_create(&thread, NULL, rtspserver, &cs) != 0) {
@@ -148,11 +202,39 @@ ff_server_init(void *arg) {
 		perror("listen");
 		return -1;
 	}
+#ifdef HOLE_PUNCHING
+	nack_enabled = ga_conf_readbool("rtp-nack", 1);
+	if(ga_conf_readint("rtp-nack-budget") > 0)
+		nack_budget = 1000LL * ga_conf_readint("rtp-nack-budget");
+	if((fec_enabled = ga_conf_readbool("rtp-fec", 0)) != 0) {
+		fec_fixed = ga_conf_readint("rtp-fec-group");
+		if(fec_fixed > GA_FEC_GROUP_MAX)
+			fec_fixed = GA_FEC_GROUP_MAX;
+		fec_group = fec_fixed > 0 ? fec_fixed : 0;
+		if(ga_conf_readint("rtp-fec-payload-type") > 0)
+			fec_pt = ga_conf_readint("rtp-fec-payload-type") & 0x7f;
+		// FEC is told apart by payload type alone, keep clear of the
+		// dynamic types (96 + stream index) of the RTP muxer
+		if(fec_pt < 98) {
+			ga_error("ffmpeg-server: FEC payload type %d collides with media, use 127\n", fec_pt);
+			fec_pt = 127;
+		}
+		fec_report = 1000000LL * ga_conf_readint("rtp-send-report");
+		ga_error("ffmpeg-server: RTP FEC enabled, payload type %d, group %s\n",
+			fec_pt, fec_fixed > 0 ? "fixed" : "adaptive");
+	}
+#endif
 	return 0;
 }
 
 static int
 ff_server_start(void *arg) {
+#ifdef RTSP_REACTOR
+	rtsp_reactor_start();
+#endif
+#ifdef RTP_PACER
+	rtp_pacer_start();
+#endif
 	if(pthread_create(&server_tid, NULL, ff_server_main, NULL) != 0) {
 		ga_error("start ffmpeg-server failed.\n");
 		return -1;
@@ -178,50 +260,518 @@ ff_server_deinit(void *arg) {
 #else
 	if(server_socket >= 0)		{ close(server_socket); }
 	server_socket = -1;
+#endif
+#ifdef HOLE_PUNCHING
+	do {
+		int i, j;
+		struct ff_rtp_history_s *h = &history[0][0];
+		struct ff_shared_packetizer_s *sp = &shared[0][0];
+		pthread_mutex_lock(&history_mutex);
+		for(i = 0; i < RTSP_CHANNEL_MAX * ENCODER_SIMULCAST_MAX; i++) {
+			if(h[i].data)	free(h[i].data);
+			if(h[i].slot)	free(h[i].slot);
+		}
+		bzero(history, sizeof(history));
+		pthread_mutex_unlock(&history_mutex);
+		for(i = 0; i < RTSP_CHANNEL_MAX * ENCODER_SIMULCAST_MAX; i++) {
+			AVFormatContext *fmtctx = sp[i].fmtctx;
+			if(fmtctx == NULL)
+				continue;
+			for(j = 0; j < (int) fmtctx->nb_streams; j++) {
+				if(fmtctx->streams[j]->codec)
+					ga_avcodec_close(fmtctx->streams[j]->codec);
+				av_freep(&fmtctx->streams[j]->codec);
+				av_freep(&fmtctx->streams[j]);
+			}
+			av_free(fmtctx);
+		}
+		bzero(shared, sizeof(shared));
+	} while(0);
 #endif
 	return 0;
 }
 
+#ifdef HOLE_PUNCHING
+/* allocate the retransmission history of a rendition, sized rtp-history-size KB */
 static int
-ff_server_send_packet_1(const char *prefix, void *ctx, int channelId, AVPacket *pkt, int64_t encoderPts, struct timeval *ptv) {
-	int iolen;
-	uint8_t *iobuf;
-	RTSPContext *rtsp = (RTSPContext*) ctx;
+ff_server_history_init(int channelId, int rendition, int mtu) {
+	struct ff_rtp_history_s *h = &history[channelId][rendition];
+	unsigned int slots = 64;
+	int kbytes;
+	char buf[64];
 	//
-	if(rtsp->fmtctx[channelId] == NULL) {
-		// not initialized - disabled?
+	if(ga_conf_readv("rtp-history-size", buf, sizeof(buf)) == NULL)
+		kbytes = 512;
+	else
+		kbytes = ga_conf_readint("rtp-history-size");
+	if(kbytes <= 0 || nack_enabled == 0)
 		return 0;
+	// slots are indexed by the sequence number, so keep a power of two
+	while(slots < 32768 && slots * 2 * mtu <= kbytes * 1024U)
+		slots *= 2;
+	pthread_mutex_lock(&history_mutex);
+	h->slot = (struct ff_rtp_history_slot_s*) calloc(slots, sizeof(*h->slot));
+	h->data = (unsigned char*) malloc(slots * mtu);
+	if(h->slot == NULL || h->data == NULL) {
+		if(h->slot)	free(h->slot);
+		if(h->data)	free(h->data);
+		bzero(h, sizeof(*h));
+		pthread_mutex_unlock(&history_mutex);
+		ga_error("ffmpeg-server: cannot allocate RTP history for channel %d/#%d.\n",
+			channelId, rendition);
+		return -1;
+	}
+	h->mask = slots - 1;
+	h->slotsize = mtu;
+	pthread_mutex_unlock(&history_mutex);
+	ga_error("ffmpeg-server: RTP history for channel %d/#%d, %u packets, %d KB\n",
+		channelId, rendition, slots, (int) (slots * mtu / 1024));
+	return 0;
+}
+
+/* keep the RTP packets of a dynamic packet buffer in the history */
+static void
+ff_server_history_put(int channelId, int rendition, const uint8_t *buf, int buflen) {
+	struct ff_rtp_history_s *h = &history[channelId][rendition];
+	struct ff_rtp_history_slot_s *slot;
+	unsigned short seq;
+	long long now;
+	int i, pktlen;
+	const uint8_t *p;
+	//
+	if(h->data == NULL)
+		return;
+	now = ga_monotonic_us();
+	pthread_mutex_lock(&history_mutex);
+	for(i = 0; i + 4 <= buflen; i += 4 + pktlen) {
+		pktlen = (buf[i] << 24) | (buf[i+1] << 16) | (buf[i+2] << 8) | buf[i+3];
+		p = &buf[i+4];
+		if(pktlen < 12 || pktlen > h->slotsize || i + 4 + pktlen > buflen)
+			continue;
+		if(p[1] >= 200 && p[1] <= 204)	// RTCP from the muxer
+			continue;
+		seq = (p[2] << 8) | p[3];
+		slot = &h->slot[seq & h->mask];
+		slot->len = pktlen;
+		slot->seq = seq;
+		slot->sent = now;
+		bcopy(p, &h->data[(seq & h->mask) * h->slotsize], pktlen);
+	}
+	pthread_mutex_unlock(&history_mutex);
+	return;
+}
+
+/* packetize an encoded packet once with the shared muxer of the rendition */
+static int
+ff_server_packetize(const char *prefix, int channelId, int rendition, AVPacket *pkt, int64_t encoderPts, uint8_t **iobuf) {
+	struct ff_shared_packetizer_s *sp = &shared[channelId][rendition];
+	//
+	if(sp->fmtctx == NULL) {
+		int mtu;
+		if(sp->failed)
+			return -1;
+		if((mtu = ga_conf_readint("packet-size")) <= 0)
+			mtu = RTSP_TCP_MAX_PACKET_SIZE;
+		if(rtp_new_shared_stream(channelId, mtu, &sp->fmtctx, &sp->stream, &sp->encoder) < 0) {
+			ga_error("%s: cannot create shared packetizer for channel %d/#%d.\n",
+				prefix, channelId, rendition);
+			sp->failed = 1;
+			return -1;
+		}
+		ff_server_history_init(channelId, rendition, mtu);
 	}
 	if(encoderPts != (int64_t) AV_NOPTS_VALUE) {
 		pkt->pts = av_rescale_q(encoderPts,
-				rtsp->encoder[channelId]->time_base,
-				rtsp->stream[channelId]->time_base);
+				sp->encoder->time_base,
+				sp->stream->time_base);
 	}
-#ifdef HOLE_PUNCHING
-	if(ffio_open_dyn_packet_buf(&rtsp->fmtctx[channelId]->pb, rtsp->mtu) < 0) {
+	if(ffio_open_dyn_packet_buf(&sp->fmtctx->pb, sp->fmtctx->packet_size) < 0) {
 		ga_error("%s: buffer allocation failed.\n", prefix);
 		return -1;
 	}
-	if(av_write_frame(rtsp->fmtctx[channelId], pkt) != 0) {
+	if(av_write_frame(sp->fmtctx, pkt) != 0) {
+		uint8_t *dummybuf = NULL;
+		avio_close_dyn_buf(sp->fmtctx->pb, &dummybuf);
+		av_free(dummybuf);
 		ga_error("%s: write failed.\n", prefix);
 		return -1;
 	}
-	iolen = avio_close_dyn_buf(rtsp->fmtctx[channelId]->pb, &iobuf);
-	if(rtsp->lower_transport[channelId] == RTSP_LOWER_TRANSPORT_TCP) {
-		if(rtsp_write_bindata(rtsp, channelId, iobuf, iolen) < 0) {
-			av_free(iobuf);
-			ga_error("%s: RTSP write failed.\n", prefix);
-			return -1;
+	return avio_close_dyn_buf(sp->fmtctx->pb, iobuf);
+}
+
+static inline void
+rtp_put32(uint8_t *p, unsigned int v) {
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static inline unsigned int
+rtp_get32(const uint8_t *p) {
+	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/* rewrite SSRC, sequence number, and timestamp of all packets in a dynamic
+ * packet buffer; dseq and dts are added to the current header values */
+static void
+ff_server_rewrite_headers(uint8_t *buf, int buflen, unsigned int ssrc, unsigned short dseq, unsigned int dts) {
+	int i, pktlen;
+	uint8_t *p;
+	//
+	for(i = 0; i + 4 <= buflen; i += 4 + pktlen) {
+		pktlen = rtp_get32(&buf[i]);
+		p = &buf[i+4];
+		if(pktlen < 8 || i + 4 + pktlen > buflen)
+			continue;
+		if((p[0] & 0xc0) != 0x80)
+			continue;
+		if(p[1] >= 200 && p[1] <= 204) {
+			// RTCP compound packet (SR, SDES, BYE from the muxer)
+			int off = 0, len;
+			while(off + 8 <= pktlen) {
+				len = (((p[off+2] << 8) | p[off+3]) + 1) * 4;
+				if(off + len > pktlen)
+					break;
+				rtp_put32(&p[off+4], ssrc);
+				if(p[off+1] == 200 && len >= 20)
+					rtp_put32(&p[off+16], rtp_get32(&p[off+16]) + dts);
+				off += len;
+			}
+			continue;
 		}
-	} else {
-		if(rtp_write_bindata(rtsp, channelId, iobuf, iolen) < 0) {
-			av_free(iobuf);
-			ga_error("%s: RTP write failed.\n", prefix);
-			return -1;
+		if(pktlen < 12)
+			continue;
+		if((p[1] & 0x7f) == fec_pt && pktlen >= GA_FEC_HEADER_SIZE) {
+			// SN base, and TS recovery of a frame with an odd group
+			unsigned short base = ((p[14] << 8) | p[15]) + dseq;
+			unsigned short mask = (p[24] << 8) | p[25];
+			int odd = 0;
+			p[14] = base >> 8;
+			p[15] = base & 0x0ff;
+			for(; mask != 0; mask &= (mask - 1))
+				odd ^= 1;
+			if(odd)
+				rtp_put32(&p[16], rtp_get32(&p[16]) + dts);
+		}
+		do {
+			unsigned short seq = ((p[2] << 8) | p[3]) + dseq;
+			p[2] = seq >> 8;
+			p[3] = seq & 0x0ff;
+		} while(0);
+		rtp_put32(&p[4], rtp_get32(&p[4]) + dts);
+		rtp_put32(&p[8], ssrc);
+	}
+	return;
+}
+
+/* build the parity packets of a frame, in groups of at most fec_group
+ * packets; all RTP packets of a frame share the same timestamp, so the
+ * TS recovery field can be rewritten per client */
+static int
+ff_server_fec_encode(int channelId, int rendition, const uint8_t *buf, int buflen, uint8_t **fecbuf) {
+	struct ff_shared_packetizer_s *sp = &shared[channelId][rendition];
+	const unsigned char *pkts[RTP_FEC_FRAME_MAX];
+	int lens[RTP_FEC_FRAME_MAX];
+	int i, n = 0, pktlen, group, ngroups, fecsize, feclen = 0, len, first;
+	long long t0, t1;
+	uint8_t *out;
+	//
+	if((group = fec_group) <= 0)
+		return 0;
+	t0 = ga_monotonic_us();
+	for(i = 0; i + 4 <= buflen && n < RTP_FEC_FRAME_MAX; i += 4 + pktlen) {
+		pktlen = rtp_get32(&buf[i]);
+		if(pktlen < 12 || i + 4 + pktlen > buflen)
+			continue;
+		if(buf[i+5] >= 200 && buf[i+5] <= 204)	// RTCP from the muxer
+			continue;
+		pkts[n] = &buf[i+4];
+		lens[n] = pktlen;
+		n++;
+	}
+	if(n == 0)
+		return 0;
+	// spread the packets evenly over the groups
+	ngroups = (n + group - 1) / group;
+	fecsize = ngroups * (4 + GA_FEC_HEADER_SIZE + sp->fmtctx->packet_size);
+	if((out = (uint8_t*) malloc(fecsize)) == NULL)
+		return -1;
+	for(i = 0, first = 0; i < ngroups; i++) {
+		int count = (n - first) / (ngroups - i);
+		if((len = ga_fec_encode(out + feclen + 4, fecsize - feclen - 4,
+				pkts + first, lens + first, count,
+				fec_pt, sp->fecseq)) > 0) {
+			rtp_put32(out + feclen, len);
+			feclen += 4 + len;
+			sp->fecseq++;
+		}
+		first += count;
+	}
+	t1 = ga_monotonic_us();
+	// encoder statistics
+	fec_stats.frames++;
+	fec_stats.packets += n;
+	fec_stats.parity += ngroups;
+	fec_stats.elapsed += (t1 - t0);
+	if(fec_report > 0) {
+		if(fec_stats.since == 0) {
+			fec_stats.since = t1;
+		} else if(t1 - fec_stats.since >= fec_report) {
+			ga_error("RTP: FEC group %d, %u frames, %.1f pkts/frame, %.1f parity/frame, %.1f us/frame\n",
+				group, fec_stats.frames,
+				1.0 * fec_stats.packets / fec_stats.frames,
+				1.0 * fec_stats.parity / fec_stats.frames,
+				1.0 * fec_stats.elapsed / fec_stats.frames);
+			bzero(&fec_stats, sizeof(fec_stats));
+			fec_stats.since = t1;
+		}
+	}
+	*fecbuf = out;
+	return feclen;
+}
+
+/* sequence numbers of the first and the last RTP packets, and the timestamp
+ * of the first one, in a dynamic packet buffer; returns the packet count */
+static int
+ff_server_rtp_range(const uint8_t *buf, int buflen, unsigned short *first, unsigned short *last, unsigned int *ts) {
+	int i, n = 0, pktlen;
+	const uint8_t *p;
+	//
+	for(i = 0; i + 4 <= buflen; i += 4 + pktlen) {
+		pktlen = rtp_get32(&buf[i]);
+		p = &buf[i+4];
+		if(pktlen < 12 || i + 4 + pktlen > buflen)
+			continue;
+		if(p[1] >= 200 && p[1] <= 204)	// RTCP from the muxer
+			continue;
+		if(n++ == 0) {
+			*first = (p[2] << 8) | p[3];
+			*ts = rtp_get32(&p[4]);
+		}
+		*last = (p[2] << 8) | p[3];
+	}
+	return n;
+}
+
+/* a client moves to another rendition: continue its sequence numbers and
+ * timestamps across the switch; NACKs for packets sent before the switch
+ * are not answered, they belong to the history of the previous rendition */
+static void
+ff_server_switch_rendition(RTSPContext *rtsp, int channelId, int rendition, unsigned short first) {
+	int prev = rtsp->rtpRendition[channelId];
+	//
+	pthread_mutex_lock(&history_mutex);
+	if(prev >= 0) {
+		rtsp->rtpSeqOffset[channelId] = rtsp->rtpSeqNext[channelId] - first;
+		rtsp->rtpTsOffset[channelId] += shared[channelId][prev].tsbase - shared[channelId][rendition].tsbase;
+	}
+	rtsp->rtpSeqSwitch[channelId] = first + rtsp->rtpSeqOffset[channelId];
+	rtsp->rtpRendition[channelId] = rendition;
+	pthread_mutex_unlock(&history_mutex);
+	return;
+}
+
+static int
+ff_server_send_packet(const char *prefix, int channelId, int rendition, AVPacket *pkt, int64_t encoderPts, struct timeval *ptv) {
+	map<void*, void*>::iterator mi;
+	uint8_t *iobuf = NULL, *fecbuf = NULL;
+	int iolen = 0, feclen = 0;
+	unsigned short seqoff = 0;	// offsets currently applied to iobuf
+	unsigned int tsoff = 0;
+	unsigned short fseqoff = 0;	// offsets currently applied to fecbuf
+	unsigned int ftsoff = 0;
+	unsigned short first = 0, last = 0;	// sequence numbers of the shared packetizer
+	unsigned int ts = 0;
+	int npkts = 0;
+	//
+	if(channelId < 0 || channelId >= RTSP_CHANNEL_MAX)
+		return -1;
+	if(rendition < 0 || rendition >= ENCODER_SIMULCAST_MAX)
+		return -1;
+	// each channel muxer has a single stream, whatever the rendition
+	pkt->stream_index = 0;
+	pthread_rwlock_rdlock(&cclock);
+	for(mi = client_context.begin(); mi != client_context.end(); mi++) {
+		RTSPContext *rtsp = (RTSPContext*) mi->second;
+		// simulcast: deliver only the rendition the client subscribed to
+		if(encoder_simulcast_accept(mi->second, channelId, rendition, pkt) == 0)
+			continue;
+		if(rtsp->fmtctx[channelId] == NULL)
+			continue;
+		// fragmentation is done once, for the first interested client
+		if(iobuf == NULL) {
+			if((iolen = ff_server_packetize(prefix, channelId, rendition, pkt, encoderPts, &iobuf)) <= 0)
+				break;
+			if((npkts = ff_server_rtp_range(iobuf, iolen, &first, &last, &ts)) > 0
+			&& pkt->pts != (int64_t) AV_NOPTS_VALUE)
+				shared[channelId][rendition].tsbase = ts - (unsigned int) pkt->pts;
+			ff_server_history_put(channelId, rendition, iobuf, iolen);
+			if(fec_enabled && channelId < video_source_channels())
+				feclen = ff_server_fec_encode(channelId, rendition, iobuf, iolen, &fecbuf);
+		}
+		if(npkts > 0 && rtsp->rtpRendition[channelId] != rendition)
+			ff_server_switch_rendition(rtsp, channelId, rendition, first);
+		ff_server_rewrite_headers(iobuf, iolen,
+			rtsp->rtpSSRC[channelId],
+			rtsp->rtpSeqOffset[channelId] - seqoff,
+			rtsp->rtpTsOffset[channelId] - tsoff);
+		seqoff = rtsp->rtpSeqOffset[channelId];
+		tsoff = rtsp->rtpTsOffset[channelId];
+		if(npkts > 0)
+			rtsp->rtpSeqNext[channelId] = last + 1 + seqoff;
+		//
+		if(rtsp->lower_transport[channelId] == RTSP_LOWER_TRANSPORT_TCP) {
+			if(rtsp_write_bindata(rtsp, channelId, iobuf, iolen, pkt->flags & AV_PKT_FLAG_KEY) < 0)
+				ga_error("%s: RTSP write failed.\n", prefix);
+		} else {
+			if(rtp_pace_bindata(rtsp, channelId, iobuf, iolen) < 0)
+				ga_error("%s: RTP write failed.\n", prefix);
+			// parity packets follow the frame, only over UDP
+			if(feclen > 0) {
+				ff_server_rewrite_headers(fecbuf, feclen,
+					rtsp->rtpSSRC[channelId],
+					rtsp->rtpSeqOffset[channelId] - fseqoff,
+					rtsp->rtpTsOffset[channelId] - ftsoff);
+				fseqoff = rtsp->rtpSeqOffset[channelId];
+				ftsoff = rtsp->rtpTsOffset[channelId];
+				rtp_pace_bindata(rtsp, channelId, fecbuf, feclen);
+			}
+		}
+	}
+	pthread_rwlock_unlock(&cclock);
+	if(iobuf != NULL)
+		av_free(iobuf);
+	if(fecbuf != NULL)
+		free(fecbuf);
+	return 0;
+}
+
+/* adapt the FEC group size and the pacing rate to client net-reports */
+static int
+ff_server_ioctl(int command, int argsize, void *arg) {
+	ga_ioctl_packetloss_t *loss = (ga_ioctl_packetloss_t*) arg;
+	//
+	switch(command) {
+	case GA_IOCTL_CAPACITY:
+		if(argsize != sizeof(ga_ioctl_capacity_t))
+			return GA_IOCTL_ERR_INVALID_ARGUMENT;
+#ifdef RTP_PACER
+		rtp_pacer_capacity(((ga_ioctl_capacity_t*) arg)->kbps);
+#endif
+		break;
+	case GA_IOCTL_PACKETLOSS:
+		if(argsize != sizeof(ga_ioctl_packetloss_t))
+			return GA_IOCTL_ERR_INVALID_ARGUMENT;
+		if(fec_enabled == 0 || fec_fixed > 0)
+			break;
+		// one parity packet per 50/loss% media packets
+		if(loss->percent <= 0)
+			fec_group = 0;
+		else if(loss->percent >= 25)
+			fec_group = 2;
+		else if(50 / loss->percent > GA_FEC_GROUP_MAX)
+			fec_group = GA_FEC_GROUP_MAX;
+		else
+			fec_group = 50 / loss->percent;
+		break;
+	default:
+		return GA_IOCTL_ERR_NOTSUPPORTED;
+	}
+	return GA_IOCTL_ERR_NONE;
+}
+
+/**
+ * Retransmit packets reported lost by a generic NACK (RFC 4585).
+ *
+ * @param ccontext [in] The client context (RTSPContext).
+ * @param channelId [in] The channel the NACK refers to.
+ * @param pid [in] The first lost sequence number, as seen by the client.
+ * @param blp [in] Bitmask of the following 16 lost packets.
+ * @return The number of packets retransmitted, or -1 on error.
+ *
+ * Packets are resent unchanged, with the sequence numbers they were first
+ * sent with; packets older than rtp-nack-budget ms, or sent before the
+ * client switched to its current simulcast rendition, are not resent.
+ */
+int
+ff_server_handle_nack(void *ccontext, int channelId, unsigned short pid, unsigned short blp) {
+	RTSPContext *rtsp = (RTSPContext*) ccontext;
+	struct ff_rtp_history_s *h;
+	struct ff_rtp_history_slot_s *slot;
+	unsigned short seq, seqoff;
+	unsigned int tsoff;
+	uint8_t *buf;
+	long long now;
+	int i, buflen = 0, count = 0, expired = 0;
+	//
+	if(channelId < 0 || channelId >= RTSP_CHANNEL_MAX)
+		return -1;
+	if(nack_enabled == 0 || rtsp->fmtctx[channelId] == NULL)
+		return 0;
+	if(rtsp->lower_transport[channelId] != RTSP_LOWER_TRANSPORT_UDP)
+		return 0;
+	now = ga_monotonic_us();
+	pthread_mutex_lock(&history_mutex);
+	// the history of the rendition the client currently receives
+	if(rtsp->rtpRendition[channelId] < 0
+	|| (h = &history[channelId][rtsp->rtpRendition[channelId]])->data == NULL) {
+		pthread_mutex_unlock(&history_mutex);
+		return 0;
+	}
+	if((buf = (uint8_t*) malloc(17 * (4 + h->slotsize))) == NULL) {
+		pthread_mutex_unlock(&history_mutex);
+		return -1;
+	}
+	seqoff = rtsp->rtpSeqOffset[channelId];
+	tsoff = rtsp->rtpTsOffset[channelId];
+	for(i = 0; i <= 16; i++) {
+		if(i > 0 && (blp & (1 << (i-1))) == 0)
+			continue;
+		if((short) (pid + i - rtsp->rtpSeqSwitch[channelId]) < 0) {
+			expired++;
+			continue;
 		}
+		// back to the sequence number of the shared packetizer
+		seq = pid + i - seqoff;
+		slot = &h->slot[seq & h->mask];
+		if(slot->len == 0 || slot->seq != seq || now - slot->sent > nack_budget) {
+			expired++;
+			continue;
+		}
+		rtp_put32(&buf[buflen], slot->len);
+		bcopy(&h->data[(seq & h->mask) * h->slotsize], &buf[buflen+4], slot->len);
+		buflen += 4 + slot->len;
+		count++;
+	}
+	pthread_mutex_unlock(&history_mutex);
+	if(count > 0) {
+		ff_server_rewrite_headers(buf, buflen,
+			rtsp->rtpSSRC[channelId], seqoff, tsoff);
+		if(rtp_write_bindata(rtsp, channelId, buf, buflen) < 0)
+			count = -1;
 	}
-	av_free(iobuf);
+	free(buf);
+	pthread_mutex_lock(&rtsp->rtpStatsMutex);
+	rtsp->rtpSendStats[channelId].resent += (count > 0 ? count : 0);
+	rtsp->rtpSendStats[channelId].expired += expired;
+	pthread_mutex_unlock(&rtsp->rtpStatsMutex);
+	return count;
+}
 #else
+static int
+ff_server_send_packet_1(const char *prefix, void *ctx, int channelId, AVPacket *pkt, int64_t encoderPts, struct timeval *ptv) {
+	RTSPContext *rtsp = (RTSPContext*) ctx;
+	//
+	if(rtsp->fmtctx[channelId] == NULL) {
+		// not initialized - disabled?
+		return 0;
+	}
+	if(encoderPts != (int64_t) AV_NOPTS_VALUE) {
+		pkt->pts = av_rescale_q(encoderPts,
+				rtsp->encoder[channelId]->time_base,
+				rtsp->stream[channelId]->time_base);
+	}
 	if(rtsp->lower_transport[channelId] == RTSP_LOWER_TRANSPORT_TCP) {
 		//if(avio_open_dyn_buf(&rtsp->fmtctx[channelId]->pb) < 0)
 		if(ffio_open_dyn_packet_buf(&rtsp->fmtctx[channelId]->pb, rtsp->mtu) < 0) {
@@ -237,27 +787,32 @@ ff_server_send_packet_1(const char *prefix, void *ctx, int channelId, AVPacket *
 		int iolen;
 		uint8_t *iobuf;
 		iolen = avio_close_dyn_buf(rtsp->fmtctx[channelId]->pb, &iobuf);
-		if(rtsp_write_bindata(rtsp, channelId, iobuf, iolen) < 0) {
+		if(rtsp_write_bindata(rtsp, channelId, iobuf, iolen, pkt->flags & AV_PKT_FLAG_KEY) < 0) {
 			av_free(iobuf);
 			ga_error("%s: write failed.\n", prefix);
 			return -1;
 		}
 		av_free(iobuf);
 	}
-#endif
 	return 0;
 }
 
 static int
-ff_server_send_packet(const char *prefix, int channelId, AVPacket *pkt, int64_t encoderPts, struct timeval *ptv) {
+ff_server_send_packet(const char *prefix, int channelId, int rendition, AVPacket *pkt, int64_t encoderPts, struct timeval *ptv) {
 	map<void*, void*>::iterator mi;
+	// each channel muxer has a single stream, whatever the rendition
+	pkt->stream_index = 0;
 	pthread_rwlock_rdlock(&cclock);
 	for(mi = client_context.begin(); mi != client_context.end(); mi++) {
+		// simulcast: deliver only the rendition the client subscribed to
+		if(encoder_simulcast_accept(mi->second, channelId, rendition, pkt) == 0)
+			continue;
 		ff_server_send_packet_1(prefix, mi->second, channelId, pkt, encoderPts, ptv);
 	}
 	pthread_rwlock_unlock(&cclock);
 	return 0;
 }
+#endif
 
 ga_module_t *
 module_load() {
@@ -271,6 +826,9 @@ module_load() {
 	m.stop = ff_server_stop;
 	m.deinit = ff_server_deinit;
 	m.send_packet = ff_server_send_packet;
+#ifdef HOLE_PUNCHING
+	m.ioctl = ff_server_ioctl;
+#endif
 	//
 	encoder_register_sinkserver(&m);
 	//
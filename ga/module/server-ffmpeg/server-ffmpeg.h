@@ -21,6 +21,7 @@
 
 int ff_server_register_client(void *ccontext);
 int ff_server_unregister_client(void *ccontext);
+int ff_server_handle_nack(void *ccontext, int channelId, unsigned short pid, unsigned short blp);
 
 #endif	/* __SERVER_FFMPEG_H__ */
 
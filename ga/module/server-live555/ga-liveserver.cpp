@@ -1,8 +1,13 @@
 #include <liveMedia.hh>
 #include <BasicUsageEnvironment.hh>
+#include <stdio.h>
+#include <pthread.h>
 #include <map>
+#include <vector>
 
 #include "ga-common.h"
+#include "ga-conf.h"
+#include "ga-thread.h"
 #include "rtspconf.h"
 #include "encoder-common.h"
 #include "vsource.h"
@@ -26,6 +31,7 @@ liveserver_main(void *arg) {
 	TaskScheduler* scheduler = BasicTaskScheduler::createNew();
 	UserAuthenticationDatabase* authDB = NULL;
 	env = BasicUsageEnvironment::createNew(*scheduler);
+	ga_thread_role("server", 0);
 #if 0	// need access control?
 	// To implement client access control to the RTSP server, do the following:
 	authDB = new UserAuthenticationDatabase;
@@ -98,14 +104,115 @@ static TaskToken qos_task = NULL;
 static int qos_started = 0;
 static struct timeval qos_tv;
 
+// sinkmap is read by qos_server_get_stats() from other threads
+static pthread_mutex_t qos_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<std::pair<qos_server_callback_t, void*> > qos_subscribers;
+static FILE *qos_dump = NULL;
+
 static void qos_server_schedule();
 
+/* append a receiver report sample to the dump file, one JSON object per line */
+static void
+qos_server_dump(const qos_server_stats_t *st, const qos_server_sample_t *s) {
+	fprintf(qos_dump, "{\"t\":%ld.%06ld,\"sink\":\"%s\",\"ssrc\":%u,"
+		"\"rtt_us\":%u,\"jitter_us\":%u,\"sent\":%u,\"lost\":%u,"
+		"\"fraction_lost\":%u,\"kbps\":%u,"
+		"\"srtt_ms\":%.3f,\"rttvar_ms\":%.3f,\"loss\":%.4f,\"burst\":%u}\n",
+		(long) s->timestamp.tv_sec, (long) s->timestamp.tv_usec,
+		st->name, st->ssrc,
+		s->rtt_us, s->jitter_us, s->pkts_sent, s->pkts_lost,
+		s->fraction_lost, s->kbps,
+		st->rtt_ms, st->rttvar_ms, st->loss, st->loss_burst);
+	fflush(qos_dump);
+	return;
+}
+
+/* turn a new receiver report into a sample and update the statistics;
+ * returns 1 if there is a new report */
+static int
+qos_server_sample(RTPSink *sink, RTPTransmissionStats *stats, qos_server_record_t *qr, struct timeval *now) {
+	qos_server_stats_t *st = &qr->stats;
+	qos_server_sample_t *s;
+	struct timeval rr = stats->lastTimeReceived();
+	unsigned int seq = stats->lastPacketNumReceived();
+	unsigned int lost = stats->totNumPacketsLost();
+	unsigned int freq = sink->rtpTimestampFrequency();
+	unsigned int bytes_hi, bytes_lo;
+	unsigned long long bytes;
+	long long elapsed;
+	double rtt, err;
+	//
+	if(qr->rr_received.tv_sec == rr.tv_sec && qr->rr_received.tv_usec == rr.tv_usec)
+		return 0;
+	stats->getTotalOctetCount(bytes_hi, bytes_lo);
+	bytes = bytes_hi;
+	bytes = (bytes << 32) | bytes_lo;
+	elapsed = tvdiff_us(&rr, &qr->rr_received);
+	// the first report only sets the reference
+	if(qr->rr_received.tv_sec == 0 && qr->rr_received.tv_usec == 0) {
+		strncpy(st->name, sink->rtpPayloadFormatName(), sizeof(st->name)-1);
+		st->video = (strcmp(sink->sdpMediaType(), "video") == 0);
+		st->ssrc = stats->SSRC();
+		goto done;
+	}
+	s = &st->sample[st->nsamples % QOS_SERVER_SAMPLES];
+	bzero(s, sizeof(*s));
+	s->timestamp = *now;
+	s->rtt_us = (unsigned int) (1000000ULL * stats->roundTripDelay() / 65536);
+	s->jitter_us = freq > 0 ? (unsigned int) (1000000ULL * stats->jitter() / freq) : 0;
+	s->pkts_sent = seq - qr->rr_seq;
+	s->pkts_lost = (int) (lost - qr->rr_lost) > 0 ? lost - qr->rr_lost : 0;
+	if(s->pkts_lost > s->pkts_sent)
+		s->pkts_lost = s->pkts_sent;
+	s->fraction_lost = stats->packetLossRatio();
+	s->kbps = elapsed > 0 ? (unsigned int) (8000ULL * (bytes - qr->rr_bytes) / elapsed) : 0;
+	// smoothed values: RTT as in TCP (RFC 6298), loss with gain 1/4
+	if(s->rtt_us > 0) {
+		rtt = s->rtt_us / 1000.0;
+		if(st->rtt_ms == 0) {
+			st->rtt_ms = rtt;
+			st->rttvar_ms = rtt / 2;
+		} else {
+			err = rtt > st->rtt_ms ? rtt - st->rtt_ms : st->rtt_ms - rtt;
+			st->rttvar_ms += (err - st->rttvar_ms) / 4;
+			st->rtt_ms += (rtt - st->rtt_ms) / 8;
+		}
+	}
+	st->jitter_ms = s->jitter_us / 1000.0;
+	if(s->pkts_sent > 0)
+		st->loss += (1.0 * s->pkts_lost / s->pkts_sent - st->loss) / 4;
+	// loss bursts: runs of consecutive reports with losses
+	if(s->pkts_lost > 0) {
+		if(st->loss_burst++ == 0)
+			st->loss_bursts++;
+		if(st->loss_burst > st->loss_burst_max)
+			st->loss_burst_max = st->loss_burst;
+	} else {
+		st->loss_burst = 0;
+	}
+	st->pkts_sent += s->pkts_sent;
+	st->pkts_lost += s->pkts_lost;
+	st->nsamples++;
+	if(qos_dump != NULL)
+		qos_server_dump(st, s);
+done:
+	qr->rr_received = rr;
+	qr->rr_seq = seq;
+	qr->rr_lost = lost;
+	qr->rr_bytes = bytes;
+	return qr->stats.nsamples > 0 ? 1 : 0;
+}
+
 static void
 qos_server_report(void *clientData) {
 	struct timeval now;
 	std::map<RTPSink*, std::map<unsigned,qos_server_record_t> >::iterator mi;
+	std::vector<qos_server_stats_t> updated;
+	std::vector<std::pair<qos_server_callback_t, void*> > subscribers;
+	unsigned int i, j;
 	//
 	gettimeofday(&now, NULL);
+	pthread_mutex_lock(&qos_mutex);
 	for(mi = sinkmap.begin(); mi != sinkmap.end(); mi++) {
 		RTPTransmissionStatsDB& db = mi->first->transmissionStatsDB();
 		RTPTransmissionStatsDB::Iterator statsIter(db);
@@ -128,6 +235,10 @@ qos_server_report(void *clientData) {
 				continue;
 			}
 			//
+			if(qos_server_sample(mi->first, stats, &mj->second, &now) > 0
+			&& qos_subscribers.size() > 0)
+				updated.push_back(mj->second.stats);
+			//
 			elapsed = tvdiff_us(&now, &mj->second.timestamp);
 			if(elapsed < QOS_SERVER_REPORT_INTERVAL_MS * 1000)
 				continue;
@@ -168,6 +279,13 @@ qos_server_report(void *clientData) {
 			mj->second.bytes_sent = bytes_sent;
 		}
 	}
+	subscribers = qos_subscribers;
+	pthread_mutex_unlock(&qos_mutex);
+	// notify subscribers without holding the lock
+	for(i = 0; i < updated.size(); i++) {
+		for(j = 0; j < subscribers.size(); j++)
+			subscribers[j].first(subscribers[j].second, &updated[i]);
+	}
 	// schedule next qos
 	qos_tv = now;
 	qos_server_schedule();
@@ -208,35 +326,117 @@ qos_server_stop() {
 int
 qos_server_add_sink(const char *prefix, RTPSink *rtpsink) {
 	std::map<unsigned/*SSRC*/,qos_server_record_t> x;
+	pthread_mutex_lock(&qos_mutex);
 	sinkmap[rtpsink] = x;
 	ga_error("qos: add sink#%d for %s, rtpsink=%p\n", sinkmap.size(), prefix, rtpsink);
+	pthread_mutex_unlock(&qos_mutex);
 	return 0;
 }
 
 int
 qos_server_remove_sink(RTPSink *rtpsink) {
+	pthread_mutex_lock(&qos_mutex);
 	sinkmap.erase(rtpsink);
+	pthread_mutex_unlock(&qos_mutex);
 	return 0;
 }
 
+/**
+ * Get statistics of all receivers that have sent receiver reports.
+ *
+ * @param stats [out] Array for the statistics.
+ * @param maxstats [in] Number of entries in \a stats.
+ * @return Number of entries filled.
+ *
+ * Can be called from any thread.
+ */
+int
+qos_server_get_stats(qos_server_stats_t *stats, int maxstats) {
+	std::map<RTPSink*, std::map<unsigned,qos_server_record_t> >::iterator mi;
+	std::map<unsigned,qos_server_record_t>::iterator mj;
+	int n = 0;
+	pthread_mutex_lock(&qos_mutex);
+	for(mi = sinkmap.begin(); mi != sinkmap.end() && n < maxstats; mi++) {
+		for(mj = mi->second.begin(); mj != mi->second.end() && n < maxstats; mj++) {
+			if(mj->second.stats.nsamples == 0)
+				continue;
+			bcopy(&mj->second.stats, &stats[n++], sizeof(qos_server_stats_t));
+		}
+	}
+	pthread_mutex_unlock(&qos_mutex);
+	return n;
+}
+
+/**
+ * Subscribe to receiver report updates.
+ *
+ * @param cb [in] Callback, invoked from the live555 event loop with the
+ *	updated statistics of a receiver.
+ * @param arg [in] Argument passed to \a cb.
+ * @return 0 on success.
+ */
+int
+qos_server_subscribe(qos_server_callback_t cb, void *arg) {
+	pthread_mutex_lock(&qos_mutex);
+	qos_subscribers.push_back(std::make_pair(cb, arg));
+	pthread_mutex_unlock(&qos_mutex);
+	return 0;
+}
+
+/**
+ * Cancel a subscription made with qos_server_subscribe().
+ *
+ * @param cb [in] The callback.
+ * @param arg [in] The argument of the callback.
+ * @return 0 on success, or -1 if not subscribed.
+ */
+int
+qos_server_unsubscribe(qos_server_callback_t cb, void *arg) {
+	std::vector<std::pair<qos_server_callback_t, void*> >::iterator vi;
+	int ret = -1;
+	pthread_mutex_lock(&qos_mutex);
+	for(vi = qos_subscribers.begin(); vi != qos_subscribers.end(); vi++) {
+		if(vi->first == cb && vi->second == arg) {
+			qos_subscribers.erase(vi);
+			ret = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&qos_mutex);
+	return ret;
+}
+
 int
 qos_server_deinit() {
 	if(env != NULL) {
 		env->taskScheduler().unscheduleDelayedTask(qos_task);
 	}
 	qos_task = NULL;
+	pthread_mutex_lock(&qos_mutex);
 	sinkmap.clear();
+	pthread_mutex_unlock(&qos_mutex);
+	if(qos_dump != NULL) {
+		fclose(qos_dump);
+		qos_dump = NULL;
+	}
 	ga_error("qos-measurement: deinitialized.\n");
 	return 0;
 }
 
 int
 qos_server_init() {
+	char path[1024];
 	if(env == NULL) {
 		ga_error("liveserver: UsageEnvironment has not been initialized.\n");
 		return -1;
 	}
+	pthread_mutex_lock(&qos_mutex);
 	sinkmap.clear();
+	pthread_mutex_unlock(&qos_mutex);
+	if(ga_conf_readv("qos-server-dump", path, sizeof(path)) != NULL && path[0] != '\0') {
+		if((qos_dump = fopen(path, "a")) == NULL)
+			ga_error("qos-measurement: cannot open dump file %s.\n", path);
+	}
 	ga_error("qos-measurement: initialized.\n");
 	return 0;
 }
@@ -25,17 +25,56 @@
 
 #define DISCRETE_FRAMER		/* use discrete framer */
 
-#define	QOS_SERVER_CHECK_INTERVAL_MS	(1 * 1000)	/* check every N seconds */
+#define	QOS_SERVER_CHECK_INTERVAL_MS	250		/* check every N milliseconds */
 #define	QOS_SERVER_REPORT_INTERVAL_MS	(30 * 1000)	/* report every N seconds */
 #define QOS_SERVER_PREFIX_LEN		64
+#define	QOS_SERVER_SAMPLES		64		/* RR samples kept per receiver */
+
+/* one RTCP receiver report */
+typedef struct qos_server_sample_s {
+	struct timeval timestamp;	/* when the report was noticed */
+	unsigned int rtt_us;		/* 0 = unknown */
+	unsigned int jitter_us;
+	unsigned int pkts_sent;		/* expected since the previous report */
+	unsigned int pkts_lost;		/* lost since the previous report */
+	unsigned int fraction_lost;	/* in 1/256, as reported */
+	unsigned int kbps;		/* sent since the previous report */
+}	qos_server_sample_t;
+
+/* per-receiver statistics built from its receiver reports */
+typedef struct qos_server_stats_s {
+	char name[QOS_SERVER_PREFIX_LEN];	/* payload format of the sink */
+	int video;			/* video or audio sink */
+	unsigned int ssrc;		/* SSRC of the receiver */
+	double rtt_ms;			/* smoothed RTT, gain 1/8 */
+	double rttvar_ms;		/* smoothed RTT deviation, gain 1/4 */
+	double jitter_ms;		/* latest interarrival jitter */
+	double loss;			/* smoothed loss fraction, gain 1/4 */
+	unsigned int loss_burst;	/* current run of reports with losses */
+	unsigned int loss_burst_max;	/* longest run of reports with losses */
+	unsigned int loss_bursts;	/* number of runs */
+	unsigned long long pkts_sent;	/* totals over all reports */
+	unsigned long long pkts_lost;
+	unsigned int nsamples;		/* reports so far; the ring keeps the last ones */
+	qos_server_sample_t sample[QOS_SERVER_SAMPLES];
+}	qos_server_stats_t;
 
 typedef struct qos_server_record_s {
 	unsigned long long pkts_lost;
 	unsigned long long pkts_sent;
 	unsigned long long bytes_sent;
 	struct timeval timestamp;
+	// state at the last receiver report
+	struct timeval rr_received;
+	unsigned int rr_seq;
+	unsigned int rr_lost;
+	unsigned long long rr_bytes;
+	qos_server_stats_t stats;
 }	qos_server_record_t;
 
+/* invoked from the live555 event loop on every new receiver report */
+typedef void (*qos_server_callback_t)(void *arg, const qos_server_stats_t *stats);
+
 void * liveserver_taskscheduler();
 void * liveserver_main(void *arg);
 
@@ -45,5 +84,8 @@ int qos_server_add_sink(const char *prefix, RTPSink *rtpsink);
 int qos_server_remove_sink(RTPSink *rtpsink);
 int qos_server_deinit();
 int qos_server_init();
+int qos_server_get_stats(qos_server_stats_t *stats, int maxstats);
+int qos_server_subscribe(qos_server_callback_t cb, void *arg);
+int qos_server_unsubscribe(qos_server_callback_t cb, void *arg);
 
 #endif /* __GA_LIVERSERVER_H__ */
@@ -208,6 +208,22 @@ RTPSink* GAMediaSubsession
 				interopConstraintsStr*/);
 	} else if(strcmp(mimetype, "video/VP8") == 0) {
 		result = QoSVP8VideoRTPSink::createNew(envir(), rtpGroupsock, rtpPayloadTypeIfDynamic);
+	} else if(strcmp(mimetype, "video/VP9") == 0) {
+		ga_module_t *m = encoder_get_vencoder();
+		ga_ioctl_buffer_t mb;
+		u_int8_t vpcc[64];
+		int profile = -1;
+		// the profile of the codec configuration record goes to the SDP
+		mb.id = this->channelId;
+		mb.ptr = vpcc;
+		mb.size = sizeof(vpcc);
+		if((err = ga_module_ioctl(m, GA_IOCTL_GETEXTRADATA, sizeof(mb), &mb)) < 0 || mb.size < 5) {
+			ga_error("GAMediaSubsession: no VP9 codec configuration from %s, err=%d\n", m->name, err);
+		} else {
+			profile = vpcc[4];
+		}
+		ga_error("GAMediaSubsession: %s profile-id=%d\n", mimetype, profile);
+		result = QoSVP9VideoRTPSink::createNew(envir(), rtpGroupsock, rtpPayloadTypeIfDynamic, profile);
 	} 
 	if(result == NULL) {
 		ga_error("GAMediaSubsession: create RTP sink for %s failed.\n", mimetype);
@@ -241,3 +241,29 @@ QoSVP8VideoRTPSink
 
 //////////////////////////////////////////////////////////////////////////////
 
+QoSVP9VideoRTPSink*
+QoSVP9VideoRTPSink
+::createNew(UsageEnvironment& env, Groupsock* RTPgs, unsigned char rtpPayloadFormat, int profile) {
+	return new QoSVP9VideoRTPSink(env, RTPgs, rtpPayloadFormat, profile);
+}
+
+QoSVP9VideoRTPSink
+::QoSVP9VideoRTPSink(UsageEnvironment& env, Groupsock* RTPgs, unsigned char rtpPayloadFormat, int profile)
+	: VP9VideoRTPSink(env, RTPgs, rtpPayloadFormat) {
+	fmtp[0] = '\0';
+	if(profile >= 0)
+		snprintf(fmtp, sizeof(fmtp), "a=fmtp:%d profile-id=%d\r\n", rtpPayloadType(), profile);
+	qos_server_add_sink("VP9", this);
+}
+
+QoSVP9VideoRTPSink
+::~QoSVP9VideoRTPSink() { qos_server_remove_sink(this); }
+
+char const*
+QoSVP9VideoRTPSink
+::auxSDPLine() {
+	return fmtp[0] != '\0' ? fmtp : NULL;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
@@ -27,6 +27,7 @@
 #include <H264VideoRTPSink.hh>
 #include <H265VideoRTPSink.hh>
 #include <VP8VideoRTPSink.hh>
+#include <VP9VideoRTPSink.hh>
 #include <TheoraVideoRTPSink.hh>
 #include <T140TextRTPSink.hh>
 
@@ -168,4 +169,18 @@ protected:
 
 //////////////////////////////////////////////////////////////////////////////
 
+class QoSVP9VideoRTPSink: public VP9VideoRTPSink {
+public:
+	static QoSVP9VideoRTPSink*
+		createNew(UsageEnvironment& env, Groupsock* RTPgs, unsigned char rtpPayloadFormat, int profile = -1);
+protected:
+	QoSVP9VideoRTPSink(UsageEnvironment& env, Groupsock* RTPgs, unsigned char rtpPayloadFormat, int profile);
+	~QoSVP9VideoRTPSink();
+	virtual char const* auxSDPLine();
+private:
+	char fmtp[64];		// a=fmtp with the profile-id, empty if unknown
+};
+
+//////////////////////////////////////////////////////////////////////////////
+
 #endif	/* __GA_QOSSINK_H__ */
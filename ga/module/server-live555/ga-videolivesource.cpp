@@ -30,7 +30,6 @@ static void signalNewVideoFrameData(int channelId);
 
 //EventTriggerId GAVideoLiveSource::eventTriggerId = 0;
 unsigned GAVideoLiveSource::referenceCount = 0;
-int GAVideoLiveSource::remove_startcode = 0;
 ga_module_t * GAVideoLiveSource::m = NULL;
 
 GAVideoLiveSource * GAVideoLiveSource
@@ -45,9 +44,6 @@ GAVideoLiveSource
 	if (referenceCount == 0) {
 		// Any global initialization of the device would be done here:
 		m = encoder_get_vencoder();
-		if(strcmp(m->mimetype, "video/H264") == 0
-		|| strcmp(m->mimetype, "video/H265") == 0)
-			remove_startcode = 1;
 		live_server_register_client(this);
 	}
 	++referenceCount;
@@ -68,7 +64,6 @@ GAVideoLiveSource
 	if (referenceCount == 0) {
 		// Any global 'destruction' (i.e., resetting) of the device would be done here:
 		live_server_unregister_client(this);
-		remove_startcode = 0;
 		m = NULL;
 		encoder_pktqueue_unregister_callback(this->channelId, signalNewVideoFrameData);
 		// Reclaim our 'event trigger'
@@ -125,46 +120,26 @@ void GAVideoLiveSource
 	if (!isCurrentlyAwaitingData()) return; // we're not ready for the data yet
 
 	encoder_packet_t pkt;
-	u_int8_t* newFrameDataStart = NULL; //%%% TO BE WRITTEN %%%
-	unsigned newFrameSize = 0; //%%% TO BE WRITTEN %%%
+	int pktsize;
 
-	newFrameDataStart = (u_int8_t*) encoder_pktqueue_front(this->channelId, &pkt);
-	if(newFrameDataStart == NULL)
+	// Deliver the data here: copy from the packet queue and remove the
+	// packet in one go. For H.264 and H.265, packets are NAL units
+	// without start codes (see live_server_send_packet).
+#ifdef DISCRETE_FRAMER
+	if((pktsize = encoder_pktqueue_read(this->channelId, (char*) fTo, fMaxSize, 0, &pkt)) < 0)
 		return;
-	newFrameSize = pkt.size;
-#ifdef DISCRETE_FRAMER	// special handling for packets with startcode
-	if(remove_startcode != 0) {
-		if(newFrameDataStart[0] == 0
-		&& newFrameDataStart[1] == 0) {
-			if(newFrameDataStart[2] == 0
-			&& newFrameDataStart[3] == 1) {
-				newFrameDataStart += 4;
-				newFrameSize -= 4;
-			} else if(newFrameDataStart[2] == 1) {
-				newFrameDataStart += 3;
-				newFrameSize -= 3;
-			}
-		}
+	if((unsigned) pktsize > fMaxSize) {
+		fNumTruncatedBytes = pktsize - fMaxSize;
+		ga_error("video encoder: packet truncated (%d > %d).\n", pktsize, fMaxSize);
 	}
+#else		// for regular H264Framer: the rest is delivered next time
+	if((pktsize = encoder_pktqueue_read(this->channelId, (char*) fTo, fMaxSize, 1, &pkt)) < 0)
+		return;
 #endif
-	// Deliver the data here:
-	if (newFrameSize > fMaxSize) {
-		fFrameSize = fMaxSize;
-#ifdef DISCRETE_FRAMER
-		fNumTruncatedBytes = newFrameSize - fMaxSize;
-		ga_error("video encoder: packet truncated (%d > %d).\n", newFrameSize, fMaxSize);
-#else		// for regular H264Framer
-		encoder_pktqueue_split_packet(this->channelId, (char*) newFrameDataStart + fMaxSize);
-#endif
-	} else {
-		fFrameSize = newFrameSize;
-	}
+	fFrameSize = pkt.size;
 	//gettimeofday(&fPresentationTime, NULL); // If you have a more accurate time - e.g., from an encoder - then use that instead.
 	fPresentationTime = pkt.pts_tv;
 	// If the device is *not* a 'live source' (e.g., it comes instead from a file or buffer), then set "fDurationInMicroseconds" here.
-	memmove(fTo, newFrameDataStart, fFrameSize);
-
-	encoder_pktqueue_pop_front(channelId);
 
 	// After delivering the data, inform the reader that it is now available:
 	FramedSource::afterGetting(this);
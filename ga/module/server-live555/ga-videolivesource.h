@@ -31,7 +31,6 @@ protected:
 	~GAVideoLiveSource();
 private:
 	static unsigned referenceCount;
-	static int remove_startcode;
 	static ga_module_t *m;
 	int channelId;
 	//
@@ -30,14 +30,19 @@
 #endif	/* ! WIN32 */
 
 #include "ga-common.h"
+#include "ga-conf.h"
 #include "ga-module.h"
 #include "encoder-common.h"
+#include "vsource.h"
 #include "rtspconf.h"
 
 #include "ga-liveserver.h"
 #include "server-live555.h"
 
 static pthread_t server_tid;
+#ifdef DISCRETE_FRAMER
+static int split_nals = -1;	/* queue video as NAL units: H.264 and H.265 */
+#endif
 
 int
 live_server_register_client(void *ccontext) {
@@ -53,9 +58,26 @@ live_server_unregister_client(void *ccontext) {
 	return 0;
 }
 
+/* pass the smoothed loss of audio receivers to the audio encoder as a hint */
+static void
+live_server_qos_update(void *arg, const qos_server_stats_t *stats) {
+	static int lastpercent = -1;
+	ga_ioctl_packetloss_t loss;
+	if(stats->video)
+		return;
+	bzero(&loss, sizeof(loss));
+	loss.percent = (int) (100.0 * stats->loss + 0.5);
+	if(loss.percent == lastpercent)
+		return;
+	lastpercent = loss.percent;
+	ga_module_ioctl(encoder_get_aencoder(), GA_IOCTL_PACKETLOSS, sizeof(loss), &loss);
+	return;
+}
+
 static int
 live_server_init(void *arg) {
-	// nothing to do now
+	if(ga_conf_readbool("qos-server-loss-hint", 1) != 0)
+		qos_server_subscribe(live_server_qos_update, NULL);
 	return 0;
 }
 
@@ -77,12 +99,28 @@ live_server_stop(void *arg) {
 
 static int
 live_server_deinit(void *arg) {
-	// nothing to do now
+	qos_server_unsubscribe(live_server_qos_update, NULL);
 	return 0;
 }
 
 static int
-live_server_send_packet(const char *prefix, int channelId, AVPacket *pkt, int64_t encoderPts, struct timeval *ptv) {
+live_server_send_packet(const char *prefix, int channelId, int rendition, AVPacket *pkt, int64_t encoderPts, struct timeval *ptv) {
+	// all clients share one source: only deliver simulcast rendition 0
+	if(encoder_simulcast_accept(NULL, channelId, rendition, pkt) == 0)
+		return 0;
+#ifdef DISCRETE_FRAMER
+	if(split_nals < 0) {
+		ga_module_t *m = encoder_get_vencoder();
+		split_nals = (m != NULL && m->mimetype != NULL
+			&& (strcmp(m->mimetype, "video/H264") == 0
+			 || strcmp(m->mimetype, "video/H265") == 0)) ? 1 : 0;
+	}
+	// the discrete framers take one NAL unit without start code at a time
+	if(split_nals > 0 && channelId < video_source_channels()) {
+		encoder_pktqueue_append_nals(channelId, pkt, encoderPts, ptv);
+		return 0;
+	}
+#endif
 	encoder_pktqueue_append(channelId, pkt, encoderPts, ptv);
 	return 0;
 }
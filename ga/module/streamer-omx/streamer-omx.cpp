@@ -317,6 +317,8 @@ vencoder_threadproc(void *arg) {
 		} else {
 			newpts = ptsSync + omxe[cid].frame_out - basePts;
 		}
+		if(cid == 0)
+			encoder_clock_report(ENCODER_CLOCK_VIDEO, newpts, rtspconf->video_fps);
 		//
 		if((enc = omx_streamer_get(&omxe[cid], &encsize)) == NULL) {
 			ga_error("video encoder: encode failed.\n");
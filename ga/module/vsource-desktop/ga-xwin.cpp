@@ -174,3 +174,18 @@ ga_xwin_capture(char *buf, int buflen, struct gaRect *rect) {
 	return;
 }
 
+int
+ga_xwin_cursor(int *x, int *y) {
+	Window root, child;
+	int winx, winy;
+	unsigned int mask;
+	if(display == NULL)
+		return -1;
+	if(XQueryPointer(display, rootWindow, &root, &child,
+			x, y, &winx, &winy, &mask) == False) {
+		// pointer is on another screen
+		return -1;
+	}
+	return 0;
+}
+
@@ -34,6 +34,7 @@ int	ga_xwin_init(const char *displayname, gaImage *gaimg);
 void	ga_xwin_deinit();
 void	ga_xwin_imageinfo(XImage *image);
 void	ga_xwin_capture(char *buf, int buflen, struct gaRect *rect);
+int	ga_xwin_cursor(int *x, int *y);
 #ifdef __cplusplus
 }
 #endif
@@ -31,6 +31,7 @@
 #include "rtspconf.h"
 
 #include "ga-common.h"
+#include "ga-thread.h"
 
 #ifdef WIN32
 #include "ga-win32-common.h"
@@ -68,6 +69,11 @@ static int vsource_initialized = 0;
 static int vsource_started = 0;
 static pthread_t vsource_tid;
 
+/* region-of-interest: previous image for changed region detection */
+static vsource_roi_config_t roiconf;
+static unsigned char *roi_prevbuf = NULL;
+static int roi_prevstride = 0;
+
 /* support reconfiguration of frame rate */
 static int vsource_framerate_n = -1;
 static int vsource_framerate_d = -1;
@@ -141,6 +147,18 @@ vsource_init(void *arg) {
 
 	screenwidth = image->width;
 	screenheight = image->height;
+	// region-of-interest
+	if(vsource_roi_config_load(&roiconf) > 0) {
+		roi_prevstride = (prect ? prect->width : image->width) * RGBA_SIZE;
+		roi_prevbuf = (unsigned char*) malloc(roi_prevstride
+				* (prect ? prect->height : image->height));
+		if(roi_prevbuf == NULL) {
+			ga_error("video source: ROI buffer allocation failed, ROI disabled.\n");
+			roiconf.enabled = 0;
+		} else {
+			bzero(roi_prevbuf, roi_prevstride * (prect ? prect->height : image->height));
+		}
+	}
 
 #ifdef SOURCES
 	do {
@@ -203,6 +221,7 @@ vsource_threadproc(void *arg) {
 		}
 	}
 	//
+	ga_thread_role("vsource", 0);
 	ga_error("video source thread started: tid=%ld\n", ga_gettid());
 	gettimeofday(&initialTv, NULL);
 	lastTv = initialTv;
@@ -279,6 +298,40 @@ vsource_threadproc(void *arg) {
 #ifdef WIN32
 		ga_win32_draw_system_cursor(frame);
 #endif
+		// region-of-interest: changed regions, cursor, and static regions
+		vsource_frame_roi_reset(frame);
+		if(roiconf.enabled != 0) {
+			int cx, cy;
+#ifdef WIN32
+			POINT pt;
+			cx = cy = -1;
+			if(GetCursorPos(&pt) != FALSE) {
+				cx = pt.x;
+				cy = pt.y;
+			}
+#elif defined __APPLE__ || defined ANDROID
+			cx = cy = -1;
+#else
+			if(ga_xwin_cursor(&cx, &cy) < 0)
+				cx = cy = -1;
+#endif
+			if(prect != NULL && cx >= 0) {
+				cx -= prect->left;
+				cy -= prect->top;
+			}
+			if(cx >= 0 && cx < frame->realwidth
+			&& cy >= 0 && cy < frame->realheight) {
+				frame->cursor_x = cx;
+				frame->cursor_y = cy;
+			}
+			// static regions first, so they are never merged away
+			for(i = 0; i < roiconf.nstatic; i++) {
+				vsource_roi_t *r = &roiconf.rstatic[i];
+				vsource_frame_add_roi(frame, r->type,
+					r->left, r->top, r->right, r->bottom);
+			}
+			vsource_frame_diff_roi(frame, roi_prevbuf, roi_prevstride);
+		}
 		//gImgPts++;
 		frame->imgpts = tvdiff_us(&captureTv, &initialTv)/frame_interval;
 		frame->timestamp = captureTv;
@@ -334,6 +387,10 @@ vsource_deinit(void *arg) {
 	//ga_xwin_deinit(display, image);
 	ga_xwin_deinit();
 #endif
+	if(roi_prevbuf != NULL) {
+		free(roi_prevbuf);
+		roi_prevbuf = NULL;
+	}
 	vsource_initialized = 0;
 	return 0;
 }
@@ -176,6 +176,7 @@ int
 load_modules() {
 	char module_path[2048] = "";
 	char hook_audio[64] = "";
+	char aencoder_name[64];
 	//
 	snprintf(module_path, sizeof(module_path),
 		BACKSLASHDIR("%s/mod/filter-rgb2yuv", "%smod\\filter-rgb2yuv"),
@@ -202,9 +203,11 @@ load_modules() {
 	//////////////////////////
 	}
 #endif
+	if(ga_conf_readv("audio-encoder-module", aencoder_name, sizeof(aencoder_name)) == NULL)
+		strcpy(aencoder_name, "encoder-audio");
 	snprintf(module_path, sizeof(module_path),
-		BACKSLASHDIR("%s/mod/encoder-audio", "%smod\\encoder-audio"),
-		ga_root);
+		BACKSLASHDIR("%s/mod/%s", "%smod\\%s"),
+		ga_root, aencoder_name);
 	if((m_aencoder = ga_load_module(module_path, "aencoder_")) == NULL)
 		return -1;
 	//////////////////////////
@@ -288,6 +291,8 @@ run_modules() {
 	encoder_register_aencoder(m_aencoder, audio_encoder_param);
 	//////////////////////////
 	}
+	// warm-pool mode: open encoders before any client connects
+	encoder_warm_start();
 	// server
 	if(m_server->start(NULL) < 0)	exit(-1);
 	//
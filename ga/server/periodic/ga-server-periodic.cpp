@@ -24,6 +24,7 @@
 
 #include "ga-common.h"
 #include "ga-conf.h"
+#include "ga-thread.h"
 #include "ga-module.h"
 #include "rtspconf.h"
 #include "controller.h"
@@ -50,6 +51,7 @@ static ga_module_t *m_vsource, *m_filter, *m_vencoder, *m_asource, *m_aencoder,
 
 int
 load_modules() {
+	char asource_name[64], aencoder_name[64], module_path[128];
 	if((m_vsource = ga_load_module("mod/vsource-desktop", "vsource_")) == NULL)
 		return -1;
 	if((m_filter = ga_load_module("mod/filter-rgb2yuv", "filter_RGB2YUV_")) == NULL)
@@ -59,10 +61,16 @@ load_modules() {
 	if(ga_conf_readbool("enable-audio", 1) != 0) {
 	//////////////////////////
 #ifndef __APPLE__
-	if((m_asource = ga_load_module("mod/asource-system", "asource_")) == NULL)
+	if(ga_conf_readv("audio-source-module", asource_name, sizeof(asource_name)) == NULL)
+		strcpy(asource_name, "asource-system");
+	snprintf(module_path, sizeof(module_path), "mod/%s", asource_name);
+	if((m_asource = ga_load_module(module_path, "asource_")) == NULL)
 		return -1;
 #endif
-	if((m_aencoder = ga_load_module("mod/encoder-audio", "aencoder_")) == NULL)
+	if(ga_conf_readv("audio-encoder-module", aencoder_name, sizeof(aencoder_name)) == NULL)
+		strcpy(aencoder_name, "encoder-audio");
+	snprintf(module_path, sizeof(module_path), "mod/%s", aencoder_name);
+	if((m_aencoder = ga_load_module(module_path, "aencoder_")) == NULL)
 		return -1;
 	//////////////////////////
 	}
@@ -115,6 +123,7 @@ run_modules() {
 	if(m_vsource->start(prect) < 0)		exit(-1);
 	//ga_run_single_module_or_quit("filter 0", m_filter->threadproc, (void*) filterpipe);
 	if(m_filter->start(filter_param) < 0)	exit(-1);
+	encoder_register_vsource(m_vsource);
 	encoder_register_vencoder(m_vencoder, video_encoder_param);
 	// audio
 	if(ga_conf_readbool("enable-audio", 1) != 0) {
@@ -126,6 +135,8 @@ run_modules() {
 	encoder_register_aencoder(m_aencoder, audio_encoder_param);
 	//////////////////////////
 	}
+	// warm-pool mode: open encoders before any client connects
+	encoder_warm_start();
 	// server
 	if(m_server->start(NULL) < 0)		exit(-1);
 	//
@@ -202,12 +213,33 @@ handle_netreport(ctrlmsg_system_t *msg) {
 		msgn->bytecount / 1024,
 		msgn->duration / 1000000.0,
 		msgn->bytecount / 1024.0 / (msgn->duration / 1000000.0));
+	// pick simulcast renditions and pacing rates based on the measured capacity
+	if(msgn->capacity > 0) {
+		ga_ioctl_capacity_t cap;
+		encoder_simulcast_estimate(NULL, msgn->capacity / 1000);
+		cap.id = 0;
+		cap.kbps = msgn->capacity / 1000;
+		if(encoder_get_sinkserver() != NULL)
+			ga_module_ioctl(encoder_get_sinkserver(), GA_IOCTL_CAPACITY, sizeof(cap), &cap);
+	}
+	// loss hint for audio encoders with in-band FEC, and for the RTP FEC
+	// protection level of the sink server
+	if(msgn->pktcount > 0) {
+		ga_ioctl_packetloss_t loss;
+		loss.id = 0;
+		loss.percent = (int) (100LL * msgn->pktloss / msgn->pktcount);
+		if(encoder_get_aencoder() != NULL)
+			ga_module_ioctl(encoder_get_aencoder(), GA_IOCTL_PACKETLOSS, sizeof(loss), &loss);
+		if(encoder_get_sinkserver() != NULL)
+			ga_module_ioctl(encoder_get_sinkserver(), GA_IOCTL_PACKETLOSS, sizeof(loss), &loss);
+	}
 	return;
 }
 
 int
 main(int argc, char *argv[]) {
 	int notRunning = 0;
+	int report, elapsed = 0;
 #ifdef WIN32
 	if(CoInitializeEx(NULL, COINIT_MULTITHREADED) < 0) {
 		fprintf(stderr, "cannot initialize COM.\n");
@@ -252,8 +284,15 @@ main(int argc, char *argv[]) {
 #endif
 	//rtspserver_main(NULL);
 	//liveserver_main(NULL);
+	ga_thread_role("main", 0);
+	report = ga_conf_readint("thread-report");
 	while(1) {
 		usleep(5000000);
+		elapsed += 5;
+		if(report > 0 && elapsed >= report) {
+			ga_thread_report();
+			elapsed = 0;
+		}
 	}
 	// alternatively, it is able to create a thread to run rtspserver_main:
 	//	pthread_create(&t, NULL, rtspserver_main, NULL);